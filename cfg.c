@@ -17,6 +17,7 @@ void clear_cfg(void)
 
 	if (debug > 1) mrlog("clear_cfg()");
 
+	lock_cfg();
 	while (conf) {
 		c = conf;
 		conf = c->next;
@@ -24,6 +25,7 @@ void clear_cfg(void)
 		big_free("clear_cfg", c->cfg);
 		big_free("clear_cfg", c);
 	}
+	unlock_cfg();
 }
 
 void add_cfg(char *name, char *cfg)
@@ -31,6 +33,7 @@ void add_cfg(char *name, char *cfg)
 	struct config *c;
 
 	if (debug > 1) mrlog("add_cfg(%s, %s)", name, cfg);
+	lock_cfg();
 	for (c = conf; c && strcmp(name, c->name); c = c->next);
 	if (c == NULL) {
 		c = big_malloc("add_cfg", sizeof *c);
@@ -41,6 +44,7 @@ void add_cfg(char *name, char *cfg)
 		conf = c;
 	}
 	snprcat(c->cfg, CFG_MAX, "%s\n", cfg);
+	unlock_cfg();
 }
 
 int get_cfg(char *name, char *b, size_t n, int line)
@@ -53,8 +57,10 @@ int get_cfg(char *name, char *b, size_t n, int line)
 
 	if (debug > 1) mrlog("get_cfg(%s, %p, %ld, %d)", name, b, n, line);
 
+	lock_cfg();
 	for (c = conf; c && strcmp(name, c->name); c = c->next);
 	if (c == NULL) {
+		unlock_cfg();
 		if (debug) mrlog("get_cfg can't find key %s", name);
 		return 0;
 	}
@@ -80,6 +86,7 @@ int get_cfg(char *name, char *b, size_t n, int line)
 		memcpy(b, p, m);
 		b[m] = '\0';
 	}
+	unlock_cfg();
 	if (debug > 1) mrlog("get_cfg returns %d (%s)", retval, b);
 	return retval;
 }
@@ -242,6 +249,7 @@ void read_cfg(char *cat, char *filename)
 
 	strlcpy(category, cat, sizeof category);
 
+	lock_cfg();
 	while (fgets(b, sizeof b, fp)) {
 		chomp(b);
 		if (b[0] == '[') {
@@ -264,6 +272,7 @@ void read_cfg(char *cat, char *filename)
 			add_cfg(category, b);
 		}
 	}
+	unlock_cfg();
 	big_fclose("read_cfg", fp);
 }
 
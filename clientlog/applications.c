@@ -23,57 +23,83 @@ typedef struct {
     applications_Arch Architecture;
 } applications_Application;
 
-typedef struct _ApplicationTree {
+// The subkeys of both Uninstall trees, kept between cycles with their last
+// write time. Each cycle only enumerates the subkey names and times, and
+// reads the values of the subkeys that are new or changed. The section is
+// rendered again only when something changed.
+typedef struct {
+    CHAR Key[MAX_REG_KEY_NAME];
+    FILETIME LastWrite;
+    BOOL Listed; // has a version or a publisher, so it is in the section
+    BOOL Seen;
     applications_Application Value;
-    struct _ApplicationTree *Left;
-    struct _ApplicationTree *Right;
-} applications_ApplicationTree;
+} applications_Entry;
+
+typedef struct {
+    applications_Entry *Entries; // ordered by key name
+    DWORD NumEntries, MaxEntries;
+} applications_View;
+
+static SRWLOCK applications_Lock = SRWLOCK_INIT; // guards the views and the rendering
+static applications_View applications_Views[2];  // by applications_Arch
+static clog_utils_SectionText applications_Text = CLOG_UTILS_SECTIONTEXT_INIT;
 
 LPCSTR applications_PrettyApplication(applications_Application *a, LPSTR out) {
     snprintf(out, MAX_APPLICATIONS_ROW_SIZE, "%s\t%s\t%s\t%s", a->Name, a->Version, a->Publisher, applications_PrettyArch(a->Architecture));
     return out;
 }
 
-// Returns root, or t if root is NULL
-applications_ApplicationTree *applications_TreeInsert(applications_ApplicationTree *root, applications_ApplicationTree *t) {
-    if (root == NULL) {
-        return t;
-    }
+static int applications_CompareKey(const void *a, const void *b) {
+    return _stricmp(((const applications_Entry *)a)->Key, ((const applications_Entry *)b)->Key);
+}
 
-    int tComp = strncmp(t->Value.Name, root->Value.Name, MAX_APPLICATION_NAME);
-    tComp = tComp ? tComp : (int)(t->Value.Architecture - root->Value.Architecture);
-    applications_ApplicationTree **direction;
-    if (tComp < 0) {
-        direction = &root->Left;
-    } else if (tComp > 0) {
-        direction = &root->Right;
-    } else {
-        if (root->Left == NULL) {
-            direction = &root->Left;
-        } else {
-            direction = &root->Right;
-        }
-    }
-    if (*direction == NULL) {
-        *direction = t;
-    } else {
-        applications_TreeInsert(*direction, t);
-    }
-    return root;
+static int applications_CompareRow(const applications_Application *a, const applications_Application *b) {
+    int cmp = strncmp(a->Name, b->Name, MAX_APPLICATION_NAME);
+    if (cmp == 0) cmp = strncmp(a->Version, b->Version, MAX_APPLICATION_VERSION);
+    if (cmp == 0) cmp = strncmp(a->Publisher, b->Publisher, MAX_APPLICATION_PUBLISHER);
+    return cmp;
 }
 
-void applications_TreeTraverseAppend(applications_ApplicationTree *t, clog_Arena *a) {
-    if (t->Left != NULL) {
-        applications_TreeTraverseAppend(t->Left, a);
-    }
-    CHAR applicationBuf[MAX_APPLICATIONS_ROW_SIZE];
-    clog_ArenaAppend(a, "\n%s", applications_PrettyApplication(&t->Value, applicationBuf));
-    if (t->Right != NULL) {
-        applications_TreeTraverseAppend(t->Right, a);
+static int applications_CompareApplication(const void *a, const void *b) {
+    const applications_Application *aa = *(const applications_Application **)a, *ab = *(const applications_Application **)b;
+    int cmp = applications_CompareRow(aa, ab);
+    return cmp ? cmp : (int)(aa->Architecture - ab->Architecture);
+}
+
+static void applications_ReadEntry(HKEY hKey, applications_Entry *e, applications_Arch arch) {
+    DWORD displayNameBufSize = MAX_PATH, displayVersionBufSize = 255, publisherBufSize = 255, bufsize;
+    CHAR displayName[MAX_PATH], displayVersion[displayVersionBufSize], publisherName[publisherBufSize];
+
+    bufsize = displayNameBufSize;
+    DWORD nameStatus = RegGetValueA(hKey, e->Key, "DisplayName", RRF_RT_REG_SZ | RRF_RT_REG_MULTI_SZ | RRF_RT_REG_EXPAND_SZ, NULL, displayName, &bufsize);
+
+    bufsize = displayVersionBufSize;
+    DWORD versionStatus = RegGetValueA(hKey, e->Key, "DisplayVersion", RRF_RT_REG_SZ | RRF_RT_REG_MULTI_SZ | RRF_RT_REG_EXPAND_SZ, NULL, displayVersion, &bufsize);
+
+    bufsize = publisherBufSize;
+    DWORD publisherStatus = RegGetValueA(hKey, e->Key, "Publisher", RRF_RT_REG_SZ | RRF_RT_REG_MULTI_SZ | RRF_RT_REG_EXPAND_SZ, NULL, publisherName, &bufsize);
+
+    e->Listed = versionStatus == ERROR_SUCCESS || publisherStatus == ERROR_SUCCESS;
+    if (e->Listed) {
+        CHAR *name = nameStatus == ERROR_SUCCESS ? displayName : e->Key;
+        clog_utils_ClampString(name, e->Value.Name, MAX_APPLICATION_NAME);
+
+        CHAR *version = versionStatus == ERROR_SUCCESS ? displayVersion : "-";
+        clog_utils_ClampString(version, e->Value.Version, MAX_APPLICATION_VERSION);
+
+        CHAR *publisher = publisherStatus == ERROR_SUCCESS ? publisherName : "-";
+        clog_utils_ClampString(publisher, e->Value.Publisher, MAX_APPLICATION_PUBLISHER);
+
+        e->Value.Architecture = arch;
     }
 }
 
-applications_ApplicationTree *applications_InsertApplications(applications_ApplicationTree *root, applications_Arch arch, clog_Arena *a) {
+/**
+ * Bring the entries of one Uninstall tree up to date.
+ * @return TRUE if any subkey was added, changed or removed.
+ */
+static BOOL applications_RefreshView(applications_Arch arch) {
+    applications_View *v = &applications_Views[arch];
     HKEY hKey;
     DWORD openStatus;
     switch (arch) {
@@ -84,67 +110,101 @@ applications_ApplicationTree *applications_InsertApplications(applications_Appli
         openStatus = RegOpenKeyEx(HKEY_LOCAL_MACHINE, "Software\\WOW6432Node\\Microsoft\\Windows\\CurrentVersion\\Uninstall", 0, KEY_READ | KEY_WOW64_64KEY, &hKey);
         break;
     default:
-        clog_ArenaAppend(a, "\nError: Unknown architecture (%d).", arch);
-        return root;
+        return FALSE;
     }
 
-    if (openStatus != ERROR_SUCCESS) {
-        return root;
+    DWORD numSubKeys = 0;
+    if (openStatus != ERROR_SUCCESS ||
+        RegQueryInfoKey(hKey, NULL, NULL, NULL, &numSubKeys, NULL, NULL, NULL, NULL, NULL, NULL, NULL) != ERROR_SUCCESS) {
+        if (openStatus == ERROR_SUCCESS) RegCloseKey(hKey);
+        BOOL changed = v->NumEntries > 0;
+        v->NumEntries = 0;
+        return changed;
     }
 
-    clog_Defer(a, hKey, RETURN_LONG, &RegCloseKey);
-
-    DWORD ix = 0;
-    CHAR regKeyName[MAX_REG_KEY_NAME];
-    DWORD regKeyNameLen = MAX_REG_KEY_NAME;
-    DWORD enumStatus = RegEnumKeyEx(hKey, ix, regKeyName, &regKeyNameLen, 0, NULL, NULL, NULL);
-
-    DWORD displayNameBufSize = MAX_PATH, displayVersionBufSize = 255, publisherBufSize = 255, bufsize;
-    CHAR displayName[MAX_PATH], displayVersion[displayVersionBufSize], publisherName[publisherBufSize];
-    while (enumStatus == ERROR_SUCCESS) {
-        bufsize = displayNameBufSize;
-        DWORD nameStatus = RegGetValueA(hKey, regKeyName, "DisplayName", RRF_RT_REG_SZ | RRF_RT_REG_MULTI_SZ | RRF_RT_REG_EXPAND_SZ, NULL, displayName, &bufsize);
-
-        bufsize = displayVersionBufSize;
-        DWORD versionStatus = RegGetValueA(hKey, regKeyName, "DisplayVersion", RRF_RT_REG_SZ | RRF_RT_REG_MULTI_SZ | RRF_RT_REG_EXPAND_SZ, NULL, displayVersion, &bufsize);
-
-        bufsize = publisherBufSize;
-        DWORD publisherStatus = RegGetValueA(hKey, regKeyName, "Publisher", RRF_RT_REG_SZ | RRF_RT_REG_MULTI_SZ | RRF_RT_REG_EXPAND_SZ, NULL, publisherName, &bufsize);
-
-        if (versionStatus == ERROR_SUCCESS || publisherStatus == ERROR_SUCCESS) {
-            applications_ApplicationTree *app = clog_ArenaAlloc(a, applications_ApplicationTree, 1);
-
-            CHAR *name = nameStatus == ERROR_SUCCESS ? displayName : regKeyName;
-            clog_utils_ClampString(name, app->Value.Name, MAX_APPLICATION_NAME);
-
-            CHAR *version = versionStatus == ERROR_SUCCESS ? displayVersion : "-";
-            clog_utils_ClampString(version, app->Value.Version, MAX_APPLICATION_VERSION);
+    // Room for all subkeys up front, so the entries don't move while adding
+    if (numSubKeys > v->MaxEntries) {
+        applications_Entry *more = realloc(v->Entries, numSubKeys * sizeof(*more));
+        if (more != NULL) {
+            v->Entries = more;
+            v->MaxEntries = numSubKeys;
+        }
+    }
+    for (DWORD i = 0; i < v->NumEntries; i++) v->Entries[i].Seen = FALSE;
+
+    DWORD numOld = v->NumEntries, numChanged = 0;
+    applications_Entry key;
+    for (DWORD ix = 0;; ix++) {
+        DWORD regKeyNameLen = MAX_REG_KEY_NAME;
+        if (RegEnumKeyEx(hKey, ix, key.Key, &regKeyNameLen, 0, NULL, NULL, &key.LastWrite) != ERROR_SUCCESS) break;
+
+        applications_Entry *e = bsearch(&key, v->Entries, numOld, sizeof(*v->Entries), applications_CompareKey);
+        if (e == NULL) {
+            if (v->NumEntries == v->MaxEntries) continue; // out of memory, or added since RegQueryInfoKey
+            e = &v->Entries[v->NumEntries++];
+            strcpy(e->Key, key.Key);
+            e->LastWrite.dwLowDateTime = e->LastWrite.dwHighDateTime = 0;
+        }
+        e->Seen = TRUE;
+        if (CompareFileTime(&e->LastWrite, &key.LastWrite) != 0) {
+            e->LastWrite = key.LastWrite;
+            applications_ReadEntry(hKey, e, arch);
+            numChanged++;
+        }
+    }
+    RegCloseKey(hKey);
 
-            CHAR *publisher = publisherStatus == ERROR_SUCCESS ? publisherName : "-";
-            clog_utils_ClampString(publisher, app->Value.Publisher, MAX_APPLICATION_PUBLISHER);
+    DWORD n = 0;
+    for (DWORD i = 0; i < v->NumEntries; i++) {
+        if (v->Entries[i].Seen) v->Entries[n++] = v->Entries[i];
+    }
+    BOOL changed = numChanged > 0 || n != v->NumEntries;
+    LOG_DEBUG("\tapplications.c: %lu subkeys, %lu new or changed, %lu gone.", n, numChanged, v->NumEntries - n);
+    v->NumEntries = n;
+    if (changed) qsort(v->Entries, n, sizeof(*v->Entries), applications_CompareKey);
+    return changed;
+}
 
-            app->Value.Architecture = arch;
+static void applications_Render(void) {
+    DWORD numRows = applications_Views[x86_32].NumEntries + applications_Views[x86_64].NumEntries;
+    applications_Application **rows = malloc((numRows + 1) * sizeof(*rows));
+    if (rows == NULL) return;
 
-            root = applications_TreeInsert(root, app);
+    numRows = 0;
+    for (int arch = x86_32; arch <= x86_64; arch++) {
+        applications_View *v = &applications_Views[arch];
+        for (DWORD i = 0; i < v->NumEntries; i++) {
+            if (v->Entries[i].Listed) rows[numRows++] = &v->Entries[i].Value;
         }
-        regKeyNameLen = MAX_REG_KEY_NAME;
-        enumStatus = RegEnumKeyEx(hKey, ++ix, regKeyName, &regKeyNameLen, 0, NULL, NULL, NULL);
     }
-
-    return root;
+    qsort(rows, numRows, sizeof(*rows), applications_CompareApplication);
+
+    clog_utils_Text *t = clog_utils_NewText(numRows * (MAX_APPLICATIONS_ROW_SIZE + 1) + 64);
+    if (t != NULL) {
+        for (DWORD i = 0; i < numRows; i++) {
+            // A 32-bit mrbig reads the same tree twice, and some installers
+            // register in both, so the same application is listed once
+            if (i > 0 && applications_CompareRow(rows[i], rows[i - 1]) == 0) continue;
+            CHAR applicationBuf[MAX_APPLICATIONS_ROW_SIZE];
+            t->Length += sprintf(&t->Text[t->Length], "\n%s", applications_PrettyApplication(rows[i], applicationBuf));
+        }
+        if (numRows == 0) {
+            t->Length = sprintf(t->Text, "\n(No applications found)");
+        }
+        clog_utils_SetText(&applications_Text, t);
+    }
+    free(rows);
 }
 
 void clog_applications(clog_Arena scratch) {
-    applications_ApplicationTree *applications = NULL;
-    applications = applications_InsertApplications(applications, x86_32, &scratch);
-    clog_PopDeferAll(&scratch);
-    applications = applications_InsertApplications(applications, x86_64, &scratch);
-    clog_PopDeferAll(&scratch);
+    AcquireSRWLockExclusive(&applications_Lock);
+    BOOL changed = applications_RefreshView(x86_32);
+    changed = applications_RefreshView(x86_64) || changed;
+    if (changed || !clog_utils_HasText(&applications_Text)) applications_Render();
+    ReleaseSRWLockExclusive(&applications_Lock);
 
     clog_ArenaAppend(&scratch, "[applications]");
-    if (applications != NULL) {
-        applications_TreeTraverseAppend(applications, &scratch);
-    } else {
+    if (!clog_utils_AppendText(&applications_Text, &scratch)) {
         clog_ArenaAppend(&scratch, "\n(No applications found)");
     }
 }
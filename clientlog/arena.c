@@ -42,6 +42,19 @@ void clog_ArenaAppend(clog_Arena *a, const char *format, ...) {
     ((clog_ArenaState *)a->State)->CurrentStart += written;
 }
 
+// Like clog_ArenaAppend("%.*s", ...), without going through the formatter
+void clog_ArenaAppendBytes(clog_Arena *a, const void *bytes, size_t len) {
+    BYTE *aStart = ((clog_ArenaState *)a->State)->CurrentStart;
+    ptrdiff_t freeBytes = a->End - aStart;
+    if ((ptrdiff_t)len >= freeBytes) {
+        clog_ThrowError(a, 1);
+    }
+
+    memcpy(aStart, bytes, len);
+    aStart[len] = '\0';
+    ((clog_ArenaState *)a->State)->CurrentStart += len;
+}
+
 clog_ArenaState *clog_ArenaMake(size_t capacity) {
     clog_ArenaState *pState = malloc(sizeof(clog_ArenaState));
     *pState = (clog_ArenaState){0};
@@ -118,7 +131,18 @@ clog_CloseHandleReturnValue clog_PopDefer(clog_Arena *a) {
 
 void clog_PopDeferAll(clog_Arena *a) {
     clog_ArenaState *state = (clog_ArenaState *)a->State;
-    while (state->NumHandles > 0) {
+    while (state->NumHandles > state->NumKept) {
         clog_PopDefer(a);
     }
+}
+
+void clog_KeepDeferred(clog_Arena *a) {
+    clog_ArenaState *state = (clog_ArenaState *)a->State;
+    state->NumKept = state->NumHandles;
+}
+
+void clog_PopDeferKept(clog_Arena *a) {
+    clog_ArenaState *state = (clog_ArenaState *)a->State;
+    state->NumKept = 0;
+    clog_PopDeferAll(a);
 }
\ No newline at end of file
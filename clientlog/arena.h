@@ -38,6 +38,7 @@ typedef struct {
     jmp_buf MemoryErrorHandler;
     clog_Arena Memory;
     DWORD NumHandles;
+    DWORD NumKept; // the bottom handles, left alone by clog_PopDeferAll
     BYTE *Start, *End;
     BYTE *CurrentStart;
 } clog_ArenaState;
@@ -49,6 +50,7 @@ typedef struct {
 #define clog_ThrowError(arena, errorcode) longjmp((void *)((clog_ArenaState *)(arena)->State)->MemoryErrorHandler, errorcode)
 
 void clog_ArenaAppend(clog_Arena *a, const char *format, ...);
+void clog_ArenaAppendBytes(clog_Arena *a, const void *bytes, size_t len);
 
 void *clog__ArenaAllocate(clog_Arena *a, size_t size, size_t align, size_t count);
 #define clog_ArenaAlloc(arena, type, numelements) (type *)clog__ArenaAllocate(arena, sizeof(type), alignof(type), numelements)
@@ -61,4 +63,8 @@ void clog_ArenaFreeAll(clog_ArenaState *a);
 void clog_Defer(clog_Arena *a, void *handle, clog_CloseHandleReturnType type, void *freeFn);
 void clog_IgnorePopDefer(clog_Arena *a);
 clog_CloseHandleReturnValue clog_PopDefer(clog_Arena *a);
-void clog_PopDeferAll(clog_Arena *a);
\ No newline at end of file
+void clog_PopDeferAll(clog_Arena *a);
+// Handles deferred so far are kept by clog_PopDeferAll, for handles used
+// across sections. clog_PopDeferKept releases them as well.
+void clog_KeepDeferred(clog_Arena *a);
+void clog_PopDeferKept(clog_Arena *a);
\ No newline at end of file
@@ -2,13 +2,14 @@
 #include <wincrypt.h>
 
 #define CERTIFICATES_ROW_SIZE (512)
+#define CERTIFICATES_HASH_SIZE 20
 
 typedef struct {
     DWORD PublicKeySize;
     CHAR *Subject;
     CHAR *FriendlyName;
     CHAR *Issuer;
-    CHAR **EKUPurposes;
+    CHAR *EKUPurposes;
     FILETIME NotBefore;
     FILETIME NotAfter;
     CHAR *StoreLocation;
@@ -17,23 +18,8 @@ typedef struct {
     CHAR *SerialNumber;
 } Certificate;
 
-LPSTR certificates_PrettyEKUPurposes(CHAR **eku, LPSTR out, size_t outSize) {
-    if (eku != NULL) {
-        DWORD i = 0, written = 0;
-        while (eku[i] != NULL) {
-            if (i != 0 && outSize - written > 1) {
-                out[written++] = ',';
-            }
-            written += snprintf(&out[written], outSize - written, "%s", eku[i++]);
-        }
-    } else {
-        snprintf(out, outSize, "None");
-    }
-    return out;
-}
-
 LPSTR certificates_PrettyCertificate(Certificate *c, LPSTR out) {
-    CHAR eku[64], validFromBuf[64], validToBuf[64];
+    CHAR validFromBuf[64], validToBuf[64];
     SYSTEMTIME validFrom, validTo;
     FileTimeToSystemTime(&c->NotBefore, &validFrom);
     FileTimeToSystemTime(&c->NotAfter, &validTo);
@@ -55,7 +41,7 @@ LPSTR certificates_PrettyCertificate(Certificate *c, LPSTR out) {
              c->StoreLocation,
              c->Subject,
              c->Issuer,
-             certificates_PrettyEKUPurposes(c->EKUPurposes, eku, sizeof(eku)),
+             c->EKUPurposes,
              c->PublicKeySize,
              c->SignatureAlgorithm,
              c->Fingerprint,
@@ -83,8 +69,8 @@ size_t certificates_GetOIDName(CHAR *oID, CHAR *out, size_t outSize) {
     return written;
 }
 
-CHAR **certificates_GetEKUPurposes(CERT_INFO *ctx, clog_Arena *a) {
-    CHAR **res = NULL;
+LPSTR certificates_PrettyEKUPurposes(CERT_INFO *ctx, LPSTR out, size_t outSize) {
+    snprintf(out, outSize, "None");
     for (DWORD i = 0; i < ctx->cExtension; i++) {
         CERT_EXTENSION *ext = &ctx->rgExtension[i];
         if (strcmp(ext->pszObjId, szOID_ENHANCED_KEY_USAGE) != 0) continue;
@@ -97,140 +83,270 @@ CHAR **certificates_GetEKUPurposes(CERT_INFO *ctx, clog_Arena *a) {
         WINBOOL success = CryptDecodeObjectEx(X509_ASN_ENCODING, szOID_ENHANCED_KEY_USAGE, ext->Value.pbData, ext->Value.cbData, CRYPT_DECODE_NOCOPY_FLAG, NULL, decodedData, &decodedSize);
 
         if (!success) {
-            res = clog_ArenaAlloc(a, CHAR *, 2);
-            res[0] = clog_ArenaAlloc(a, CHAR, 32);
-            sprintf(res[0], "<Error with code %#010lx>", GetLastError());
-            res[1] = NULL;
+            snprintf(out, outSize, "<Error with code %#010lx>", GetLastError());
             break;
         }
         CTL_USAGE *p = ((CTL_USAGE *)decodedData);
-        res = clog_ArenaAlloc(a, CHAR *, p->cUsageIdentifier + 1);
-        for (DWORD j = 0; j < p->cUsageIdentifier; j++) {
+        size_t written = 0;
+        out[0] = '\0';
+        for (DWORD j = 0; j < p->cUsageIdentifier && written < outSize - 1; j++) {
             CHAR *oID = p->rgpszUsageIdentifier[j];
             CHAR purposeBuf[128];
             LOG_DEBUG("\tcertificates.c: \t\tGetting OID info %lu.", j);
             size_t purposeLen = certificates_GetOIDName(oID, purposeBuf, 128);
 
             if (purposeLen <= 0) {
-                purposeLen = sprintf(purposeBuf, "Unknown purpose (%s)", oID);
+                snprintf(purposeBuf, sizeof(purposeBuf), "Unknown purpose (%s)", oID);
             }
-
-            CHAR *purpose = clog_ArenaAlloc(a, CHAR, purposeLen + 1);
-            memcpy(purpose, purposeBuf, purposeLen);
-            purpose[purposeLen] = '\0';
-            res[j] = purpose;
-            LOG_DEBUG("\tcertificates.c: \t\tOID info %lu = '%s'", j, purpose);
+            written += snprintf(&out[written], outSize - written, "%s%s", j ? "," : "", purposeBuf);
+            LOG_DEBUG("\tcertificates.c: \t\tOID info %lu = '%s'", j, purposeBuf);
         }
-        res[p->cUsageIdentifier] = NULL;
         break;
     }
-    return res;
+    return out;
 }
 
-WINBOOL CertCloseStoreWrapper(HCERTSTORE h) {
-    return CertCloseStore(h, 0);
+/**
+ * Render the section row of a certificate, the slow part: six name lookups,
+ * decoding the EKUs and the OIDs, and formatting the hashes.
+ * @return the row, malloc'd, NULL if out of memory.
+ */
+static CHAR *certificates_RenderRow(const CERT_CONTEXT *ctx, const BYTE *hash, DWORD hashSize) {
+    CHAR friendlyName[128], subject[256], issuer[256], eku[64], algo[64];
+    CHAR certificateBuf[CERTIFICATES_ROW_SIZE];
+    Certificate c = {0};
+
+    // Friendly Name
+    DWORD getNameStringType = CERT_X500_NAME_STR | CERT_NAME_STR_REVERSE_FLAG;
+    LOG_DEBUG("\tcertificates.c: \tGetting RDN friendly name.");
+    CertGetNameStringA(ctx, CERT_NAME_FRIENDLY_DISPLAY_TYPE, CERT_NAME_DISABLE_IE4_UTF8_FLAG, &getNameStringType, friendlyName, sizeof(friendlyName));
+    c.FriendlyName = friendlyName;
+
+    // Subject
+    getNameStringType = CERT_X500_NAME_STR | CERT_NAME_STR_REVERSE_FLAG;
+    LOG_DEBUG("\tcertificates.c: \tGetting subject RDN.");
+    CertGetNameStringA(ctx, CERT_NAME_RDN_TYPE, CERT_NAME_DISABLE_IE4_UTF8_FLAG, &getNameStringType, subject, sizeof(subject));
+    c.Subject = subject;
+
+    // Issued By
+    getNameStringType = CERT_X500_NAME_STR | CERT_NAME_STR_REVERSE_FLAG;
+    LOG_DEBUG("\tcertificates.c: \tGetting issuer RDN.");
+    CertGetNameStringA(ctx, CERT_NAME_RDN_TYPE, CERT_NAME_ISSUER_FLAG | CERT_NAME_DISABLE_IE4_UTF8_FLAG, &getNameStringType, issuer, sizeof(issuer));
+    c.Issuer = issuer;
+
+    // Intended Purposes
+    LOG_DEBUG("\tcertificates.c: \tGetting cert EKU purposes.");
+    c.EKUPurposes = certificates_PrettyEKUPurposes(ctx->pCertInfo, eku, sizeof(eku));
+
+    // Signature Algorithm
+    size_t algoLen = certificates_GetOIDName(ctx->pCertInfo->SignatureAlgorithm.pszObjId, algo, sizeof(algo));
+    c.SignatureAlgorithm = algoLen <= 0 ? "<unknown>" : algo;
+
+    // Fingerprint
+    CHAR fingerprintHex[2 * CERTIFICATES_HASH_SIZE + 1] = "";
+    for (DWORD i = 0; i < hashSize; i++) {
+        sprintf(&fingerprintHex[2 * i], "%02x", hash[i]);
+    }
+    c.Fingerprint = fingerprintHex;
+
+    // Serial Number
+    CHAR serialHex[128] = "";
+    size_t serialWritten = 0;
+    for (int i = ctx->pCertInfo->SerialNumber.cbData - 1; i >= 0 && serialWritten < sizeof(serialHex) - 2; i--) {
+        serialWritten += sprintf(&serialHex[serialWritten], "%02x", ctx->pCertInfo->SerialNumber.pbData[i]);
+    }
+    c.SerialNumber = serialHex;
+
+    // rest
+    c.NotBefore = ctx->pCertInfo->NotBefore;
+    c.NotAfter = ctx->pCertInfo->NotAfter;
+    c.StoreLocation = "Local Machine";
+    c.PublicKeySize = CertGetPublicKeyLength(X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, &ctx->pCertInfo->SubjectPublicKeyInfo);
+
+    certificates_PrettyCertificate(&c, certificateBuf);
+    return _strdup(certificateBuf);
 }
 
-void clog_certificates(clog_Arena scratch) {
-    const LPSTR storeLocation = "MY";
+// The rendered row of each certificate in the store, kept between cycles and
+// ordered by expiry, so the first one is the next to expire. The store is
+// watched for changes, and when it changes only the thumbprints and friendly
+// names are read, so only new and renamed certificates are rendered.
+typedef struct {
+    BYTE Hash[CERTIFICATES_HASH_SIZE]; // SHA-1 thumbprint
+    unsigned long NameHash;            // of the friendly name, which can be changed in place
+    ULONGLONG NotAfter;
+    CHAR *Row;
+    BOOL Seen;
+} certificates_Entry;
 
-    clog_ArenaAppend(&scratch, "[certificates]");
+static clog_utils_SectionText certificates_Text = CLOG_UTILS_SECTIONTEXT_INIT; // the whole section as last rendered
+static SRWLOCK certificates_Lock = SRWLOCK_INIT; // guards all below
+static HCERTSTORE certificates_Store;
+static HANDLE certificates_Changed; // set by the store when it changes
+static certificates_Entry *certificates_Entries;
+static DWORD certificates_NumEntries, certificates_MaxEntries;
 
-    LOG_DEBUG("\tcertificates.c: Opening certificate store.");
-    HCERTSTORE hStore = CertOpenStore(CERT_STORE_PROV_SYSTEM_A, X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, 0, CERT_SYSTEM_STORE_LOCAL_MACHINE | CERT_STORE_READONLY_FLAG, "My");
-    clog_Defer(&scratch, hStore, RETURN_INT, &CertCloseStoreWrapper);
+static int certificates_CompareExpiry(const void *a, const void *b) {
+    const certificates_Entry *ea = a, *eb = b;
+    if (ea->NotAfter != eb->NotAfter) return ea->NotAfter < eb->NotAfter ? -1 : 1;
+    return memcmp(ea->Hash, eb->Hash, CERTIFICATES_HASH_SIZE);
+}
 
-    // HCERTSTORE hStore = CertOpenSystemStoreA(0, storeLocation);
-    // CertControlStore(hStore, 0, CERT_STORE_CTRL_AUTO_RESYNC, NULL);
+static int certificates_CompareHash(const void *a, const void *b) {
+    return memcmp(certificates_Entries[*(const DWORD *)a].Hash, certificates_Entries[*(const DWORD *)b].Hash, CERTIFICATES_HASH_SIZE);
+}
 
-    const CERT_CONTEXT *ctx = NULL;
-    CHAR certificateBuf[CERTIFICATES_ROW_SIZE];
-    DWORD numCertificates = 0;
-
-    while ((ctx = CertEnumCertificatesInStore(hStore, ctx))) {
-        LOG_DEBUG("\tcertificates.c: Start of certificate enumeration.");
-
-        clog_Defer(&scratch, (void *)ctx, RETURN_INT, &CertFreeCertificateContext);
-        numCertificates++;
-        Certificate c = {0};
-
-        // Friendly Name
-        DWORD getNameStringType = CERT_X500_NAME_STR | CERT_NAME_STR_REVERSE_FLAG;
-        LOG_DEBUG("\tcertificates.c: \tGetting RDN friendly name.");
-        DWORD friendlySize = CertGetNameStringA(ctx, CERT_NAME_FRIENDLY_DISPLAY_TYPE, CERT_NAME_DISABLE_IE4_UTF8_FLAG, &getNameStringType, NULL, 0);
-        c.FriendlyName = clog_ArenaAlloc(&scratch, void, friendlySize);
-        LOG_DEBUG("\tcertificates.c: \tGetting RDN friendly name.");
-        CertGetNameStringA(ctx, CERT_NAME_FRIENDLY_DISPLAY_TYPE, CERT_NAME_DISABLE_IE4_UTF8_FLAG, &getNameStringType, c.FriendlyName, friendlySize);
-        LOG_DEBUG("\tcertificates.c: \tRDN friendly name = '%s'.", c.FriendlyName);
-
-        // Subject
-        getNameStringType = CERT_X500_NAME_STR | CERT_NAME_STR_REVERSE_FLAG;
-        LOG_DEBUG("\tcertificates.c: \tGetting subject RDN size.");
-        DWORD subjectSize = CertGetNameStringA(ctx, CERT_NAME_RDN_TYPE, CERT_NAME_DISABLE_IE4_UTF8_FLAG, &getNameStringType, NULL, 0);
-        c.Subject = clog_ArenaAlloc(&scratch, void, subjectSize);
-        LOG_DEBUG("\tcertificates.c: \tGetting subject RDN.");
-        CertGetNameString(ctx, CERT_NAME_RDN_TYPE, CERT_NAME_DISABLE_IE4_UTF8_FLAG, &getNameStringType, c.Subject, subjectSize);
-        LOG_DEBUG("\tcertificates.c: \tSubject RDN = '%s'.", c.Subject);
-
-        // Issued By
-        getNameStringType = CERT_X500_NAME_STR | CERT_NAME_STR_REVERSE_FLAG;
-        LOG_DEBUG("\tcertificates.c: \tGetting issuer RDN size.");
-        DWORD issuerSize = CertGetNameStringA(ctx, CERT_NAME_RDN_TYPE, CERT_NAME_ISSUER_FLAG | CERT_NAME_DISABLE_IE4_UTF8_FLAG, &getNameStringType, NULL, 0);
-        c.Issuer = clog_ArenaAlloc(&scratch, void, issuerSize);
-        LOG_DEBUG("\tcertificates.c: \tGetting issuer RD.");
-        CertGetNameString(ctx, CERT_NAME_RDN_TYPE, CERT_NAME_DISABLE_IE4_UTF8_FLAG, &getNameStringType, c.Issuer, issuerSize);
-        LOG_DEBUG("\tcertificates.c: \tIssuer RDN = '%s'.", c.Issuer);
-
-        // Intended Purposes
-        LOG_DEBUG("\tcertificates.c: \tGetting cert EKU purposes.");
-        c.EKUPurposes = certificates_GetEKUPurposes(ctx->pCertInfo, &scratch);
-
-        // Signature Algorithm
-        CHAR algoBuf[64];
-        size_t algoLen = certificates_GetOIDName(ctx->pCertInfo->SignatureAlgorithm.pszObjId, algoBuf, 64);
-        if (algoLen <= 0)
-            c.SignatureAlgorithm = "<unknown>";
-        else {
-            CHAR *algo = clog_ArenaAlloc(&scratch, CHAR, algoLen + 1);
-            memcpy(algo, algoBuf, algoLen);
-            algo[algoLen] = '\0';
-            c.SignatureAlgorithm = algo;
+static certificates_Entry *certificates_Find(DWORD *byHash, DWORD numByHash, const BYTE *hash) {
+    DWORD lo = 0, hi = numByHash;
+    while (lo < hi) {
+        DWORD mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(certificates_Entries[byHash[mid]].Hash, hash, CERTIFICATES_HASH_SIZE);
+        if (cmp == 0) return &certificates_Entries[byHash[mid]];
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+/**
+ * @return a hash of the friendly name property, 0 if there is none. The
+ * thumbprint stays the same when the name is changed.
+ */
+static unsigned long certificates_NameHash(const CERT_CONTEXT *ctx) {
+    DWORD size = 0;
+    if (!CertGetCertificateContextProperty(ctx, CERT_FRIENDLY_NAME_PROP_ID, NULL, &size) || size == 0) return 0;
+
+    // Names can be of any length, so not on the stack
+    BYTE *name = malloc(size);
+    if (name == NULL) return 0;
+    unsigned long h = 0;
+    if (CertGetCertificateContextProperty(ctx, CERT_FRIENDLY_NAME_PROP_ID, name, &size)) {
+        h = 2166136261UL;
+        for (DWORD i = 0; i < size; i++) {
+            h ^= name[i];
+            h *= 16777619UL;
         }
+    }
+    free(name);
+    return h;
+}
+
+static DWORD certificates_OpenStore(void) {
+    certificates_Store = CertOpenStore(CERT_STORE_PROV_SYSTEM_A, X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, 0, CERT_SYSTEM_STORE_LOCAL_MACHINE | CERT_STORE_READONLY_FLAG, "My");
+    if (certificates_Store == NULL) return GetLastError();
+
+    // Without the notification every cycle reads the thumbprints
+    certificates_Changed = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (certificates_Changed != NULL && !CertControlStore(certificates_Store, 0, CERT_STORE_CTRL_NOTIFY_CHANGE, &certificates_Changed)) {
+        LOG_DEBUG("\tcertificates.c: No change notification, error code %#010lx.", GetLastError());
+        CloseHandle(certificates_Changed);
+        certificates_Changed = NULL;
+    }
+    return ERROR_SUCCESS;
+}
+
+/**
+ * Bring the entries and the section text up to date with the store. Call
+ * with certificates_Lock held.
+ */
+static DWORD certificates_Refresh(void) {
+    if (certificates_Store == NULL) {
+        DWORD err = certificates_OpenStore();
+        if (err != ERROR_SUCCESS) return err;
+    } else if (clog_utils_HasText(&certificates_Text) && certificates_Changed != NULL && WaitForSingleObject(certificates_Changed, 0) == WAIT_TIMEOUT) {
+        LOG_DEBUG("\tcertificates.c: Store unchanged.");
+        return ERROR_SUCCESS;
+    } else {
+        CertControlStore(certificates_Store, 0, CERT_STORE_CTRL_RESYNC, certificates_Changed ? &certificates_Changed : NULL);
+    }
+
+    DWORD *byHash = malloc((certificates_NumEntries + 1) * sizeof(*byHash));
+    if (byHash == NULL) return ERROR_NOT_ENOUGH_MEMORY;
+    DWORD numByHash = certificates_NumEntries;
+    for (DWORD i = 0; i < numByHash; i++) {
+        byHash[i] = i;
+        certificates_Entries[i].Seen = FALSE;
+    }
+    qsort(byHash, numByHash, sizeof(*byHash), certificates_CompareHash);
+
+    const CERT_CONTEXT *ctx = NULL;
+    DWORD numNew = 0, numChanged = 0;
+    while ((ctx = CertEnumCertificatesInStore(certificates_Store, ctx))) {
+        BYTE hash[CERTIFICATES_HASH_SIZE] = {0};
+        DWORD hashSize = sizeof(hash);
+        if (!CertGetCertificateContextProperty(ctx, CERT_HASH_PROP_ID, hash, &hashSize)) continue;
+        unsigned long nameHash = certificates_NameHash(ctx);
 
-        // Fingerprint
-        BYTE fingerprintHash[64] = {0};
-        DWORD fingeprintSize = sizeof(fingerprintHash);
-        CHAR fingerprintHex[128] = "";
-        if (CertGetCertificateContextProperty(ctx, CERT_HASH_PROP_ID, fingerprintHash, &fingeprintSize)) {
-            size_t written = 0;
-            for (int i = 0; i < fingeprintSize; i++) {
-                written += sprintf(&fingerprintHex[written], "%02x", fingerprintHash[i]);
+        certificates_Entry *e = certificates_Find(byHash, numByHash, hash);
+        if (e != NULL && e->NameHash != nameHash) {
+            LOG_DEBUG("\tcertificates.c: \tRendering renamed certificate.");
+            CHAR *row = certificates_RenderRow(ctx, hash, hashSize);
+            if (row != NULL) {
+                free(e->Row);
+                e->Row = row;
+                e->NameHash = nameHash;
+                numChanged++;
+            }
+        } else if (e == NULL) {
+            if (certificates_NumEntries == certificates_MaxEntries) {
+                DWORD max = certificates_MaxEntries ? 2 * certificates_MaxEntries : 64;
+                certificates_Entry *more = realloc(certificates_Entries, max * sizeof(*more));
+                if (more == NULL) continue;
+                certificates_Entries = more;
+                certificates_MaxEntries = max;
             }
+            LOG_DEBUG("\tcertificates.c: \tRendering new certificate.");
+            e = &certificates_Entries[certificates_NumEntries];
+            e->Row = certificates_RenderRow(ctx, hash, hashSize);
+            if (e->Row == NULL) continue;
+            memcpy(e->Hash, hash, sizeof(e->Hash));
+            e->NameHash = nameHash;
+            e->NotAfter = ((ULONGLONG)ctx->pCertInfo->NotAfter.dwHighDateTime << 32) | ctx->pCertInfo->NotAfter.dwLowDateTime;
+            certificates_NumEntries++;
+            numNew++;
         }
-        c.Fingerprint = fingerprintHex;
+        e->Seen = TRUE;
+    }
+    free(byHash);
 
-        // Serial Number
-        CHAR serialHex[128] = "";
-        size_t serialWritten = 0;
-        for (int i = ctx->pCertInfo->SerialNumber.cbData - 1; i >= 0; i--) {
-            serialWritten += sprintf(&serialHex[serialWritten], "%02x", ctx->pCertInfo->SerialNumber.pbData[i]);
+    // Drop the certificates that are gone, then order by expiry
+    DWORD n = 0;
+    size_t textLength = 0;
+    for (DWORD i = 0; i < certificates_NumEntries; i++) {
+        certificates_Entry *e = &certificates_Entries[i];
+        if (!e->Seen) {
+            free(e->Row);
+            continue;
         }
-        c.SerialNumber = serialHex;
-
-        // rest
-        LOG_DEBUG("\tcertificates.c: \tGetting other data.");
-        c.NotBefore = ctx->pCertInfo->NotBefore;
-        c.NotAfter = ctx->pCertInfo->NotAfter;
-        c.StoreLocation = "Local Machine";
-        c.PublicKeySize = CertGetPublicKeyLength(X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, &ctx->pCertInfo->SubjectPublicKeyInfo);
-
-        LOG_DEBUG("\tcertificates.c: \tPrinting cert to buffer.");
-        clog_ArenaAppend(&scratch, "%s\n", certificates_PrettyCertificate(&c, certificateBuf));
-        LOG_DEBUG("\tcertificates.c: \tPrinted cert to buffer.");
-        clog_IgnorePopDefer(&scratch);
+        textLength += strlen(e->Row) + 1;
+        certificates_Entries[n++] = *e;
+    }
+    LOG_DEBUG("\tcertificates.c: %lu certificates, %lu new, %lu renamed, %lu gone.", n, numNew, numChanged, certificates_NumEntries - n);
+    certificates_NumEntries = n;
+    qsort(certificates_Entries, n, sizeof(*certificates_Entries), certificates_CompareExpiry);
+
+    clog_utils_Text *t = clog_utils_NewText(textLength + 64);
+    if (t == NULL) return ERROR_NOT_ENOUGH_MEMORY;
+    for (DWORD i = 0; i < n; i++) {
+        t->Length += sprintf(&t->Text[t->Length], "%s\n", certificates_Entries[i].Row);
     }
-    if (numCertificates == 0) {
-        clog_ArenaAppend(&scratch, "\n(No certificates found in store '%s')", storeLocation);
+    if (n == 0) {
+        t->Length = sprintf(t->Text, "\n(No certificates found in store '%s')", "MY");
+    }
+    clog_utils_SetText(&certificates_Text, t);
+    return ERROR_SUCCESS;
+}
+
+void clog_certificates(clog_Arena scratch) {
+    clog_ArenaAppend(&scratch, "[certificates]");
+
+    AcquireSRWLockExclusive(&certificates_Lock);
+    DWORD err = certificates_Refresh();
+    ReleaseSRWLockExclusive(&certificates_Lock);
+
+    if (!clog_utils_AppendText(&certificates_Text, &scratch)) {
+        clog_ArenaAppend(&scratch, "\n(Unable to open certificate store, error code %#010lx)", err);
+        return;
     }
     LOG_DEBUG("\tcertificates.c: End.");
 }
@@ -7,11 +7,13 @@
     } while (0)
 
 void (*clog_mrlog)(char *fmt, ...) = NULL;
-void clientlog(char *mrmachine, void (*mrsend)(char *machine, char *message), void (*mrlog)(char *fmt, ...)) {
+void clientlog(char *mrmachine, DWORD cmdTimeoutMs, void (*mrsend)(char *machine, char *message, size_t len), void (*mrlog)(char *fmt, ...)) {
     clog_mrlog = mrlog;
     LOG_DEBUG("Clientlog start");
     clog_ArenaState *arenaState = clog_ArenaMake(0x80000); // 512 KB
     clog_Arena arena = arenaState->Memory;
+    // Owned here rather than deferred, sections pop all deferred handles
+    clog_RunCmd *volatile hIpconfig = NULL, *volatile hWinroute = NULL;
 
     LOG_DEBUG("Clientlog setup");
     clog_DeferError(&arena, errorcode) {
@@ -20,10 +22,12 @@ void clientlog(char *mrmachine, void (*mrsend)(char *machine, char *message), vo
         sprintf((char *)arenaState->CurrentStart - 1 - strlen(errormessage), errormessage, errorcode);
 
         LOG_DEBUG("Clientlog error mrsend");
-        mrsend(mrmachine, (char *)arenaState->Start);
+        mrsend(mrmachine, (char *)arenaState->Start, strlen((char *)arenaState->Start));
 
         LOG_DEBUG("Clientlog error teardown");
-        clog_PopDeferAll(&arena);
+        clog_PopDeferKept(&arena);
+        clog_runcmd_Free(hIpconfig);
+        clog_runcmd_Free(hWinroute);
         clog_ArenaFreeAll(arenaState);
 
         LOG_DEBUG("Clientlog error end");
@@ -32,6 +36,13 @@ void clientlog(char *mrmachine, void (*mrsend)(char *machine, char *message), vo
 
     LOG_DEBUG("Clientlog start processes query");
     processes_Handle hProcesses = clog_processes_StartQuery(&arena);
+    // Its snapshot is used by a later section, which must not release it
+    clog_KeepDeferred(&arena);
+
+    // The commands run while the sections before theirs are collected
+    LOG_DEBUG("Clientlog start commands");
+    hIpconfig = clog_ipconfig_Start(cmdTimeoutMs);
+    hWinroute = clog_winroute_Start(cmdTimeoutMs);
 
     LOG_DEBUG("Clientlog start message");
     clog_ArenaAppend(&arena, "client %s.windows windows\n", mrmachine);
@@ -42,8 +53,9 @@ void clientlog(char *mrmachine, void (*mrsend)(char *machine, char *message), vo
     RUN(clog_osversion, arena);
     clog_ArenaAppend(&arena, "\n");
 
-    // RUN(clog_kbs, arena);
-    // clog_ArenaAppend(&arena, "\n");
+    RUN(clog_kbs, arena);
+    clog_ArenaAppend(&arena, "\n");
+
     RUN(clog_winuptime, arena);
     clog_ArenaAppend(&arena, "\n");
 
@@ -59,10 +71,10 @@ void clientlog(char *mrmachine, void (*mrsend)(char *machine, char *message), vo
     RUN(clog_winmemory, arena);
     clog_ArenaAppend(&arena, "\n");
 
-    RUN(clog_ipconfig, arena);
+    RUN(clog_ipconfig_EndAppend, hIpconfig, &arena);
     clog_ArenaAppend(&arena, "\n");
 
-    RUN(clog_winroute, arena);
+    RUN(clog_winroute_EndAppend, hWinroute, &arena);
     clog_ArenaAppend(&arena, "\n");
 
     RUN(clog_winports, arena);
@@ -93,18 +105,23 @@ void clientlog(char *mrmachine, void (*mrsend)(char *machine, char *message), vo
     // No newline
 
     LOG_DEBUG("Clientlog mrsend\n");
-    mrsend(mrmachine, (char *)arenaState->Start);
+    // The arena knows how much was written, no need to measure it again
+    mrsend(mrmachine, (char *)arenaState->Start, arenaState->CurrentStart - arenaState->Start);
 
     LOG_DEBUG("Clientlog teardown");
-    clog_PopDeferAll(&arena);
+    clog_PopDeferKept(&arena);
+    clog_runcmd_Free(hIpconfig);
+    clog_runcmd_Free(hWinroute);
     clog_ArenaFreeAll(arenaState);
 
     LOG_DEBUG("Clientlog end");
 }
 
 #ifdef CLIENTLOGEXE
-void sendfn(char *machine, char *message) {
-    printf("%s", message);
+#include "procsnap.h"
+
+void sendfn(char *machine, char *message, size_t len) {
+    fwrite(message, 1, len, stdout);
 }
 
 void logfn(char *fmt, ...) {
@@ -115,7 +132,12 @@ void logfn(char *fmt, ...) {
 }
 
 int main(int argc, char *argv[]) {
-    clientlog("test", &sendfn, &logfn);
+    // mrbig refreshes the process snapshot every main loop, here we need a
+    // baseline for the CPU column
+    clog_procsnap_Release(clog_procsnap_Refresh());
+    Sleep(1000);
+    clog_procsnap_Release(clog_procsnap_Refresh());
+    clientlog("test", 10000, &sendfn, &logfn);
     return 0;
 }
 #endif
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "arena.h"
+#include "runcmd.h"
 #include <stdio.h>
 #include <wtypesbase.h>
 
@@ -12,7 +13,8 @@
     if (clog_mrlog) clog_mrlog("\n" __VA_ARGS__);
 extern void (*clog_mrlog)(char *fmt, ...);
 
-void clientlog(char *mrmachine, void (*mrsend)(char *machine, char *message), void (*mrlog)(char *fmt, ...));
+// cmdTimeoutMs is how long ipconfig and route may take
+void clientlog(char *mrmachine, DWORD cmdTimeoutMs, void (*mrsend)(char *machine, char *message, size_t len), void (*mrlog)(char *fmt, ...));
 
 /* utils */
 LPSTR clog_utils_ClampString(LPSTR str, LPSTR out, size_t outSize);
@@ -23,7 +25,28 @@ enum clog_utils_PrettyTimestampFlags {
     clog_utils_TIMESTAMP_DATETIME,
 };
 LPSTR clog_utils_PrettySystemtime(SYSTEMTIME *t, UINT8 flags, LPSTR out, size_t outSize);
-DWORD clog_utils_RunCmdSynchronously(CHAR *cmdline, clog_Arena scratch);
+DWORD clog_utils_AppendCmdOutput(clog_RunCmd *cmd, clog_Arena *a);
+
+// The text of a section that is rendered by a collector, and shared with
+// the clientlog runs that are appending it
+typedef struct {
+    volatile LONG Refs;
+    size_t Length;
+    CHAR Text[];
+} clog_utils_Text;
+
+typedef struct {
+    SRWLOCK Lock; // guards Current
+    clog_utils_Text *Current;
+} clog_utils_SectionText;
+
+#define CLOG_UTILS_SECTIONTEXT_INIT {SRWLOCK_INIT, NULL}
+
+clog_utils_Text *clog_utils_NewText(size_t size);
+void clog_utils_ReleaseText(clog_utils_Text *t);
+void clog_utils_SetText(clog_utils_SectionText *s, clog_utils_Text *t);
+BOOL clog_utils_HasText(clog_utils_SectionText *s);
+BOOL clog_utils_AppendText(clog_utils_SectionText *s, clog_Arena *a);
 
 /* applications */
 void clog_applications(clog_Arena scratch);
@@ -50,9 +73,11 @@ void clog_diskinfo(clog_Arena scratch);
 void clog_eventlog(DWORD maxNumEvents, clog_Arena scratch);
 
 /* ipconfig */
-void clog_ipconfig(clog_Arena scratch);
+clog_RunCmd *clog_ipconfig_Start(DWORD timeoutMs);
+void clog_ipconfig_EndAppend(clog_RunCmd *cmd, clog_Arena *a);
 
 /* kbs */
+void clog_kbs_Start(const CHAR *cacheFile, DWORD intervalSeconds);
 void clog_kbs(clog_Arena scratch);
 
 /* osversion */
@@ -76,7 +101,8 @@ void clog_who(DWORD maxNumSessions, clog_Arena scratch);
 void clog_winmemory(clog_Arena scratch);
 
 /* winroute */
-void clog_winroute(clog_Arena scratch);
+clog_RunCmd *clog_winroute_Start(DWORD timeoutMs);
+void clog_winroute_EndAppend(clog_RunCmd *cmd, clog_Arena *a);
 
 /* winports + winportsused */
 void clog_winports(clog_Arena scratch);
@@ -1,10 +1,12 @@
 #include "clientlog.h"
+#include "pubcache.h"
 #include <time.h>
 #include <winevt.h>
 
 #define MAX_PROVIDER_NAME_LENGTH (255)
 #define MAX_EVENT_MESSAGE_SIZE (0x1000) // 4 KB
 #define MAX_EVENTLOG_ROW_SIZE (512)
+#define RENDER_BUFFER_SIZE (0x1000) // Initial size in bytes for the system properties of one event
 
 // Due to string literal concatenation in EvtQuery below, you must treat this as a string (not a number) when modifying
 // For example, a writing 3600 * 1000 instead of 3600000 will not work
@@ -58,24 +60,37 @@ LPSTR eventlog_PrettyEvent(eventlog_Event *e, CHAR *out) {
     return out;
 }
 
-eventlog_Event eventlog_GetEventData(EVT_HANDLE eventHandle) {
+// Publisher metadata handles are kept between runs
+static clog_PubCache eventlog_Publishers;
+static BOOL eventlog_PublishersInit;
+
+static void *eventlog_OpenPublisher(const wchar_t *provider) {
+    return EvtOpenPublisherMetadata(NULL, provider, NULL, 0, 0);
+}
+
+static void eventlog_ClosePublisher(void *handle) {
+    EvtClose(handle);
+}
+
+/**
+ * Render the system properties and message of an event.
+ * @param contextHandle a system render context, shared by all events of a run.
+ * @param scratch used only when an event does not fit the stack buffers.
+ */
+eventlog_Event eventlog_GetEventData(EVT_HANDLE contextHandle, EVT_HANDLE eventHandle, clog_Arena scratch) {
     eventlog_Event result = {0};
 
     // Follows general steps of .Net (C#) class EventLogRecord.cs, from System.Diagnostics.Reader
-    EVT_HANDLE contextHandle = EvtCreateRenderContext(0, NULL, EvtRenderContextSystem);
-
+    EVT_VARIANT propsBuffer[RENDER_BUFFER_SIZE / sizeof(EVT_VARIANT)];
+    EVT_VARIANT *eventSystemProperties = propsBuffer;
     DWORD bufferNeeded, propCount;
-    BOOL status = EvtRender(contextHandle, eventHandle, EvtRenderEventValues, 0, NULL, &bufferNeeded, &propCount);
+    BOOL status = EvtRender(contextHandle, eventHandle, EvtRenderEventValues, sizeof(propsBuffer), eventSystemProperties, &bufferNeeded, &propCount);
     DWORD error = GetLastError();
-    if (error != ERROR_INSUFFICIENT_BUFFER) {
-        EvtClose(contextHandle);
-        return result;
+    if (!status && error == ERROR_INSUFFICIENT_BUFFER) {
+        eventSystemProperties = clog_ArenaAlloc(&scratch, EVT_VARIANT, bufferNeeded / sizeof(EVT_VARIANT) + 1);
+        status = EvtRender(contextHandle, eventHandle, EvtRenderEventValues, bufferNeeded, eventSystemProperties, &bufferNeeded, &propCount);
     }
-
-    EVT_VARIANT eventSystemProperties[bufferNeeded / sizeof(EVT_VARIANT)];
-    status = EvtRender(contextHandle, eventHandle, EvtRenderEventValues, bufferNeeded, eventSystemProperties, &bufferNeeded, &propCount);
     if (!status) {
-        EvtClose(contextHandle);
         return result;
     }
 
@@ -103,41 +118,38 @@ eventlog_Event eventlog_GetEventData(EVT_HANDLE eventHandle) {
     }
 
     if (providerName != NULL) {
-        // TODO: cache publisher handles like in .NET EventLogRecord.
-        EVT_HANDLE pmHandle = EvtOpenPublisherMetadata(NULL, providerName, NULL, 0, 0); // RE providerName. We cannot use result.Provider, since we need wchar_t*
-
-        WCHAR emptyBuffer[1] = {L'\0'}; // Due to: https://github.com/dotnet/runtime/issues/100198"
-        status = EvtFormatMessage(pmHandle, eventHandle, 0, 0, NULL, EvtFormatMessageEvent, 0, emptyBuffer, &bufferNeeded);
-        error = GetLastError();
-        if (!status && // EventLogRecord says: Unresolved inserts are indications that strings COULD be missing, and are not real errors
-            error != ERROR_EVT_UNRESOLVED_VALUE_INSERT &&
-            error != ERROR_EVT_UNRESOLVED_PARAMETER_INSERT &&
-            error != ERROR_INSUFFICIENT_BUFFER) {
-            EvtClose(pmHandle);
-            EvtClose(contextHandle);
-            return result;
+        if (!eventlog_PublishersInit) {
+            clog_pubcache_Init(&eventlog_Publishers, eventlog_OpenPublisher, eventlog_ClosePublisher);
+            eventlog_PublishersInit = TRUE;
         }
+        EVT_HANDLE pmHandle = clog_pubcache_Get(&eventlog_Publishers, providerName); // RE providerName. We cannot use result.Provider, since we need wchar_t*
 
-        WCHAR messageBuffer[bufferNeeded];
-        status = EvtFormatMessage(pmHandle, eventHandle, 0, 0, NULL, EvtFormatMessageEvent, bufferNeeded, messageBuffer, &bufferNeeded);
+        // Format straight into a buffer of the final size, and only retry when the message is larger
+        WCHAR messageBuffer[MAX_EVENT_MESSAGE_SIZE];
+        WCHAR *message = messageBuffer;
+        status = EvtFormatMessage(pmHandle, eventHandle, 0, 0, NULL, EvtFormatMessageEvent, lengthof(messageBuffer), message, &bufferNeeded);
         error = GetLastError();
-        EvtClose(pmHandle);
-        if (!status &&
+        if (!status && error == ERROR_INSUFFICIENT_BUFFER) {
+            message = clog_ArenaAlloc(&scratch, WCHAR, bufferNeeded);
+            status = EvtFormatMessage(pmHandle, eventHandle, 0, 0, NULL, EvtFormatMessageEvent, bufferNeeded, message, &bufferNeeded);
+            error = GetLastError();
+        }
+        if (!status && // EventLogRecord says: Unresolved inserts are indications that strings COULD be missing, and are not real errors
             error != ERROR_EVT_UNRESOLVED_VALUE_INSERT &&
             error != ERROR_EVT_UNRESOLVED_PARAMETER_INSERT) {
-            EvtClose(contextHandle);
             return result;
         }
-        size_t messageWritten = wcstombs(result.Message, messageBuffer, MAX_EVENT_MESSAGE_SIZE);
+        size_t messageWritten = wcstombs(result.Message, message, MAX_EVENT_MESSAGE_SIZE);
         if (messageWritten >= MAX_EVENT_MESSAGE_SIZE) result.Message[MAX_EVENT_MESSAGE_SIZE - 1] = '\0';
     }
 
-    EvtClose(contextHandle);
     return result;
 }
 
 void clog_eventlog(DWORD maxNumEvents, clog_Arena scratch) {
     CHAR eventBuffer[MAX_EVENTLOG_ROW_SIZE];
+    EVT_HANDLE contextHandle = EvtCreateRenderContext(0, NULL, EvtRenderContextSystem);
+    clog_Defer(&scratch, contextHandle, RETURN_INT, &EvtClose);
     for (DWORD channelIx = 0; channelIx < NUM_CHANNELS; channelIx++) {
         CHAR channelName[32];
         wcstombs(channelName, CHANNELS[channelIx], 32);
@@ -153,7 +165,7 @@ void clog_eventlog(DWORD maxNumEvents, clog_Arena scratch) {
             clog_ArenaAppend(&scratch, "\n%-23s\t%6s \t%-7s\t %-30s\t%s", "Timestamp", "Id", "Level", "Source", "Message");
 
             for (DWORD i = 0; i < nEvents; i++) {
-                eventlog_Event e = eventlog_GetEventData(event[i]);
+                eventlog_Event e = eventlog_GetEventData(contextHandle, event[i], scratch);
                 clog_Defer(&scratch, event[i], RETURN_INT, &EvtClose);
                 clog_ArenaAppend(&scratch, "\n%s", eventlog_PrettyEvent(&e, eventBuffer));
                 clog_PopDefer(&scratch);
@@ -163,6 +175,7 @@ void clog_eventlog(DWORD maxNumEvents, clog_Arena scratch) {
         }
         clog_PopDefer(&scratch);
     }
+    clog_PopDefer(&scratch);
 }
 
 #ifdef STANDALONE
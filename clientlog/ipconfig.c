@@ -1,6 +1,10 @@
 #include "clientlog.h"
 
-void clog_ipconfig(clog_Arena scratch) {
-    clog_ArenaAppend(&scratch, "[ipconfig]\n");
-    clog_utils_RunCmdSynchronously("C:\\Windows\\System32\\ipconfig.exe /all", scratch);
+clog_RunCmd *clog_ipconfig_Start(DWORD timeoutMs) {
+    return clog_runcmd_Start("C:\\Windows\\System32\\ipconfig.exe /all", timeoutMs);
+}
+
+void clog_ipconfig_EndAppend(clog_RunCmd *cmd, clog_Arena *a) {
+    clog_ArenaAppend(a, "[ipconfig]\n");
+    clog_utils_AppendCmdOutput(cmd, a);
 }
\ No newline at end of file
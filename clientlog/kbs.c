@@ -3,16 +3,22 @@
 #include <wuapi.h>
 #include <wuerror.h>
 
-typedef struct TreeSet {
-    struct TreeSet *Left;
-    struct TreeSet *Right;
-    DWORD Value;
-} TreeSet;
+// Searching for installed updates takes from seconds to minutes, so it runs
+// on a background thread every few hours. The result is kept as the text of
+// the [kbs] section, which clientlog copies as it is, and in a cache file
+// that is read at startup, so the section isn't empty until the first search
+// after a restart.
 
-struct ComString {
-    UINT32 len;
-    wchar_t content[1];
-};
+#define KBS_MININTERVAL 600 // seconds
+#define KBS_RETRY 3600      // seconds, after a failed search
+#define KBS_FILETIME_SECOND 10000000ULL
+
+// "\nKB123\nKB456", ascending, or why there are none
+static clog_utils_SectionText kbs_Text = CLOG_UTILS_SECTIONTEXT_INIT;
+static CHAR kbs_CacheFile[MAX_PATH];
+static volatile LONG kbs_Interval; // seconds
+static volatile LONG kbs_Started;
+static ULONGLONG kbs_LastSearch; // FILETIME, only used by the thread once started
 
 DWORD kbs_ExtractKBNumber(wchar_t *title) {
     DWORD res = 0;
@@ -36,139 +42,244 @@ DWORD kbs_ExtractKBNumber(wchar_t *title) {
     return 0;
 }
 
-void kbs_InsertKB(TreeSet **root, TreeSet *node) {
-    if (*root == NULL) {
-        *root = node;
-    } else {
-        TreeSet *rootNode = *root;
-        if (node->Value < rootNode->Value)
-            kbs_InsertKB(&rootNode->Left, node);
-        else if (node->Value > rootNode->Value)
-            kbs_InsertKB(&rootNode->Right, node);
-        else
-            return;
-    }
+static int kbs_CompareKB(const void *a, const void *b) {
+    DWORD ka = *(const DWORD *)a, kb = *(const DWORD *)b;
+    return ka < kb ? -1 : ka > kb;
 }
 
-void kbs_appendKBs(clog_Arena *a, TreeSet *root) {
-    LOG_DEBUG("\t\tkbs.c: Appending KB%d.", root->Value);
-    if (root->Left) kbs_appendKBs(a, root->Left);
-    clog_ArenaAppend(a, "\nKB%lu", root->Value);
-    if (root->Right) kbs_appendKBs(a, root->Right);
+/**
+ * Sort the KB numbers, drop duplicates and format them as the section text.
+ * Without any, the text says why.
+ * @return the text with one reference, NULL if out of memory.
+ */
+static clog_utils_Text *kbs_MakeInventory(DWORD *kbs, DWORD numKBs, HRESULT errorCode) {
+    qsort(kbs, numKBs, sizeof(*kbs), kbs_CompareKB);
+
+    clog_utils_Text *inv = clog_utils_NewText(numKBs * (sizeof("\nKB4294967295") - 1) + 64);
+    if (inv == NULL) return NULL;
+    for (DWORD i = 0; i < numKBs; i++) {
+        if (i > 0 && kbs[i] == kbs[i - 1]) continue;
+        inv->Length += sprintf(&inv->Text[inv->Length], "\nKB%lu", (unsigned long)kbs[i]);
+    }
+    if (numKBs == 0 && errorCode != S_OK) {
+        inv->Length = sprintf(inv->Text, "\n(Unable to search for updates, error code %#010lx)", (unsigned long)errorCode);
+    } else if (numKBs == 0) {
+        inv->Length = sprintf(inv->Text, "(No KBs found)");
+    }
+    return inv;
 }
 
-void clog_kbs(clog_Arena scratch) {
-    TreeSet *kbs = NULL;
+/**
+ * Ask Windows Update for the installed updates. Very slow.
+ * @param kbs set to a malloc'd array of KB numbers, in the order found
+ * @return S_OK, or the error that stopped the search
+ */
+static HRESULT kbs_Search(DWORD **kbs, DWORD *numKBs) {
     IUpdateSession *session = NULL;
     IUpdateSearcher *searcher = NULL;
     ISearchResult *searchResult = NULL;
     IUpdateCollection *updates = NULL;
-    clog_ArenaAppend(&scratch, "[kbs]");
-
-
-
-    LOG_DEBUG("\tkbs.c: Initializing COM library.");
-    HRESULT status = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
-    if (status != S_OK) {
-        LOG_DEBUG("\tkbs.c: COM library could not be initalized, error code %lu.", GetLastError());
-        clog_ArenaAppend(&scratch, "(Unable to initialize COM)");
-        return;
-    }
-
-#define HANDLE_COM_ALLOCATION(obj)                                                               \
-    if (status != S_OK) {                                                                   \
-        LOG_DEBUG("\tkbs.c: COM library " #obj " failed, error code %lu.", GetLastError()); \
-        goto Cleanup;                                                                       \
-    }                                                                                       \
-    clog_Defer(&scratch, obj, RETURN_LONG, obj->lpVtbl->Release)
+    BSTR query = NULL;
+    *kbs = NULL;
+    *numKBs = 0;
 
     LOG_DEBUG("\tkbs.c: Starting COM session.");
-    status = CoCreateInstance(&CLSID_UpdateSession, NULL, CLSCTX_INPROC_SERVER, &IID_IUpdateSession, (LPVOID *)&session);
-    HANDLE_COM_ALLOCATION(session);
+    HRESULT status = CoCreateInstance(&CLSID_UpdateSession, NULL, CLSCTX_INPROC_SERVER, &IID_IUpdateSession, (LPVOID *)&session);
+    if (status != S_OK) goto Cleanup;
 
     LOG_DEBUG("\tkbs.c: Creating searcher.");
     status = session->lpVtbl->CreateUpdateSearcher(session, &searcher);
-    HANDLE_COM_ALLOCATION(searcher);
+    if (status != S_OK) goto Cleanup;
 
-    wchar_t *queryChar = L"( IsInstalled = 1 and IsHidden = 0 )";
-    BSTR query = SysAllocString(queryChar);
-    clog_Defer(&scratch, query, RETURN_VOID, SysFreeString);
-    // Very slow, see earlier commit in history for other version using another method
+    query = SysAllocString(L"( IsInstalled = 1 and IsHidden = 0 )");
     status = searcher->lpVtbl->Search(searcher, query, &searchResult);
-    HANDLE_COM_ALLOCATION(searchResult);
+    if (status != S_OK) goto Cleanup;
 
     OperationResultCode searchResultCode = 0;
     status = searchResult->lpVtbl->get_ResultCode(searchResult, &searchResultCode);
-    if (status != S_OK || (searchResultCode != orcSucceeded && searchResultCode != orcSucceededWithErrors)) {
-        LOG_DEBUG("\tkbs.c: Could not complete search, error code %lu.", GetLastError());
-        goto Cleanup;
+    if (status == S_OK && searchResultCode != orcSucceeded && searchResultCode != orcSucceededWithErrors) {
+        status = E_FAIL;
     }
+    if (status != S_OK) goto Cleanup;
 
     status = searchResult->lpVtbl->get_Updates(searchResult, &updates);
-    HANDLE_COM_ALLOCATION(updates);
+    if (status != S_OK) goto Cleanup;
 
     LONG count = 0;
     status = updates->lpVtbl->get_Count(updates, &count);
-    if (status != S_OK) {
-        LOG_DEBUG("\tkbs.c: Could not get count, error code %lu.", GetLastError());
+    if (status != S_OK || count == 0) goto Cleanup;
+
+    *kbs = malloc(count * sizeof(**kbs));
+    if (*kbs == NULL) {
+        status = E_OUTOFMEMORY;
         goto Cleanup;
     }
-    if (count == 0) {
-        LOG_DEBUG("\tkbs.c: Searcher update count is zero.");
-        goto Cleanup;
+    for (LONG i = 0; i < count; i++) {
+        IUpdate *item = NULL;
+        if (updates->lpVtbl->get_Item(updates, i, &item) != S_OK) {
+            LOG_DEBUG("\t\tkbs.c: Could not get item %ld.", i);
+            continue;
+        }
+        BSTR title = NULL;
+        if (item->lpVtbl->get_Title(item, &title) == S_OK && title != NULL) {
+            DWORD kb = kbs_ExtractKBNumber(title);
+            if (kb) (*kbs)[(*numKBs)++] = kb;
+            SysFreeString(title);
+        }
+        item->lpVtbl->Release(item);
     }
 
-    for (int i = 0; i < count; i++) {
-        LOG_DEBUG("\tkbs.c: Item %d:", i);
-        IUpdate *item;
-        updates->lpVtbl->get_Item(updates, i, &item);
-        if (status != S_OK) {
-            LOG_DEBUG("\t\tkbs.c: Could not get item %d, error code %lu.", i, GetLastError());
-            continue;
+Cleanup:
+    if (status != S_OK) LOG_DEBUG("\tkbs.c: Search failed, error code %#010lx.", (unsigned long)status);
+    if (updates) updates->lpVtbl->Release(updates);
+    if (searchResult) searchResult->lpVtbl->Release(searchResult);
+    if (query) SysFreeString(query);
+    if (searcher) searcher->lpVtbl->Release(searcher);
+    if (session) session->lpVtbl->Release(session);
+    return status;
+}
+
+// The cache file is the section text, one KB number per line, written to a
+// temporary file first so a crash can't leave half of it behind.
+static void kbs_WriteCache(clog_utils_Text *inv) {
+    CHAR tmp[MAX_PATH + 4];
+
+    if (kbs_CacheFile[0] == '\0') return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", kbs_CacheFile);
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL) return;
+    BOOL ok = fwrite(inv->Text, 1, inv->Length, fp) == inv->Length;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || !MoveFileEx(tmp, kbs_CacheFile, MOVEFILE_REPLACE_EXISTING)) {
+        LOG_DEBUG("\tkbs.c: Could not write %s.", kbs_CacheFile);
+        DeleteFile(tmp);
+    }
+}
+
+/**
+ * Read the inventory saved by an earlier search.
+ * @return FILETIME of the search, 0 if there is no cache file.
+ */
+static ULONGLONG kbs_ReadCache(void) {
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    CHAR line[32];
+    DWORD numKBs = 0, maxKBs = 256, *kbs;
+
+    if (!GetFileAttributesEx(kbs_CacheFile, GetFileExInfoStandard, &attr)) return 0;
+    FILE *fp = fopen(kbs_CacheFile, "rb");
+    if (fp == NULL) return 0;
+    kbs = malloc(maxKBs * sizeof(*kbs));
+    while (kbs != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "KB", 2) != 0) continue;
+        if (numKBs == maxKBs) {
+            DWORD *more = realloc(kbs, 2 * maxKBs * sizeof(*kbs));
+            if (more == NULL) break;
+            kbs = more;
+            maxKBs *= 2;
         }
+        kbs[numKBs] = strtoul(&line[2], NULL, 10);
+        if (kbs[numKBs] != 0) numKBs++;
+    }
+    fclose(fp);
+    if (kbs == NULL) return 0;
+
+    clog_utils_Text *inv = kbs_MakeInventory(kbs, numKBs, S_OK);
+    free(kbs);
+    if (inv == NULL) return 0;
+    clog_utils_SetText(&kbs_Text, inv);
+    return ((ULONGLONG)attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+}
+
+/**
+ * Search, then replace the current inventory and the cache file with the
+ * result. A failed search keeps the last inventory that worked.
+ * @return TRUE if the search worked.
+ */
+static BOOL kbs_Refresh(void) {
+    DWORD *kbs, numKBs;
+    HRESULT status = kbs_Search(&kbs, &numKBs);
+
+    if (status != S_OK) {
+        free(kbs);
+        if (!clog_utils_HasText(&kbs_Text)) clog_utils_SetText(&kbs_Text, kbs_MakeInventory(NULL, 0, status));
+        return FALSE;
+    }
+    clog_utils_Text *inv = kbs_MakeInventory(kbs, numKBs, S_OK);
+    free(kbs);
+    if (inv == NULL) return FALSE;
+    kbs_WriteCache(inv);
+    clog_utils_SetText(&kbs_Text, inv);
+    return TRUE;
+}
+
+static ULONGLONG kbs_Now(void) {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+static DWORD WINAPI kbs_Thread(LPVOID arg) {
+    BOOL failed = FALSE;
 
-        wchar_t *title = NULL;
-        item->lpVtbl->get_Title(item, (short unsigned int **)&title);
-        if (status != S_OK) {
-            LOG_DEBUG("\t\tkbs.c: Could not get item title, error code %lu.", GetLastError());
-            goto NextItem;
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    if (CoInitializeEx(NULL, COINIT_APARTMENTTHREADED) != S_OK) {
+        LOG_DEBUG("\tkbs.c: COM library could not be initalized.");
+        clog_utils_SetText(&kbs_Text, kbs_MakeInventory(NULL, 0, E_FAIL));
+        return 0;
+    }
+    for (;;) {
+        // Woken every minute, so a new interval takes effect without a search
+        ULONGLONG interval = failed ? min(kbs_Interval, KBS_RETRY) : kbs_Interval;
+        ULONGLONG now = kbs_Now(), next = kbs_LastSearch + interval * KBS_FILETIME_SECOND;
+        if (now >= next || now < kbs_LastSearch) {
+            LOG_DEBUG("\tkbs.c: Searching for installed updates.");
+            failed = !kbs_Refresh();
+            kbs_LastSearch = kbs_Now();
+        } else {
+            Sleep((DWORD)min((next - now) / 10000, 60000));
         }
+    }
+    return 0;
+}
 
-        LOG_DEBUG("\t\tkbs.c: Extracting KB number from title.");
-        DWORD kb = kbs_ExtractKBNumber(title);
-        if (kb) {
-            LOG_DEBUG("\t\tkbs.c: Extracted KB%lu. Adding to list.", kb);
-            TreeSet *node = clog_ArenaAlloc(&scratch, TreeSet, 1);
-            *node = (TreeSet){0};
-            node->Value = kb;
-            kbs_InsertKB(&kbs, node);
-        } else
-            LOG_DEBUG("\t\tkbs.c: Title did not contain KB number, skipping.");
-
-    NextItem:
-        LOG_DEBUG("\t\tkbs.c: Releasing item %d.", i);
-        item->lpVtbl->Release(item);
+/**
+ * Start collecting the KB inventory in the background, once. Later calls
+ * only change the interval.
+ * @param cacheFile where to keep the inventory between restarts, "" for nowhere
+ * @param intervalSeconds time between searches, at least KBS_MININTERVAL
+ */
+void clog_kbs_Start(const CHAR *cacheFile, DWORD intervalSeconds) {
+    InterlockedExchange(&kbs_Interval, max(intervalSeconds, KBS_MININTERVAL));
+    if (InterlockedCompareExchange(&kbs_Started, 1, 0) != 0) return;
+
+    snprintf(kbs_CacheFile, sizeof(kbs_CacheFile), "%s", cacheFile);
+    if (kbs_CacheFile[0] != '\0') kbs_LastSearch = kbs_ReadCache();
+    HANDLE h = CreateThread(NULL, 0, kbs_Thread, NULL, 0, NULL);
+    if (h == NULL) {
+        LOG_DEBUG("\tkbs.c: CreateThread failed, error code %lu.", GetLastError());
+        kbs_Started = 0;
+        return;
     }
+    CloseHandle(h);
+}
 
-Cleanup:
-    LOG_DEBUG("\tkbs.c: Performing cleanup.");
-    clog_PopDeferAll(&scratch);
-    CoUninitialize();
-
-    LOG_DEBUG("\tkbs.c: Cleanup complete.");
-    if (kbs) {
-        LOG_DEBUG("\tkbs.c: Printing KBs to output.");
-        kbs_appendKBs(&scratch, kbs);
-    } else {
-        LOG_DEBUG("\tkbs.c: No installed KBs found.");
-        clog_ArenaAppend(&scratch, "(No KBs found)");
+void clog_kbs(clog_Arena scratch) {
+    clog_ArenaAppend(&scratch, "[kbs]");
+
+    if (!clog_utils_AppendText(&kbs_Text, &scratch)) {
+        clog_ArenaAppend(&scratch, "\n(KB inventory not collected yet)");
     }
 }
 
 #ifdef STANDALONE
 int main(int argc, CHAR *argv[]) {
     clog_ArenaState *st = clog_ArenaMake(0x20000);
+    if (argc > 1) {
+        snprintf(kbs_CacheFile, sizeof(kbs_CacheFile), "%s", argv[1]);
+        kbs_ReadCache();
+    }
+    if (CoInitializeEx(NULL, COINIT_APARTMENTTHREADED) == S_OK) kbs_Refresh();
     clog_kbs(st->Memory);
     printf("%s", st->Start);
 }
-#endif
\ No newline at end of file
+#endif
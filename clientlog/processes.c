@@ -1,15 +1,15 @@
 #include "clientlog.h"
-#include <tlhelp32.h>
-#include <pdhmsg.h>
-#include <pdh.h>
+#include "procsnap.h"
+#include "topk.h"
+#include <sddl.h>
 
-#define PROCESSES_BENCHMARK_SECONDS (1)
 #define NUM_TOPPROCESSES (20)
+#define PROCESSES_SIDTTL (60 * 60 * 1000)      // accounts can be renamed, look them up again after an hour
+#define PROCESSES_NEGATIVETTL (5 * 60 * 1000) // failed lookups are retried after five minutes
+#define PROCESSES_MAXSIDS 4096
 
 typedef struct {
-    PDH_HQUERY Query;
-    PDH_HCOUNTER IDProcess, WorkingSet, ProcessorTime;
-    HANDLE Event;
+    clog_ProcSnap *Snap;
     DWORD ErrorCode;
 } processes_State;
 
@@ -27,252 +27,375 @@ typedef struct {
     DWORD ErrorCode;
 } processes_Table;
 
+// The CPU column covers the time since the previous process snapshot,
+// which mrbig takes once per main loop. The snapshot is released with the
+// deferred handles, so it is not lost when the arena runs out.
 processes_Handle clog_processes_StartQuery(clog_Arena *a) {
-    HANDLE eventRes = NULL;
-    PDH_HQUERY queryRes = NULL;
-    PDH_HCOUNTER idProcess, workingSet, processorTime;
     processes_State *state = clog_ArenaAlloc(a, processes_State, 1);
 
-    state->ErrorCode = PdhOpenQuery(NULL, 0, &queryRes);
-    if (state->ErrorCode != ERROR_SUCCESS) goto Cleanup;
-
-    state->ErrorCode = PdhAddEnglishCounter(queryRes, "\\Process(*)\\ID Process", 0, &idProcess);
-    if (state->ErrorCode != ERROR_SUCCESS) goto Cleanup;
+    state->Snap = clog_procsnap_Get();
+    if (state->Snap == NULL) {
+        state->ErrorCode = ERROR_NOT_ENOUGH_MEMORY;
+    } else {
+        clog_Defer(a, state->Snap, RETURN_VOID, &clog_procsnap_Release);
+        state->ErrorCode = state->Snap->ErrorCode;
+    }
+    return state;
+}
 
-    state->ErrorCode = PdhAddEnglishCounter(queryRes, "\\Process(*)\\Working Set - Private", 0, &workingSet);
-    if (state->ErrorCode != ERROR_SUCCESS) goto Cleanup;
+// The user of each process from the previous cycle, ordered by PID like the
+// snapshot rows. The user of a process never changes, so only failed
+// queries expire.
+typedef struct {
+    DWORD PID;
+    ULONGLONG CreateTime;
+    ULONGLONG Expires; // for failed queries, where SidLength is 0
+    DWORD SidLength;
+    BYTE Sid[SECURITY_MAX_SID_SIZE];
+} processes_UserEntry;
+
+// "DOMAIN\user" for each SID. LookupAccountSid may have to ask a domain
+// controller, so names, and failures to find one, are kept until they expire.
+typedef struct {
+    DWORD SidLength; // 0 when the slot is free
+    BYTE Sid[SECURITY_MAX_SID_SIZE];
+    unsigned long Hash;
+    ULONGLONG Expires;
+    CHAR *User;
+} processes_SidEntry;
+
+static SRWLOCK processes_UserLock = SRWLOCK_INIT; // guards the caches below
+static processes_UserEntry *processes_Users;
+static DWORD processes_NumUsers;
+static processes_SidEntry *processes_Sids; // open addressing, processes_SidMask + 1 slots
+static DWORD processes_SidMask, processes_NumSids;
+
+static unsigned long processes_HashSid(BYTE *sid, DWORD length) {
+    unsigned long h = 2166136261UL;
+    for (DWORD i = 0; i < length; i++) {
+        h ^= sid[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
 
-    state->ErrorCode = PdhAddEnglishCounter(queryRes, "\\Process(*)\\% Processor Time", 0, &processorTime);
-    if (state->ErrorCode != ERROR_SUCCESS) goto Cleanup;
+static processes_SidEntry *processes_FindSid(BYTE *sid, DWORD length, unsigned long hash) {
+    for (DWORD i = hash & processes_SidMask;; i = (i + 1) & processes_SidMask) {
+        processes_SidEntry *e = &processes_Sids[i];
+        if (e->SidLength == 0 || (e->Hash == hash && e->SidLength == length && !memcmp(e->Sid, sid, length))) return e;
+    }
+}
 
-    eventRes = CreateEvent(NULL, FALSE, FALSE, NULL);
-    if (eventRes == NULL) goto Cleanup;
+static void processes_ClearSids(void) {
+    for (DWORD i = 0; processes_Sids != NULL && i <= processes_SidMask; i++)
+        free(processes_Sids[i].User);
+    free(processes_Sids);
+    processes_Sids = NULL;
+    processes_SidMask = processes_NumSids = 0;
+}
 
-    PdhCollectQueryData(queryRes); // PdhCollectQueryDataEx does in fact not perform an initial query
-    state->ErrorCode = PdhCollectQueryDataEx(queryRes, PROCESSES_BENCHMARK_SECONDS, eventRes);
-    if (state->ErrorCode != ERROR_SUCCESS) goto Cleanup;
+/**
+ * Make room for one more SID, keeping the table at most 3/4 full. The
+ * table is started over when it holds more SIDs than any host should have.
+ * @return FALSE if out of memory.
+ */
+static BOOL processes_ReserveSid(void) {
+    if (processes_NumSids >= PROCESSES_MAXSIDS) processes_ClearSids();
+    if (processes_Sids != NULL && (processes_NumSids + 1) * 4 <= (processes_SidMask + 1) * 3) return TRUE;
+
+    processes_SidEntry *old = processes_Sids;
+    DWORD oldSize = old ? processes_SidMask + 1 : 0, size = old ? 2 * oldSize : 64;
+    processes_Sids = calloc(size, sizeof(*processes_Sids));
+    if (processes_Sids == NULL) {
+        processes_Sids = old;
+        return FALSE;
+    }
+    processes_SidMask = size - 1;
+    for (DWORD i = 0; i < oldSize; i++) {
+        if (old[i].SidLength != 0) *processes_FindSid(old[i].Sid, old[i].SidLength, old[i].Hash) = old[i];
+    }
+    free(old);
+    return TRUE;
+}
 
-    state->Query = queryRes;
-    state->IDProcess = idProcess;
-    state->WorkingSet = workingSet;
-    state->ProcessorTime = processorTime;
-    state->Event = eventRes;
-    state->ErrorCode = ERROR_SUCCESS;
-    return state;
+/**
+ * Find the account name of a SID as "DOMAIN\user". SIDs without one, as
+ * from deleted accounts or unreachable domains, are shown as "S-1-5-...".
+ * @return FALSE if the name could not be found.
+ */
+static BOOL processes_ResolveSid(PSID sid, CHAR *out, size_t outSize) {
+    CHAR name[256], domain[256];
+    DWORD nameSize = sizeof(name), domainSize = sizeof(domain);
+    SID_NAME_USE type;
+    CHAR *sidString;
 
-Cleanup:
-    if (queryRes != NULL) PdhCloseQuery(queryRes);
-    if (eventRes != NULL) CloseHandle(eventRes);
-    return state;
+    if (LookupAccountSid(NULL, sid, name, &nameSize, domain, &domainSize, &type)) {
+        if (*domain)
+            snprintf(out, outSize, "%s\\%s", domain, name);
+        else
+            snprintf(out, outSize, "%s", name);
+        return TRUE;
+    }
+    if (ConvertSidToStringSid(sid, &sidString)) {
+        snprintf(out, outSize, "%s", sidString);
+        LocalFree(sidString);
+    } else {
+        snprintf(out, outSize, "-");
+    }
+    return FALSE;
 }
 
-CHAR *processes_GetProcessUser(DWORD processID, clog_Arena *a) { // TODO: Cache lookups
-    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processID);
-    clog_Defer(a, process, RETURN_INT, &CloseHandle);
-    HANDLE processToken = NULL;
-    if (!OpenProcessToken(process, TOKEN_QUERY, &processToken)) {
-        return "-";
+/**
+ * @return the name for a SID, from the cache if it hasn't expired. Points
+ * into the cache or to buf, so copy it before releasing processes_UserLock.
+ */
+static CHAR *processes_LookupSid(BYTE *sid, DWORD length, ULONGLONG now, CHAR *buf, size_t bufSize) {
+    unsigned long hash = processes_HashSid(sid, length);
+    if (!processes_ReserveSid()) {
+        processes_ResolveSid(sid, buf, bufSize);
+        return buf;
     }
-    clog_Defer(a, processToken, RETURN_INT, &CloseHandle);
 
-    DWORD userSIDbufsize = 0;
-    GetTokenInformation(processToken, TokenUser, NULL, 0, &userSIDbufsize);
-    BYTE userSID[userSIDbufsize];
-    if (!GetTokenInformation(processToken, TokenUser, (TOKEN_USER *)userSID, userSIDbufsize, &userSIDbufsize)) {
-        return "-";
+    processes_SidEntry *e = processes_FindSid(sid, length, hash);
+    if (e->SidLength != 0 && now < e->Expires && e->User != NULL) return e->User;
+
+    BOOL found = processes_ResolveSid(sid, buf, bufSize);
+    if (e->SidLength == 0) {
+        memcpy(e->Sid, sid, length);
+        e->SidLength = length;
+        e->Hash = hash;
+        processes_NumSids++;
     }
+    free(e->User);
+    e->User = _strdup(buf);
+    e->Expires = now + (found ? PROCESSES_SIDTTL : PROCESSES_NEGATIVETTL);
+    return buf;
+}
 
-    DWORD userBufsize = 256, domainBufsize = 256;
-    CHAR username[userBufsize];
-    CHAR domain[domainBufsize];
-    SID_NAME_USE type;
-    
-    LookupAccountSid(NULL, ((TOKEN_USER *)userSID)->User.Sid, username, &userBufsize, domain, &domainBufsize, &type);
-    CHAR *result = clog_ArenaAlloc(a, char, userBufsize + domainBufsize + 2);
-    sprintf(result, "%s\\%s", domain, username);
-    return result;
+/**
+ * Read the user SID from the token of a process into e. When that fails,
+ * as for protected processes, e->SidLength is 0.
+ */
+static void processes_GetProcessSid(DWORD processID, processes_UserEntry *e, ULONGLONG now) {
+    e->SidLength = 0;
+    e->Expires = now + PROCESSES_NEGATIVETTL;
+
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processID);
+    if (process == NULL) return;
+    HANDLE processToken = NULL;
+    BOOL ok = OpenProcessToken(process, TOKEN_QUERY, &processToken);
+    CloseHandle(process);
+    if (!ok) return;
+
+    union {
+        TOKEN_USER User;
+        BYTE Buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+    } tokenUser;
+    DWORD size;
+    ok = GetTokenInformation(processToken, TokenUser, &tokenUser, sizeof(tokenUser), &size);
+    CloseHandle(processToken);
+    if (!ok) return;
+    DWORD length = GetLengthSid(tokenUser.User.User.Sid);
+    if (length <= sizeof(e->Sid) && CopySid(sizeof(e->Sid), e->Sid, tokenUser.User.User.Sid)) e->SidLength = length;
 }
 
-processes_Table processes_AwaitSummarizeQuery(processes_State *state, clog_Arena *a) {
-    processes_Table result = {0};
+/**
+ * Look up the users of all processes in the snapshot. Processes seen in the
+ * previous cycle are matched on PID and creation time, so only new ones
+ * have their token opened, and each SID is resolved once per PROCESSES_SIDTTL.
+ *
+ * The names are collected in a temporary block and only copied to the arena
+ * after processes_UserLock is released, since the arena may longjmp out.
+ * The temporary blocks are deferred for the same reason. The previous
+ * cycle is kept when there is no memory for this one.
+ */
+static void processes_GetUsers(clog_ProcSnap *snap, processes_TableRow *rows, clog_Arena *a) {
+    ULONGLONG now = GetTickCount64();
+    CHAR buf[2 * 256 + 2];
+    size_t *offsets = malloc(snap->NumRows * sizeof(*offsets));
+    clog_Defer(a, offsets, RETURN_VOID, &free);
+    CHAR *names = NULL;
+    size_t namesLen = 0, namesSize = 0;
+
+    AcquireSRWLockExclusive(&processes_UserLock);
+    processes_UserEntry *old = processes_Users, *users = malloc(snap->NumRows * sizeof(*users));
+    DWORD j = 0;
+    for (DWORD i = 0; offsets != NULL && i < snap->NumRows; i++) {
+        clog_ProcSnapRow *r = &snap->Rows[i];
+        processes_UserEntry tmp, *e = users ? &users[i] : &tmp;
+        while (j < processes_NumUsers && old[j].PID < r->PID) j++;
+        if (j < processes_NumUsers && old[j].PID == r->PID && old[j].CreateTime == r->CreateTime &&
+            (old[j].SidLength != 0 || now < old[j].Expires)) {
+            *e = old[j];
+        } else {
+            e->PID = r->PID;
+            e->CreateTime = r->CreateTime;
+            if (r->PID == 0) {
+                e->SidLength = 0;
+                e->Expires = ~0ULL;
+            } else {
+                processes_GetProcessSid(r->PID, e, now);
+            }
+        }
 
-    result.ErrorCode = WaitForSingleObject(state->Event, PROCESSES_BENCHMARK_SECONDS * 1500);
-    CloseHandle(state->Event);
-    if (result.ErrorCode != WAIT_OBJECT_0) {
-        PdhCloseQuery(state->Query);
-        return result;
+        CHAR *user = e->SidLength ? processes_LookupSid(e->Sid, e->SidLength, now, buf, sizeof(buf)) : "-";
+        size_t userLen = strlen(user) + 1;
+        if (namesLen + userLen > namesSize) {
+            size_t size = namesSize ? 2 * namesSize : 64 * userLen;
+            CHAR *p = realloc(names, size);
+            if (p == NULL) {
+                offsets[i] = (size_t)-1;
+                continue;
+            }
+            names = p;
+            namesSize = size;
+        }
+        offsets[i] = namesLen;
+        memcpy(names + namesLen, user, userLen);
+        namesLen += userLen;
     }
-
-    DWORD bufsize = 0, numItems;
-    result.ErrorCode = PdhGetFormattedCounterArray(state->ProcessorTime, PDH_FMT_DOUBLE, &bufsize, &numItems, NULL);
-    if (result.ErrorCode != PDH_MORE_DATA) {
-        PdhCloseQuery(state->Query);
-        return result;
+    if (users != NULL && offsets != NULL) {
+        free(old);
+        processes_Users = users;
+        processes_NumUsers = snap->NumRows;
+    } else {
+        free(users);
     }
+    ReleaseSRWLockExclusive(&processes_UserLock);
+    clog_Defer(a, names, RETURN_VOID, &free);
 
-    BYTE idProcesses[bufsize];
-    BYTE workingSets[bufsize];
-    BYTE processorTimes[bufsize];
-
-    PdhGetFormattedCounterArray(state->IDProcess, PDH_FMT_LONG, &bufsize, &numItems, (PDH_FMT_COUNTERVALUE_ITEM *)idProcesses);
-    PdhGetFormattedCounterArray(state->WorkingSet, PDH_FMT_LARGE, &bufsize, &numItems, (PDH_FMT_COUNTERVALUE_ITEM *)workingSets);
-    result.ErrorCode = PdhGetFormattedCounterArray(state->ProcessorTime, PDH_FMT_DOUBLE, &bufsize, &numItems, (PDH_FMT_COUNTERVALUE_ITEM *)processorTimes);
-    if (result.ErrorCode == ERROR_SUCCESS) {
-        result.NumRows = numItems;
-        processes_TableRow *rows = clog_ArenaAlloc(a, processes_TableRow, numItems);
-        for (DWORD i = 0; i < numItems; i++) {
-            CHAR *processName = ((PDH_FMT_COUNTERVALUE_ITEM *)processorTimes)[i].szName;
-            size_t processNameLen = strlen(processName);
-            CHAR *heapProcessName = clog_ArenaAlloc(a, CHAR, processNameLen + 10);
-            memcpy(heapProcessName, processName, processNameLen + 1);
-            LONG processID = ((PDH_FMT_COUNTERVALUE_ITEM *)idProcesses)[i].FmtValue.longValue;
-            CHAR *user = processes_GetProcessUser(processID, a);
-            clog_PopDeferAll(a);
-
-            rows[i] = (processes_TableRow){
-                .Process = heapProcessName,
-                .PID = processID,
-                .User = user,
-                .CPU = ((PDH_FMT_COUNTERVALUE_ITEM *)processorTimes)[i].FmtValue.doubleValue,
-                .Memory = ((PDH_FMT_COUNTERVALUE_ITEM *)workingSets)[i].FmtValue.largeValue};
-        }
-        result.Rows = rows;
+    CHAR *heapNames = clog_ArenaAlloc(a, CHAR, namesLen);
+    if (namesLen > 0) memcpy(heapNames, names, namesLen);
+    for (DWORD i = 0; i < snap->NumRows; i++) {
+        rows[i].User = offsets && offsets[i] != (size_t)-1 ? heapNames + offsets[i] : "-";
     }
+    clog_PopDefer(a); // names and offsets
+    clog_PopDefer(a);
+}
 
-    PdhCloseQuery(state->Query);
+processes_Table processes_SummarizeSnapshot(processes_State *state, clog_Arena *a) {
+    processes_Table result = {0};
+    clog_ProcSnap *snap = state->Snap;
+
+    result.NumRows = snap->NumRows;
+    processes_TableRow *rows = clog_ArenaAlloc(a, processes_TableRow, snap->NumRows);
+    for (DWORD i = 0; i < snap->NumRows; i++) {
+        clog_ProcSnapRow *r = &snap->Rows[i];
+        // Without the extension, as the Process performance object names them
+        size_t processNameLen = strlen(r->Name);
+        if (processNameLen > 4 && !_stricmp(r->Name + processNameLen - 4, ".exe")) processNameLen -= 4;
+        CHAR *heapProcessName = clog_ArenaAlloc(a, CHAR, processNameLen + 1);
+        memcpy(heapProcessName, r->Name, processNameLen);
+        heapProcessName[processNameLen] = '\0';
+
+        rows[i] = (processes_TableRow){
+            .Process = heapProcessName,
+            .PID = r->PID,
+            .CPU = r->CPU,
+            .Memory = r->WorkingSet};
+    }
+    processes_GetUsers(snap, rows, a);
+    result.Rows = rows;
     return result;
 }
 
-void processes_AppendTable(processes_Table t, DWORD maxNumRows, clog_Arena *a) {
+void processes_AppendHeader(clog_Arena *a) {
     clog_ArenaAppend(a, "\n%-31s\t%6s\t%-31s\t%7s\t%12s\n", "PROCESS", "PID", "USER", "CPU", "MEMORY");
-    if (t.ErrorCode != ERROR_SUCCESS) {
-        clog_ArenaAppend(a, "(Unable to query processes, error code %#0x.)", t.ErrorCode);
-        return;
-    }
+}
 
+void processes_AppendRow(const processes_TableRow *r, clog_Arena *a) {
     CHAR memoryBuf[24];
-    for (DWORD i = 0; i < t.NumRows && i < maxNumRows; i++) {
-        if (t.Rows[i].PID == 0) {
-            maxNumRows++;
-            continue;
-        }
-        if (t.Rows[i].Memory == 0)
-            memcpy(memoryBuf, "-", 2);
-        else
-            clog_utils_PrettyBytes(t.Rows[i].Memory, 0, memoryBuf);
+    if (r->Memory == 0)
+        memcpy(memoryBuf, "-", 2);
+    else
+        clog_utils_PrettyBytes(r->Memory, 0, memoryBuf);
+
+    clog_ArenaAppend(a, "%-31s\t%6ld\t%-31s\t%5.1lf %%\t%12s\n", r->Process, r->PID, r->User, r->CPU, memoryBuf);
+}
 
-        clog_ArenaAppend(a, "%-31s\t%6ld\t%-31s\t%5.1lf %%\t%12s\n", t.Rows[i].Process, t.Rows[i].PID, t.Rows[i].User, t.Rows[i].CPU, memoryBuf);
+// Top tables leave out the Idle process, so one more row is selected
+void processes_AppendTop(processes_Table t, clog_TopKRankFn rank, clog_Arena *a) {
+    const void *top[NUM_TOPPROCESSES + 1];
+    size_t n = clog_topk_Select(t.Rows, t.NumRows, sizeof(*t.Rows), lengthof(top), rank, top);
+
+    processes_AppendHeader(a);
+    for (size_t i = 0, numAppended = 0; i < n && numAppended < NUM_TOPPROCESSES; i++) {
+        const processes_TableRow *r = top[i];
+        if (r->PID == 0) continue;
+        processes_AppendRow(r, a);
+        numAppended++;
     }
 }
 
-INT8 processes__CompareName(processes_TableRow *a, processes_TableRow *b) {
-    INT8 res = -_stricmp(a->Process, b->Process);
+// By name, and the same names by descending PID
+int processes_CompareName(const void *pa, const void *pb) {
+    const processes_TableRow *a = pa, *b = pb;
+    int res = _stricmp(a->Process, b->Process);
     if (res == 0) {
-        return a->PID > b->PID ? 1 : -1;
+        return a->PID > b->PID ? -1 : a->PID < b->PID;
     } else {
         return res;
     }
 }
 
-INT8 processes__CompareCPU(processes_TableRow *a, processes_TableRow *b) {
+int processes_RankCPU(const void *pa, const void *pb) {
+    const processes_TableRow *a = pa, *b = pb;
     if (a->CPU > b->CPU) {
         return 1;
     } else if (a->CPU < b->CPU) {
         return -1;
     } else {
-        return processes__CompareName(a, b);
+        return -processes_CompareName(a, b);
     }
 }
 
-INT8 processes__CompareMemory(processes_TableRow *a, processes_TableRow *b) {
+int processes_RankMemory(const void *pa, const void *pb) {
+    const processes_TableRow *a = pa, *b = pb;
     if (a->Memory > b->Memory) {
         return 1;
     } else if (a->Memory < b->Memory) {
         return -1;
     } else {
-        return processes__CompareName(a, b);
-    }
-}
-
-void processes__HelperSortBy(processes_TableRow **p, INT8 (*compare)(processes_TableRow *, processes_TableRow *), DWORD start, DWORD end) {
-    if (end - start > 1) {
-        processes_TableRow *res[end - start];
-        DWORD mid = (end + start) / 2;
-        processes__HelperSortBy(p, compare, start, mid);
-        processes__HelperSortBy(p, compare, mid, end);
-        DWORD i = 0, j = 0;
-        while (i < mid - start && j < end - mid) {
-            INT8 comp = compare(p[start + i],  p[mid + j]);
-            if (comp >= 0) {
-                res[i + j] = p[start + i];
-                i++;
-            } else {
-                res[i + j] = p[mid + j];
-                j++;
-            }
-        }
-
-        for (; i < mid - start; i++)
-            res[i + j] = p[start + i];
-        for (; j < end - mid; j++)
-            res[i + j] = p[mid + j];
-
-        for (DWORD k = 0; k < end - start; k++) {
-            p[k + start] = res[k];
-        }
+        return -processes_CompareName(a, b);
     }
 }
 
-void processes_SortBy(processes_Table *p, INT8 (*compare)(processes_TableRow *, processes_TableRow *), clog_Arena *a) {
-    processes_TableRow *res[p->NumRows];
-    for (DWORD i = 0; i < p->NumRows; i++)
-        res[i] = &p->Rows[i];
-
-    processes__HelperSortBy(res, compare, 0, p->NumRows);
-    processes_TableRow *sorted = clog_ArenaAlloc(a, processes_TableRow, p->NumRows);
-
-    for (DWORD i = 0; i < p->NumRows; i++)
-        sorted[i] = *res[i];
-
-    p->Rows = sorted;
-}
-
 void clog_processes_EndAppendQuery(processes_Handle h, clog_Arena *a) {
     processes_State *startedQuery = (processes_State *)h;
 
     processes_Table endedQuery;
     if (startedQuery->ErrorCode == ERROR_SUCCESS) {
-        endedQuery = processes_AwaitSummarizeQuery(startedQuery, a);
+        endedQuery = processes_SummarizeSnapshot(startedQuery, a);
     }
 
     clog_ArenaAppend(a, "[processes]");
     if (startedQuery->ErrorCode != ERROR_SUCCESS || endedQuery.ErrorCode != ERROR_SUCCESS) {
         clog_ArenaAppend(a, "\n(Unable to query processes, error code %#010x)\n", startedQuery->ErrorCode != ERROR_SUCCESS ? startedQuery->ErrorCode : endedQuery.ErrorCode);
     } else {
-        processes_SortBy(&endedQuery, &processes__CompareName, a);
-        processes_AppendTable(endedQuery, endedQuery.NumRows, a);
+        // Sorted in place, the top tables below don't depend on the order
+        qsort(endedQuery.Rows, endedQuery.NumRows, sizeof(*endedQuery.Rows), processes_CompareName);
+        processes_AppendHeader(a);
+        for (DWORD i = 0; i < endedQuery.NumRows; i++) {
+            if (endedQuery.Rows[i].PID != 0) processes_AppendRow(&endedQuery.Rows[i], a);
+        }
     }
 
     clog_ArenaAppend(a, "[topprocessescpu]");
     if (startedQuery->ErrorCode != ERROR_SUCCESS || endedQuery.ErrorCode != ERROR_SUCCESS) {
         clog_ArenaAppend(a, "\n(Unable to query processes, error code %#010x)\n", startedQuery->ErrorCode != ERROR_SUCCESS ? startedQuery->ErrorCode : endedQuery.ErrorCode);
     } else {
-        processes_SortBy(&endedQuery, &processes__CompareCPU, a);
-        processes_AppendTable(endedQuery, NUM_TOPPROCESSES, a);
+        processes_AppendTop(endedQuery, processes_RankCPU, a);
     }
 
     clog_ArenaAppend(a, "[topprocessesmemory]");
     if (startedQuery->ErrorCode != ERROR_SUCCESS || endedQuery.ErrorCode != ERROR_SUCCESS) {
         clog_ArenaAppend(a, "\n(Unable to query processes, error code %#010x)\n", startedQuery->ErrorCode != ERROR_SUCCESS ? startedQuery->ErrorCode : endedQuery.ErrorCode);
     } else {
-        processes_SortBy(&endedQuery, &processes__CompareMemory, a);
-        processes_AppendTable(endedQuery, NUM_TOPPROCESSES, a);
+        processes_AppendTop(endedQuery, processes_RankMemory, a);
     }
 }
 
 void _processes(clog_Arena scratch) {
-    // This function should ideally not be used. It is better to separate the calls to processes_StartQuery and processes_EndAppendQuery,
-    // since there is a 1 second timer on processes_EndAppendQuery. So we can process other parts of clientlog in the meantime.
     processes_Handle h = clog_processes_StartQuery(&scratch); // BIIGHANDLE
     clog_processes_EndAppendQuery(h, &scratch);
 }
@@ -280,7 +403,11 @@ void _processes(clog_Arena scratch) {
 #ifdef STANDALONE
 int main(int argc, TCHAR *argv[]) {
     clog_ArenaState *st = clog_ArenaMake(0x10000);
+    clog_procsnap_Release(clog_procsnap_Refresh());
+    Sleep(1000);
+    clog_procsnap_Release(clog_procsnap_Refresh());
     _processes(st->Memory);
+    clog_PopDeferAll(&st->Memory);
     printf("%s", st->Start);
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,222 @@
+#include "procsnap.h"
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROCSNAP_MINBUFSIZE 0x40000 // 256 KB, about 500 processes
+#define PROCSNAP_SYSTEMPROCESSINFORMATION 5
+#define PROCSNAP_STATUS_INFO_LENGTH_MISMATCH ((LONG)0xC0000004)
+
+// SYSTEM_PROCESS_INFORMATION as far as we need it. The one in winternl.h
+// hides most of the fields.
+typedef struct {
+    ULONG NextEntryOffset;
+    ULONG NumberOfThreads;
+    LARGE_INTEGER WorkingSetPrivateSize;
+    ULONG HardFaultCount;
+    ULONG NumberOfThreadsHighWatermark;
+    ULONGLONG CycleTime;
+    LARGE_INTEGER CreateTime;
+    LARGE_INTEGER UserTime;
+    LARGE_INTEGER KernelTime;
+    struct {
+        USHORT Length, MaximumLength;
+        PWSTR Buffer;
+    } ImageName;
+    LONG BasePriority;
+    HANDLE UniqueProcessId;
+    HANDLE InheritedFromUniqueProcessId;
+    ULONG HandleCount;
+    ULONG SessionId;
+} procsnap_ProcessInformation;
+
+typedef LONG(WINAPI *procsnap_QueryFn)(ULONG infoClass, PVOID info, ULONG infoLength, PULONG returnLength);
+
+static SRWLOCK procsnap_Lock = SRWLOCK_INIT;        // guards procsnap_Current
+static SRWLOCK procsnap_RefreshLock = SRWLOCK_INIT; // one refresh at a time, guards the rest
+static clog_ProcSnap *procsnap_Current;
+static clog_ProcSnap *procsnap_Baseline; // the last snapshot that worked
+static BYTE *procsnap_Buffer;
+static ULONG procsnap_BufferSize;
+
+static int procsnap_ComparePID(const void *a, const void *b) {
+    DWORD pa = ((const clog_ProcSnapRow *)a)->PID, pb = ((const clog_ProcSnapRow *)b)->PID;
+    return pa < pb ? -1 : pa > pb;
+}
+
+/**
+ * Fill procsnap_Buffer with the process list. The buffer is kept between
+ * calls and only grows, so this normally takes a single system call.
+ */
+static DWORD procsnap_Query(void) {
+    static procsnap_QueryFn query;
+    ULONG needed = 0;
+
+    if (query == NULL) {
+        query = (procsnap_QueryFn)GetProcAddress(GetModuleHandle("ntdll.dll"), "NtQuerySystemInformation");
+        if (query == NULL) return GetLastError();
+    }
+    for (;;) {
+        if (procsnap_Buffer != NULL) {
+            LONG status = query(PROCSNAP_SYSTEMPROCESSINFORMATION, procsnap_Buffer, procsnap_BufferSize, &needed);
+            if (status >= 0) return ERROR_SUCCESS;
+            if (status != PROCSNAP_STATUS_INFO_LENGTH_MISMATCH) return (DWORD)status;
+        }
+        // Processes may start before the next call, so leave some room
+        ULONG size = procsnap_BufferSize ? 2 * procsnap_BufferSize : PROCSNAP_MINBUFSIZE;
+        if (size < needed + needed / 4) size = needed + needed / 4;
+        free(procsnap_Buffer);
+        procsnap_Buffer = malloc(size);
+        procsnap_BufferSize = procsnap_Buffer ? size : 0;
+        if (procsnap_Buffer == NULL) return ERROR_NOT_ENOUGH_MEMORY;
+    }
+}
+
+static clog_ProcSnap *procsnap_Take(clog_ProcSnap *prev) {
+    FILETIME now;
+    clog_ProcSnap *s;
+    DWORD err = procsnap_Query();
+
+    GetSystemTimeAsFileTime(&now);
+    if (err != ERROR_SUCCESS) {
+        s = calloc(1, sizeof(*s));
+        if (s == NULL) return NULL;
+        s->ErrorCode = err;
+        s->Time = ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+        return s;
+    }
+
+    // Count first, so that the rows and all names fit in one allocation
+    procsnap_ProcessInformation *pi;
+    DWORD numRows = 0;
+    size_t nameBytes = 0;
+    for (BYTE *p = procsnap_Buffer;; p += pi->NextEntryOffset) {
+        pi = (procsnap_ProcessInformation *)p;
+        numRows++;
+        nameBytes += pi->ImageName.Length + sizeof("Idle"); // ACP needs at most 2 bytes per WCHAR
+        if (pi->NextEntryOffset == 0) break;
+    }
+
+    s = malloc(sizeof(*s) + numRows * sizeof(clog_ProcSnapRow) + nameBytes);
+    if (s == NULL) return NULL;
+    s->Refs = 0;
+    s->Time = ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+    s->NumRows = numRows;
+    s->Rows = (clog_ProcSnapRow *)(s + 1);
+    s->ErrorCode = ERROR_SUCCESS;
+
+    CHAR *names = (CHAR *)(s->Rows + numRows), *namesEnd = names + nameBytes;
+    clog_ProcSnapRow *row = s->Rows;
+    for (BYTE *p = procsnap_Buffer;; p += pi->NextEntryOffset) {
+        pi = (procsnap_ProcessInformation *)p;
+        row->Name = names;
+        if (pi->ImageName.Length == 0 || pi->ImageName.Buffer == NULL) {
+            strcpy(names, "Idle");
+            names += sizeof("Idle");
+        } else {
+            int n = WideCharToMultiByte(CP_ACP, 0, pi->ImageName.Buffer, pi->ImageName.Length / sizeof(WCHAR),
+                                        names, namesEnd - names - 1, NULL, NULL);
+            names[n > 0 ? n : 0] = '\0';
+            names += (n > 0 ? n : 0) + 1;
+        }
+        row->PID = (DWORD)(ULONG_PTR)pi->UniqueProcessId;
+        row->ParentPID = (DWORD)(ULONG_PTR)pi->InheritedFromUniqueProcessId;
+        row->SessionID = pi->SessionId;
+        row->CreateTime = pi->CreateTime.QuadPart;
+        row->CPUTime = pi->UserTime.QuadPart + pi->KernelTime.QuadPart;
+        row->CPU = 0;
+        row->WorkingSet = pi->WorkingSetPrivateSize.QuadPart;
+        row++;
+        if (pi->NextEntryOffset == 0) break;
+    }
+    qsort(s->Rows, numRows, sizeof(*s->Rows), procsnap_ComparePID);
+
+    // Both tables are ordered by PID, so CPU time is matched in one pass.
+    // Processes started since the previous snapshot are measured from their
+    // start, so they don't show up idle for their first cycle.
+    if (prev != NULL && s->Time > prev->Time) {
+        DWORD j = 0;
+        for (DWORD i = 0; i < numRows; i++) {
+            clog_ProcSnapRow *r = &s->Rows[i];
+            while (j < prev->NumRows && prev->Rows[j].PID < r->PID) j++;
+            clog_ProcSnapRow *q = j < prev->NumRows ? &prev->Rows[j] : NULL;
+            if (q != NULL && q->PID == r->PID && q->CreateTime == r->CreateTime) {
+                if (r->CPUTime >= q->CPUTime) r->CPU = 100.0 * (r->CPUTime - q->CPUTime) / (s->Time - prev->Time);
+            } else if (r->CreateTime > prev->Time && r->CreateTime < s->Time) {
+                r->CPU = 100.0 * r->CPUTime / (s->Time - r->CreateTime);
+            }
+        }
+    }
+    return s;
+}
+
+/**
+ * Take a new snapshot and make it the current one. CPU percentages are
+ * measured against the previous snapshot that worked, so they cover the
+ * whole time between two main loops rather than a short sample, and a
+ * failed snapshot doesn't lose the baseline.
+ * @return the new snapshot, to be released by the caller. NULL if out of memory.
+ */
+clog_ProcSnap *clog_procsnap_Refresh(void) {
+    AcquireSRWLockExclusive(&procsnap_RefreshLock);
+
+    clog_ProcSnap *s = procsnap_Take(procsnap_Baseline);
+    if (s != NULL) {
+        s->Refs = 2; // the caller and procsnap_Current
+        AcquireSRWLockExclusive(&procsnap_Lock);
+        clog_ProcSnap *old = procsnap_Current;
+        procsnap_Current = s;
+        ReleaseSRWLockExclusive(&procsnap_Lock);
+        clog_procsnap_Release(old);
+        if (s->ErrorCode == ERROR_SUCCESS) {
+            InterlockedIncrement(&s->Refs);
+            clog_procsnap_Release(procsnap_Baseline);
+            procsnap_Baseline = s;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&procsnap_RefreshLock);
+    return s;
+}
+
+/**
+ * @return the current snapshot, taking one if there is none yet. To be
+ * released by the caller.
+ */
+clog_ProcSnap *clog_procsnap_Get(void) {
+    AcquireSRWLockShared(&procsnap_Lock);
+    clog_ProcSnap *s = procsnap_Current;
+    if (s != NULL) InterlockedIncrement(&s->Refs);
+    ReleaseSRWLockShared(&procsnap_Lock);
+
+    if (s == NULL) s = clog_procsnap_Refresh();
+    return s;
+}
+
+void clog_procsnap_Release(clog_ProcSnap *s) {
+    if (s != NULL && InterlockedDecrement(&s->Refs) == 0) free(s);
+}
+
+#ifdef STANDALONE
+// Two snapshots a second apart, so there is something in the CPU column:
+//   gcc -DSTANDALONE -o procsnap procsnap.c && procsnap
+#include <stdio.h>
+
+int main(int argc, char *argv[]) {
+    clog_procsnap_Release(clog_procsnap_Refresh());
+    Sleep(1000);
+    clog_ProcSnap *s = clog_procsnap_Refresh();
+    if (s == NULL || s->ErrorCode != ERROR_SUCCESS) {
+        printf("Unable to take a snapshot, error code %#lx\n", s ? (unsigned long)s->ErrorCode : 0UL);
+        return 1;
+    }
+    for (DWORD i = 0; i < s->NumRows; i++) {
+        clog_ProcSnapRow *r = &s->Rows[i];
+        printf("%6lu %6lu %-31s %5.1f %% %12llu\n", (unsigned long)r->PID, (unsigned long)r->ParentPID, r->Name, r->CPU,
+               (unsigned long long)r->WorkingSet);
+    }
+    printf("%lu processes\n", (unsigned long)s->NumRows);
+    clog_procsnap_Release(s);
+    return 0;
+}
+#endif
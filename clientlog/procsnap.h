@@ -0,0 +1,35 @@
+#pragma once
+
+#include <wtypesbase.h>
+
+// A snapshot of all processes, taken with a single NtQuerySystemInformation
+// call. procs, cpu and the clientlog processes section all read the same
+// snapshot, which mrbig refreshes once per main loop, so the process table
+// is collected once per cycle no matter how many parts need it.
+//
+// Snapshots are reference counted. A refresh replaces the current snapshot
+// while readers of the old one finish with it. The last snapshot without an
+// error is also kept as the baseline for the CPU column of the next one.
+
+typedef struct {
+    CHAR *Name; // image name as in "svchost.exe", "Idle" for PID 0
+    DWORD PID;
+    DWORD ParentPID;
+    DWORD SessionID;
+    ULONGLONG CreateTime; // FILETIME, tells a reused PID apart
+    ULONGLONG CPUTime;    // user + kernel, 100 ns units
+    DOUBLE CPU;           // percent of one CPU since the previous good snapshot, or since it started
+    ULONGLONG WorkingSet; // private working set in bytes
+} clog_ProcSnapRow;
+
+typedef struct {
+    volatile LONG Refs;
+    ULONGLONG Time; // FILETIME when taken
+    DWORD NumRows;
+    clog_ProcSnapRow *Rows; // ordered by PID
+    DWORD ErrorCode;        // when nonzero there are no rows
+} clog_ProcSnap;
+
+clog_ProcSnap *clog_procsnap_Refresh(void);
+clog_ProcSnap *clog_procsnap_Get(void);
+void clog_procsnap_Release(clog_ProcSnap *s);
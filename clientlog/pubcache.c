@@ -0,0 +1,120 @@
+#include "pubcache.h"
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long pubcache_Hash(const wchar_t *s) {
+    unsigned long h = 2166136261UL;
+    while (*s) {
+        h ^= (unsigned long)*s++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+void clog_pubcache_Init(clog_PubCache *c, clog_PubCacheOpenFn open, clog_PubCacheCloseFn close) {
+    memset(c, 0, sizeof(*c));
+    c->Open = open;
+    c->Close = close;
+}
+
+/**
+ * Look up the publisher metadata handle for a provider, opening it on a miss.
+ * When the cache is full, the least recently used handle is closed to make room.
+ * @return the handle, which stays owned by the cache. NULL if it could not be opened.
+ */
+void *clog_pubcache_Get(clog_PubCache *c, const wchar_t *provider) {
+    unsigned long h = pubcache_Hash(provider);
+    clog_PubCacheEntry *victim = &c->Entries[0];
+
+    for (size_t i = 0; i < CLOG_PUBCACHE_SIZE; i++) {
+        clog_PubCacheEntry *e = &c->Entries[i];
+        if (e->Provider == NULL) {
+            if (victim->Provider != NULL) victim = e;
+            continue;
+        }
+        if (e->Hash == h && !wcscmp(e->Provider, provider)) {
+            e->LastUse = ++c->Clock;
+            c->Hits++;
+            return e->Handle;
+        }
+        if (victim->Provider != NULL && e->LastUse < victim->LastUse) victim = e;
+    }
+
+    c->Misses++;
+    size_t len = wcslen(provider) + 1;
+    wchar_t *copy = malloc(len * sizeof(wchar_t));
+    if (copy == NULL) return NULL;
+    if (victim->Provider != NULL) {
+        if (victim->Handle != NULL) c->Close(victim->Handle);
+        free(victim->Provider);
+    }
+    victim->Provider = memcpy(copy, provider, len * sizeof(wchar_t));
+    victim->Handle = c->Open(provider);
+    victim->Hash = h;
+    victim->LastUse = ++c->Clock;
+    return victim->Handle;
+}
+
+void clog_pubcache_Clear(clog_PubCache *c) {
+    for (size_t i = 0; i < CLOG_PUBCACHE_SIZE; i++) {
+        clog_PubCacheEntry *e = &c->Entries[i];
+        if (e->Provider == NULL) continue;
+        if (e->Handle != NULL) c->Close(e->Handle);
+        free(e->Provider);
+        e->Provider = NULL;
+        e->Handle = NULL;
+    }
+}
+
+#ifdef STANDALONE
+// Exercises the cache with a stub provider, so it runs anywhere:
+//   gcc -DSTANDALONE -o pubcache pubcache.c && ./pubcache
+#include <stdio.h>
+
+static int numOpen, numClose;
+
+static void *stub_Open(const wchar_t *provider) {
+    numOpen++;
+    if (!wcscmp(provider, L"Missing")) return NULL;
+    return (void *)(size_t)pubcache_Hash(provider);
+}
+
+static void stub_Close(void *handle) {
+    numClose++;
+}
+
+int main(int argc, char *argv[]) {
+    static clog_PubCache c;
+    wchar_t name[32];
+    int failed = 0;
+
+    clog_pubcache_Init(&c, stub_Open, stub_Close);
+
+    // Repeated lookups of a few providers open each once
+    for (int i = 0; i < 1000; i++) {
+        swprintf(name, sizeof(name) / sizeof(*name), L"Provider%d", i % 10);
+        if (clog_pubcache_Get(&c, name) != (void *)(size_t)pubcache_Hash(name)) failed++;
+    }
+    if (numOpen != 10) failed++;
+
+    // Failed opens are cached as well
+    clog_pubcache_Get(&c, L"Missing");
+    if (clog_pubcache_Get(&c, L"Missing") != NULL || numOpen != 11) failed++;
+
+    // Overflowing the cache evicts the least recently used entries
+    for (int i = 0; i < CLOG_PUBCACHE_SIZE; i++) {
+        swprintf(name, sizeof(name) / sizeof(*name), L"Other%d", i);
+        clog_pubcache_Get(&c, name);
+        clog_pubcache_Get(&c, L"Provider0");
+    }
+    if (numClose != 10) failed++; // Provider1..9 and Other0; "Missing" had no handle
+    numOpen = 0;
+    clog_pubcache_Get(&c, L"Provider0");
+    if (numOpen != 0) failed++;
+
+    clog_pubcache_Clear(&c);
+    printf("hits %lu, misses %lu, opened %d, closed %d: %s\n", c.Hits, c.Misses,
+           numOpen, numClose, failed ? "FAILED" : "ok");
+    return failed != 0;
+}
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <wchar.h>
+
+// A small LRU cache of publisher metadata handles, keyed on provider name.
+// Opening publisher metadata is expensive, and a log typically has only a
+// handful of distinct providers. The open and close functions are supplied
+// by the caller (EvtOpenPublisherMetadata and EvtClose on Windows), which
+// keeps this file free of Windows dependencies.
+
+#define CLOG_PUBCACHE_SIZE 64
+
+typedef void *(*clog_PubCacheOpenFn)(const wchar_t *provider);
+typedef void (*clog_PubCacheCloseFn)(void *handle);
+
+typedef struct {
+    wchar_t *Provider; // NULL when the slot is free
+    void *Handle;      // may be NULL, failed opens are cached too
+    unsigned long Hash;
+    unsigned long LastUse;
+} clog_PubCacheEntry;
+
+typedef struct {
+    clog_PubCacheEntry Entries[CLOG_PUBCACHE_SIZE];
+    clog_PubCacheOpenFn Open;
+    clog_PubCacheCloseFn Close;
+    unsigned long Clock;
+    unsigned long Hits, Misses;
+} clog_PubCache;
+
+void clog_pubcache_Init(clog_PubCache *c, clog_PubCacheOpenFn open, clog_PubCacheCloseFn close);
+void *clog_pubcache_Get(clog_PubCache *c, const wchar_t *provider);
+void clog_pubcache_Clear(clog_PubCache *c);
@@ -0,0 +1,340 @@
+#include "runcmd.h"
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+#define RUNCMD_MINREAD 0x1000 // free space to have before each read
+#define RUNCMD_DROP 0x1000    // read into this when over CLOG_RUNCMD_MAXOUTPUT
+
+/**
+ * Make room for the next read, growing the output buffer to twice its size.
+ * @return where to read to and the number of bytes that fit there. Past
+ * CLOG_RUNCMD_MAXOUTPUT, or when out of memory, this is a buffer that is
+ * thrown away, so the pipe is still drained.
+ */
+static char *runcmd_Reserve(clog_RunCmd *c, char *drop, size_t *room) {
+    if (c->Size - c->Length < RUNCMD_MINREAD && c->Size < CLOG_RUNCMD_MAXOUTPUT) {
+        size_t size = c->Size ? 2 * c->Size : 2 * RUNCMD_MINREAD;
+        if (size > CLOG_RUNCMD_MAXOUTPUT) size = CLOG_RUNCMD_MAXOUTPUT;
+        char *output = realloc(c->Output, size);
+        if (output != NULL) {
+            c->Output = output;
+            c->Size = size;
+        }
+    }
+    if (c->Size == c->Length) {
+        c->Truncated = 1;
+        *room = RUNCMD_DROP;
+        return drop;
+    }
+    *room = c->Size - c->Length;
+    return c->Output + c->Length;
+}
+
+static clog_RunCmd *runcmd_New(const char *cmdline) {
+    clog_RunCmd *c = calloc(1, sizeof(*c) + strlen(cmdline) + 1);
+    if (c == NULL) return NULL;
+    c->Cmdline = strcpy((char *)(c + 1), cmdline);
+    c->Status = clog_runcmd_RUNNING;
+    return c;
+}
+
+#ifdef _WIN32
+// The reader owns Output until it returns, at the end of the output or when
+// clog_runcmd_Wait cancels its read.
+static DWORD WINAPI runcmd_Reader(LPVOID arg) {
+    clog_RunCmd *c = arg;
+    char drop[RUNCMD_DROP];
+    size_t room;
+    DWORD n;
+
+    for (;;) {
+        char *p = runcmd_Reserve(c, drop, &room);
+        if (!ReadFile(c->Pipe, p, (DWORD)room, &n, NULL) || n == 0) break;
+        if (p != drop) c->Length += n;
+    }
+    return 0;
+}
+
+static clog_RunCmd *runcmd_Fail(clog_RunCmd *c, HANDLE pipeWrite) {
+    c->ErrorCode = GetLastError();
+    c->Status = clog_runcmd_FAILED;
+    if (pipeWrite != NULL) CloseHandle(pipeWrite);
+    if (c->Pipe != NULL) CloseHandle(c->Pipe);
+    if (c->Process != NULL) {
+        TerminateProcess(c->Process, 1);
+        CloseHandle(c->Process);
+    }
+    c->Pipe = c->Process = NULL;
+    return c;
+}
+
+/**
+ * Start a command, with stdout and stderr going to a pipe that is read
+ * while it runs.
+ * @param cmdline the command to run, including flags
+ * @param timeoutMs how long the command may take, from now
+ * @return the command, to be waited for and freed. If it could not be
+ * started this says why, NULL only when out of memory.
+ */
+clog_RunCmd *clog_runcmd_Start(const char *cmdline, unsigned long timeoutMs) {
+    clog_RunCmd *c = runcmd_New(cmdline);
+    if (c == NULL) return NULL;
+    c->Deadline = GetTickCount64() + timeoutMs;
+
+    SECURITY_ATTRIBUTES securityAttributes;
+    securityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+    securityAttributes.bInheritHandle = TRUE;
+    securityAttributes.lpSecurityDescriptor = NULL;
+
+    // Only the write end of the pipe goes to the child
+    HANDLE pipeWrite = NULL;
+    if (!CreatePipe(&c->Pipe, &pipeWrite, &securityAttributes, 0)) return runcmd_Fail(c, NULL);
+    if (!SetHandleInformation(c->Pipe, HANDLE_FLAG_INHERIT, 0)) return runcmd_Fail(c, pipeWrite);
+
+    PROCESS_INFORMATION procInfo;
+    ZeroMemory(&procInfo, sizeof(procInfo));
+    STARTUPINFO startInfo;
+    ZeroMemory(&startInfo, sizeof(startInfo));
+    startInfo.cb = sizeof(STARTUPINFO);
+    startInfo.hStdError = pipeWrite;
+    startInfo.hStdOutput = pipeWrite;
+    startInfo.dwFlags |= STARTF_USESTDHANDLES;
+
+    // CreateProcess may write to the command line
+    char *mutableCmdline = _strdup(cmdline);
+    if (mutableCmdline == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return runcmd_Fail(c, pipeWrite);
+    }
+    BOOL created = CreateProcess(NULL, mutableCmdline, NULL, NULL,
+                                 TRUE, // must inherit handles due to STARTF_USESTDHANDLES
+                                 CREATE_NO_WINDOW, NULL, NULL, &startInfo, &procInfo);
+    free(mutableCmdline);
+    if (!created) return runcmd_Fail(c, pipeWrite);
+    CloseHandle(procInfo.hThread);
+    c->Process = procInfo.hProcess;
+
+    // Our copy of the write end must go, or the reader never sees the end
+    CloseHandle(pipeWrite);
+    c->Reader = CreateThread(NULL, 0, runcmd_Reader, c, 0, NULL);
+    if (c->Reader == NULL) return runcmd_Fail(c, NULL);
+    return c;
+}
+
+static DWORD runcmd_Remaining(clog_RunCmd *c) {
+    ULONGLONG now = GetTickCount64();
+    return now < c->Deadline ? (DWORD)(c->Deadline - now) : 0;
+}
+
+/**
+ * Wait for the command to exit and its output to end, killing it at the
+ * deadline. Output is complete after this returns.
+ */
+enum clog_RunCmdStatus clog_runcmd_Wait(clog_RunCmd *c) {
+    if (c->Status != clog_runcmd_RUNNING) return c->Status;
+
+    if (WaitForSingleObject(c->Reader, runcmd_Remaining(c)) == WAIT_OBJECT_0 &&
+        WaitForSingleObject(c->Process, runcmd_Remaining(c)) == WAIT_OBJECT_0) {
+        DWORD exitCode = 0;
+        GetExitCodeProcess(c->Process, &exitCode);
+        c->ErrorCode = exitCode;
+        c->Status = clog_runcmd_EXITED;
+    } else {
+        c->Status = clog_runcmd_TIMEDOUT;
+        TerminateProcess(c->Process, 1);
+        // A child of the command may still hold the pipe, so the read may
+        // not end by itself. Cancel it until the reader notices.
+        while (WaitForSingleObject(c->Reader, 100) == WAIT_TIMEOUT) CancelSynchronousIo(c->Reader);
+    }
+    return c->Status;
+}
+
+void clog_runcmd_Free(clog_RunCmd *c) {
+    if (c == NULL) return;
+    if (c->Status == clog_runcmd_RUNNING) {
+        c->Deadline = 0;
+        clog_runcmd_Wait(c);
+    }
+    if (c->Reader != NULL) CloseHandle(c->Reader);
+    if (c->Process != NULL) CloseHandle(c->Process);
+    if (c->Pipe != NULL) CloseHandle(c->Pipe);
+    free(c->Output);
+    free(c);
+}
+#else
+static unsigned long long runcmd_Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void *runcmd_Reader(void *arg) {
+    clog_RunCmd *c = arg;
+    char drop[RUNCMD_DROP];
+    struct pollfd pfd = {c->Pipe, POLLIN, 0};
+    size_t room;
+
+    // Polled, so that a child of the command holding the pipe can't keep
+    // the reader from stopping
+    while (!__atomic_load_n(&c->Stop, __ATOMIC_RELAXED)) {
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        char *p = runcmd_Reserve(c, drop, &room);
+        ssize_t n = read(c->Pipe, p, room);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (p != drop) c->Length += n;
+    }
+    pthread_mutex_lock(&c->Lock);
+    c->Done = 1;
+    pthread_cond_signal(&c->DoneCond);
+    pthread_mutex_unlock(&c->Lock);
+    return NULL;
+}
+
+static clog_RunCmd *runcmd_Fail(clog_RunCmd *c, int err, int pipeWrite) {
+    c->ErrorCode = err;
+    c->Status = clog_runcmd_FAILED;
+    if (pipeWrite >= 0) close(pipeWrite);
+    if (c->Pipe >= 0) close(c->Pipe);
+    c->Pipe = -1;
+    if (c->PID > 0) {
+        kill(c->PID, SIGKILL);
+        waitpid(c->PID, NULL, 0);
+    }
+    return c;
+}
+
+clog_RunCmd *clog_runcmd_Start(const char *cmdline, unsigned long timeoutMs) {
+    clog_RunCmd *c = runcmd_New(cmdline);
+    if (c == NULL) return NULL;
+    c->Deadline = runcmd_Now() + timeoutMs;
+    c->Pipe = -1;
+    pthread_mutex_init(&c->Lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&c->DoneCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    int fds[2], err;
+    if (pipe(fds) != 0) return runcmd_Fail(c, errno, -1);
+    c->Pipe = fds[0];
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 2);
+    posix_spawn_file_actions_addclose(&actions, fds[1]);
+    char *argv[] = {"/bin/sh", "-c", c->Cmdline, NULL};
+    err = posix_spawn(&c->PID, "/bin/sh", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        c->PID = 0;
+        return runcmd_Fail(c, err, fds[1]);
+    }
+    close(fds[1]);
+
+    err = pthread_create(&c->Reader, NULL, runcmd_Reader, c);
+    if (err != 0) return runcmd_Fail(c, err, -1);
+    return c;
+}
+
+enum clog_RunCmdStatus clog_runcmd_Wait(clog_RunCmd *c) {
+    if (c->Status != clog_runcmd_RUNNING) return c->Status;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    unsigned long long now = runcmd_Now(), ms = c->Deadline > now ? c->Deadline - now : 0;
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    // DoneCond uses the monotonic clock, see clog_runcmd_Start
+    pthread_mutex_lock(&c->Lock);
+    while (!c->Done && pthread_cond_timedwait(&c->DoneCond, &c->Lock, &deadline) == 0)
+        ;
+    int done = c->Done;
+    pthread_mutex_unlock(&c->Lock);
+
+    // The output has ended, but the command may not have exited yet
+    int status = 0;
+    pid_t exited = 0;
+    while (done && (exited = waitpid(c->PID, &status, WNOHANG)) == 0 && runcmd_Now() < c->Deadline) {
+        struct timespec tick = {0, 10000000};
+        nanosleep(&tick, NULL);
+    }
+    if (exited == c->PID) {
+        c->ErrorCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        c->Status = clog_runcmd_EXITED;
+    } else {
+        c->Status = clog_runcmd_TIMEDOUT;
+        kill(c->PID, SIGKILL);
+        waitpid(c->PID, NULL, 0);
+    }
+    __atomic_store_n(&c->Stop, 1, __ATOMIC_RELAXED);
+    pthread_join(c->Reader, NULL);
+    return c->Status;
+}
+
+void clog_runcmd_Free(clog_RunCmd *c) {
+    if (c == NULL) return;
+    if (c->Status == clog_runcmd_RUNNING) {
+        c->Deadline = 0;
+        clog_runcmd_Wait(c);
+    }
+    if (c->Pipe >= 0) close(c->Pipe);
+    pthread_cond_destroy(&c->DoneCond);
+    pthread_mutex_destroy(&c->Lock);
+    free(c->Output);
+    free(c);
+}
+#endif
+
+#ifdef STANDALONE
+// Runs a few commands at once: one with more output than a pipe holds, one
+// that takes too long, one that fails and one that doesn't exist.
+//   gcc -DSTANDALONE -o runcmd runcmd.c -lpthread && ./runcmd
+#include <stdio.h>
+
+int main(int argc, char *argv[]) {
+#ifdef _WIN32
+    const char *cmdlines[] = {"C:\\Windows\\System32\\cmd.exe /c dir /s C:\\Windows\\System32",
+                              "C:\\Windows\\System32\\ping.exe -n 10 127.0.0.1",
+                              "C:\\Windows\\System32\\cmd.exe /c exit 3", "C:\\nonexistent.exe"};
+#else
+    const char *cmdlines[] = {"seq 1 200000", "sleep 10", "echo failing >&2; exit 3", "/nonexistent"};
+#endif
+    const char *statuses[] = {"running", "exited", "timed out", "failed"};
+    clog_RunCmd *cmds[sizeof(cmdlines) / sizeof(*cmdlines)];
+
+    for (size_t i = 0; i < sizeof(cmdlines) / sizeof(*cmdlines); i++) cmds[i] = clog_runcmd_Start(cmdlines[i], 2000);
+    for (size_t i = 0; i < sizeof(cmdlines) / sizeof(*cmdlines); i++) {
+        clog_RunCmd *c = cmds[i];
+        clog_runcmd_Wait(c);
+        printf("%-50s %-9s code %lu, %lu bytes%s", c->Cmdline, statuses[c->Status], c->ErrorCode,
+               (unsigned long)c->Length, c->Truncated ? " (truncated)" : "");
+        if (c->Length > 0) {
+            size_t n = c->Length < 40 ? c->Length : 40;
+            printf(", ending in \"");
+            for (const char *p = c->Output + c->Length - n; p < c->Output + c->Length; p++) putchar(*p == '\n' ? ' ' : *p);
+            printf("\"");
+        }
+        printf("\n");
+        clog_runcmd_Free(c);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/types.h>
+#endif
+
+// Commands run in the background with their output captured as it comes.
+// A reader thread per command drains the pipe while the command runs, so
+// a command that writes more than the pipe holds doesn't block, and
+// several commands can run while clientlog does other work. Each command
+// has a deadline, after which it is killed.
+//
+// On Windows commands are started with CreateProcess, elsewhere through
+// /bin/sh with posix_spawn, so this can be tried out on Linux.
+
+#define CLOG_RUNCMD_MAXOUTPUT 0x400000 // 4 MB, the rest is read and dropped
+
+enum clog_RunCmdStatus {
+    clog_runcmd_RUNNING,
+    clog_runcmd_EXITED,   // ErrorCode is the exit code
+    clog_runcmd_TIMEDOUT, // killed at the deadline
+    clog_runcmd_FAILED,   // could not be started, ErrorCode says why
+};
+
+typedef struct {
+    char *Cmdline;
+    enum clog_RunCmdStatus Status;
+    unsigned long ErrorCode;
+    char *Output; // stdout and stderr, not '\0' terminated
+    size_t Length, Size;
+    int Truncated;
+    unsigned long long Deadline; // milliseconds on the monotonic clock
+#ifdef _WIN32
+    HANDLE Process, Pipe, Reader;
+#else
+    pid_t PID;
+    int Pipe;
+    pthread_t Reader;
+    int Done, Stop;
+    pthread_mutex_t Lock;
+    pthread_cond_t DoneCond;
+#endif
+} clog_RunCmd;
+
+clog_RunCmd *clog_runcmd_Start(const char *cmdline, unsigned long timeoutMs);
+enum clog_RunCmdStatus clog_runcmd_Wait(clog_RunCmd *c);
+void clog_runcmd_Free(clog_RunCmd *c);
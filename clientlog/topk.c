@@ -0,0 +1,145 @@
+#include "topk.h"
+
+// out[0..n) is a heap with the lowest ranked element on top
+static void topk_SiftDown(const void **heap, size_t n, size_t i, clog_TopKRankFn rank) {
+    const void *e = heap[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= n) break;
+        if (child + 1 < n && rank(heap[child + 1], heap[child]) < 0) child++;
+        if (rank(heap[child], e) >= 0) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = e;
+}
+
+/**
+ * Find the k highest ranked of num elements of size bytes each.
+ * @param out room for k pointers, which are set to the selected elements
+ * ordered from the highest rank down
+ * @return the number of pointers set, the smaller of k and num
+ */
+size_t clog_topk_Select(const void *base, size_t num, size_t size, size_t k, clog_TopKRankFn rank, const void **out) {
+    const char *p = base;
+    size_t n = 0;
+
+    if (k == 0) return 0;
+    for (size_t i = 0; i < num; i++, p += size) {
+        if (n < k) {
+            out[n++] = p;
+            if (n == k) {
+                for (size_t j = k / 2; j-- > 0;)
+                    topk_SiftDown(out, k, j, rank);
+            }
+        } else if (rank(p, out[0]) > 0) {
+            out[0] = p;
+            topk_SiftDown(out, k, 0, rank);
+        }
+    }
+    if (n < k) {
+        for (size_t j = n / 2; j-- > 0;)
+            topk_SiftDown(out, n, j, rank);
+    }
+
+    // Taking the lowest off the top and putting it at the end leaves the
+    // highest first
+    for (size_t end = n; end > 1; end--) {
+        const void *e = out[0];
+        out[0] = out[end - 1];
+        out[end - 1] = e;
+        topk_SiftDown(out, end - 1, 0, rank);
+    }
+    return n;
+}
+
+#ifdef STANDALONE
+// Checks the selection against a full sort and compares the time taken, over
+// synthetic process tables of 5000 to 50000 rows. Runs anywhere:
+//   gcc -O2 -DSTANDALONE -o topk topk.c && ./topk
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define K 21 // NUM_TOPPROCESSES, plus the Idle process that is skipped
+
+typedef struct {
+    char Process[16];
+    long PID;
+    double CPU;
+    long long Memory;
+} bench_Row;
+
+static int bench_RankCPU(const void *a, const void *b) {
+    const bench_Row *x = a, *y = b;
+    if (x->CPU != y->CPU) return x->CPU > y->CPU ? 1 : -1;
+    int res = strcmp(y->Process, x->Process);
+    if (res != 0) return res;
+    return x->PID > y->PID ? 1 : x->PID < y->PID ? -1 : 0;
+}
+
+static int bench_CompareCPU(const void *a, const void *b) {
+    return bench_RankCPU(b, a);
+}
+
+static int bench_RankInt(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+static double bench_Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+
+    static const size_t sizes[] = {5000, 10000, 20000, 50000};
+
+    srand(1);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+        size_t num = sizes[s];
+        bench_Row *rows = malloc(num * sizeof(*rows)), *sorted = malloc(num * sizeof(*rows));
+        const void *top[K];
+        int rounds = 20;
+
+        for (size_t i = 0; i < num; i++) {
+            snprintf(rows[i].Process, sizeof(rows[i].Process), "proc%d", rand() % 200);
+            rows[i].PID = 4 * (long)i;
+            rows[i].CPU = rand() % 4 ? 0.0 : (rand() % 1000) / 10.0; // mostly idle, many ties
+            rows[i].Memory = (long long)rand() * 4096;
+        }
+
+        double t0 = bench_Now();
+        for (int r = 0; r < rounds; r++) {
+            memcpy(sorted, rows, num * sizeof(*rows));
+            qsort(sorted, num, sizeof(*sorted), bench_CompareCPU);
+        }
+        double t1 = bench_Now();
+        size_t n = 0;
+        for (int r = 0; r < rounds; r++)
+            n = clog_topk_Select(rows, num, sizeof(*rows), K, bench_RankCPU, top);
+        double t2 = bench_Now();
+
+        if (n != K) failed++;
+        for (size_t i = 0; i < n; i++) {
+            if (memcmp(top[i], &sorted[i], sizeof(*rows))) failed++;
+        }
+        printf("%6zu rows: copy and qsort %8.1f us, top %d %6.1f us\n", num, (t1 - t0) / rounds * 1e6, K,
+               (t2 - t1) / rounds * 1e6);
+        free(rows);
+        free(sorted);
+    }
+
+    // Fewer elements than k
+    int small[] = {1, 3, 2};
+    const void *out[K];
+    if (clog_topk_Select(small, 3, sizeof(int), K, bench_RankInt, out) != 3 || *(const int *)out[0] != 3 ||
+        *(const int *)out[2] != 1)
+        failed++;
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed != 0;
+}
+#endif
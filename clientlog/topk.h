@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+// Partial selection of the k highest ranked elements of an array, for the
+// "top 20" tables. A bounded heap of k pointers is kept while the array is
+// scanned once, so this takes O(n log k) comparisons and doesn't move or copy
+// the elements.
+
+// Like a qsort comparison, but positive when a ranks above b
+typedef int (*clog_TopKRankFn)(const void *a, const void *b);
+
+size_t clog_topk_Select(const void *base, size_t num, size_t size, size_t k, clog_TopKRankFn rank, const void **out);
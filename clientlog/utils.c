@@ -59,110 +59,98 @@ LPSTR clog_utils_PrettySystemtime(SYSTEMTIME *t, UINT8 flags, LPSTR out, size_t
     return out;
 }
 
-#define PROCESS_TIMOUT_LIMIT_MS 1000
-#define BUFREAD 513
-/** Run a shell command. Callers should call clog_PopDeferAll(&scratch) after this function has been used.
- * @param cmdline the command to run, including flags
- * @param scratch a clientlog arena to which the output will be appended
- * @return If the command finished sucessfully, TRUE, otherwise FALSE. A command with an errored status code is not considered a failure.
+// Arena space left for the sections after a command's output
+#define UTILS_CMDOUTPUT_RESERVE 0x10000
+
+/** Wait for a command started with clog_runcmd_Start and append what it wrote
+ * to stdout and stderr. The output is cut to what the arena can hold, leaving
+ * UTILS_CMDOUTPUT_RESERVE bytes for the rest of the report. The command stays
+ * with the caller, to be freed with clog_runcmd_Free also when the arena runs
+ * out.
+ * @param cmd the command, NULL if it could not be allocated
+ * @param a a clientlog arena to which the output will be appended
+ * @return the exit code of the command, or the error that kept it from running
  */
-DWORD clog_utils_RunCmdSynchronously(CHAR *cmdline, clog_Arena scratch) {
-    HANDLE hPipeOutputRead = NULL;
-    HANDLE hPipeOutputWrite = NULL;
-    DWORD status = 0;
-
-    SECURITY_ATTRIBUTES securityAttributes;
-    // Set the bInheritHandle flag so pipe handles are inherited.
-    securityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
-    securityAttributes.bInheritHandle = TRUE;
-    securityAttributes.lpSecurityDescriptor = NULL;
-
-    // Create a pipe for the child process's STDOUT.
-    if (!CreatePipe(&hPipeOutputRead, &hPipeOutputWrite, &securityAttributes, 0)) {
-        status = GetLastError();
-        clog_ArenaAppend(&scratch, "(Failed to run command, unknown error. Error code 1.%#010x.)", status);
-        CloseHandle(hPipeOutputRead);
-        CloseHandle(hPipeOutputWrite);
-        return status;
+DWORD clog_utils_AppendCmdOutput(clog_RunCmd *cmd, clog_Arena *a) {
+    if (cmd == NULL) {
+        clog_ArenaAppend(a, "(Failed to run command, out of memory. Error code %#010x.)", ERROR_NOT_ENOUGH_MEMORY);
+        return ERROR_NOT_ENOUGH_MEMORY;
     }
 
-    // Ensure the read handle to the pipe for STDOUT is not inherited.
-    if (!SetHandleInformation(hPipeOutputRead, HANDLE_FLAG_INHERIT, 0)) {
-        status = GetLastError();
-        clog_ArenaAppend(&scratch, "(Failed to run command, unknown error. Error code 2.%#010x.)", status);
-        CloseHandle(hPipeOutputRead);
-        CloseHandle(hPipeOutputWrite);
-        return status;
+    enum clog_RunCmdStatus status = clog_runcmd_Wait(cmd);
+    if (status == clog_runcmd_FAILED) {
+        clog_ArenaAppend(a, "(Failed to run command, could not create process from '%s'. Error code %#010x.)", cmd->Cmdline, cmd->ErrorCode);
+        return cmd->ErrorCode;
     }
 
-    PROCESS_INFORMATION procInfo;
-    ZeroMemory(&procInfo, sizeof(procInfo));
-    STARTUPINFO startInfo;
-    ZeroMemory(&startInfo, sizeof(startInfo));
-    startInfo.cb = sizeof(STARTUPINFO);
-    startInfo.hStdError = hPipeOutputWrite;
-    startInfo.hStdOutput = hPipeOutputWrite;
-    startInfo.dwFlags |= STARTF_USESTDHANDLES;
-
-    status = CreateProcess(NULL,
-                           cmdline,
-                           NULL,
-                           NULL,
-                           TRUE, // important, must inherit handles due to STARTF_USESTDHANDLES
-                           0,
-                           NULL,
-                           NULL,
-                           &startInfo,
-                           &procInfo);
-
-    CloseHandle(hPipeOutputWrite);
-    if (!status) {
-        status = GetLastError();
-        clog_ArenaAppend(&scratch, "(Failed to run command, could not create process from '%s'. Error code 3.%#010x.)", cmdline, status);
-        CloseHandle(hPipeOutputRead);
-        CloseHandle(procInfo.hProcess);
-        CloseHandle(procInfo.hThread);
-        return status;
+    // Whatever came before the deadline is still worth showing
+    ptrdiff_t freeBytes = a->End - ((clog_ArenaState *)a->State)->CurrentStart;
+    size_t length = cmd->Length;
+    if (freeBytes <= UTILS_CMDOUTPUT_RESERVE)
+        length = 0;
+    else if (length > (size_t)(freeBytes - UTILS_CMDOUTPUT_RESERVE))
+        length = freeBytes - UTILS_CMDOUTPUT_RESERVE;
+    clog_ArenaAppendBytes(a, cmd->Output, length);
+    if (cmd->Truncated || length < cmd->Length) {
+        clog_ArenaAppend(a, "\n(Output truncated at %lu bytes)", (unsigned long)length);
     }
-
-    status = WaitForSingleObject(procInfo.hProcess, PROCESS_TIMOUT_LIMIT_MS);
-    if (status != WAIT_OBJECT_0) {
-        if (status == WAIT_FAILED) {
-            status = GetLastError();
-            clog_ArenaAppend(&scratch, "(Failed to run command, unknown error. Error code 4.%#010x.)", PROCESS_TIMOUT_LIMIT_MS, status);
-        } else if (status == WAIT_TIMEOUT) {
-            clog_ArenaAppend(&scratch, "(Failed to run command, process took more than %dms to run. Error code 5.%lu.)", PROCESS_TIMOUT_LIMIT_MS, status);
-        } else {
-            DWORD lastError = GetLastError();
-            clog_ArenaAppend(&scratch, "(Failed to run command, unknown error. Error code 6.%lu.%#010x.)", PROCESS_TIMOUT_LIMIT_MS, status, lastError);
-        }
-        CloseHandle(procInfo.hProcess);
-        CloseHandle(procInfo.hThread);
-        CloseHandle(hPipeOutputRead);
-        return status;
+    if (status == clog_runcmd_TIMEDOUT) {
+        clog_ArenaAppend(a, "%s(Failed to run command, process took too long to run and was stopped.)", cmd->Length ? "\n" : "");
+        return WAIT_TIMEOUT;
     }
+    if (cmd->Length == 0) {
+        clog_ArenaAppend(a, "(No output)");
+    }
+    return cmd->ErrorCode;
+}
 
-    DWORD readBufLen = 0, written = 0;
-    CHAR readBuf[BUFREAD];
-    do {
-        status = ReadFile(hPipeOutputRead, readBuf, BUFREAD-1, &readBufLen, NULL);
-        if (readBufLen > 0) {
-            readBuf[readBufLen] = '\0';
-            clog_ArenaAppend(&scratch, "%s", readBuf);
-            written += readBufLen;
-        } else {
-            break;
-        }
-    } while (TRUE);
+/** A section text with room for size characters and a '\0', and one reference.
+ * @return the text, NULL if out of memory
+ */
+clog_utils_Text *clog_utils_NewText(size_t size) {
+    clog_utils_Text *t = malloc(sizeof(*t) + size + 1);
+    if (t == NULL) return NULL;
+    t->Refs = 1;
+    t->Length = 0;
+    t->Text[0] = '\0';
+    return t;
+}
 
-    CloseHandle(procInfo.hProcess);
-    CloseHandle(procInfo.hThread);
-    CloseHandle(hPipeOutputRead);
-    if (written <= 0) {
-        clog_ArenaAppend(&scratch, "(No output)");
-    }
+void clog_utils_ReleaseText(clog_utils_Text *t) {
+    if (t != NULL && InterlockedDecrement(&t->Refs) == 0) free(t);
+}
+
+/** Make t the current text of the section, taking over its reference. The
+ * previous text is freed once the runs appending it are done with it.
+ */
+void clog_utils_SetText(clog_utils_SectionText *s, clog_utils_Text *t) {
+    AcquireSRWLockExclusive(&s->Lock);
+    clog_utils_Text *old = s->Current;
+    s->Current = t;
+    ReleaseSRWLockExclusive(&s->Lock);
+    clog_utils_ReleaseText(old);
+}
+
+BOOL clog_utils_HasText(clog_utils_SectionText *s) {
+    AcquireSRWLockShared(&s->Lock);
+    BOOL have = s->Current != NULL;
+    ReleaseSRWLockShared(&s->Lock);
+    return have;
+}
 
-    return status;
+/** Append the current text of the section. The text is deferred while it is
+ * copied, so it is released also when the arena runs out.
+ * @return FALSE if the section has no text yet
+ */
+BOOL clog_utils_AppendText(clog_utils_SectionText *s, clog_Arena *a) {
+    AcquireSRWLockShared(&s->Lock);
+    clog_utils_Text *t = s->Current;
+    if (t != NULL) InterlockedIncrement(&t->Refs);
+    ReleaseSRWLockShared(&s->Lock);
+
+    if (t == NULL) return FALSE;
+    clog_Defer(a, t, RETURN_VOID, &clog_utils_ReleaseText);
+    clog_ArenaAppendBytes(a, t->Text, t->Length);
+    clog_PopDefer(a);
+    return TRUE;
 }
-#undef BUFREAD
-#undef PROCESS_TIMOUT_LIMIT_MS
\ No newline at end of file
@@ -6,9 +6,8 @@
     We need to link with Iphlpapi.lib in Makefile.
    This file also needs Ws2_32.lib, but that is a requirement for other files too */
 
-#define MAX_PORT_ENTRIES 5000
+#define MAX_PORT_GROUPS 5000
 #define MAX_PORT 0xFFFF
-#define SIMILAR_ENTRIES_MAX_NUM 20
 
 typedef enum {
     TCP = 1,
@@ -20,13 +19,26 @@ typedef enum {
     IPv6 = 23,
 } winports_IpVersion;
 
+// Addresses in network byte order, IPv4 in the first 4 bytes
 typedef struct {
-    CHAR LocalAddress[64], RemoteAddress[64];
+    BYTE LocalAddress[16], RemoteAddress[16];
     DWORD LocalPort, RemotePort;
     DWORD State;
     DWORD PID;
 } winports_Record;
 
+// Connections of one process on one local address in one state. Listening
+// TCP ports are kept apart, the rest are counted with their range of local
+// ports, so thousands of client connections make a single row.
+typedef struct {
+    winports_Record First;
+    DWORD KeyPort; // the local port for listening TCP ports, otherwise 0
+    DWORD LowPort, HighPort;
+    DWORD Count;
+    BOOL MixedRemoteAddress, MixedRemotePort;
+    unsigned long Hash;
+} winports_Group;
+
 typedef union {
     MIB_TCPTABLE_OWNER_PID TCP4;
     MIB_UDPTABLE_OWNER_PID UDP4;
@@ -34,55 +46,91 @@ typedef union {
     MIB_UDP6TABLE_OWNER_PID UDP6;
 } winports_ConnectionTable;
 
-CHAR *winports_PrettyIPv6(BYTE *b, CHAR *out) {
+// The formatters below write to out and return the end, without a
+// terminating '\0'. They replace inet_ntoa and snprintf for large tables.
+static CHAR *winports_FormatUInt(DWORD v, CHAR *out) {
+    CHAR digits[10];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    while (n > 0)
+        *out++ = digits[--n];
+    return out;
+}
+
+static CHAR *winports_FormatIPv4(BYTE *b, CHAR *out) {
+    for (int i = 0; i < 4; i++) {
+        if (i > 0) *out++ = '.';
+        out = winports_FormatUInt(b[i], out);
+    }
+    return out;
+}
+
+// As in RFC 5952: lowercase, no leading zeros, the longest run of two or
+// more zero groups shortened to "::", in brackets to set off the port
+static CHAR *winports_FormatIPv6(BYTE *b, CHAR *out) {
+    static const CHAR hex[] = "0123456789abcdef";
     UINT16 group[8];
-    for (DWORD i = 0; i < 8; i++) {
-        UINT16 b1 = b[15 - 2 * i];
-        UINT16 b2 = b[14 - 2 * i];
-        group[i] = ((UINT16)b1 << 8) + b2;
+    for (int i = 0; i < 8; i++)
+        group[i] = ((UINT16)b[2 * i] << 8) | b[2 * i + 1];
+
+    int zeroIx = 8, zeroLen = 0;
+    for (int i = 0; i < 8;) {
+        int len = 0;
+        while (i + len < 8 && group[i + len] == 0)
+            len++;
+        if (len > zeroLen && len >= 2) {
+            zeroIx = i;
+            zeroLen = len;
+        }
+        i += len ? len : 1;
     }
 
-    DWORD largestZeroClusterIx = 0;
-    DWORD largestZeroClusterLen = 0;
-    DWORD curr, len;
-    for (DWORD i = 0; i < 8; i++) {
-        if (group[i] == 0) {
-            curr = i;
-            len = 1;
-            while (++i < 8 && group[i] == 0) {
-                len++;
-            }
-            if (len > largestZeroClusterLen) {
-                largestZeroClusterIx = curr;
-                largestZeroClusterLen = len;
+    *out++ = '[';
+    for (int i = 0; i < 8; i++) {
+        if (i == zeroIx) {
+            *out++ = ':';
+            *out++ = ':';
+            i += zeroLen - 1;
+            continue;
+        }
+        if (i > 0 && i != zeroIx + zeroLen) *out++ = ':';
+        BOOL started = FALSE;
+        for (int shift = 12; shift >= 0; shift -= 4) {
+            int d = (group[i] >> shift) & 0xF;
+            if (d || started || shift == 0) {
+                *out++ = hex[d];
+                started = TRUE;
             }
         }
     }
+    *out++ = ']';
+    return out;
+}
 
-    if (largestZeroClusterLen == 0) {
-        largestZeroClusterIx = 8;
-    }
+static CHAR *winports_FormatAddress(BYTE *b, const ULONG af, CHAR *out) {
+    return af == IPv4 ? winports_FormatIPv4(b, out) : winports_FormatIPv6(b, out);
+}
 
-    CHAR *currOut = out;
-    currOut += sprintf(currOut, "[");
-    for (DWORD i = 0; i < largestZeroClusterIx; i++) {
-        currOut += sprintf(currOut, "%x", group[i]);
-        if (i != largestZeroClusterIx - 1)
-            currOut += sprintf(currOut, ":");
-    }
-    if (largestZeroClusterLen > 0) {
-        currOut += sprintf(currOut, "::");
-    }
-    for (DWORD i = largestZeroClusterIx + largestZeroClusterLen; i < 8; i++) {
-        currOut += sprintf(currOut, "%x", group[i]);
-        if (i != 7)
-            currOut += sprintf(currOut, ":");
-    }
-    currOut += sprintf(currOut, "]");
+// Fill with spaces up to width characters after start, like "%-*s"
+static CHAR *winports_Pad(CHAR *start, CHAR *out, int width) {
+    while (out - start < width)
+        *out++ = ' ';
     return out;
 }
 
-LPCSTR winports_PrettyPortState(DWORD state, CHAR *out) {
+// Like "%*lu"
+static CHAR *winports_FormatUIntRight(DWORD v, CHAR *out, int width) {
+    CHAR num[10];
+    int len = winports_FormatUInt(v, num) - num;
+    out = winports_Pad(out, out, width - len);
+    memcpy(out, num, len);
+    return out + len;
+}
+
+LPCSTR winports_PrettyPortState(DWORD state) {
     switch (state) {
     case MIB_TCP_STATE_CLOSED:
         return "CLOSED";
@@ -138,101 +186,176 @@ void *winports_GetConnectionTable(const ULONG af, const winports_Protocol proto,
     return result;
 }
 
+DWORD winports_NumEntries(winports_ConnectionTable *connections, const ULONG af, const winports_Protocol proto) {
+    if (IPv4 == af)
+        return TCP == proto ? connections->TCP4.dwNumEntries : connections->UDP4.dwNumEntries;
+    else
+        return TCP == proto ? connections->TCP6.dwNumEntries : connections->UDP6.dwNumEntries;
+}
+
 void winports_GetRow(winports_ConnectionTable *connections, DWORD i, const ULONG af, const winports_Protocol proto, winports_Record *out) {
-    struct in_addr ipAddress;
+    memset(out, 0, sizeof(*out));
     if (IPv4 == af) {
         if (TCP == proto) {
             MIB_TCPROW_OWNER_PID *tcp4row = &connections->TCP4.table[i];
-            ipAddress.S_un.S_addr = (u_long)tcp4row->dwLocalAddr;
-            snprintf(out->LocalAddress, sizeof(out->LocalAddress), "%s", inet_ntoa(ipAddress));
-            out->LocalPort = ntohs(tcp4row->dwLocalPort);
-            ipAddress.S_un.S_addr = (u_long)tcp4row->dwRemoteAddr;
-            snprintf(out->RemoteAddress, sizeof(out->RemoteAddress), "%s", inet_ntoa(ipAddress));
-            out->RemotePort = ntohs(tcp4row->dwRemotePort);
+            memcpy(out->LocalAddress, &tcp4row->dwLocalAddr, 4);
+            out->LocalPort = ntohs((u_short)tcp4row->dwLocalPort);
+            memcpy(out->RemoteAddress, &tcp4row->dwRemoteAddr, 4);
+            out->RemotePort = ntohs((u_short)tcp4row->dwRemotePort);
             out->State = tcp4row->dwState;
             out->PID = tcp4row->dwOwningPid;
         } else if (UDP == proto) {
             MIB_UDPROW_OWNER_PID *udp4row = &connections->UDP4.table[i];
-            ipAddress.S_un.S_addr = (u_long)udp4row->dwLocalAddr;
-            snprintf(out->LocalAddress, sizeof(out->LocalAddress), "%s", inet_ntoa(ipAddress));
-            out->LocalPort = ntohs(udp4row->dwLocalPort);
-            memcpy(out->RemoteAddress, "*:*", 4); // same as netstat
-            out->State = 99;
+            memcpy(out->LocalAddress, &udp4row->dwLocalAddr, 4);
+            out->LocalPort = ntohs((u_short)udp4row->dwLocalPort);
             out->PID = udp4row->dwOwningPid;
         }
     } else if (IPv6 == af) {
         if (TCP == proto) {
             MIB_TCP6ROW_OWNER_PID *tcp6row = &connections->TCP6.table[i];
-            winports_PrettyIPv6(tcp6row->ucLocalAddr, out->LocalAddress);
+            memcpy(out->LocalAddress, tcp6row->ucLocalAddr, 16);
             out->LocalPort = ntohs((u_short)tcp6row->dwLocalPort);
-            winports_PrettyIPv6(tcp6row->ucRemoteAddr, out->RemoteAddress);
+            memcpy(out->RemoteAddress, tcp6row->ucRemoteAddr, 16);
             out->RemotePort = ntohs((u_short)tcp6row->dwRemotePort);
             out->State = tcp6row->dwState;
             out->PID = tcp6row->dwOwningPid;
         } else if (UDP == proto) {
             MIB_UDP6ROW_OWNER_PID *udp6row = &connections->UDP6.table[i];
-            winports_PrettyIPv6(udp6row->ucLocalAddr, out->LocalAddress);
+            memcpy(out->LocalAddress, udp6row->ucLocalAddr, 16);
             out->LocalPort = ntohs((u_short)udp6row->dwLocalPort);
-            memcpy(out->RemoteAddress, "*:*", 4); // same as netstat
-            out->State = 99;
             out->PID = udp6row->dwOwningPid;
         }
     }
 }
 
-// N.B. x ^ x = 0, x ^ y = y ^ x
-// => b -> a ^ b ^ b = a,
-// => a -> a ^ b ^ a = b.
-#define PTR_SWAP(a, b)                       \
-    a = (void *)((intptr_t)a ^ (intptr_t)b); \
-    b = (void *)((intptr_t)a ^ (intptr_t)b); \
-    a = (void *)((intptr_t)a ^ (intptr_t)b);
+static unsigned long winports_Hash(winports_Record *r, DWORD keyPort) {
+    unsigned long h = 2166136261UL;
+    DWORD words[3] = {r->PID, r->State, keyPort};
+    for (int i = 0; i < 16; i++)
+        h = (h ^ r->LocalAddress[i]) * 16777619UL;
+    for (int i = 0; i < 3; i++)
+        h = (h ^ words[i]) * 16777619UL;
+    return h;
+}
 
-void winports_AppendConnections(winports_ConnectionTable *connections, const ULONG af, const winports_Protocol proto, clog_Arena *a) {
-    winports_Record rData = {0}, rPrevData = {0};
-    winports_Record *r = &rData, *rPrev = &rPrevData;
+/**
+ * Collect the rows of a connection table into groups, in the order they
+ * first appear. Groups and the hash table are allocated like the
+ * connection table, on the heap, and left on the defer stack for the
+ * caller to pop.
+ * @return the number of groups, or -1 if out of memory.
+ */
+LONG winports_GroupConnections(winports_ConnectionTable *connections, const ULONG af, const winports_Protocol proto, winports_Group **out, clog_Arena *a) {
+    DWORD numEntries = winports_NumEntries(connections, af, proto);
+    DWORD numSlots = 16;
+    while (numSlots < 2 * numEntries)
+        numSlots *= 2;
 
-    CHAR portStateBuf[16], localAddressPortBuf[74], remoteAddressPortBuf[74];
-    DWORD numEntries = min(connections->TCP4.dwNumEntries /* Well... If it works, it works */, MAX_PORT_ENTRIES);
+    winports_Group *groups = malloc((numEntries ? numEntries : 1) * sizeof(*groups));
+    clog_Defer(a, groups, RETURN_VOID, &free);
+    DWORD *slots = calloc(numSlots, sizeof(*slots)); // group index + 1, 0 when free
+    clog_Defer(a, slots, RETURN_VOID, &free);
+    if (groups == NULL || slots == NULL) return -1;
 
-    BOOL skipping = FALSE;
-    DWORD range = 1;
-    #define SKIPPING_FMT "\n\t...IP %s and PID %lu spans above %d entries, and %lu more with highest local port %u"
+    DWORD numGroups = 0;
+    winports_Record r;
     for (DWORD i = 0; i < numEntries; i++) {
-        PTR_SWAP(r, rPrev);
+        winports_GetRow(connections, i, af, proto, &r);
+        DWORD keyPort = proto == TCP && r.State == MIB_TCP_STATE_LISTEN ? r.LocalPort : 0;
+        unsigned long h = winports_Hash(&r, keyPort);
 
-        winports_GetRow(connections, i, af, proto, r);
-        if (r->PID == rPrev->PID && strcmp(r->LocalAddress, rPrev->LocalAddress) == 0) {
-            if (++range > SIMILAR_ENTRIES_MAX_NUM) skipping = TRUE;
-            if (skipping) continue;
+        DWORD s = h & (numSlots - 1);
+        winports_Group *g = NULL;
+        for (; slots[s] != 0; s = (s + 1) & (numSlots - 1)) {
+            g = &groups[slots[s] - 1];
+            if (g->Hash == h && g->First.PID == r.PID && g->First.State == r.State && g->KeyPort == keyPort &&
+                !memcmp(g->First.LocalAddress, r.LocalAddress, 16))
+                break;
+            g = NULL;
+        }
+        if (g == NULL) {
+            g = &groups[numGroups++];
+            slots[s] = numGroups;
+            *g = (winports_Group){.First = r, .KeyPort = keyPort, .LowPort = r.LocalPort, .HighPort = r.LocalPort, .Hash = h};
         } else {
-            if (skipping)
-                clog_ArenaAppend(a, SKIPPING_FMT, rPrev->LocalAddress, rPrev->PID, SIMILAR_ENTRIES_MAX_NUM, range - SIMILAR_ENTRIES_MAX_NUM, rPrev->LocalPort);
-            skipping = FALSE;
-            range = 1;
+            if (r.LocalPort < g->LowPort) g->LowPort = r.LocalPort;
+            if (r.LocalPort > g->HighPort) g->HighPort = r.LocalPort;
+            if (memcmp(g->First.RemoteAddress, r.RemoteAddress, 16)) g->MixedRemoteAddress = TRUE;
+            if (g->First.RemotePort != r.RemotePort) g->MixedRemotePort = TRUE;
         }
+        g->Count++;
+    }
+    *out = groups;
+    return numGroups;
+}
 
-        snprintf(localAddressPortBuf, 74, "%s:%lu", r->LocalAddress, r->LocalPort);
-        if (proto == TCP) {
-            snprintf(remoteAddressPortBuf, 74, "%s:%lu", r->RemoteAddress, r->RemotePort);
+void winports_AppendConnections(winports_ConnectionTable *connections, const ULONG af, const winports_Protocol proto, clog_Arena *a) {
+    winports_Group *groups;
+    LONG numGroups = winports_GroupConnections(connections, af, proto, &groups, a);
+    if (numGroups < 0) {
+        clog_ArenaAppend(a, "\n(Out of memory for %s %s entries)", proto == TCP ? "TCP" : "UDP", af == IPv4 ? "IPv4" : "IPv6");
+        numGroups = 0;
+    }
+
+    CHAR line[256];
+    for (LONG i = 0; i < numGroups && i < MAX_PORT_GROUPS; i++) {
+        winports_Group *g = &groups[i];
+        CHAR *p = line, *col;
+
+        *p++ = '\n';
+        col = p;
+        memcpy(p, proto == TCP ? "TCP" : "UDP", 3);
+        p = winports_Pad(col, p + 3, 7);
+        *p++ = '\t';
+
+        col = p;
+        p = winports_FormatAddress(g->First.LocalAddress, af, p);
+        *p++ = ':';
+        p = winports_FormatUInt(g->LowPort, p);
+        if (g->HighPort != g->LowPort) {
+            *p++ = '-';
+            p = winports_FormatUInt(g->HighPort, p);
+        }
+        p = winports_Pad(col, p, 39);
+        *p++ = '\t';
+
+        // Foreign address as netstat has it, with * for what differs in a group
+        col = p;
+        if (proto == UDP || g->MixedRemoteAddress) {
+            memcpy(p, "*:*", 3);
+            p += 3;
         } else {
-            snprintf(remoteAddressPortBuf, 64, "%s", r->RemoteAddress);
+            p = winports_FormatAddress(g->First.RemoteAddress, af, p);
+            *p++ = ':';
+            if (g->MixedRemotePort)
+                *p++ = '*';
+            else
+                p = winports_FormatUInt(g->First.RemotePort, p);
         }
+        p = winports_Pad(col, p, 39);
+        *p++ = '\t';
 
-        clog_ArenaAppend(a, "\n%-7s\t%-39s\t%-39s\t%-15s\t%7lu",
-                         proto == TCP ? "TCP" : "UDP",
-                         localAddressPortBuf,
-                         remoteAddressPortBuf,
-                         proto == TCP ? winports_PrettyPortState(r->State, portStateBuf) : "",
-                         r->PID);
-    }
-    if (skipping) {
-        clog_ArenaAppend(a, SKIPPING_FMT, rPrev->LocalAddress, rPrev->PID, SIMILAR_ENTRIES_MAX_NUM, range - SIMILAR_ENTRIES_MAX_NUM, rPrev->LocalPort);
+        col = p;
+        if (proto == TCP) {
+            LPCSTR state = winports_PrettyPortState(g->First.State);
+            size_t len = strlen(state);
+            memcpy(p, state, len);
+            p += len;
+        }
+        p = winports_Pad(col, p, 15);
+        *p++ = '\t';
+
+        p = winports_FormatUIntRight(g->First.PID, p, 7);
+        *p++ = '\t';
+        p = winports_FormatUIntRight(g->Count, p, 7);
+
+        clog_ArenaAppendBytes(a, line, p - line);
     }
-    #undef SKIPPING_FMT
-    if (connections->TCP4.dwNumEntries > MAX_PORT_ENTRIES) {
-        clog_ArenaAppend(a, "\n(+ %lu more %s %s entries)", connections->TCP4.dwNumEntries - MAX_PORT_ENTRIES,  proto == TCP ? "TCP" : "UDP", af == IPv4 ? "IPv4" : "IPv6");
+    if (numGroups > MAX_PORT_GROUPS) {
+        clog_ArenaAppend(a, "\n(+ %ld more %s %s groups)", numGroups - MAX_PORT_GROUPS, proto == TCP ? "TCP" : "UDP", af == IPv4 ? "IPv4" : "IPv6");
     }
+    clog_PopDefer(a); // the groups and the hash table
+    clog_PopDefer(a);
 }
 
 void winports_AppendPortStatistics(ULONG af, winports_Protocol proto, DWORD numEntries, clog_Arena *a) {
@@ -264,7 +387,7 @@ void clog_winports(clog_Arena scratch) {
     int errored = 0;
     for (int i = 0; i < lengthof(portGroups); i++) {
         if (tables[i] != NULL)
-            winports_AppendPortStatistics(portGroups[i].version, portGroups[i].proto, tables[i]->TCP4.dwNumEntries, &scratch);
+            winports_AppendPortStatistics(portGroups[i].version, portGroups[i].proto, winports_NumEntries(tables[i], portGroups[i].version, portGroups[i].proto), &scratch);
         else
             errored++;
     }
@@ -274,7 +397,7 @@ void clog_winports(clog_Arena scratch) {
         clog_ArenaAppend(&scratch, "\n(Unable to get some of the networking statistics)");
 
     clog_ArenaAppend(&scratch, "\n[winports]");
-    clog_ArenaAppend(&scratch, "\n%-7s\t%-39s\t%-39s\t%-15s\t%7s", "Proto", "Local Address", "Foreign Address", "State", "PID");
+    clog_ArenaAppend(&scratch, "\n%-7s\t%-39s\t%-39s\t%-15s\t%7s\t%7s", "Proto", "Local Address", "Foreign Address", "State", "PID", "Count");
     errored = 0;
     for (int i = 0; i < lengthof(portGroups); i++) {
         if (tables[i] != NULL) {
@@ -282,7 +405,7 @@ void clog_winports(clog_Arena scratch) {
         } else
             errored++;
     }
-    clog_PopDeferAll(&scratch); // free malloced memory in winports_GetConnectionTable
+    clog_PopDeferAll(&scratch); // free malloced memory in winports_GetConnectionTable and winports_GroupConnections
     if (errored == lengthof(portGroups))
         clog_ArenaAppend(&scratch, "\n(Unable to get networking statistics)");
     else if (errored > 0)
@@ -1,6 +1,10 @@
 #include "clientlog.h"
 
-void clog_winroute(clog_Arena scratch) {
-    clog_ArenaAppend(&scratch, "[winroute]\n");
-    clog_utils_RunCmdSynchronously("C:\\Windows\\System32\\route print", scratch);
+clog_RunCmd *clog_winroute_Start(DWORD timeoutMs) {
+    return clog_runcmd_Start("C:\\Windows\\System32\\route print", timeoutMs);
+}
+
+void clog_winroute_EndAppend(clog_RunCmd *cmd, clog_Arena *a) {
+    clog_ArenaAppend(a, "[winroute]\n");
+    clog_utils_AppendCmdOutput(cmd, a);
 }
\ No newline at end of file
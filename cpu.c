@@ -34,7 +34,11 @@ Most active processes
 */
 
 
-static long get_uptime(void)
+/* All the performance objects cpu() reads, fetched in one go. The
+   Processor object (238) is read by the load sampler instead. */
+static DWORD cpu_objects[] = {2, 330, 0};
+
+static long get_uptime(struct perfsnap *ps)
 {
 	int object = 2;
 	DWORD counters[] = {674, 0};
@@ -43,7 +47,7 @@ static long get_uptime(void)
 	long long perf_time, perf_freq;
 
 	if (debug > 1) mrlog("get_uptime()");
-	pc = read_perfcounters(object, counters, &perf_time, &perf_freq);
+	pc = perfsnap_counters(ps, object, counters, &perf_time, &perf_freq);
 	if (pc) {
 		result = (perf_time-pc[0].value[0])/perf_freq;
 	} else {
@@ -58,19 +62,22 @@ static long get_uptime(void)
 
 static long pscount(void)
 {
-	/* NT4 and up, requires psapi.dll */
-	DWORD aProcesses[1024], cbNeeded;
+	clog_ProcSnap *ps = clog_procsnap_Get();
+	long n;
 
 	if (debug > 1) mrlog("pscount()");
-	if (!EnumProcesses(aProcesses, sizeof(aProcesses), &cbNeeded)) {
-		mrlog("Can't EnumProcesses");
-		return 0;
+	if (ps == NULL || ps->ErrorCode) {
+		mrlog("Can't get process list");
+		n = 0;
+	} else {
+		n = ps->NumRows;
 	}
-	return cbNeeded / sizeof aProcesses[0];
+	clog_procsnap_Release(ps);
+	return n;
 }
 
 
-static long users(void)
+static long users(struct perfsnap *ps)
 {
 	DWORD object = 330;
 	DWORD counters[] = {314, 0};
@@ -79,7 +86,7 @@ static long users(void)
 
 	if (debug > 1) mrlog("users()");
 
-	pc = read_perfcounters(object, counters, NULL, NULL);
+	pc = perfsnap_counters(ps, object, counters, NULL, NULL);
 	if (pc) {
 		result = pc[0].value[0];
 	} else {
@@ -90,70 +97,76 @@ static long users(void)
 	return result;
 }
 
-static int get_load(int version)
+/* The load comes from the sampler in cpuload.c. These remember where
+   the previous report left off; only cpu() uses them. */
+static long long load_since;
+static struct cpucores load_cores;
+
+/* Average load since the previous report, or over the last minute
+   for the first one. The highest load between two samples goes in
+   *peak. */
+static int get_load(double *peak)
 {
-	/* to measure the sample period */
-	/* in units of 1 second */
-	static time_t time0 = 0;
-	time_t time1;
-
-	/* to measure the processor time */
-	/* in units of 100 ns = 1/10000000 s */
-	static long long proc0 = 0;
-	long long proc1;
-
-	struct perfcounter *perfc;
-	int i;
-	int load = 0;
-
-	if (debug > 1) mrlog("get_load(%d)", version);
-
-	if (version >= 5) {	/* W2K and up */
-		DWORD counters[] = {6, 0};
-		perfc = read_perfcounters(238, counters, NULL, NULL);
-		if (perfc == NULL) return 0;
-		for (i = 0; perfc[0].instance; i++) {
-			if (!strcmp(perfc[i].instance, "_Total")) break;
-		}
-		if (perfc[i].instance == NULL) {
-			proc1 = 0;	/* No data found */
-		} else {
-			proc1 = perfc[i].value[0];
-		}
-	} else {		/* NT4 */
-		DWORD counters[] = {240, 0};
-		perfc = read_perfcounters(2, counters, NULL, NULL);
-		if (perfc == NULL) return 0;
-		proc1 = perfc->value[0];
+	double load;
+
+	if (debug > 1) mrlog("get_load()");
+
+	*peak = 0;
+	if (!cpuload_since(&load_since, &load, peak)) {
+		if (!cpuload_average(60, &load)) return 0;
+		*peak = load;
 	}
-	time1 = time(NULL);
-	if (proc0 && time1 > time0) {
-		/* we need two samples! */
-		load = 100-(proc1-proc0)/100000/(time1-time0);
-	} else {
-		load = 0;
+	return load+0.5;
+}
+
+static void append_load(struct sbuf *b, double peak)
+{
+	double avg[3];
+	int minutes[3] = {1, 5, 15};
+	struct cpucores cc;
+	int i, j, n;
+
+	for (i = 0; i < 3; i++) {
+		if (!cpuload_average(60*minutes[i], &avg[i])) break;
+	}
+	if (i < 3) {
+		sb_printf(b, "Load average: not enough samples yet\n");
+		return;
+	}
+	sb_printf(b, "Load average: %.1f%% %.1f%% %.1f%% (1, 5, 15 minutes)\n",
+		avg[0], avg[1], avg[2]);
+	sb_printf(b, "Peak load: %.1f%%\n", peak);
+
+	if (!cpuload_cores(&cc)) return;
+	if (cc.n == load_cores.n && cc.time > load_cores.time) {
+		sb_printf(b, "Per core:");
+		for (i = n = 0; i < cc.n; i++) {
+			j = 100-100.0*(cc.idle[i]-load_cores.idle[i])/
+				(cc.time-load_cores.time)+0.5;
+			if (j < 0) j = 0;
+			if (j > 100) j = 100;
+			sb_printf(b, "%s %s %d%%",
+				n && n % 8 == 0 ? "\n         " : "",
+				cc.name[i], j);
+			n++;
+		}
+		sb_printf(b, "\n");
 	}
-	time0 = time1;
-	proc0 = proc1;
-	free_perfcounters(perfc);
-	// sanity check
-	if (load < 0) load = 0;
-	return load;
+	load_cores = cc;
 }
 
-static void append_limits(char *a, size_t n)
+static void append_limits(struct sbuf *a)
 {
-	snprcat(a, n, "\nLimits:\n");
-	snprcat(a, n, "Yellow uptime: %d minutes\n", bootyellow);
-	snprcat(a, n, "Red uptime: %d minutes\n", bootred);
-	snprcat(a, n, "Yellow CPU: %d%%\n", cpuyellow);
-	snprcat(a, n, "Red CPU: %d%%\n", cpured);
+	sb_printf(a, "\nLimits:\n");
+	sb_printf(a, "Yellow uptime: %d minutes\n", bootyellow);
+	sb_printf(a, "Red uptime: %d minutes\n", bootred);
+	sb_printf(a, "Yellow CPU: %d%%\n", cpuyellow);
+	sb_printf(a, "Red CPU: %d%%\n", cpured);
 }
 
-void cpu(void)
+void cpu(struct mrcfg *mc)
 {
-	char b[5000];
-	int n = sizeof b;
+	struct sbuf b;
 	char r[1000];
 	char up[100];
 	char *color = "green";
@@ -161,21 +174,26 @@ void cpu(void)
 	int um;
 	int uc;
 	int load;
+	double peak;
 	int pc;
 	MEMORYSTATUSEX statex;
 	OSVERSIONINFO osvi;
 	DWORD memusage;
+	struct perfsnap ps;
 
-	if (debug > 1) mrlog("cpu(%p, %d)", b, n);
+	if (debug > 1) mrlog("cpu()");
 
-	if (get_option("no_cpu", 0)) {
-		mrsend(mrmachine, "cpu", "clear", "option no_cpu\n");
+	if (get_option(mc, "no_cpu", 0)) {
+		mrsend(mc->machine, "cpu", "clear", "option no_cpu\n");
 		return;
 	}
 
-	ut = get_uptime();
+	if (!perfsnap_take(&ps, cpu_objects)) {
+		mrlog("Can't read performance data for cpu");
+	}
+	ut = get_uptime(&ps);
 	um = ut/60;
-	uc = users();
+	uc = users(&ps);
 	load = 0;
 	pc = pscount();
 
@@ -183,12 +201,13 @@ void cpu(void)
 	osvi.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
 	if (!GetVersionEx(&osvi) || osvi.dwPlatformId != VER_PLATFORM_WIN32_NT) {
 		/* Failed, boo hiss */
-		b[0] = '\0';
-		snprcat(b, n,
+		sb_init(&b, 0);
+		sb_printf(&b,
 			"No version info\n"
 			"%s %s (%s)\n",
 			PACKAGE, VERSION, CPU);
-		mrsend(mrmachine, "cpu", "red", b);
+		mrsendn(mc->machine, "cpu", "red", b.s, b.len);
+		sb_free(&b);
 		return;
 	}
 
@@ -209,7 +228,7 @@ void cpu(void)
 	} else {
 		snprcat(up, sizeof up, "%d days", um/(24*60));
 	}
-	load = get_load(osvi.dwMajorVersion);
+	load = get_load(&peak);
 	if (load >= cpured) {
 		color = "red";
 	} else if (load >= cpuyellow && !strcmp(color, "green")) {
@@ -220,10 +239,16 @@ void cpu(void)
 #else
 	memusage = statex.dwMemoryLoad;
 #endif
-	b[0] = '\0';
-	snprcat(b, n,
-		"%s up: %s, %d users, %d procs, load=%d%%, PhysicalMem: %ldMB (%d%%)\n%s\n"
-		"Memory Statistics\n"
+	sb_init(&b, 0);
+	sb_printf(&b,
+		"%s up: %s, %d users, %d procs, load=%d%%, PhysicalMem: %ldMB (%d%%)\n%s\n",
+		mc->now, up, uc, pc, load,
+		(long)(statex.ullTotalPhys / (1024*1024)),
+		(int)memusage,
+		r);
+	append_load(&b, peak);
+	sb_printf(&b,
+		"\nMemory Statistics\n"
 		"Total physical memory:         %*.0f bytes\n"
 		"Available physical memory:     %*.0f bytes\n"
 		"Total pagefile size:           %*.0f bytes\n"
@@ -232,10 +257,6 @@ void cpu(void)
 		"Available virtual memory size: %*.0f bytes\n\n"
 		"Windows version %d.%d\n"
 		"%s %s (%s)\n",
-		now, up, uc, pc, load,
-		(long)(statex.ullTotalPhys / (1024*1024)),
-		(int)memusage,
-		r,
 #if 0
 		WIDTH, (double)stat.dwTotalPhys,
 		WIDTH, (double)stat.dwAvailPhys,
@@ -253,6 +274,7 @@ void cpu(void)
 #endif
 		(int)osvi.dwMajorVersion, (int)osvi.dwMinorVersion,
 		PACKAGE, VERSION, CPU);
-	append_limits(b, n);
-	mrsend(mrmachine, "cpu", color, b);
+	append_limits(&b);
+	mrsendn(mc->machine, "cpu", color, b.s, b.len);
+	sb_free(&b);
 }
@@ -0,0 +1,293 @@
+#ifdef STANDALONE
+#include <string.h>
+#include "cpuload.h"
+#include "standalone.h"
+#else
+#include "mrbig.h"
+#endif
+
+#define load(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define store(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+struct cpusample {
+	long seq;		/* number of the sample + 1, 0 while written */
+	long long time, idle;
+};
+
+static struct cpusample ring[CPULOAD_RING];
+static long head;	/* number of samples written */
+
+static struct {
+	long seq;	/* odd while cc is written */
+	struct cpucores cc;
+} cores;
+
+/* Append a sample. Only the sampler thread may call this. */
+void cpuload_add(long long time, long long idle, struct cpucores *cc)
+{
+	long h = load(&head);
+	struct cpusample *s = &ring[h % CPULOAD_RING];
+
+	store(&s->seq, 0);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	store(&s->time, time);
+	store(&s->idle, idle);
+	__atomic_store_n(&s->seq, h+1, __ATOMIC_RELEASE);
+	__atomic_store_n(&head, h+1, __ATOMIC_RELEASE);
+
+	if (cc) {
+		store(&cores.seq, cores.seq+1);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy(&cores.cc, cc, sizeof *cc);
+		__atomic_store_n(&cores.seq, cores.seq+1, __ATOMIC_RELEASE);
+	}
+}
+
+/* Copy sample n to s. Returns 0 if it has been overwritten. */
+static int get_sample(long n, struct cpusample *s)
+{
+	struct cpusample *r = &ring[n % CPULOAD_RING];
+
+	if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != n+1) return 0;
+	s->time = load(&r->time);
+	s->idle = load(&r->idle);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return load(&r->seq) == n+1;
+}
+
+static double busy(struct cpusample *a, struct cpusample *b)
+{
+	double pct = 100.0-100.0*(b->idle-a->idle)/(b->time-a->time);
+
+	if (pct < 0) pct = 0;
+	if (pct > 100) pct = 100;
+	return pct;
+}
+
+/* Walk back from the newest sample to the last one taken at or before
+   from, or as far as the ring goes. Returns 0 unless there are at
+   least two samples. */
+static int window(long long from, struct cpusample *first,
+		struct cpusample *last, double *peak)
+{
+	long h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	long n;
+	struct cpusample s, next;
+
+	if (h < 2 || !get_sample(h-1, last) || last->time <= from) return 0;
+	*first = next = *last;
+	if (peak) *peak = 0;
+	for (n = h-2; n >= 0 && n >= h-CPULOAD_RING; n--) {
+		if (!get_sample(n, &s) || s.time >= next.time) break;
+		if (peak && busy(&s, &next) > *peak) *peak = busy(&s, &next);
+		*first = next = s;
+		if (s.time <= from) break;
+	}
+	return first->time < last->time;
+}
+
+/* Average load in percent over the last seconds */
+int cpuload_average(int seconds, double *load)
+{
+	struct cpusample first, last;
+	long h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+	if (h < 1 || !get_sample(h-1, &last)) return 0;
+	if (!window(last.time-seconds*10000000LL, &first, &last, NULL)) {
+		return 0;
+	}
+	*load = busy(&first, &last);
+	return 1;
+}
+
+/* Average and highest load in percent from *since to the newest
+   sample, which must be two samples apart. *since is then set to the
+   time of the newest sample, for the next call. 0 for *since means
+   the last minute. */
+int cpuload_since(long long *since, double *load, double *peak)
+{
+	struct cpusample first, last;
+	long long from = *since;
+
+	if (from == 0) {
+		long h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+		if (h < 1 || !get_sample(h-1, &last)) return 0;
+		from = last.time-60*10000000LL;
+	}
+	if (!window(from, &first, &last, peak)) return 0;
+	*load = busy(&first, &last);
+	*since = last.time;
+	return 1;
+}
+
+/* Copy the idle times per core from the newest sample. Returns 0 if
+   there is none yet. */
+int cpuload_cores(struct cpucores *cc)
+{
+	long seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&cores.seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) continue;
+		memcpy(cc, &cores.cc, sizeof *cc);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (load(&cores.seq) == seq) break;
+	}
+	return seq != 0;
+}
+
+#ifndef STANDALONE
+/* The sampler's own buffer, so that it doesn't need to share the ones
+   in readperf.c with cpu() */
+static struct perfbuf cpuload_buf = {"238"};
+
+static void cpuload_sample(void)
+{
+	DWORD counters[] = {6, 0};	/* % Processor Time, as idle time */
+	struct counter_info ci[1];
+	static struct cpucores cc;
+	PERF_DATA_BLOCK *bp;
+	PERF_OBJECT_TYPE *op;
+	struct perfinst it;
+	DWORD len;
+	long long total = -1;
+	int more;
+
+	bp = read_perfbuf(&cpuload_buf, &len);
+	if (bp == NULL) return;
+	op = perfdata_object(bp, len, 238);
+	if (op == NULL || !perfdata_offsets(op, counters, ci)) return;
+
+	cc.time = bp->PerfTime100nSec.QuadPart;
+	cc.n = 0;
+	for (more = perfinst_first(op, &it); more; more = perfinst_next(&it)) {
+		if (perfinst_is(&it, "_Total")) {
+			total = perfinst_value(&it, &ci[0]);
+		} else if (cc.n < CPULOAD_CORES) {
+			perfinst_name(&it, cc.name[cc.n], sizeof cc.name[cc.n]);
+			cc.idle[cc.n++] = perfinst_value(&it, &ci[0]);
+		}
+	}
+	if (total >= 0) cpuload_add(cc.time, total, &cc);
+}
+
+static DWORD WINAPI cpuload_thread(LPVOID arg)
+{
+	int s;
+
+	for (;;) {
+		cpuload_sample();
+		s = cpusample;
+		if (s < 1) s = 1;
+		if (s > 60) s = 60;
+		Sleep(s*1000);
+	}
+	return 0;
+}
+
+/* Start the sampler, once */
+void cpuload_start(void)
+{
+	static int started = 0;
+	HANDLE h;
+
+	if (started) return;
+	h = CreateThread(NULL, 0, cpuload_thread, NULL, 0, NULL);
+	if (h == NULL) {
+		mrlog("cpuload_start: CreateThread failed (%d)",
+			(int)GetLastError());
+		return;
+	}
+	CloseHandle(h);
+	started = 1;
+}
+#endif
+
+#ifdef STANDALONE
+/*
+Feed made up samples through the ring and check the averages, then
+time the readers against a writer that never stops.
+
+	gcc -O2 -DSTANDALONE -o cpuload cpuload.c -lpthread && ./cpuload
+*/
+#include <pthread.h>
+#include <time.h>
+
+#define SECOND 10000000LL
+#define NREADS 1000000
+
+static volatile int stop;
+
+static void *writer(void *arg)
+{
+	struct cpucores cc;
+	long long t = 0, idle = 0;
+
+	memset(&cc, 0, sizeof cc);
+	cc.n = 4;
+	while (!stop) {
+		t += 5*SECOND;
+		idle += 5*SECOND/2;	/* always 50% */
+		cc.time = t;
+		cc.idle[0] = cc.idle[1] = cc.idle[2] = cc.idle[3] = idle;
+		cpuload_add(t, idle, &cc);
+	}
+	return NULL;
+}
+
+static int near(double a, double b)
+{
+	return a-b < 0.01 && b-a < 0.01;
+}
+
+int main(int argc, char **argv)
+{
+	struct cpucores cc;
+	long long t, idle, since = 0;
+	double load, peak;
+	int i, failed = 0;
+	pthread_t th;
+	clock_t c0;
+
+	if (cpuload_average(60, &load)) failed++;
+
+	/* 20 minutes at 5 seconds: idle for 10, then 50% for 5, then
+	   90% for the last 5 with one peak in the last minute */
+	t = idle = 0;
+	for (i = 0; i <= 240; i++) {
+		if (i > 0) {
+			t += 5*SECOND;
+			if (i <= 120) idle += 5*SECOND;
+			else if (i <= 180) idle += 5*SECOND/2;
+			else if (i != 235) idle += 5*SECOND/10;
+		}
+		cpuload_add(t, idle, NULL);
+	}
+	if (!cpuload_average(60, &load) || !near(load, 90+10.0/12)) failed++;
+	printf("1 minute %.1f%%", load);
+	if (!cpuload_average(300, &load) || !near(load, 90+10.0/60)) failed++;
+	printf(", 5 minutes %.1f%%", load);
+	if (!cpuload_average(900, &load) || !near(load, (60*50+60*90+10)/180.0)) failed++;
+	printf(", 15 minutes %.1f%%\n", load);
+	if (!cpuload_since(&since, &load, &peak) || !near(peak, 100)) failed++;
+	printf("last minute %.1f%%, peak %.1f%%\n", load, peak);
+	if (cpuload_since(&since, &load, &peak)) failed++;	/* nothing new */
+	if (cpuload_cores(&cc)) failed++;
+
+	stop = 0;
+	pthread_create(&th, NULL, writer, NULL);
+	while (!cpuload_cores(&cc))
+		;	/* until the samples above are left behind */
+	c0 = clock();
+	for (i = 0; i < NREADS; i++) {
+		if (cpuload_average(60, &load) && !near(load, 50)) failed++;
+		if (cpuload_cores(&cc) && cc.n != 4) failed++;
+	}
+	stop = 1;
+	pthread_join(th, NULL);
+	printf("%d reads against a busy writer: %.2f us each\n", NREADS,
+		(double)(clock()-c0)/CLOCKS_PER_SEC*1e6/NREADS);
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed != 0;
+}
+#endif
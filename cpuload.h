@@ -0,0 +1,33 @@
+/* Processor load sampled in the background.
+
+A thread reads the Processor object (238) every cpusample seconds and
+appends the idle time of _Total to a ring of samples, so load averages
+and peaks can be computed for any period in the ring without waiting
+for a second sample. The ring has a single writer and is read without
+locks: each slot carries the number of the sample in it, which is
+cleared while the slot is being written. The idle times of the single
+cores are kept for the latest sample only, behind a sequence count.
+
+This part does not call Windows, so it can be exercised with made up
+samples on any platform.
+*/
+
+#define CPULOAD_RING 1024	/* samples, over an hour at 5 seconds */
+#define CPULOAD_CORES 64
+
+/* Idle times per core, in 100 ns units like the time */
+struct cpucores {
+	long long time;
+	int n;
+	char name[CPULOAD_CORES][8];
+	long long idle[CPULOAD_CORES];
+};
+
+extern void cpuload_add(long long time, long long idle,
+			struct cpucores *cc);
+extern int cpuload_average(int seconds, double *load);
+extern int cpuload_since(long long *since, double *load, double *peak);
+extern int cpuload_cores(struct cpucores *cc);
+#ifndef STANDALONE
+extern void cpuload_start(void);
+#endif
@@ -0,0 +1,216 @@
+#ifdef STANDALONE
+#include "dirwatch.h"
+#include "standalone.h"
+#else
+#include "mrbig.h"
+#endif
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+static int arm(struct dirwatch *w)
+{
+	if (!ReadDirectoryChangesW(w->dir, w->buf, sizeof w->buf, FALSE,
+			FILE_NOTIFY_CHANGE_FILE_NAME|FILE_NOTIFY_CHANGE_LAST_WRITE,
+			NULL, &w->ov, NULL)) {
+		mrlog("dirwatch: ReadDirectoryChangesW failed (%d)",
+			(int)GetLastError());
+		return 0;
+	}
+	return 1;
+}
+
+int dirwatch_open(struct dirwatch *w, char *dir)
+{
+	memset(w, 0, sizeof *w);
+	w->dir = CreateFile(dir, FILE_LIST_DIRECTORY,
+			FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING,
+			FILE_FLAG_BACKUP_SEMANTICS|FILE_FLAG_OVERLAPPED, NULL);
+	if (w->dir == INVALID_HANDLE_VALUE) {
+		mrlog("dirwatch: can't open %s (%d)", dir, (int)GetLastError());
+		return 0;
+	}
+	w->ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (w->ov.hEvent == NULL || !arm(w)) {
+		if (w->ov.hEvent) CloseHandle(w->ov.hEvent);
+		CloseHandle(w->dir);
+		return 0;
+	}
+	return 1;
+}
+
+/* Wait at most ms for changes and call fn for each name. Returns the
+   number of names, 0 if nothing happened, DIRWATCH_LOST or
+   DIRWATCH_ERROR. */
+int dirwatch_wait(struct dirwatch *w, int ms,
+	void (*fn)(char *, void *), void *arg)
+{
+	FILE_NOTIFY_INFORMATION *fni;
+	char name[MAX_PATH], last[MAX_PATH];
+	DWORD n, off;
+	int len, names = 0;
+
+	if (WaitForSingleObject(w->ov.hEvent, ms) != WAIT_OBJECT_0) return 0;
+	if (!GetOverlappedResult(w->dir, &w->ov, &n, FALSE)) {
+		if (GetLastError() != ERROR_NOTIFY_ENUM_DIR) {
+			mrlog("dirwatch: GetOverlappedResult failed (%d)",
+				(int)GetLastError());
+			return DIRWATCH_ERROR;
+		}
+		n = 0;
+	}
+	ResetEvent(w->ov.hEvent);
+	/* More changes than fit in the buffer */
+	if (n == 0) return arm(w) ? DIRWATCH_LOST : DIRWATCH_ERROR;
+
+	last[0] = '\0';
+	for (off = 0;; off += fni->NextEntryOffset) {
+		fni = (FILE_NOTIFY_INFORMATION *)((char *)w->buf+off);
+		if (fni->Action == FILE_ACTION_ADDED ||
+		    fni->Action == FILE_ACTION_MODIFIED ||
+		    fni->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+			len = WideCharToMultiByte(CP_ACP, 0, fni->FileName,
+				fni->FileNameLength/sizeof(WCHAR),
+				name, sizeof name - 1, NULL, NULL);
+			name[len] = '\0';
+			/* A file being written is reported once per write */
+			if (len > 0 && strcmp(name, last)) {
+				strlcpy(last, name, sizeof last);
+				fn(name, arg);
+				names++;
+			}
+		}
+		if (fni->NextEntryOffset == 0) break;
+	}
+	/* Changes in the meantime are kept by the system until then */
+	return arm(w) ? names : DIRWATCH_ERROR;
+}
+
+void dirwatch_close(struct dirwatch *w)
+{
+	CancelIo(w->dir);
+	CloseHandle(w->dir);
+	CloseHandle(w->ov.hEvent);
+}
+#else
+int dirwatch_open(struct dirwatch *w, char *dir)
+{
+	w->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (w->fd == -1) {
+		mrlog("dirwatch: inotify_init1 failed (%d)", errno);
+		return 0;
+	}
+	if (inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE|IN_MOVED_TO|
+			IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR) == -1) {
+		mrlog("dirwatch: can't watch %s (%d)", dir, errno);
+		close(w->fd);
+		return 0;
+	}
+	return 1;
+}
+
+int dirwatch_wait(struct dirwatch *w, int ms,
+	void (*fn)(char *, void *), void *arg)
+{
+	struct pollfd pfd = {w->fd, POLLIN, 0};
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+	int names = 0, lost = 0;
+
+	if (poll(&pfd, 1, ms) <= 0) return 0;
+	n = read(w->fd, w->buf, sizeof w->buf);
+	if (n <= 0) return errno == EAGAIN ? 0 : DIRWATCH_ERROR;
+	for (p = w->buf; p < w->buf+n; p += sizeof *ev+ev->len) {
+		ev = (struct inotify_event *)p;
+		if (ev->mask & IN_Q_OVERFLOW) lost = 1;
+		else if (ev->mask & (IN_IGNORED|IN_DELETE_SELF|IN_MOVE_SELF))
+			return DIRWATCH_ERROR;
+		else if (ev->len && !(ev->mask & IN_ISDIR)) {
+			fn(ev->name, arg);
+			names++;
+		}
+	}
+	return lost ? DIRWATCH_LOST : names;
+}
+
+void dirwatch_close(struct dirwatch *w)
+{
+	close(w->fd);
+}
+#endif
+
+#ifdef STANDALONE
+/*
+Watch a scratch directory while files are written to it and renamed
+into it, and show how long each one took to be reported.
+
+	gcc -O2 -DSTANDALONE -o dirwatch dirwatch.c strlcpy.c && ./dirwatch
+*/
+
+#include <sys/time.h>
+
+static char seen[4][64];
+static int nseen;
+
+static void found(char *name, void *arg)
+{
+	struct timeval *t0 = arg, t;
+
+	gettimeofday(&t, NULL);
+	printf("%-12s after %ld us\n", name,
+		(long)((t.tv_sec-t0->tv_sec)*1000000+t.tv_usec-t0->tv_usec));
+	if (nseen < 4) strlcpy(seen[nseen++], name, sizeof seen[0]);
+}
+
+int main(int argc, char **argv)
+{
+	char dir[] = "/tmp/dirwatchXXXXXX", fn[256], to[256];
+	struct dirwatch w;
+	struct timeval t0;
+	FILE *fp;
+	int i, n;
+
+	if (mkdtemp(dir) == NULL || !dirwatch_open(&w, dir)) return 1;
+
+	gettimeofday(&t0, NULL);
+	snprintf(fn, sizeof fn, "%s/host.disk", dir);
+	fp = fopen(fn, "w");
+	fprintf(fp, "green\nall is well\n");
+	fclose(fp);
+	snprintf(fn, sizeof fn, "%s/.tmp", dir);
+	snprintf(to, sizeof to, "%s/host.backup", dir);
+	fp = fopen(fn, "w");
+	fprintf(fp, "red\nbackup failed\n");
+	fclose(fp);
+	rename(fn, to);
+
+	for (i = 0; i < 10 && nseen < 3; i++) {
+		n = dirwatch_wait(&w, 100, found, &t0);
+		if (n < 0) return 1;
+	}
+	/* Nothing more, and the wait times out */
+	n = dirwatch_wait(&w, 100, found, &t0);
+
+	unlink(to);
+	unlink(fn);
+	snprintf(fn, sizeof fn, "%s/host.disk", dir);
+	unlink(fn);
+	dirwatch_close(&w);
+	rmdir(dir);
+
+	if (nseen != 3 || n != 0 || strcmp(seen[0], "host.disk") ||
+			strcmp(seen[1], ".tmp") || strcmp(seen[2], "host.backup")) {
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
+#endif
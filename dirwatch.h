@@ -0,0 +1,34 @@
+/* Change notifications for the pickup directory.
+
+dirwatch_wait hands the names of files that were created, written to or
+renamed into the directory to a callback as soon as the system reports
+them, instead of waiting for the next scan. When the system had to drop
+notifications, the caller must scan the whole directory. A name may be
+reported before the file is complete, and more than once; deciding
+when to pick it up is left to the caller.
+
+On Windows this is ReadDirectoryChangesW with an overlapped read, so a
+write may be reported before the writer has closed the file; elsewhere
+it is inotify, which reports the close, so it can be tried out on Linux.
+*/
+
+#define DIRWATCH_BUF 16384
+
+#define DIRWATCH_LOST (-1)	/* notifications were dropped, scan */
+#define DIRWATCH_ERROR (-2)	/* the watch is gone, close and reopen */
+
+struct dirwatch {
+#ifdef _WIN32
+	HANDLE dir;
+	OVERLAPPED ov;
+	DWORD buf[DIRWATCH_BUF/sizeof(DWORD)];
+#else
+	int fd;
+	char buf[DIRWATCH_BUF];
+#endif
+};
+
+extern int dirwatch_open(struct dirwatch *w, char *dir);
+extern int dirwatch_wait(struct dirwatch *w, int ms,
+	void (*fn)(char *, void *), void *arg);
+extern void dirwatch_close(struct dirwatch *w);
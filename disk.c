@@ -64,37 +64,36 @@ static void lookup_limits(char *drive, double *yellow, double *red)
 	*red = dfred;
 }
 
-static void append_limits(char *a, size_t n)
+static void append_limits(struct sbuf *a)
 {
 	struct cfg *pc;
 
 #if 0	/* this upsets Hobbit's rrd handler module do_disk.c */
-	snprcat(a, n, "\n<b>Limits:</b>\n<table>\n");
-	snprcat(a, n, "<tr><th>Drive</th><th>Yellow</th><th>Red</th></tr>\n");
+	sb_printf(a, "\n<b>Limits:</b>\n<table>\n");
+	sb_printf(a, "<tr><th>Drive</th><th>Yellow</th><th>Red</th></tr>\n");
 	for (pc = pcfg_disk; pc; pc = pc->next) {
-		snprcat(a, n, "<tr><td>%s</td><td>%.1f%%</td><td>%.1f%%</td></tr>\n",
+		sb_printf(a, "<tr><td>%s</td><td>%.1f%%</td><td>%.1f%%</td></tr>\n",
 			pc->name, pc->yellow, pc->red);
 	}
-	snprcat(a, n, "<tr><td>Default</td><td>%.1f%%</td><td>%.1f%%</td></tr>\n",
+	sb_printf(a, "<tr><td>Default</td><td>%.1f%%</td><td>%.1f%%</td></tr>\n",
 		dfyellow, dfred);
-	snprcat(a, n, "</table>\n");
+	sb_printf(a, "</table>\n");
 #else	/* fixed width plain text should be safe */
-	snprcat(a, n, "\nLimits:\n");
-	snprcat(a, n, "%-10s %-10s %-10s\n", "Drive", "Yellow", "Red");
+	sb_printf(a, "\nLimits:\n");
+	sb_printf(a, "%-10s %-10s %-10s\n", "Drive", "Yellow", "Red");
 	for (pc = pcfg_disk; pc; pc = pc->next) {
-		snprcat(a, n, "%-10s %-10.1f %-10.1f\n", pc->name, pc->yellow, pc->red);
+		sb_printf(a, "%-10s %-10.1f %-10.1f\n", pc->name, pc->yellow, pc->red);
 	}
-	snprcat(a, n, "%-10s %-10.1f %-10.1f\n", "Default", dfyellow, dfred);
+	sb_printf(a, "%-10s %-10.1f %-10.1f\n", "Default", dfyellow, dfred);
 #endif
 }
 
-void disk(void)
+void disk(struct mrcfg *mc)
 {
-	char b[5000];
-	int n = sizeof b;
+	struct sbuf b, q, r;
 	int drive_letter, res;
 	double yellow, red;
-	char d[10], q[5000], r[5000], *color = "green";
+	char d[10], *color = "green";
 	char cfgfile[1024], drive[10];
 	DWORD drives;
 	unsigned int dtype;
@@ -102,23 +101,23 @@ void disk(void)
 	uint64_t total_bytes, free_bytes;
 	ULARGE_INTEGER fa, tb, fb;
 
-	if (debug > 1) mrlog("disk(%p, %d)", b, n);
+	if (debug > 1) mrlog("disk()");
 
-	if (get_option("no_disk", 0)) {
-		mrsend(mrmachine, "disk", "clear", "option no_disk\n");
+	if (get_option(mc, "no_disk", 0)) {
+		mrsend(mc->machine, "disk", "clear", "option no_disk\n");
 		return;
 	}
 
 	drives = GetLogicalDrives();
 
 	cfgfile[0] = '\0';
-	snprcat(cfgfile, sizeof cfgfile, "%s%c%s", cfgdir, dirsep, "disk.cfg");
+	snprcat(cfgfile, sizeof cfgfile, "%s%c%s", mc->cfgdir, dirsep, "disk.cfg");
 	read_cfg("disk", cfgfile);
 	read_diskcfg(/*cfgfile*/);
 
-	r[0] = '\0';
-	q[0] = '\0';
-	snprcat(q, sizeof q, "%-11s %11s %11s %11s %11s  %s\n",
+	sb_init(&r, 0);
+	sb_init(&q, 0);
+	sb_printf(&q, "%-11s %11s %11s %11s %11s  %s\n",
 		"Filesystem", "1k-blocks", "Used", "Avail", "Capacity",
 		"Mounted");
 	for (drive_letter = 'A'; drive_letter <= 'Z'; drive_letter++) {
@@ -142,12 +141,12 @@ void disk(void)
 				}
 				lookup_limits(drive, &yellow, &red);
 				if (pct >= red) {
-					snprcat(r, sizeof r,
+					sb_printf(&r,
 						"&red %s (%.1f%%) has reached the PANIC level (%.1f%%)\n",
 						d, pct, red);
 					color = "red";
 				} else if (pct >= yellow) {
-					snprcat(r, sizeof r,
+					sb_printf(&r,
 						"&yellow %s (%.1f%%) has reached the WARNING level (%.1f%%)\n",
 						d, pct, yellow);
 					if (!strcmp(color, "green")) {
@@ -156,7 +155,7 @@ void disk(void)
 				}
 
 				/* Filesystem */
-				snprcat(q, sizeof q,
+				sb_printf(&q,
 					"%-11c % 11" PRIu64 " % 11" PRIu64 " % 11" PRIu64 " % 10.1f%%  /FIXED/%c\n",
 					drive_letter,
 					(total_bytes / 1024),
@@ -167,9 +166,12 @@ void disk(void)
 		}
 		drives >>= 1;
 	}
-	b[0] = '\0';
-	snprcat(b, n, "%s\n\n%s\n%s\n", now, r, q);
-	append_limits(b, n);
+	sb_init(&b, 0);
+	sb_printf(&b, "%s\n\n%s\n%s\n", mc->now, r.s, q.s);
+	append_limits(&b);
 	free_cfg();
-	mrsend(mrmachine, "disk", color, b);
+	mrsendn(mc->machine, "disk", color, b.s, b.len);
+	sb_free(&b);
+	sb_free(&q);
+	sb_free(&r);
 }
@@ -0,0 +1,420 @@
+#ifdef STANDALONE
+#include "evlog.h"
+#include "standalone.h"
+#else
+#include "mrbig.h"
+#endif
+
+/*
+Each channel keeps a bookmark, the highest EventRecordId seen so far.
+The first read of a channel covers the msgage window; after that the
+provider only returns events newer than the bookmark. Matched events
+are retained until they fall out of the msgage window, so the report
+still lists everything inside the window without reading it again.
+
+Different channels may be read at the same time, but evlog_state()
+must not be called while that happens.
+*/
+
+static struct logstate *states;
+
+struct logstate *evlog_state(char *name)
+{
+	struct logstate *ls;
+
+	for (ls = states; ls; ls = ls->next) {
+		if (!strcmp(ls->name, name)) return ls;
+	}
+	ls = big_malloc("evlog_state (node)", sizeof *ls);
+	ls->name = big_strdup("evlog_state (name)", name);
+	ls->bookmark = 0;
+	ls->n = 0;
+	ls->priv = NULL;
+	ls->free_priv = NULL;
+	ls->next = states;
+	states = ls;
+	return ls;
+}
+
+static void free_retained(struct retained *r)
+{
+	big_free("free_retained (source)", r->source);
+	big_free("free_retained (message)", r->message);
+}
+
+void evlog_reset(struct logstate *ls)
+{
+	int i;
+
+	if (debug > 1) mrlog("evlog_reset(%s)", ls->name);
+	for (i = 0; i < ls->n; i++) free_retained(&ls->retained[i]);
+	ls->n = 0;
+	ls->bookmark = 0;
+	if (ls->priv && ls->free_priv) ls->free_priv(ls->priv);
+	ls->priv = NULL;
+}
+
+void evlog_reset_all(void)
+{
+	struct logstate *ls;
+
+	for (ls = states; ls; ls = ls->next) evlog_reset(ls);
+}
+
+/* If the newest record in the log is below the bookmark, the log has
+   been cleared since the bookmark was taken and we start over. A
+   negative newest means it is not known. Returns 1 after a reset. */
+int evlog_cleared(struct logstate *ls, long long newest)
+{
+	if (newest < 0 || newest >= ls->bookmark) return 0;
+	mrlog("evlog: %s has been cleared, starting over", ls->name);
+	evlog_reset(ls);
+	return 1;
+}
+
+/* Format the message if the provider has not done so already */
+char *evlog_message(struct event *e)
+{
+	if (e->message == NULL && e->format) e->format(e);
+	if (e->message == NULL) e->message = big_strdup("evlog_message", "(No message)");
+	return e->message;
+}
+
+void evlog_free_event(struct event *e)
+{
+	if (e->source) big_free("evlog_free_event (source)", e->source);
+	if (e->message) big_free("evlog_free_event (message)", e->message);
+	e->source = e->message = NULL;
+}
+
+/* Keep the list ordered by record. Events normally arrive in order,
+   but the first read of a channel goes backwards. When the list is
+   full the oldest entry is dropped. */
+static void retain(struct logstate *ls, struct event *e, char *color)
+{
+	struct retained *r;
+	int i;
+
+	for (i = ls->n; i > 0 && ls->retained[i-1].record > e->record; i--);
+	if (ls->n == EVLOG_RETAIN) {
+		if (i == 0) return;
+		free_retained(&ls->retained[0]);
+		memmove(&ls->retained[0], &ls->retained[1],
+			(i-1)*sizeof *ls->retained);
+		i--;
+	} else {
+		memmove(&ls->retained[i+1], &ls->retained[i],
+			(ls->n-i)*sizeof *ls->retained);
+		ls->n++;
+	}
+	r = &ls->retained[i];
+	r->gtime = e->gtime;
+	r->record = e->record;
+	r->color = color;
+	r->source = e->source ? e->source : big_strdup("retain (source)", "");
+	r->message = evlog_message(e);
+	e->source = e->message = NULL;
+}
+
+/* Read new events from the provider, match them and advance the
+   bookmark. Events older than cutoff are neither matched nor
+   formatted. Returns the number of events read. */
+int evlog_read(struct logstate *ls, struct evlog_provider *pv,
+		char *(*match)(struct event *, char *), time_t cutoff)
+{
+	struct event e;
+	char *color;
+	int n = 0;
+
+	if (debug > 1) mrlog("evlog_read(%s) from %lld", ls->name, ls->bookmark);
+
+	memset(&e, 0, sizeof e);
+	while (pv->next(pv->ctx, &e)) {
+		n++;
+		if (e.record > ls->bookmark) ls->bookmark = e.record;
+		if (e.gtime >= cutoff && (color = match(&e, ls->name))) {
+			retain(ls, &e, color);
+		}
+		evlog_free_event(&e);
+		memset(&e, 0, sizeof e);
+	}
+	if (debug > 1) mrlog("evlog_read(%s) read %d events, bookmark %lld",
+		ls->name, n, ls->bookmark);
+	return n;
+}
+
+/* Drop retained events that are older than cutoff */
+void evlog_expire(struct logstate *ls, time_t cutoff)
+{
+	int i, j;
+
+	for (i = j = 0; i < ls->n; i++) {
+		if (ls->retained[i].gtime < cutoff) {
+			free_retained(&ls->retained[i]);
+		} else {
+			ls->retained[j++] = ls->retained[i];
+		}
+	}
+	ls->n = j;
+}
+
+#ifdef STANDALONE
+/*
+Replay recorded events through the bookkeeping. Each file is one pass
+of the main loop, a snapshot of the whole log at that time, and holds
+lines of the form
+
+	record<TAB>time<TAB>type<TAB>id<TAB>source<TAB>message
+
+The fixture provider honours the bookmark like the real query does,
+and in fast mode returns only the newest FIXTURE_BATCH events, newest
+first. Type 1 events are reported red and type 2 yellow, and messages
+containing "ignore" are not reported. The window is the hour before
+the newest event in the file.
+
+Without arguments the recorded scenarios in fixtures/ are replayed and
+checked, so run it from the top directory:
+
+	gcc -O2 -DSTANDALONE -o evlog evlog.c strlcpy.c && ./evlog
+
+With arguments the files are replayed as one channel and the passes
+are shown.
+*/
+
+#define FIXTURE_BATCH 3
+
+struct fixture {
+	FILE *fp;
+	long long bookmark;
+	char message[4096];
+	int formatted;
+	/* fast mode: the newest lines, returned from the end */
+	int fast, n, i;
+	char lines[FIXTURE_BATCH][4096];
+};
+
+static void fixture_format(struct event *e)
+{
+	struct fixture *f = e->handle;
+
+	f->formatted++;
+	e->message = big_strdup("fixture_format", f->message);
+}
+
+static int fixture_parse(struct fixture *f, char *b, struct event *e)
+{
+	char source[256];
+	long long record, id;
+	long gtime, type;
+
+	f->message[0] = '\0';
+	if (sscanf(b, "%lld\t%ld\t%ld\t%lld\t%255[^\t]\t%4095[^\r\n]",
+			&record, &gtime, &type, &id, source, f->message) < 5) {
+		return 0;
+	}
+	if (record <= f->bookmark) return 0;
+	if (e == NULL) return 1;
+	e->record = record;
+	e->gtime = e->wtime = gtime;
+	e->type = type;
+	e->id = id;
+	e->source = big_strdup("fixture_next (source)", source);
+	e->handle = f;
+	e->format = fixture_format;
+	return 1;
+}
+
+static int fixture_next(void *ctx, struct event *e)
+{
+	struct fixture *f = ctx;
+	char b[4096];
+
+	if (f->fast) {
+		while (f->i > 0 && f->i > f->n-FIXTURE_BATCH) {
+			f->i--;
+			if (fixture_parse(f, f->lines[f->i%FIXTURE_BATCH], e))
+				return 1;
+		}
+		return 0;
+	}
+	while (fgets(b, sizeof b, f->fp)) {
+		if (fixture_parse(f, b, e)) return 1;
+	}
+	return 0;
+}
+
+static void fixture_close(void *ctx)
+{
+	fclose(((struct fixture *)ctx)->fp);
+}
+
+static int fixture_open(struct fixture *f, char *fn, long long bookmark,
+	int fast, struct evlog_provider *pv)
+{
+	char b[4096];
+
+	f->fp = fopen(fn, "r");
+	if (f->fp == NULL) {
+		perror(fn);
+		return 0;
+	}
+	f->bookmark = bookmark;
+	f->formatted = 0;
+	f->fast = fast;
+	f->n = 0;
+	while (fast && fgets(b, sizeof b, f->fp)) {
+		if (fixture_parse(f, b, NULL))
+			strlcpy(f->lines[f->n++%FIXTURE_BATCH], b, sizeof f->lines[0]);
+	}
+	f->i = f->n;
+	pv->ctx = f;
+	pv->next = fixture_next;
+	pv->close = fixture_close;
+	return 1;
+}
+
+static char *fixture_match(struct event *e, char *log)
+{
+	if (e->type > 2) return NULL;
+	if (strstr(evlog_message(e), "ignore")) return NULL;
+	if (e->type == 1) return "red";
+	if (e->type == 2) return "yellow";
+	return NULL;
+}
+
+/* The newest time and record in a file */
+static void newest(char *fn, time_t *gtime, long long *record)
+{
+	FILE *fp = fopen(fn, "r");
+	char b[4096];
+	long long r;
+	long t;
+
+	*gtime = 0;
+	*record = -1;
+	if (fp == NULL) return;
+	while (fgets(b, sizeof b, fp)) {
+		if (sscanf(b, "%lld\t%ld", &r, &t) != 2) continue;
+		if (t > *gtime) *gtime = t;
+		if (r > *record) *record = r;
+	}
+	fclose(fp);
+}
+
+/* One pass of the main loop over fn: check for a cleared log like
+   read_log does, read, expire. The summary goes into sum. */
+static int pass(struct logstate *ls, char *fn, int fast, char *sum, size_t len)
+{
+	struct fixture f;
+	struct evlog_provider pv;
+	long long record;
+	time_t cutoff;
+	size_t l;
+	int j, n;
+
+	newest(fn, &cutoff, &record);
+	cutoff -= 3600;
+	if (ls->bookmark) evlog_cleared(ls, record);
+	if (!fixture_open(&f, fn, ls->bookmark, fast, &pv)) return 0;
+	n = evlog_read(ls, &pv, fixture_match, cutoff);
+	pv.close(pv.ctx);
+	evlog_expire(ls, cutoff);
+	snprintf(sum, len, "read %d, formatted %d, bookmark %lld, retained",
+		n, f.formatted, ls->bookmark);
+	for (j = 0; j < ls->n; j++) {
+		l = strlen(sum);
+		snprintf(sum+l, len-l, " %s:%lld",
+			ls->retained[j].color, ls->retained[j].record);
+	}
+	return 1;
+}
+
+/* Stands in for the provider's state, which a reset must free */
+static int privs;
+
+static void fixture_free_priv(void *priv)
+{
+	privs--;
+	big_free("fixture_free_priv", priv);
+}
+
+/* Recorded scenarios, each a channel read over a few passes */
+static struct {
+	char *name;
+	struct {
+		char *file;
+		int fast;
+		char *expect;
+	} passes[3];
+} scenarios[] = {
+	{"resume", {
+		{"fixtures/evlog-resume-1.txt", 0,
+		 "read 5, formatted 3, bookmark 5, retained yellow:2 red:3"},
+		/* only the new events are read, 2 and 3 fall out of the window */
+		{"fixtures/evlog-resume-2.txt", 0,
+		 "read 3, formatted 2, bookmark 8, retained yellow:6 red:8"}}},
+	{"cleared", {
+		{"fixtures/evlog-cleared-1.txt", 0,
+		 "read 3, formatted 2, bookmark 102, retained red:100 yellow:102"},
+		/* records start over below the bookmark */
+		{"fixtures/evlog-cleared-2.txt", 0,
+		 "read 2, formatted 1, bookmark 2, retained yellow:2"}}},
+	{"fast", {
+		{"fixtures/evlog-fast-1.txt", 1,
+		 "read 3, formatted 1, bookmark 5, retained red:4"},
+		/* 6 to 9 are skipped, the bookmark goes to the newest */
+		{"fixtures/evlog-fast-2.txt", 1,
+		 "read 3, formatted 2, bookmark 12, retained red:4 yellow:10 red:12"},
+		{"fixtures/evlog-fast-2.txt", 1,
+		 "read 0, formatted 0, bookmark 12, retained red:4 yellow:10 red:12"}}},
+};
+
+int main(int argc, char **argv)
+{
+	struct logstate *ls;
+	char sum[1024];
+	int i, j, failed = 0;
+
+	if (argc > 1) {
+		ls = evlog_state("Fixture");
+		for (i = 1; i < argc; i++) {
+			if (!pass(ls, argv[i], 0, sum, sizeof sum))
+				return EXIT_FAILURE;
+			printf("pass %d: %s\n", i, sum);
+			for (j = 0; j < ls->n; j++) {
+				printf("\t&%s %lld %ld %s - %s\n",
+					ls->retained[j].color, ls->retained[j].record,
+					(long)ls->retained[j].gtime,
+					ls->retained[j].source, ls->retained[j].message);
+			}
+		}
+		evlog_reset_all();
+		return 0;
+	}
+
+	for (i = 0; i < sizeof scenarios/sizeof *scenarios; i++) {
+		ls = evlog_state(scenarios[i].name);
+		ls->priv = big_malloc("main (priv)", 1);
+		ls->free_priv = fixture_free_priv;
+		privs++;
+		for (j = 0; j < 3 && scenarios[i].passes[j].file; j++) {
+			if (!pass(ls, scenarios[i].passes[j].file,
+					scenarios[i].passes[j].fast, sum, sizeof sum))
+				return EXIT_FAILURE;
+			if (strcmp(sum, scenarios[i].passes[j].expect)) {
+				printf("%s pass %d: %s\n\texpected %s\n",
+					scenarios[i].name, j+1, sum,
+					scenarios[i].passes[j].expect);
+				failed++;
+			}
+		}
+	}
+	evlog_reset_all();
+	if (privs) {
+		printf("%d provider states not freed\n", privs);
+		failed++;
+	}
+	printf(failed ? "FAILED\n" : "ok\n");
+	return failed ? EXIT_FAILURE : 0;
+}
+#endif
@@ -0,0 +1,62 @@
+/* Incremental event log reading.
+
+This part does not depend on the Windows event log API. Events come
+from a provider (readlog.c for the real thing), so the bookkeeping
+can be exercised with recorded events on any platform.
+*/
+
+#include <time.h>
+
+struct event {
+	time_t gtime, wtime;
+	long long record, id;
+	long type;
+	char *source;
+	char *message;	/* NULL until formatted, see evlog_message */
+	void *handle;
+	void (*format)(struct event *e);
+	struct event *next;
+};
+
+/* A source of events. next() fills in e and returns 1, or returns 0
+   when there are no more events. The strings in e are allocated with
+   big_malloc and belong to the caller. Formatting the message is
+   usually the expensive part, so a provider may leave it out and set
+   format() instead; that stays valid until the next call to next(). */
+struct evlog_provider {
+	void *ctx;
+	int (*next)(void *ctx, struct event *e);
+	void (*close)(void *ctx);
+};
+
+/* A matched event kept for the report */
+struct retained {
+	time_t gtime;
+	long long record;
+	char *color;
+	char *source;
+	char *message;
+};
+
+#define EVLOG_RETAIN 256
+
+/* Per channel state kept between main loops */
+struct logstate {
+	char *name;
+	long long bookmark;	/* highest EventRecordId seen, 0 for none */
+	int n;			/* entries in retained, ordered by record */
+	struct retained retained[EVLOG_RETAIN];
+	void *priv;		/* the provider's own state */
+	void (*free_priv)(void *);	/* frees priv on reset */
+	struct logstate *next;
+};
+
+extern struct logstate *evlog_state(char *name);
+extern void evlog_reset(struct logstate *ls);
+extern void evlog_reset_all(void);
+extern int evlog_cleared(struct logstate *ls, long long newest);
+extern int evlog_read(struct logstate *ls, struct evlog_provider *pv,
+		char *(*match)(struct event *, char *), time_t cutoff);
+extern void evlog_expire(struct logstate *ls, time_t cutoff);
+extern char *evlog_message(struct event *e);
+extern void evlog_free_event(struct event *e);
@@ -12,23 +12,67 @@ void mrlog(char *p)
 }
 #endif
 
-static void pickup_file(char *fn)
+/* A file is left alone until it hasn't been written to for this
+   many seconds, as status files are often written in several steps */
+#define PICKUP_QUIET 5
+
+/* The runner belongs to ext_thread. The main loop hands it the lines
+   of ext.cfg with extworkers and exttimeout, and tells it when a main
+   loop starts. The thread never reads the configuration globals, which
+   readcfg rewrites. */
+static CRITICAL_SECTION ext_lock;	/* guards everything below */
+static char *ext_cfg;		/* new configuration, or NULL */
+static int ext_workers, ext_timeout;	/* along with ext_cfg */
+static int ext_kicked;
+static ULONGLONG ext_running_since;	/* oldest running test, or 0 */
+
+static ULONGLONG filetime(FILETIME *ft)
+{
+	return ((ULONGLONG)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+}
+
+/* Whether a file last written at lw is complete. Any ext test that
+   was already running then may still be writing it, so such files
+   wait until those tests have ended, as they always did. Files from
+   other programs wait until they have been quiet for a while. */
+static int pickup_ready(FILETIME *lw)
+{
+	ULONGLONG written = filetime(lw), now, since;
+	FILETIME ft;
+
+	GetSystemTimeAsFileTime(&ft);
+	now = filetime(&ft);
+	if (now >= written && now-written < PICKUP_QUIET*10000000ULL) {
+		return 0;
+	}
+	EnterCriticalSection(&ext_lock);
+	since = ext_running_since;
+	LeaveCriticalSection(&ext_lock);
+	return since == 0 || written < since;
+}
+
+/* Returns 0 if the file may still be written to and must be picked up
+   later, otherwise 1 */
+static int pickup_file(struct mrcfg *mc, char *fn)
 {
 	char full_fn[1024], machname[261], testname[261];
-	char *b, *s, *p;
-	FILE *fp;
-	size_t n;
+	char *b, *color, *msg, *p;
+	HANDLE h;
+	LARGE_INTEGER size;
+	FILETIME lw;
+	DWORD n, want, err;
+	size_t hlen;
 
 	if (debug) mrlog("pickup_file(%s)", fn);
 
-	if (get_option("no_ext", 0)) {
+	if (get_option(mc, "no_ext", 0)) {
 		/* no mrsend with clear status because we don't
 		   know the names of the tests
 		*/
-		return;
+		return 1;
 	}
 
-	snprintf(full_fn, sizeof(full_fn), "%s%c%s", pickupdir, dirsep, fn);
+	snprintf(full_fn, sizeof(full_fn), "%s%c%s", mc->pickupdir, dirsep, fn);
 
 	p = strchr(fn, '.');
 	if (p) {
@@ -36,7 +80,7 @@ static void pickup_file(char *fn)
 		strncpy(machname, fn, sizeof(machname) - 1);
 		strncpy(testname, p, sizeof(testname) - 1);
 	} else {
-		strncpy(machname, mrmachine, sizeof(machname));
+		strncpy(machname, mc->machine, sizeof(machname));
 		strncpy(testname, fn, sizeof(machname));
 	}
 	machname[sizeof(machname)-1] = 0;
@@ -47,46 +91,86 @@ static void pickup_file(char *fn)
 		mrlog("machname = '%s'", machname);
 		mrlog("testname = '%s'", testname);
 	}
-	fp = big_fopen("pickup_file", full_fn, "r");
-	if (!fp) {
-		mrlog("Can't pick up file");
-		return;
+	/* Denying writes makes the open fail while the file is being
+	   written */
+	h = CreateFile(full_fn, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		err = GetLastError();
+		if (err == ERROR_SHARING_VIOLATION) {
+			if (debug) mrlog("%s is in use, picking it up later", full_fn);
+			return 0;
+		}
+		/* Already picked up after an earlier notification */
+		if (err == ERROR_FILE_NOT_FOUND) return 1;
+		mrlog("Can't pick up file %s (%d)", full_fn, (int)err);
+		return 1;
+	}
+	if (!GetFileSizeEx(h, &size) || !GetFileTime(h, NULL, NULL, &lw)) {
+		mrlog("Can't get the size or time of %s (%d)",
+			full_fn, (int)GetLastError());
+		CloseHandle(h);
+		return 1;
+	}
+	if (!pickup_ready(&lw)) {
+		if (debug) mrlog("%s may not be complete, picking it up later", full_fn);
+		CloseHandle(h);
+		return 0;
 	}
 
-	b = big_malloc("pickup_file", report_size);
-	s = big_malloc("pickup_file", report_size);
-	n = fread(b, 1, report_size-1, fp);
-	big_fclose("pickup_file", fp);
+	/* mrsend sends no more than report_size anyway */
+	want = size.QuadPart > report_size ? report_size : (DWORD)size.QuadPart;
+	if (size.QuadPart > want) {
+		mrlog("%s is %ld bytes, sending the first %ld",
+			full_fn, (long)size.QuadPart, (long)want);
+	}
+
+	/* Read the file after room for the time, which then takes
+	   the place of the first line */
+	hlen = strlen(mc->now)+2;
+	b = big_malloc("pickup_file", hlen+want+sizeof SBUF_MARKER+1);
+	if (!ReadFile(h, b+hlen, want, &n, NULL)) {
+		mrlog("Can't read %s (%d)", full_fn, (int)GetLastError());
+		n = 0;
+	}
+	CloseHandle(h);
 	remove(full_fn);
-	b[n] = 0;
-	no_return(b);
+	b[hlen+n] = 0;
+	no_return(b+hlen);
 
-	p = strchr(b, '\n');
+	p = strchr(b+hlen, '\n');
 
 	if (p == NULL) {
 		mrlog("No color in pickup file");
 		goto Exit;
 	}
 
+	strcat(p, size.QuadPart > want ? SBUF_MARKER : "\n");
 	*p++ = 0;
+	color = big_strdup("pickup_file", b+hlen);
 
-	snprintf(s, report_size, "%s\n\n%s\n", now, p);
+	msg = p-hlen;
+	memcpy(msg, mc->now, hlen-2);
+	msg[hlen-2] = msg[hlen-1] = '\n';
 
-	mrsend(machname, testname, b, s);
+	mrsend(machname, testname, color, msg);
+	big_free("pickup_file", color);
 
 Exit:
 	big_free("pickup_file", b);
-	big_free("pickup_file", s);
+	return 1;
 }
 
-static void pickup(void)
+/* Returns the number of files that must be picked up later */
+static int pickup(struct mrcfg *mc)
 {
 	char pattern[1024];
 	WIN32_FIND_DATA FindFileData;
 	HANDLE hFind;
+	int busy = 0;
 
 	pattern[0] = '\0';
-	snprcat(pattern, sizeof pattern, "%s%c*", pickupdir, dirsep);
+	snprcat(pattern, sizeof pattern, "%s%c*", mc->pickupdir, dirsep);
 
 	if (debug) {
 		mrlog("pickup()");
@@ -97,55 +181,235 @@ static void pickup(void)
 
 	if (hFind == INVALID_HANDLE_VALUE) {
 		mrlog("Invalid pickup directory");
-		return;
+		return 0;
 	}
 
 	do {
 		if (!(FindFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-			pickup_file(FindFileData.cFileName);
+			busy += !pickup_file(mc, FindFileData.cFileName);
 	} while (FindNextFile(hFind, &FindFileData));
 
 	FindClose(hFind);
+	return busy;
 }
 
-void ext_tests(void)
+/* Files are picked up by the pickup thread as they land, and by the
+   ext thread and the main loop when the directory can't be watched, so
+   two of them must not pick up the same file. The threads use the
+   configuration of the loop that is current when they pick up. */
+static CRITICAL_SECTION pickup_lock;
+static volatile int pickup_watching;
+
+static int pickup_locked(struct mrcfg *mc)
 {
+	int busy;
+
+	EnterCriticalSection(&pickup_lock);
+	busy = pickup(mc);
+	LeaveCriticalSection(&pickup_lock);
+	return busy;
+}
+
+static int pickup_current(void)
+{
+	struct mrcfg *mc = mrcfg_get();
+	int busy = pickup_locked(mc);
+
+	mrcfg_release(mc);
+	return busy;
+}
+
+static void pickup_name(char *fn, void *busy)
+{
+	struct mrcfg *mc = mrcfg_get();
+
+	EnterCriticalSection(&pickup_lock);
+	if (!pickup_file(mc, fn)) *(int *)busy = 1;
+	LeaveCriticalSection(&pickup_lock);
+	mrcfg_release(mc);
+}
+
+/* Returns 1 if dir is still the pickup directory */
+static int pickup_same_dir(char *dir)
+{
+	struct mrcfg *mc = mrcfg_get();
+	int same = !strcmp(dir, mc->pickupdir);
+
+	mrcfg_release(mc);
+	return same;
+}
+
+/* Watch the pickup directory and look at each file when it is
+   written. Files that aren't complete yet (see pickup_ready) are
+   looked at again every second by scanning the whole directory, which
+   is also done when the watch starts and when notifications were
+   lost. */
+static DWORD WINAPI pickup_thread(LPVOID arg)
+{
+	static struct dirwatch w;
+	struct mrcfg *mc;
+	char dir[256];
+	ULONGLONG scanned = 0;
+	int n, busy = 0, open = 0;
+
+	for (;;) {
+		if (!open) {
+			mc = mrcfg_get();
+			strlcpy(dir, mc->pickupdir, sizeof dir);
+			mrcfg_release(mc);
+			if (!dirwatch_open(&w, dir)) {
+				/* The ext thread and the main loop
+				   pick up instead */
+				Sleep(60000);
+				continue;
+			}
+			if (debug) mrlog("Watching pickup directory %s", dir);
+			open = 1;
+			pickup_watching = 1;
+			busy = pickup_current();
+			scanned = GetTickCount64();
+		}
+
+		n = dirwatch_wait(&w, busy ? 1000 : 60000, pickup_name, &busy);
+		if (n == DIRWATCH_ERROR || !pickup_same_dir(dir)) {
+			pickup_watching = 0;
+			dirwatch_close(&w);
+			open = 0;
+		} else if (n == DIRWATCH_LOST ||
+				(busy && GetTickCount64()-scanned >= 1000)) {
+			busy = pickup_current();
+			scanned = GetTickCount64();
+		}
+	}
+	return 0;
+}
+
+static void ext_apply(struct extrun *r, char *cfg, int timeout)
+{
+	char *line, *p;
+
+	extrun_begin(r);
+	for (line = cfg; line; line = p) {
+		p = strchr(line, '\n');
+		if (p) *p++ = '\0';
+		extrun_add(r, line, timeout);
+	}
+	extrun_end(r);
+}
+
+static DWORD WINAPI ext_thread(LPVOID arg)
+{
+	static struct extrun r;
+	struct extrun_result res;
+	FILETIME ft;
+	long long ms;
+	char *cfg;
+	int kicked, workers, timeout, n, busy = 0;
+
+	extrun_init(&r, 1);
+	for (;;) {
+		EnterCriticalSection(&ext_lock);
+		cfg = ext_cfg;
+		ext_cfg = NULL;
+		workers = ext_workers;
+		timeout = ext_timeout;
+		kicked = ext_kicked;
+		ext_kicked = 0;
+		LeaveCriticalSection(&ext_lock);
+
+		if (cfg) {
+			r.workers = workers;
+			ext_apply(&r, cfg, timeout);
+			big_free("ext_thread", cfg);
+		}
+		if (kicked) extrun_kick(&r);
+
+		extrun_poll(&r, 1000);
+		for (n = 0; extrun_next(&r, &res); n++) {
+			if (debug) {
+				mrlog("Ext test %s ended with %d after %ld ms",
+					res.cmd, res.status, (long)res.ms);
+			}
+		}
+
+		/* Tests only start in extrun_poll, and nothing is
+		   picked up within PICKUP_QUIET seconds of being
+		   written, so a new test is always accounted for */
+		ms = extrun_longest(&r);
+		GetSystemTimeAsFileTime(&ft);
+		EnterCriticalSection(&ext_lock);
+		ext_running_since = ms < 0 ? 0 : filetime(&ft)-ms*10000;
+		LeaveCriticalSection(&ext_lock);
+
+		/* Their status files are there now, no need to wait
+		   for the rest of the tests. The pickup thread does
+		   this when it watches the directory. */
+		if (!pickup_watching && (n || busy)) busy = pickup_current();
+	}
+	return 0;
+}
+
+void ext_tests(struct mrcfg *mc)
+{
+	static int started = 0;
 	char cfgfile[1024], cmd[1024], *p;
-	STARTUPINFO si;
-	PROCESS_INFORMATION pi;
-	DWORD n;
+	struct sbuf sb;
+	HANDLE h;
 	int i;
 
 	if (debug > 1) mrlog("ext_tests()");
 
 	cfgfile[0] = '\0';
-	snprcat(cfgfile, sizeof cfgfile, "%s%c%s", cfgdir, dirsep, "ext.cfg");
+	snprcat(cfgfile, sizeof cfgfile, "%s%c%s", mc->cfgdir, dirsep, "ext.cfg");
 	read_cfg("ext", cfgfile);
 
+	sb_init(&sb, 1024*1024);
 	for (i = 0; get_cfg("ext", cmd, sizeof cmd, i); i++) {
 		p = strchr(cmd, '\n');
 		if (p) *p = '\0';
 		if (cmd[0] == '#' || cmd[0] == '\0') continue;
 		if (debug) mrlog("Ext test: %s", cmd);
-		ZeroMemory(&si, sizeof si);
-		ZeroMemory(&pi, sizeof pi);
-		if (CreateProcess(NULL, cmd, NULL, NULL, FALSE,
-				CREATE_NO_WINDOW|DETACHED_PROCESS,
-				NULL, NULL, &si, &pi)) {
-			/* Wait no more than two minutes */
-			n = WaitForSingleObject(pi.hProcess, 120*1000);
-			if (debug) mrlog("WaitForSingleObject returns %d", n);
-			if (n == WAIT_TIMEOUT) {
-				TerminateProcess(pi.hProcess, EXIT_FAILURE);
-				mrlog("Terminating process");
-				mrlog(cmd);
-			}
-			CloseHandle(pi.hProcess);
-			CloseHandle(pi.hThread);
+		sb_printf(&sb, "%s%s", sb.len ? "\n" : "", cmd);
+	}
+
+	if (!started) {
+		InitializeCriticalSection(&ext_lock);
+		InitializeCriticalSection(&pickup_lock);
+		/* Without the thread no ext test runs, but the pickup
+		   directory is still read below */
+		h = CreateThread(NULL, 0, ext_thread, NULL, 0, NULL);
+		if (h == NULL) {
+			mrlog("ext_tests: CreateThread failed (%d), not running ext tests",
+				(int)GetLastError());
+		} else {
+			CloseHandle(h);
+		}
+		h = CreateThread(NULL, 0, pickup_thread, NULL, 0, NULL);
+		if (h == NULL) {
+			mrlog("ext_tests: CreateThread failed (%d)",
+				(int)GetLastError());
 		} else {
-			mrlog("CreateProcess failed");
+			CloseHandle(h);
 		}
+		started = 1;
 	}
-	pickup();
-}
 
+	/* The marker at the end of a cut off list would be run as a
+	   command, so the tests already running are kept instead */
+	if (sb.truncated) {
+		mrlog("ext_tests: %s is too long, keeping the previous tests", cfgfile);
+	} else {
+		EnterCriticalSection(&ext_lock);
+		if (ext_cfg) big_free("ext_tests", ext_cfg);
+		ext_cfg = big_strdup("ext_tests", sb.s);
+		ext_workers = extworkers;
+		ext_timeout = exttimeout;
+		ext_kicked = 1;
+		LeaveCriticalSection(&ext_lock);
+	}
+	sb_free(&sb);
+
+	/* Files left by anything else than our own tests, unless
+	   they are picked up as they land */
+	if (!pickup_watching) pickup_locked(mc);
+}
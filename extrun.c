@@ -0,0 +1,391 @@
+#ifdef STANDALONE
+#include "extrun.h"
+#include "standalone.h"
+#else
+#include "mrbig.h"
+#endif
+
+#ifndef _WIN32
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+#ifdef _WIN32
+static long long now_ms(void)
+{
+	return GetTickCount64();
+}
+
+static int proc_start(struct extrun_test *t)
+{
+	STARTUPINFO si;
+	PROCESS_INFORMATION pi;
+	char cmd[EXTRUN_CMD];
+
+	/* CreateProcess may write to the command line */
+	strlcpy(cmd, t->cmd, sizeof cmd);
+	ZeroMemory(&si, sizeof si);
+	ZeroMemory(&pi, sizeof pi);
+	if (!CreateProcess(NULL, cmd, NULL, NULL, FALSE,
+			CREATE_NO_WINDOW|DETACHED_PROCESS,
+			NULL, NULL, &si, &pi)) {
+		mrlog("extrun: CreateProcess failed for %s (%d)",
+			t->cmd, (int)GetLastError());
+		return 0;
+	}
+	CloseHandle(pi.hThread);
+	t->proc = pi.hProcess;
+	return 1;
+}
+
+/* Returns 1 and the exit code if the test has ended */
+static int proc_done(struct extrun_test *t, int *status)
+{
+	DWORD code;
+
+	if (WaitForSingleObject(t->proc, 0) != WAIT_OBJECT_0) return 0;
+	if (!GetExitCodeProcess(t->proc, &code)) code = EXIT_FAILURE;
+	CloseHandle(t->proc);
+	t->proc = NULL;
+	*status = code;
+	return 1;
+}
+
+static void proc_kill(struct extrun_test *t)
+{
+	TerminateProcess(t->proc, EXIT_FAILURE);
+	WaitForSingleObject(t->proc, 1000);
+	CloseHandle(t->proc);
+	t->proc = NULL;
+}
+
+/* Wait until a test ends, or at most ms */
+static void proc_wait(struct extrun *r, long long ms)
+{
+	HANDLE h[EXTRUN_MAXWORKERS];
+	int i, n = 0;
+
+	for (i = 0; i < r->ntests && n < EXTRUN_MAXWORKERS; i++) {
+		if (r->tests[i].started) h[n++] = r->tests[i].proc;
+	}
+	if (n == 0) Sleep((DWORD)ms);
+	else WaitForMultipleObjects(n, h, FALSE, (DWORD)ms);
+}
+#else
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+static int proc_start(struct extrun_test *t)
+{
+	char *argv[] = {"/bin/sh", "-c", t->cmd, NULL};
+	pid_t pid;
+	int err;
+
+	err = posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ);
+	if (err) {
+		mrlog("extrun: posix_spawn failed for %s (%d)", t->cmd, err);
+		return 0;
+	}
+	t->pid = pid;
+	return 1;
+}
+
+static int proc_done(struct extrun_test *t, int *status)
+{
+	int st;
+
+	if (waitpid(t->pid, &st, WNOHANG) != t->pid) return 0;
+	*status = WIFEXITED(st) ? WEXITSTATUS(st) : EXIT_FAILURE;
+	t->pid = 0;
+	return 1;
+}
+
+static void proc_kill(struct extrun_test *t)
+{
+	kill(t->pid, SIGKILL);
+	waitpid(t->pid, NULL, 0);
+	t->pid = 0;
+}
+
+/* There is no waiting for one of several children with a timeout, so
+   look every 10 ms */
+static void proc_wait(struct extrun *r, long long ms)
+{
+	struct timespec ts = {0, 10000000};
+	siginfo_t si;
+	long long until = now_ms()+ms;
+
+	do {
+		si.si_pid = 0;
+		if (waitid(P_ALL, 0, &si, WEXITED|WNOHANG|WNOWAIT) == 0 &&
+				si.si_pid != 0) {
+			return;
+		}
+		nanosleep(&ts, NULL);
+	} while (now_ms() < until);
+}
+#endif
+
+void extrun_init(struct extrun *r, int workers)
+{
+	memset(r, 0, sizeof *r);
+	r->workers = workers;
+}
+
+static void finish(struct extrun *r, struct extrun_test *t, int status)
+{
+	struct extrun_result *res;
+	long long now = now_ms();
+
+	if (r->qlen == EXTRUN_QUEUE) {
+		mrlog("extrun: completion queue full, dropping the result of %s",
+			r->queue[r->qhead].cmd);
+		r->qhead = (r->qhead+1) % EXTRUN_QUEUE;
+		r->qlen--;
+	}
+	res = &r->queue[(r->qhead+r->qlen++) % EXTRUN_QUEUE];
+	strlcpy(res->cmd, t->cmd, sizeof res->cmd);
+	res->status = status;
+	res->ms = t->started ? now-t->started : 0;
+
+	if (t->started) r->running--;
+	t->started = 0;
+	if (t->interval > 0) t->next = now+t->interval*1000LL;
+	else t->next = -1;
+}
+
+/* The configuration is replaced by calling extrun_begin, extrun_add
+   for each line and extrun_end. Tests that stay keep their schedule. */
+void extrun_begin(struct extrun *r)
+{
+	int i;
+
+	for (i = 0; i < r->ntests; i++) r->tests[i].seen = 0;
+}
+
+/* A line is a command, optionally after interval=seconds and
+   timeout=seconds. timeout is the default. */
+void extrun_add(struct extrun *r, char *line, int timeout)
+{
+	struct extrun_test *t;
+	int i, interval = 0, n;
+
+	for (;;) {
+		while (*line == ' ' || *line == '\t') line++;
+		if (sscanf(line, "interval=%d%n", &interval, &n) == 1 ||
+				sscanf(line, "timeout=%d%n", &timeout, &n) == 1) {
+			line += n;
+		} else {
+			break;
+		}
+	}
+	if (*line == '\0' || *line == '#') return;
+
+	for (i = 0; i < r->ntests; i++) {
+		if (!strcmp(r->tests[i].cmd, line)) break;
+	}
+	if (i == r->ntests) {
+		if (r->ntests == r->maxtests) {
+			r->maxtests = r->maxtests ? 2*r->maxtests : 16;
+			r->tests = big_realloc("extrun_add", r->tests,
+				r->maxtests*sizeof *r->tests);
+		}
+		t = &r->tests[r->ntests++];
+		memset(t, 0, sizeof *t);
+		strlcpy(t->cmd, line, sizeof t->cmd);
+		t->next = interval > 0 ? now_ms() : -1;
+	}
+	t = &r->tests[i];
+	if (t->interval == 0 && interval > 0 && !t->started) t->next = now_ms();
+	t->interval = interval;
+	t->timeout = timeout;
+	t->seen = 1;
+}
+
+/* Forget the tests that are no longer configured, except those still
+   running, which are forgotten when they end */
+static void sweep(struct extrun *r)
+{
+	int i, n = 0;
+
+	for (i = 0; i < r->ntests; i++) {
+		if (r->tests[i].seen || r->tests[i].started) {
+			r->tests[n++] = r->tests[i];
+		}
+	}
+	r->ntests = n;
+}
+
+void extrun_end(struct extrun *r)
+{
+	sweep(r);
+}
+
+/* Make the tests without an interval due */
+void extrun_kick(struct extrun *r)
+{
+	long long now = now_ms();
+	int i;
+
+	for (i = 0; i < r->ntests; i++) {
+		struct extrun_test *t = &r->tests[i];
+		if (t->interval > 0) continue;
+		if (t->started) {
+			mrlog("extrun: %s is still running, skipping", t->cmd);
+		} else {
+			t->next = now;
+		}
+	}
+}
+
+/* Collect the tests that ended or ran out of time, and start those
+   that are due. Returns the number of things that happened. */
+static int step(struct extrun *r, long long *wake)
+{
+	struct extrun_test *t;
+	long long now = now_ms(), deadline;
+	int i, status, events = 0, workers;
+
+	for (i = 0; i < r->ntests; i++) {
+		t = &r->tests[i];
+		if (!t->started) continue;
+		if (proc_done(t, &status)) {
+			finish(r, t, status);
+			events++;
+			continue;
+		}
+		if (t->timeout <= 0) continue;
+		deadline = t->started+t->timeout*1000LL;
+		if (now >= deadline) {
+			mrlog("extrun: %s ran for more than %d seconds, killing it",
+				t->cmd, t->timeout);
+			proc_kill(t);
+			finish(r, t, EXTRUN_KILLED);
+			events++;
+		} else if (deadline < *wake) {
+			*wake = deadline;
+		}
+	}
+	if (events) sweep(r);
+
+	workers = r->workers;
+	if (workers < 1) workers = 1;
+	if (workers > EXTRUN_MAXWORKERS) workers = EXTRUN_MAXWORKERS;
+	for (i = 0; i < r->ntests; i++) {
+		t = &r->tests[i];
+		if (t->started || !t->seen || t->next < 0) continue;
+		if (t->next > now) {
+			if (t->next < *wake) *wake = t->next;
+			continue;
+		}
+		if (r->running >= workers) break;
+		if (debug) mrlog("extrun: starting %s", t->cmd);
+		t->started = now;
+		if (proc_start(t)) {
+			r->running++;
+		} else {
+			t->started = 0;
+			finish(r, t, EXTRUN_FAILED);
+		}
+		events++;
+	}
+	return events;
+}
+
+/* Run the tests for at most ms, or until one of them ends or starts.
+   Returns the number of tests running. */
+int extrun_poll(struct extrun *r, int ms)
+{
+	long long until = now_ms()+ms, wake;
+
+	for (;;) {
+		wake = until;
+		if (step(r, &wake) || now_ms() >= until) break;
+		wake -= now_ms();
+		if (wake > 0) proc_wait(r, wake);
+	}
+	return r->running;
+}
+
+/* How long the test that has been running longest has run, in ms,
+   or -1 if none is running */
+long long extrun_longest(struct extrun *r)
+{
+	long long now = now_ms(), ms = -1;
+	int i;
+
+	for (i = 0; i < r->ntests; i++) {
+		if (r->tests[i].started && now-r->tests[i].started > ms) {
+			ms = now-r->tests[i].started;
+		}
+	}
+	return ms;
+}
+
+/* Take the oldest result off the completion queue. Returns 0 if
+   there is none. */
+int extrun_next(struct extrun *r, struct extrun_result *res)
+{
+	if (r->qlen == 0) return 0;
+	*res = r->queue[r->qhead];
+	r->qhead = (r->qhead+1) % EXTRUN_QUEUE;
+	r->qlen--;
+	return 1;
+}
+
+#ifdef STANDALONE
+/*
+Run a few shell commands through the runner: two workers, one test
+that runs too long, one with an interval, and one per kick.
+
+	gcc -O2 -DSTANDALONE -o extrun extrun.c strlcpy.c && ./extrun
+*/
+
+int main(int argc, char **argv)
+{
+	struct extrun r;
+	struct extrun_result res;
+	long long t0 = now_ms();
+	int n = 0, quick = 0, periodic = 0, killed = 0, failed = 0;
+
+	extrun_init(&r, 2);
+	extrun_begin(&r);
+	extrun_add(&r, "timeout=1 sleep 10", 120);
+	extrun_add(&r, "interval=1 true", 120);
+	extrun_add(&r, "sleep 0.2; exit 3", 120);
+	extrun_add(&r, "exit 0", 120);
+	extrun_add(&r, "# not a test", 120);
+	extrun_end(&r);
+	extrun_kick(&r);
+
+	while (now_ms()-t0 < 3500) {
+		extrun_poll(&r, 100);
+		if (r.running && extrun_longest(&r) < 0) failed++;
+		while (extrun_next(&r, &res)) {
+			printf("%5lld ms  %-20s status %d after %lld ms\n",
+				now_ms()-t0, res.cmd, res.status, res.ms);
+			n++;
+			if (!strcmp(res.cmd, "true")) periodic++;
+			else if (!strcmp(res.cmd, "sleep 10")) killed += res.status == EXTRUN_KILLED;
+			else if (!strcmp(res.cmd, "sleep 0.2; exit 3")) quick += res.status == 3;
+			else if (!strcmp(res.cmd, "exit 0")) quick += res.status == 0;
+			else failed++;
+		}
+	}
+	if (killed != 1 || quick != 2 || periodic < 3 || failed) {
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("ok, %d results\n", n);
+	return 0;
+}
+#endif
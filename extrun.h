@@ -0,0 +1,58 @@
+/* The runner behind the ext tests.
+
+Each command from ext.cfg runs as its own process, at most workers at
+a time. A test has its own timeout, after which it is killed, and its
+own interval. A test without an interval runs once for each call to
+extrun_kick, that is once per main loop, as before. Tests that end are
+put on a completion queue, so their results can be picked up as soon
+as they are done instead of after the slowest test.
+
+The runner has no locks of its own: it belongs to the thread that calls
+extrun_poll. Only starting, waiting for and killing processes differ
+between Windows and elsewhere, so it can be tried out with shell
+scripts.
+*/
+
+#define EXTRUN_CMD 1024
+#define EXTRUN_QUEUE 64
+#define EXTRUN_MAXWORKERS 32
+
+#define EXTRUN_KILLED (-1)	/* status of a test that ran out of time */
+#define EXTRUN_FAILED (-2)	/* status of a test that could not start */
+
+struct extrun_test {
+	char cmd[EXTRUN_CMD];
+	int interval;		/* seconds between starts, 0 for each kick */
+	int timeout;		/* seconds, 0 for no limit */
+	long long next;		/* ms, when it is due, -1 for not yet */
+	long long started;	/* ms, 0 when not running */
+	int seen;		/* still in the configuration */
+#ifdef _WIN32
+	HANDLE proc;
+#else
+	int pid;
+#endif
+};
+
+struct extrun_result {
+	char cmd[EXTRUN_CMD];
+	int status;		/* exit code, EXTRUN_KILLED or EXTRUN_FAILED */
+	long long ms;		/* how long it ran */
+};
+
+struct extrun {
+	struct extrun_test *tests;
+	int ntests, maxtests;
+	int workers, running;
+	struct extrun_result queue[EXTRUN_QUEUE];
+	int qhead, qlen;
+};
+
+extern void extrun_init(struct extrun *r, int workers);
+extern void extrun_begin(struct extrun *r);
+extern void extrun_add(struct extrun *r, char *line, int timeout);
+extern void extrun_end(struct extrun *r);
+extern void extrun_kick(struct extrun *r);
+extern int extrun_poll(struct extrun *r, int ms);
+extern int extrun_next(struct extrun *r, struct extrun_result *res);
+extern long long extrun_longest(struct extrun *r);
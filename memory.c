@@ -22,27 +22,26 @@ green Thu Nov 13 13:35:25 CET 2008 - Memory OK
 */
 
 
-static void append_limits(char *a, size_t n)
+static void append_limits(struct sbuf *a)
 {
-	snprcat(a, n, "\nLimits:\n");
-	snprcat(a, n, "Yellow RAM: %d\n", memyellow);
-	snprcat(a, n, "Red RAM: %d\n", memred);
+	sb_printf(a, "\nLimits:\n");
+	sb_printf(a, "Yellow RAM: %d\n", memyellow);
+	sb_printf(a, "Red RAM: %d\n", memred);
 }
 
-void memory(void)
+void memory(struct mrcfg *mc)
 {
-	char b[5000];
-	int n = sizeof b;
+	struct sbuf b;
 	char *color = "green";
 	MEMORYSTATUSEX statex;
 	DWORD memusage;
 	double pused, ptotal, sused, stotal;
 	int ppct, spct;
 
-	if (debug > 1) mrlog("memory(%p, %d)", b, n);
+	if (debug > 1) mrlog("memory()");
 
-	if (get_option("no_memory", 0)) {
-		mrsend(mrmachine, "memory", "clear", "option no_memory\n");
+	if (get_option(mc, "no_memory", 0)) {
+		mrsend(mc->machine, "memory", "clear", "option no_memory\n");
 		return;
 	}
 
@@ -68,13 +67,13 @@ void memory(void)
 	ppct = 100*pused/ptotal;
 	spct = 100*sused/stotal;
 
-	b[0] = '\0';
-	snprcat(b, n,
+	sb_init(&b, 0);
+	sb_printf(&b,
 		"%s\n\n"
 		"   Memory              Used       Total  Percentage\n"
 		"&%s Physical           %.0fM       %.0fM         %d%%\n"
 		"&%s Swap               %.0fM       %.0fM         %d%%\n",
-		now,
+		mc->now,
 		color, pused/1024/1024, ptotal/1024/1024, ppct,
 		"green", sused/1024/1024, stotal/1024/1024, spct);
 #if 0
@@ -94,7 +93,8 @@ void memory(void)
 		WIDTH, (double)statex.ullAvailVirtual,
 #endif
 #endif
-	append_limits(b, n);
-	mrsend(mrmachine, "memory", color, b);
+	append_limits(&b);
+	mrsendn(mc->machine, "memory", color, b.s, b.len);
+	sb_free(&b);
 }
 
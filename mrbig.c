@@ -4,28 +4,31 @@
 #define MEMSIZE 4
 #define PATTERN_SIZE (sizeof big_pattern)
 #define CHUNKS_MAX 10000
+#define SEND_MAXBUF 3	/* header, message, truncation marker */
 
 static char cfgfile[256];
-char mrmachine[256], bind_addr[256] = "0.0.0.0";
+char bind_addr[256] = "0.0.0.0";
 static struct display {
 	struct sockaddr_in in_addr;
 	int s;
-	char* pdata;
+	WSABUF buf[SEND_MAXBUF];	/* what is left to send */
+	DWORD first, nbuf;
 	int remaining;
 	struct display *next;
 } *mrdisplay;
-char cfgdir[256];
-char pickupdir[256];
-char now[1024];
+static char cfgdir[256];	/* where mrbig.exe is, the default cfgdir */
+static struct mrcfg *mrcfg;	/* the configuration of the current loop */
 static FILE *logfp = NULL;
-static int mrport, mrsleep, mrloop;
+static char logfile[256];
+static int mrport, mrsleep, mrloop, mrworkers, mrsplay, mrjitter, kbinterval, cmdtimeout;
 int bootyellow, bootred;
 double dfyellow, dfred;
-int cpuyellow, cpured;
+int cpuyellow, cpured, cpusample;
 int memyellow, memred;
 int debug = 0;
 int dirsep;
-int msgage;
+int msgage, msgworkers;
+int extworkers, exttimeout;
 int memsize = MEMSIZE;
 int standalone = 0;
 int report_size = 16384;
@@ -33,6 +36,22 @@ int report_size = 16384;
 /* nosy memory management */
 static int debug_memory = 0;
 
+/* The collectors run concurrently on the worker pool (pool.c).
+   cfg_lock protects the configuration, displays and test status;
+   mem_lock protects the chunk and file tables; log_lock protects
+   logfp. All are recursive. */
+static CRITICAL_SECTION cfg_lock, mem_lock, log_lock;
+
+void lock_cfg(void)
+{
+	EnterCriticalSection(&cfg_lock);
+}
+
+void unlock_cfg(void)
+{
+	LeaveCriticalSection(&cfg_lock);
+}
+
 struct memchunk {
 	void *p;
 	size_t n;
@@ -62,14 +81,34 @@ void mrlog(char *fmt, ...)
 {
 	FILE *fp;
 	va_list ap;
+
+	EnterCriticalSection(&log_lock);
 	if (standalone) fp = stderr;
 	else fp = logfp;
-	if (!fp) return;
-	va_start(ap, fmt);
-	vfprintf(fp, fmt, ap);
-	va_end(ap);
-	fprintf(fp, "\n");
-	fflush(fp);
+	if (fp) {
+		va_start(ap, fmt);
+		vfprintf(fp, fmt, ap);
+		va_end(ap);
+		fprintf(fp, "\n");
+		fflush(fp);
+	}
+	LeaveCriticalSection(&log_lock);
+}
+
+/* Open the log file when its name has changed. The old file is closed
+   once nobody can be writing to it any longer. */
+static void set_logfile(char *name)
+{
+	FILE *fp = NULL, *old;
+
+	if (!strcmp(name, logfile)) return;
+	if (name[0]) fp = big_fopen("set_logfile", name, "a");
+	EnterCriticalSection(&log_lock);
+	old = logfp;
+	logfp = fp;
+	strlcpy(logfile, name, sizeof logfile);
+	LeaveCriticalSection(&log_lock);
+	if (old) big_fclose("set_logfile", old);
 }
 
 #if 1
@@ -98,7 +137,10 @@ static void mrexit(char *reason, int status)
 {
 	mrlog("mrexit(%s, %d)", reason, status);
 	startup_log("mrexit(%s, %d)", reason, status);
+	EnterCriticalSection(&log_lock);
 	if (logfp) fclose(logfp);
+	logfp = NULL;
+	LeaveCriticalSection(&log_lock);
 	exit(status);
 }
 
@@ -126,11 +168,13 @@ void check_chunks(char *msg)
 {
 	int i, corrupt = 0;
 	if (debug) mrlog("check_chunks(%s)", msg);
+	EnterCriticalSection(&mem_lock);
 	for (i = 0; i < CHUNKS_MAX; i++) {
 		if (chunks[i].p) {
 			corrupt |= check_chunk(i);
 		}
 	}
+	LeaveCriticalSection(&mem_lock);
 	if (corrupt) {
 		mrlog("Memory corruption detected");
 		mrexit("check_chunks found memory corruption", EXIT_FAILURE);
@@ -145,6 +189,7 @@ static void dump_chunks(void)
 
 	mrlog("Chunks:");
 	n = 0;
+	EnterCriticalSection(&mem_lock);
 	for (i = 0; i < CHUNKS_MAX; i++) {
 		if (chunks[i].p) {
 			mrlog("%d: '%s' (%p) %ld bytes", i,
@@ -152,6 +197,7 @@ static void dump_chunks(void)
 			n++;
 		}
 	}
+	LeaveCriticalSection(&mem_lock);
 	mrlog("Total %d chunks", n);
 }
 
@@ -161,6 +207,7 @@ static void store_chunk(void *p, size_t n, char *cl)
 
 	if (!debug_memory) return;
 
+	EnterCriticalSection(&mem_lock);
 	for (i = 0; i < CHUNKS_MAX; i++)
 		if (chunks[i].p == NULL) break;
 	if (i == CHUNKS_MAX) {
@@ -176,6 +223,7 @@ mrlog("In store_chunk: i = %d", i);
 	strlcpy(chunks[i].cl, cl, 20);
 mrlog("In store_chunk: i = %d", i);
 	memcpy(p+n-PATTERN_SIZE, big_pattern, PATTERN_SIZE);
+	LeaveCriticalSection(&mem_lock);
 }
 
 static void remove_chunk(void *p, char *cl)
@@ -184,6 +232,7 @@ static void remove_chunk(void *p, char *cl)
 
 	if (!debug_memory) return;
 
+	EnterCriticalSection(&mem_lock);
 	for (i = 0; i < CHUNKS_MAX; i++)
 		if (chunks[i].p == p) break;
 	if (i == CHUNKS_MAX) {
@@ -198,6 +247,7 @@ static void remove_chunk(void *p, char *cl)
 			p, chunks[i].cl, i);
 	}
 	chunks[i].p = NULL;
+	LeaveCriticalSection(&mem_lock);
 }
 
 void *big_malloc(char *p, size_t n)
@@ -299,6 +349,7 @@ static void store_file(FILE *p, char *cl)
 	if (debug < 2) return;
 	mrlog("store_file(%p, %s)", p, cl);
 
+	EnterCriticalSection(&mem_lock);
 	for (i = 0; i < 100; i++)
 		if (files[i].p == NULL) break;
 	if (i == 100) {
@@ -310,6 +361,7 @@ static void store_file(FILE *p, char *cl)
 	dump_files();
 	files[i].p = p;
 	strlcpy(files[i].cl, cl, 20);
+	LeaveCriticalSection(&mem_lock);
 }
 
 static void remove_file(FILE *p)
@@ -319,6 +371,7 @@ static void remove_file(FILE *p)
 	if (debug < 2) return;
 
 	mrlog("remove_file(%p)", p);
+	EnterCriticalSection(&mem_lock);
 	for (i = 0; i < 100; i++)
 		if (files[i].p == p) break;
 	if (i == 100) {
@@ -329,6 +382,7 @@ static void remove_file(FILE *p)
 	mrlog("Removing file %p (%s) from slot %d", p, files[i].cl, i);
 	dump_files();
 	files[i].p = NULL;
+	LeaveCriticalSection(&mem_lock);
 }
 
 
@@ -370,6 +424,18 @@ void no_return(char *p)
 	*q = '\0';
 }
 
+/* FNV-1a */
+unsigned long strhash(const char *p)
+{
+	unsigned long h = 2166136261UL;
+
+	while (*p) {
+		h ^= (unsigned char)*p++;
+		h *= 16777619UL;
+	}
+	return h & 0xffffffffUL;
+}
+
 int snprcat(char *str, size_t size, const char *fmt, ...)
 {
 	int n, r;
@@ -391,30 +457,32 @@ struct gracetime {
 struct option {
 	char *name;
 	struct option *next;
-} *options;
+};
 
-char *get_option(char *n, int partial)
+/* The options belong to the loop's configuration, which doesn't
+   change, so no locking is needed */
+char *get_option(struct mrcfg *mc, char *n, int partial)
 {
 	struct option *o;
 	int l = strlen(n);
 
-	for (o = options; o; o = o->next) {
+	for (o = mc->options; o; o = o->next) {
 		if ((partial && !strncmp(n, o->name, l))
-			|| !strcmp(n, o->name)) return o->name;
+			|| !strcmp(n, o->name)) break;
 	}
-	return NULL;
+	return o ? o->name : NULL;
 }
 
-static struct option *insert_option(char *n)
+static struct option *insert_option(struct mrcfg *mc, char *n)
 {
 	struct option *o = big_malloc("insert_option", sizeof *o);
 	o->name = big_strdup("insert_option", n);
-	o->next = options;
-	options = o;
+	o->next = mc->options;
+	mc->options = o;
 	return o;
 }
 
-static void free_options(void)
+static void free_options(struct option *options)
 {
 	struct option *o;
 
@@ -425,6 +493,41 @@ static void free_options(void)
 	}
 }
 
+/* A reference to the configuration of the current loop. mrbig()
+   only replaces it between loops, so every test started by a loop
+   gets that loop's configuration, and keeps it if it runs into the
+   next one. */
+struct mrcfg *mrcfg_get(void)
+{
+	struct mrcfg *mc;
+
+	lock_cfg();
+	mc = mrcfg;
+	InterlockedIncrement(&mc->refs);
+	unlock_cfg();
+	return mc;
+}
+
+void mrcfg_release(struct mrcfg *mc)
+{
+	if (InterlockedDecrement(&mc->refs) == 0) {
+		free_options(mc->options);
+		big_free("mrcfg_release", mc);
+	}
+}
+
+static void mrcfg_publish(struct mrcfg *mc)
+{
+	struct mrcfg *old;
+
+	InterlockedIncrement(&mc->refs);
+	lock_cfg();
+	old = mrcfg;
+	mrcfg = mc;
+	unlock_cfg();
+	if (old) mrcfg_release(old);
+}
+
 static void insert_grace(char *test, time_t grace)
 {
         struct gracetime *gt = big_malloc("insert_grace", sizeof *gt);
@@ -456,16 +559,58 @@ static time_t lookup_grace(char *test)
         return 0;
 }
 
-static void readcfg(void)
+static void run_clientlog(struct mrcfg *mc);
+
+static void run_test(void *arg)
+{
+	struct mrcfg *mc = mrcfg_get();
+
+	((void (*)(struct mrcfg *))arg)(mc);
+	mrcfg_release(mc);
+}
+
+/* The tests run by the main loop, in the order they are queued */
+static struct pool_job tests[] = {
+	{"clientlog", run_test, (void *)run_clientlog},
+	{"cpu", run_test, (void *)cpu},
+	{"disk", run_test, (void *)disk},
+	{"memory", run_test, (void *)memory},
+	{"msgs", run_test, (void *)msgs},
+	{"procs", run_test, (void *)procs},
+	{"svcs", run_test, (void *)svcs},
+	{"wmi", run_test, (void *)wmi}
+};
+
+#define NTESTS (sizeof tests / sizeof tests[0])
+
+static void set_budget(char *test, int budget)
+{
+	int i;
+
+	for (i = 0; i < NTESTS; i++) {
+		if (!strcmp(test, tests[i].name)) {
+			tests[i].budget = budget;
+			return;
+		}
+	}
+	mrlog("No test '%s' to set a budget for", test);
+}
+
+/* Fill in mc and set the globals. Called with the cfg lock held. */
+static void readcfg(struct mrcfg *mc)
 {
-	char b[256], key[256], value[256], *p;
+	char b[256], key[256], value[256], log[256], *p;
 	struct display *mp;
 	int i;
 
 	if (debug > 1) mrlog("readcfg()");
 
 	/* Set all defaults */
-	strlcpy(mrmachine, "localhost", sizeof mrmachine);
+	strlcpy(mc->machine, "localhost", sizeof mc->machine);
+	strlcpy(mc->cfgdir, cfgdir, sizeof mc->cfgdir);
+	mc->pickupdir[0] = '\0';
+	mc->options = NULL;
+	log[0] = '\0';
 	mrport = 1984;
 	while (mrdisplay) {
 		mp = mrdisplay;
@@ -473,7 +618,6 @@ static void readcfg(void)
 		big_free("readcfg: display", mp);
 	}
 	free_grace();
-	free_options();
 	mrsleep = 300;
 	mrloop = INT_MAX;
 	bootyellow = 60;
@@ -482,19 +626,26 @@ static void readcfg(void)
 	dfred = 95;
 	cpuyellow = 80;
 	cpured = 90;
+	cpusample = 5;
+	kbinterval = 21600;
+	cmdtimeout = 10;
 	memyellow = 100;
 	memred = 100;
 	msgage = 3600;
+	msgworkers = 4;
+	extworkers = 4;
+	exttimeout = 120;
 	memsize = MEMSIZE;
-	pickupdir[0] = '\0';
-	if (logfp) big_fclose("readcfg:logfile", logfp);
-	logfp = NULL;
+	mrworkers = 4;
+	mrsplay = 1;
+	mrjitter = 0;
+	for (i = 0; i < NTESTS; i++) tests[i].budget = -1;
 
 	for (i = 0; get_cfg("mrbig", b, sizeof b, i); i++) {
 		if (b[0] == '#') continue;
 		if (sscanf(b, "%s %[^\n]", key, value) == 2) {
 			if (!strcmp(key, "machine")) {
-				strlcpy(mrmachine, value, sizeof mrmachine);
+				strlcpy(mc->machine, value, sizeof mc->machine);
 			} else if (!strcmp(key, "port")) {
 				mrport = atoi(value);
 			} else if (!strcmp(key, "display")) {
@@ -525,6 +676,12 @@ static void readcfg(void)
 				cpuyellow = atoi(value);
 			} else if (!strcmp(key, "cpured")) {
 				cpured = atoi(value);
+			} else if (!strcmp(key, "cpusample")) {
+				cpusample = atoi(value);
+			} else if (!strcmp(key, "kbinterval")) {
+				kbinterval = atoi(value);
+			} else if (!strcmp(key, "cmdtimeout")) {
+				cmdtimeout = atoi(value);
 			} else if (!strcmp(key, "dfyellow")) {
 				dfyellow = atof(value);
 			} else if (!strcmp(key, "dfred")) {
@@ -534,13 +691,19 @@ static void readcfg(void)
 			} else if (!strcmp(key, "memred")) {
 				memred = atof(value);
 			} else if (!strcmp(key, "cfgdir")) {
-				strlcpy(cfgdir, value, sizeof cfgdir);
+				strlcpy(mc->cfgdir, value, sizeof mc->cfgdir);
 			} else if (!strcmp(key, "msgage")) {
 				msgage = atoi(value);
+			} else if (!strcmp(key, "msgworkers")) {
+				msgworkers = atoi(value);
+			} else if (!strcmp(key, "extworkers")) {
+				extworkers = atoi(value);
+			} else if (!strcmp(key, "exttimeout")) {
+				exttimeout = atoi(value);
 			} else if (!strcmp(key, "pickupdir")) {
-				strlcpy(pickupdir, value, sizeof pickupdir);
+				strlcpy(mc->pickupdir, value, sizeof mc->pickupdir);
 			} else if (!strcmp(key, "logfile")) {
-				logfp = big_fopen("readcfg:logfile", value, "a");
+				strlcpy(log, value, sizeof log);
 			} else if (!strcmp(key, "gracetime")) {
 				char test[1000];
 				int grace = 0;
@@ -549,9 +712,20 @@ static void readcfg(void)
 			} else if (!strcmp(key, "report_size")) {
 				report_size = atoi(value);
 			} else if (!strcmp(key, "option")) {
-				insert_option(value);
+				insert_option(mc, value);
 			} else if (!strcmp(key, "memsize")) {
 				memsize = atoi(value);
+			} else if (!strcmp(key, "workers")) {
+				mrworkers = atoi(value);
+			} else if (!strcmp(key, "splay")) {
+				mrsplay = atoi(value);
+			} else if (!strcmp(key, "jitter")) {
+				mrjitter = atoi(value);
+			} else if (!strcmp(key, "budget")) {
+				char test[1000];
+				int budget = 0;
+				sscanf(value, "%s %d", test, &budget);
+				set_budget(test, budget);
 			} else if (!strcmp(key, "set")) {
 				char key[1000], value[1000];
 				key[0] = value[0] = '\0';
@@ -562,12 +736,34 @@ static void readcfg(void)
 	}
 
 	/* Replace . with , in fqdn (historical reasons) */
-	for (p = mrmachine; *p; p++) {
+	for (p = mc->machine; *p; p++) {
 		if (*p == '.') *p = ',';
 	}
 
+	set_logfile(log);
+
 	/* Make sure the main loop executes at least every mrsleep seconds */
 	if (mrloop > mrsleep) mrloop = mrsleep;
+
+	/* Jitter is only there to blur the edges of the schedule */
+	if (mrjitter > mrloop/2) mrjitter = mrloop/2;
+	if (mrjitter < 0) mrjitter = 0;
+
+	/* Negative intervals would wrap around in clientlog and stop the
+	   searches for updates altogether */
+	if (kbinterval <= 0) {
+		mrlog("kbinterval %d is not valid, using 21600", kbinterval);
+		kbinterval = 21600;
+	}
+
+	/* ipconfig and route get at least a second */
+	if (cmdtimeout < 1) cmdtimeout = 1;
+
+	/* Unless configured otherwise, no test may hold up the main loop
+	   for longer than the loop itself */
+	for (i = 0; i < NTESTS; i++) {
+		if (tests[i].budget < 0) tests[i].budget = mrloop;
+	}
 }
 
 static WSADATA wsaData;
@@ -727,15 +923,48 @@ and only send something if the colour has changed for this test
 *or* the bbsleep time is exceeded. Then we can run the main loop
 as often as we want without putting any more load on the bbd.
 */
-void send_update(char *p) {
+/* The socket state lives in the display nodes, so every caller gets
+   its own copy of the list. That way several tests can send at once
+   and readcfg can replace mrdisplay while they do. */
+static struct display *copy_displays(void)
+{
+    struct display *mp, *dl = NULL, *d;
+
+    lock_cfg();
+    for (mp = mrdisplay; mp; mp = mp->next) {
+        d = big_malloc("copy_displays", sizeof *d);
+        d->in_addr = mp->in_addr;
+        d->s = -1;
+        d->next = dl;
+        dl = d;
+    }
+    unlock_cfg();
+    return dl;
+}
+
+static void free_displays(struct display *dl)
+{
     struct display *mp;
+
+    while ((mp = dl)) {
+        dl = mp->next;
+        big_free("free_displays", mp);
+    }
+}
+
+/* Send the concatenation of buf[0..nbuf-1] to every display, without
+   gluing the pieces together first. */
+static void send_update(WSABUF *buf, DWORD nbuf) {
+    struct display *mp, *displays;
     struct sockaddr_in my_addr;
     struct linger l_optval;
     unsigned long nonblock;
+    DWORD i;
 
     if (!start_winsock()) return;
 
-    for (mp = mrdisplay; mp; mp = mp->next) {
+    displays = copy_displays();
+    for (mp = displays; mp; mp = mp->next) {
         mp->s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
         if (mp->s == -1) {
             mrlog("send_update: socket failed: %d", WSAGetLastError());
@@ -784,8 +1013,11 @@ void send_update(char *p) {
             }
         }
 
-        mp->pdata = p;
-        mp->remaining = strlen(p);
+        memcpy(mp->buf, buf, nbuf * sizeof *buf);
+        mp->first = 0;
+        mp->nbuf = nbuf;
+        mp->remaining = 0;
+        for (i = 0; i < nbuf; i++) mp->remaining += buf[i].len;
     }
 
     time_t start_time = time(NULL);
@@ -793,13 +1025,13 @@ void send_update(char *p) {
     for (;;) {
         struct timeval timeo;
         fd_set wfds;
-        int len;
+        DWORD len;
         int tot_remaining;
         timeo.tv_sec = 1;
         timeo.tv_usec = 0;
         FD_ZERO(&wfds);
         tot_remaining = 0;
-        for (mp = mrdisplay; mp; mp = mp->next) {
+        for (mp = displays; mp; mp = mp->next) {
             if (mp->s != -1) {
                 if (mp->remaining > 0) {
                     FD_SET(mp->s, &wfds);
@@ -817,15 +1049,24 @@ void send_update(char *p) {
             goto cleanup;
         }
         select(255 /* ignored on winsock */, NULL, &wfds, NULL, &timeo);
-        for (mp = mrdisplay; mp; mp = mp->next) {
+        for (mp = displays; mp; mp = mp->next) {
             if (mp->s != -1) {
                 if (mp->remaining > 0) {
-                    len = send(mp->s, mp->pdata, mp->remaining, 0);
-                    if (len == SOCKET_ERROR) {
+                    if (WSASend(mp->s, mp->buf+mp->first, mp->nbuf-mp->first,
+                                &len, 0, NULL, NULL) == SOCKET_ERROR) {
                         continue;
                     }
-                    mp->pdata += len;
                     mp->remaining -= len;
+                    while (len > 0 && mp->first < mp->nbuf) {
+                        WSABUF *b = &mp->buf[mp->first];
+                        if (len < b->len) {
+                            b->buf += len;
+                            b->len -= len;
+                            break;
+                        }
+                        len -= b->len;
+                        mp->first++;
+                    }
                     if (mp->remaining == 0) {
                         shutdown(mp->s, SD_BOTH);
                     }
@@ -837,13 +1078,13 @@ void send_update(char *p) {
 cleanup:
 
     /* initiate socket shutdowns */
-    for (mp = mrdisplay; mp; mp = mp->next) {
+    for (mp = displays; mp; mp = mp->next) {
         if (mp->s != -1) {
             shutdown(mp->s, SD_BOTH);
         }
     }
     /* gracefully terminate sockets, finally applying force */
-    for (mp = mrdisplay; mp; mp = mp->next) {
+    for (mp = displays; mp; mp = mp->next) {
         int i;
         if (mp->s != -1) {
             for (i = 0; i < 10; i++) {
@@ -859,44 +1100,81 @@ cleanup:
             mp->s = -1;
         }
     }
+    free_displays(displays);
 }
 
 /*	Send a status update. The format is:
     	status [machine],[domain],[tld].[test] [colour] [message]
-	Color may be one of: "green", "yellow", "red", "clear". */
-void mrsend(char *machine, char *test, char *color, char *message)
+	Color may be one of: "green", "yellow", "red", "clear".
+	Len is the length of the message, which an sbuf already knows. */
+void mrsendn(char *machine, char *test, char *color, char *message, size_t len)
 {
-	char *p = NULL;
-	int is;
+	char head[1024];
+	WSABUF buf[SEND_MAXBUF];
+	DWORD nbuf;
+	size_t max;
+	int n, is;
 
-	if (debug > 1) mrlog("mrsend(%s, %s, %s, %s)", machine, test, color, message);
+	if (debug > 1) mrlog("mrsendn(%s, %s, %s, %s)", machine, test, color, message);
 
+	lock_cfg();
 	is = insert_status(machine, test, color);
+	unlock_cfg();
 	if (is == 0) {
 		if (debug) mrlog("mrsend: no change, nothing to do");
 		return;
 	}
 
-	/* Prepare the report */
-	p = big_malloc("mrsend()", report_size+1);
-	p[0] = '\0';
-	if (is == 1) {
-		snprcat(p, report_size, "status %s.%s green %s",
-				machine, test, message);
-	} else {
-		snprcat(p, report_size, "status %s.%s %s %s",
-				machine, test, color, message);
+	/* Only the header is formatted; the message goes out as it is */
+	n = snprintf(head, sizeof head, "status %s.%s %s ",
+			machine, test, is == 1 ? "green" : color);
+	if (n < 0 || n >= sizeof head) n = strlen(head);
+	buf[0].buf = head;
+	buf[0].len = n;
+	buf[1].buf = message;
+	buf[1].len = len;
+	nbuf = 2;
+
+	/* Same limit as the reports themselves */
+	max = report_size > n+sizeof SBUF_MARKER ? report_size-n : sizeof SBUF_MARKER;
+	if (len >= max) {
+		if (debug) mrlog("mrsend: %s.%s cut off at %d bytes", machine, test, report_size);
+		buf[1].len = max-sizeof SBUF_MARKER;
+		buf[2].buf = SBUF_MARKER;
+		buf[2].len = sizeof SBUF_MARKER - 1;
+		nbuf = 3;
 	}
-    send_update(p);
-	big_free("mrsend()", p);
+	send_update(buf, nbuf);
+}
+
+/* The same for a message of unknown length */
+void mrsend(char *machine, char *test, char *color, char *message)
+{
+	mrsendn(machine, test, color, message, strlen(message));
 }
 
 /*	Send an update for clientlog style messages, which have logic configured serverside. 
 	The format is:
 		client [machine],[domain],[tld].[os] [os] [message] */
-void mrsend_clientlog(char *machine, char *message) {
-    if (debug > 1) mrlog("mrsend_clientlog(%s, ...)", machine);
-    send_update(message);
+void mrsend_clientlog(char *machine, char *message, size_t len) {
+    WSABUF buf;
+
+    if (debug > 1) mrlog("mrsend_clientlog(%s, %ld bytes)", machine, (long)len);
+    buf.buf = message;
+    buf.len = len;
+    send_update(&buf, 1);
+}
+
+static void run_clientlog(struct mrcfg *mc)
+{
+	char kbcache[256];
+
+	/* The KB inventory is collected in the background, clientlog
+	   only reports the latest one */
+	kbcache[0] = '\0';
+	snprcat(kbcache, sizeof kbcache, "%s%c%s", mc->cfgdir, dirsep, "kbs.cache");
+	clog_kbs_Start(kbcache, kbinterval);
+	clientlog(mc->machine, cmdtimeout*1000, &mrsend_clientlog, debug ? &mrlog : (void (*)(char *,...))NULL);
 }
 
 #ifdef _WIN64
@@ -972,8 +1250,30 @@ VectoredExceptionHandler(PEXCEPTION_POINTERS ExceptionInfo) {
 	return EXCEPTION_CONTINUE_SEARCH;
 };
 
+/*
+Seconds from t until the next start of the main loop on this host.
+
+The loop starts are laid out on a grid mrloop seconds apart, offset
+from the epoch by a phase derived from the machine name. Agents that
+were started at the same moment (power failure, mass deployment)
+therefore still spread their reports evenly over the interval instead
+of reaching the bbd in the same second, and since the grid does not
+depend on how long the tests took, each host keeps its exact period.
+A loop can never start twice in the same slot, so SLEEP_MIN is not
+needed to keep us from spinning.
+*/
+static int next_slot(char *machine, time_t t)
+{
+	time_t phase, next;
+
+	phase = strhash(machine) % mrloop;
+	next = ((t-phase)/mrloop+1)*mrloop+phase;
+	return next-t;
+}
+
 void mrbig(void)
 {
+	struct mrcfg *mc;
 	char *p;
 	time_t t, lastrun;
 	int sleeptime, i;
@@ -1004,46 +1304,34 @@ void mrbig(void)
 	for (i = 0; _environ[i]; i++) {
 		startup_log("%s", _environ[i]);
 	}
+	srand(time(NULL) ^ GetCurrentProcessId());
+	cpuload_start();
 	for (;;) {
 		if (debug) mrlog("main loop");
+		mc = big_malloc("mrbig (mrcfg)", sizeof *mc);
+		mc->refs = 1;	/* our own reference */
+		lock_cfg();
 		read_cfg("mrbig", cfgfile);
-		readcfg();
+		readcfg(mc);
+		unlock_cfg();
 		t = time(NULL);
-		strlcpy(now, ctime(&t), sizeof now);
-		p = strchr(now, '\n');
+		strlcpy(mc->now, ctime(&t), sizeof mc->now);
+		p = strchr(mc->now, '\n');
 		if (p) *p = '\0';
 		hostsize = sizeof hostname;
 		if (GetComputerName(hostname, &hostsize)) {
 			for (i = 0; hostname[i]; i++)
 				hostname[i] = tolower(hostname[i]);
-			snprcat(now, sizeof now, " [%s]", hostname);
+			snprcat(mc->now, sizeof mc->now, " [%s]", hostname);
 		}
+		mrcfg_publish(mc);
 
-        clientlog(mrmachine, &mrsend_clientlog, debug ? &mrlog : (void (*)(char *,...))NULL);
-        check_chunks("after clientlog test");
-
-		cpu();
-		check_chunks("after cpu test");
-
-		disk();
-		check_chunks("after disk test");
-
-		memory();
-		check_chunks("after memory test");
-
-		msgs();
-		check_chunks("after msgs test");
-
-		procs();
-		check_chunks("after procs test");
-
-		svcs();
-		check_chunks("after svcs test");
-
-		wmi();
-		check_chunks("after wmi test");
+		/* procs, cpu and clientlog share one process list per loop */
+		clog_procsnap_Release(clog_procsnap_Refresh());
+		pool_run(tests, NTESTS, mrworkers);
+		check_chunks("after tests");
 
-		if (pickupdir[0]) ext_tests();
+		if (mc->pickupdir[0]) ext_tests(mc);
 
 		lastrun = t;
 		t = time(NULL);
@@ -1051,13 +1339,17 @@ void mrbig(void)
 			mrlog("mainloop: timewarp detected, sleep for %d",
 				mrloop);
 			sleeptime = mrloop;
+		} else if (mrsplay && mrloop >= SLEEP_MIN) {
+			sleeptime = next_slot(mc->machine, t);
 		} else {
 			sleeptime = mrloop-(t-lastrun);
+			if (sleeptime < SLEEP_MIN) sleeptime = SLEEP_MIN;
 		}
-		if (sleeptime < SLEEP_MIN) sleeptime = SLEEP_MIN;
+		if (mrjitter) sleeptime += rand() % (mrjitter+1);
 		if (debug) mrlog("started at %d, finished at %d, sleep for %d",
 			(int)lastrun, (int)t, sleeptime);
 		clear_cfg();
+		mrcfg_release(mc);
 		if (debug) {
 			dump_chunks();
 			check_chunks("after main loop");
@@ -1085,6 +1377,9 @@ int main(int argc, char **argv)
 	char *p;
 
 	startup_log("main()");
+	InitializeCriticalSection(&cfg_lock);
+	InitializeCriticalSection(&mem_lock);
+	InitializeCriticalSection(&log_lock);
 	dirsep = '\\';
 	GetModuleFileName(NULL, cfgdir, sizeof cfgdir);
 	startup_log("cfgdir = '%s'", cfgdir);
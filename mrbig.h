@@ -9,6 +9,7 @@
 #include <limits.h>
 #include <tlhelp32.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <time.h>
 #include <stdint.h>
@@ -16,49 +17,112 @@
 #include <ctype.h>
 #include <inttypes.h>
 #include "clientlog/clientlog.h"
+#include "clientlog/procsnap.h"
 
 /* Never sleep for less than 10 seconds */
 #define SLEEP_MIN (10)
 
+/* from perfdata.c */
+#include "perfdata.h"
+
+/* from cpuload.c */
+#include "cpuload.h"
+
+/* from extrun.c */
+#include "extrun.h"
+
+/* from dirwatch.c */
+#include "dirwatch.h"
+
 /* from readperf.c */
-struct perfcounter {
-	char *instance;
-	uint64_t *value;
+struct perfsnap {
+	PERF_DATA_BLOCK *bp;
+	DWORD len;
+};
+/* A buffer for one query, kept between calls */
+struct perfbuf {
+	char *query;
+	BYTE *data;
+	DWORD size;
+	struct perfbuf *next;
 };
+extern PERF_DATA_BLOCK *read_perfbuf(struct perfbuf *pb, DWORD *len);
+extern PERF_DATA_BLOCK *read_perfdata(char *query, DWORD *len);
+extern int perfsnap_take(struct perfsnap *ps, DWORD *objects);
+extern PERF_OBJECT_TYPE *perfsnap_object(struct perfsnap *ps, DWORD object);
+extern struct perfcounter *perfsnap_counters(struct perfsnap *ps, DWORD object,
+			DWORD *counters, long long *perf_time, long long *perf_freq);
 extern struct perfcounter *read_perfcounters(DWORD object, DWORD *counters,
 			long long *perf_time, long long *perf_freq);
-extern void free_perfcounters(struct perfcounter *pc);
-extern void print_perfcounters(struct perfcounter *pc, int ncounters);
+
+/* from evlog.c */
+#include "evlog.h"
+
+/* from msgrules.c */
+#include "msgrules.h"
 
 /* from readlog.c */
-struct event {
-	time_t gtime, wtime;
-	long long record, id;
-	long type;
-	char *source;
-	char *message;
-	struct event *next;
+extern int read_log(struct logstate *ls, int maxage, int fast,
+			struct evlog_provider *pv);
+
+/* from sbuf.c */
+#define SBUF_CHUNK 1024
+#define SBUF_MARKER "\n[truncated]\n"
+struct sbuf {
+	char *s;
+	size_t len, size, max;
+	int truncated;
+};
+extern void sb_init(struct sbuf *sb, size_t max);
+extern int sb_vprintf(struct sbuf *sb, const char *fmt, va_list ap);
+extern int sb_printf(struct sbuf *sb, const char *fmt, ...);
+extern void sb_free(struct sbuf *sb);
+
+/* from pool.c */
+#define POOL_IDLE 0
+#define POOL_QUEUED 1
+#define POOL_RUNNING 2
+struct pool_job {
+	char *name;
+	void (*fn)(void *);
+	void *arg;
+	int budget;		/* seconds, 0 means no limit */
+	volatile LONG state;
+	volatile DWORD started;	/* set before the job is POOL_RUNNING */
+};
+extern int pool_run(struct pool_job *jobs, int njobs, int nworkers);
+
+/* from mrbig.c */
+/* The configuration of one main loop. Nothing changes it once readcfg
+   has filled it in, and it lives as long as somebody holds a
+   reference, so a test that runs into the next loop keeps using the
+   values it started with. */
+struct mrcfg {
+	volatile LONG refs;
+	char machine[256];
+	char now[1024];		/* time and host name for the reports */
+	char cfgdir[256];
+	char pickupdir[256];
+	struct option *options;
 };
-extern struct event *read_log(char *log, int maxage, int fast);
-extern void free_log(struct event *e);
-extern void print_log(struct event *e);
+extern struct mrcfg *mrcfg_get(void);
+extern void mrcfg_release(struct mrcfg *mc);
 
-extern char mrmachine[256],
-bind_addr[256];
+extern char bind_addr[256];
 //extern char mrdisplay[256];
-extern char cfgdir[256];
-extern char now[1024];
-extern char pickupdir[256];
 //extern int mrport;
 //extern int mrsleep;
 extern int bootyellow, bootred;
 extern double dfyellow, dfred;
 extern int memyellow, memred;
 extern int dirsep;
-extern int msgage;
-extern int cpuyellow, cpured;
+extern int msgage, msgworkers;
+extern int extworkers, exttimeout;
+extern int cpuyellow, cpured, cpusample;
 extern int report_size;
 extern int debug;
+extern void lock_cfg(void);
+extern void unlock_cfg(void);
 extern int start_winsock(void);
 extern void stop_winsock(void);
 
@@ -72,22 +136,24 @@ extern char *big_strdup(char *, char *);
 extern FILE *big_fopen(char *, char *, char *);
 extern int big_fclose(char *, FILE *);
 extern int snprcat(char *str, size_t size, const char *fmt, ...);
-extern char *get_option(char *name, int partial);
+extern unsigned long strhash(const char *p);
+extern char *get_option(struct mrcfg *mc, char *name, int partial);
 extern void no_return(char *);
 extern void mrsend(char *machine, char *test, char *color, char *message);
+extern void mrsendn(char *machine, char *test, char *color, char *message, size_t len);
 extern void mrlog(char *fmt, ...);
 extern void startup_log(char *fmt, ...);
-extern void cpu(void);
-extern void disk(void);
-extern void memory(void);
-extern void msgs(void);
-extern void procs(void);
-extern void svcs(void);
-extern void wmi(void);
+extern void cpu(struct mrcfg *mc);
+extern void disk(struct mrcfg *mc);
+extern void memory(struct mrcfg *mc);
+extern void msgs(struct mrcfg *mc);
+extern void procs(struct mrcfg *mc);
+extern void svcs(struct mrcfg *mc);
+extern void wmi(struct mrcfg *mc);
 extern int service_main(int argc, char **argv);
 extern void mrbig(void);
 //extern void SvcDebugOut(LPSTR, DWORD);
-extern void ext_tests(void);
+extern void ext_tests(struct mrcfg *mc);
 extern void clear_cfg(void);
 extern void add_cfg(char *name, char *cfg);
 extern int get_cfg(char *name, char *b, size_t n, int line);
@@ -0,0 +1,578 @@
+#ifdef STANDALONE
+#include <limits.h>
+#include <time.h>
+#include "evlog.h"
+#include "msgrules.h"
+#include "standalone.h"
+#else
+#include "mrbig.h"
+#endif
+
+/* Event types, as in winnt.h */
+#ifndef EVENTLOG_ERROR_TYPE
+#define EVENTLOG_ERROR_TYPE 0x0001
+#define EVENTLOG_WARNING_TYPE 0x0002
+#define EVENTLOG_INFORMATION_TYPE 0x0004
+#define EVENTLOG_AUDIT_SUCCESS 0x0008
+#define EVENTLOG_AUDIT_FAILURE 0x0010
+#endif
+
+#define NO_RULE INT_MAX
+
+/* Largest transition table for the message automaton, in entries.
+   Beyond this, matching walks the trie instead. */
+#define DFA_MAX (1 << 21)
+
+static struct {
+	char *name;
+	long type;
+} types[] = {
+	{"error", EVENTLOG_ERROR_TYPE},
+	{"warning", EVENTLOG_WARNING_TYPE},
+	{"information", EVENTLOG_INFORMATION_TYPE},
+	{"audit_success", EVENTLOG_AUDIT_SUCCESS},
+	{"audit_failure", EVENTLOG_AUDIT_FAILURE}
+};
+
+#define NTYPES (sizeof types / sizeof *types)
+
+static char *tests[] = {NULL, "type", "source", "message", "id", "log"};
+
+struct rule {
+	char *action;
+	int test;
+	char *value;
+};
+
+/* Open addressing hash table from a source, log or id to the first
+   rule testing for it */
+struct slot {
+	char *key;		/* NULL in the id table */
+	long id;
+	int first;		/* NO_RULE for an empty slot */
+};
+
+struct map {
+	struct slot *slots;
+	unsigned long mask;
+};
+
+/* Aho-Corasick automaton over the message rule values. The children
+   of a node are a sibling list; the root has a full table instead,
+   since that is where most of the lookups end up. */
+struct acnode {
+	int child, sibling, fail;
+	unsigned char c;
+	int first;		/* earliest rule ending here or down the fail chain */
+};
+
+struct msgrules {
+	struct rule *rules;
+	int n, size;
+	int types[NTYPES];
+	struct map sources, logs, ids;
+	struct acnode *ac;
+	int nac, sizeac;
+	int root[256];
+	unsigned char class[256];	/* bytes not in any value are class 0 */
+	int nclass;
+	int *dfa;		/* nac x nclass transitions, or NULL */
+	int message_first;	/* earliest message rule */
+};
+
+static unsigned long hash_string(const char *p)
+{
+	unsigned long h = 2166136261UL;
+
+	while (*p) {
+		h ^= (unsigned char)*p++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static unsigned long hash_id(long id)
+{
+	unsigned long h = (unsigned long)id;
+
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h ^= h >> 16;
+	return h;
+}
+
+static void map_init(struct map *m, int n)
+{
+	unsigned long size = 16, i;
+
+	while (size < 2*(unsigned long)n) size *= 2;
+	m->slots = big_malloc("map_init", size*sizeof *m->slots);
+	m->mask = size-1;
+	for (i = 0; i < size; i++) m->slots[i].first = NO_RULE;
+}
+
+static struct slot *map_find(struct map *m, char *key, long id)
+{
+	unsigned long i = (key ? hash_string(key) : hash_id(id)) & m->mask;
+	struct slot *s;
+
+	for (;; i = (i+1) & m->mask) {
+		s = &m->slots[i];
+		if (s->first == NO_RULE) return s;
+		if (key ? !strcmp(s->key, key) : s->id == id) return s;
+	}
+}
+
+/* Rules are added in order, so the first one to claim a key wins */
+static void map_put(struct map *m, char *key, long id, int rule)
+{
+	struct slot *s = map_find(m, key, id);
+
+	if (s->first != NO_RULE) return;
+	s->key = key;
+	s->id = id;
+	s->first = rule;
+}
+
+static int map_get(struct map *m, char *key, long id)
+{
+	return map_find(m, key, id)->first;
+}
+
+static int type_index(long type)
+{
+	int i;
+
+	for (i = 0; i < NTYPES; i++) {
+		if (types[i].type == type) return i;
+	}
+	return -1;
+}
+
+static int ac_goto(struct msgrules *mr, int node, unsigned char c)
+{
+	int n;
+
+	if (node == 0) return mr->root[c];
+	for (n = mr->ac[node].child; n >= 0; n = mr->ac[n].sibling) {
+		if (mr->ac[n].c == c) return n;
+	}
+	return -1;
+}
+
+static int ac_node(struct msgrules *mr, int parent, unsigned char c)
+{
+	struct acnode *a;
+	int n;
+
+	if (mr->nac == mr->sizeac) {
+		mr->sizeac = mr->sizeac ? 2*mr->sizeac : 256;
+		mr->ac = big_realloc("ac_node", mr->ac,
+			mr->sizeac*sizeof *mr->ac);
+	}
+	n = mr->nac++;
+	a = &mr->ac[n];
+	a->child = -1;
+	a->sibling = -1;
+	a->fail = 0;
+	a->c = c;
+	a->first = NO_RULE;
+	if (n == 0) return n;
+	if (parent == 0) {
+		mr->root[c] = n;
+	} else {
+		a->sibling = mr->ac[parent].child;
+		mr->ac[parent].child = n;
+	}
+	return n;
+}
+
+static void ac_add(struct msgrules *mr, char *p, int rule)
+{
+	int node = 0, next;
+
+	for (; *p; p++) {
+		next = ac_goto(mr, node, (unsigned char)*p);
+		if (next < 0) next = ac_node(mr, node, (unsigned char)*p);
+		node = next;
+	}
+	if (rule < mr->ac[node].first) mr->ac[node].first = rule;
+}
+
+/* Breadth first, so that a node's fail target is done before it */
+static void ac_link(struct msgrules *mr)
+{
+	int *queue = big_malloc("ac_link", (mr->nac+1)*sizeof *queue);
+	int head = 0, tail = 0, c, u, v, f;
+
+	for (c = 0; c < 256; c++) {
+		v = mr->root[c];
+		if (v < 0) continue;
+		mr->ac[v].fail = 0;
+		if (mr->ac[0].first < mr->ac[v].first)
+			mr->ac[v].first = mr->ac[0].first;
+		queue[tail++] = v;
+	}
+	while (head < tail) {
+		u = queue[head++];
+		for (v = mr->ac[u].child; v >= 0; v = mr->ac[v].sibling) {
+			f = mr->ac[u].fail;
+			while (f && ac_goto(mr, f, mr->ac[v].c) < 0)
+				f = mr->ac[f].fail;
+			f = ac_goto(mr, f, mr->ac[v].c);
+			mr->ac[v].fail = f < 0 ? 0 : f;
+			if (mr->ac[mr->ac[v].fail].first < mr->ac[v].first)
+				mr->ac[v].first = mr->ac[mr->ac[v].fail].first;
+			queue[tail++] = v;
+		}
+	}
+
+	/* Turn it into a table of transitions, with the bytes that occur
+	   in the values numbered into classes to keep the table small */
+	memset(mr->class, 0, sizeof mr->class);
+	mr->nclass = 1;
+	for (v = 1; v < mr->nac; v++) {
+		if (mr->class[mr->ac[v].c] == 0)
+			mr->class[mr->ac[v].c] = mr->nclass++;
+	}
+	if ((long)mr->nac*mr->nclass <= DFA_MAX) {
+		int *rep = big_malloc("ac_link", mr->nclass*sizeof *rep);
+		for (c = 0; c < 256; c++) rep[mr->class[c]] = c;
+		mr->dfa = big_malloc("ac_link", mr->nac*mr->nclass*sizeof *mr->dfa);
+		/* the root first, then in the same breadth first order */
+		for (head = 0; head <= tail; head++) {
+			u = head ? queue[head-1] : 0;
+			mr->dfa[u*mr->nclass] = 0;
+			for (c = 1; c < mr->nclass; c++) {
+				v = ac_goto(mr, u, rep[c]);
+				if (v < 0) v = u ? mr->dfa[mr->ac[u].fail*mr->nclass+c] : 0;
+				mr->dfa[u*mr->nclass+c] = v;
+			}
+		}
+		big_free("ac_link", rep);
+	}
+	big_free("ac_link", queue);
+}
+
+/* Earliest message rule matching p, scanning it once */
+static int ac_scan(struct msgrules *mr, char *p)
+{
+	int node = 0, next, best = mr->ac[0].first;
+
+	if (mr->dfa) {
+		for (; *p && best != mr->message_first; p++) {
+			node = mr->dfa[node*mr->nclass+mr->class[(unsigned char)*p]];
+			if (mr->ac[node].first < best) best = mr->ac[node].first;
+		}
+		return best;
+	}
+	for (; *p && best != mr->message_first; p++) {
+		while ((next = ac_goto(mr, node, (unsigned char)*p)) < 0 && node)
+			node = mr->ac[node].fail;
+		node = next < 0 ? 0 : next;
+		if (mr->ac[node].first < best) best = mr->ac[node].first;
+	}
+	return best;
+}
+
+struct msgrules *msgrules_new(void)
+{
+	struct msgrules *mr = big_malloc("msgrules_new", sizeof *mr);
+
+	memset(mr, 0, sizeof *mr);
+	return mr;
+}
+
+/* Returns 0 on success, 1 for an unknown action and 2 for an unknown test */
+int msgrules_add(struct msgrules *mr, char *action, char *test, char *value)
+{
+	struct rule r;
+
+	if (!strcmp(action, "green")) {
+		r.action = "green";
+	} else if (!strcmp(action, "yellow")) {
+		r.action = "yellow";
+	} else if (!strcmp(action, "red")) {
+		r.action = "red";
+	} else if (!strcmp(action, "ignore")) {
+		r.action = NULL;
+	} else {
+		return 1;
+	}
+	for (r.test = MSGRULE_TYPE; r.test <= MSGRULE_LOG; r.test++) {
+		if (!strcmp(test, tests[r.test])) break;
+	}
+	if (r.test > MSGRULE_LOG) return 2;
+	r.value = big_strdup("msgrules_add", value);
+
+	if (mr->n == mr->size) {
+		mr->size = mr->size ? 2*mr->size : 64;
+		mr->rules = big_realloc("msgrules_add", mr->rules,
+			mr->size*sizeof *mr->rules);
+	}
+	mr->rules[mr->n++] = r;
+	return 0;
+}
+
+void msgrules_compile(struct msgrules *mr)
+{
+	struct rule *r;
+	char b[32];
+	long id;
+	int i, t;
+
+	for (t = 0; t < NTYPES; t++) mr->types[t] = NO_RULE;
+	map_init(&mr->sources, mr->n);
+	map_init(&mr->logs, mr->n);
+	map_init(&mr->ids, mr->n);
+	for (i = 0; i < 256; i++) mr->root[i] = -1;
+	ac_node(mr, 0, 0);
+	mr->message_first = NO_RULE;
+
+	for (i = 0; i < mr->n; i++) {
+		r = &mr->rules[i];
+		switch (r->test) {
+		case MSGRULE_TYPE:
+			for (t = 0; t < NTYPES; t++) {
+				if (!strcmp(r->value, types[t].name) &&
+				    mr->types[t] == NO_RULE)
+					mr->types[t] = i;
+			}
+			break;
+		case MSGRULE_SOURCE:
+			map_put(&mr->sources, r->value, 0, i);
+			break;
+		case MSGRULE_LOG:
+			map_put(&mr->logs, r->value, 0, i);
+			break;
+		case MSGRULE_ID:
+			/* The id was compared as printed, so "007" never matched */
+			id = strtol(r->value, NULL, 10);
+			snprintf(b, sizeof b, "%ld", id);
+			if (!strcmp(b, r->value)) map_put(&mr->ids, NULL, id, i);
+			break;
+		case MSGRULE_MESSAGE:
+			ac_add(mr, r->value, i);
+			if (mr->message_first == NO_RULE) mr->message_first = i;
+			break;
+		}
+	}
+	ac_link(mr);
+	if (debug > 1) mrlog("msgrules_compile: %d rules, %d automaton nodes",
+		mr->n, mr->nac);
+}
+
+/* Returns the action of the first matching rule, or NULL if none
+   matches or the rule says ignore */
+char *msgrules_match(struct msgrules *mr, struct event *e, char *log)
+{
+	int best = NO_RULE, i;
+
+	i = type_index(e->type);
+	if (i >= 0) best = mr->types[i];
+	i = map_get(&mr->ids, NULL, (long)e->id);
+	if (i < best) best = i;
+	if (e->source) {
+		i = map_get(&mr->sources, e->source, 0);
+		if (i < best) best = i;
+	}
+	i = map_get(&mr->logs, log, 0);
+	if (i < best) best = i;
+	/* Only look at the message if that could change the outcome */
+	if (mr->message_first < best) {
+		i = ac_scan(mr, evlog_message(e));
+		if (i < best) best = i;
+	}
+	if (best == NO_RULE) return NULL;
+
+	if (debug > 1) {
+		mrlog("returning %s because %s matches %s",
+			mr->rules[best].action ? mr->rules[best].action : "ignore",
+			tests[mr->rules[best].test], mr->rules[best].value);
+	}
+	return mr->rules[best].action;
+}
+
+int msgrules_count(struct msgrules *mr)
+{
+	return mr->n;
+}
+
+void msgrules_free(struct msgrules *mr)
+{
+	int i;
+
+	for (i = 0; i < mr->n; i++) big_free("msgrules_free", mr->rules[i].value);
+	big_free("msgrules_free", mr->rules);
+	big_free("msgrules_free", mr->sources.slots);
+	big_free("msgrules_free", mr->logs.slots);
+	big_free("msgrules_free", mr->ids.slots);
+	big_free("msgrules_free", mr->ac);
+	big_free("msgrules_free", mr->dfa);
+	big_free("msgrules_free", mr);
+}
+
+#ifdef STANDALONE
+/*
+Benchmark: 1000 rules against a million synthetic events, compared
+with the old linear matcher on a sample of them.
+
+	gcc -O2 -DSTANDALONE -o msgrules msgrules.c && ./msgrules
+*/
+
+#define NEVENTS 1000000
+#define NRULES (1000-NTYPES)
+#define NMESSAGES 10000
+#define SAMPLE 10
+
+char *evlog_message(struct event *e)
+{
+	return e->message;
+}
+
+/* The matcher from before msgrules.c, for reference */
+static char *linear_match(struct msgrules *mr, struct event *e, char *log)
+{
+	char id[100];
+	int i, t;
+
+	for (i = 0; i < mr->n; i++) {
+		struct rule *r = &mr->rules[i];
+		switch (r->test) {
+		case MSGRULE_TYPE:
+			for (t = 0; t < NTYPES; t++) {
+				if (e->type == types[t].type &&
+				    !strcmp(r->value, types[t].name))
+					return r->action;
+			}
+			break;
+		case MSGRULE_SOURCE:
+			if (!strcmp(e->source, r->value)) return r->action;
+			break;
+		case MSGRULE_MESSAGE:
+			if (strstr(e->message, r->value)) return r->action;
+			break;
+		case MSGRULE_ID:
+			sprintf(id, "%ld", (long)e->id);
+			if (!strcmp(id, r->value)) return r->action;
+			break;
+		case MSGRULE_LOG:
+			if (!strcmp(log, r->value)) return r->action;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static char *word(char *b, size_t n)
+{
+	snprintf(b, n, "w%d", rand() % 5000);
+	return b;
+}
+
+int main(int argc, char **argv)
+{
+	static char *actions[] = {"red", "yellow", "green", "ignore"};
+	struct msgrules *mr = msgrules_new();
+	struct event *events = big_malloc("main", NEVENTS*sizeof *events);
+	char **messages = big_malloc("main", NMESSAGES*sizeof *messages);
+	char *sources[1000], *logs[50];
+	char b[1000], w[20];
+	char *action, *test, *a, *l;
+	int i, j, mismatches = 0, reported = 0, sampled = 0;
+	clock_t t0, t1;
+
+	srand(1);
+	for (i = 0; i < NRULES; i++) {
+		action = actions[rand() % 4];
+		switch (i % 10) {
+		case 0: case 1: case 2:
+			test = "message";
+			word(w, sizeof w);
+			if (i % 2) {
+				snprintf(b, sizeof b, "%s ", w);
+				word(w, sizeof w);
+				strcat(b, w);
+			} else {
+				snprintf(b, sizeof b, "%s", w);
+			}
+			break;
+		case 3: case 4: case 5:
+			test = "id";
+			snprintf(b, sizeof b, "%d", rand() % 10000);
+			break;
+		case 6: case 7:
+			test = "source";
+			snprintf(b, sizeof b, "Src%d", rand() % 500);
+			break;
+		default:
+			test = "log";
+			snprintf(b, sizeof b, "Log%d", rand() % 100);
+			break;
+		}
+		msgrules_add(mr, action, test, b);
+	}
+	/* Catch-all type rules at the end, as in the example msgs.cfg */
+	for (i = 0; i < NTYPES; i++) {
+		msgrules_add(mr, i < 2 ? actions[i] : "ignore", "type", types[i].name);
+	}
+	t0 = clock();
+	msgrules_compile(mr);
+	t1 = clock();
+	printf("compiled %d rules into %d nodes in %.3f ms\n", mr->n, mr->nac,
+		1000.0*(t1-t0)/CLOCKS_PER_SEC);
+
+	for (i = 0; i < 1000; i++) {
+		snprintf(b, sizeof b, "Src%d", i);
+		sources[i] = big_strdup("main", b);
+	}
+	for (i = 0; i < 50; i++) {
+		snprintf(b, sizeof b, "Log%d", i);
+		logs[i] = big_strdup("main", b);
+	}
+	for (i = 0; i < NMESSAGES; i++) {
+		b[0] = '\0';
+		for (j = 0; j < 12; j++) {
+			if (j) strcat(b, " ");
+			strcat(b, word(w, sizeof w));
+		}
+		messages[i] = big_strdup("main", b);
+	}
+	memset(events, 0, NEVENTS*sizeof *events);
+	for (i = 0; i < NEVENTS; i++) {
+		events[i].type = types[rand() % NTYPES].type;
+		events[i].id = rand() % 65536;
+		events[i].source = sources[rand() % 1000];
+		events[i].message = messages[rand() % NMESSAGES];
+		events[i].record = i;
+	}
+
+	t0 = clock();
+	for (i = 0; i < NEVENTS; i++) {
+		if (msgrules_match(mr, &events[i], logs[i % 50])) reported++;
+	}
+	t1 = clock();
+	printf("compiled: %d events in %.3f s, %.3f us/event, %d reported\n",
+		NEVENTS, (double)(t1-t0)/CLOCKS_PER_SEC,
+		1e6*(t1-t0)/CLOCKS_PER_SEC/NEVENTS, reported);
+
+	t0 = clock();
+	for (i = 0; i < NEVENTS; i += SAMPLE) {
+		if (linear_match(mr, &events[i], logs[i % 50])) sampled++;
+	}
+	t1 = clock();
+	printf("linear: %d events in %.3f s, %.3f us/event, %d reported\n",
+		NEVENTS/SAMPLE, (double)(t1-t0)/CLOCKS_PER_SEC,
+		1e6*(t1-t0)/CLOCKS_PER_SEC/(NEVENTS/SAMPLE), sampled);
+
+	for (i = 0; i < NEVENTS; i += SAMPLE) {
+		a = msgrules_match(mr, &events[i], logs[i % 50]);
+		l = linear_match(mr, &events[i], logs[i % 50]);
+		if (a != l) mismatches++;
+	}
+	printf("%d mismatches\n", mismatches);
+
+	msgrules_free(mr);
+	return mismatches != 0;
+}
+#endif
@@ -0,0 +1,22 @@
+/* Compiled msgs.cfg rules.
+
+The rules are kept in file order and the first matching rule wins,
+as before, but an event is no longer tested against each rule in
+turn. Instead each kind of test has its own index giving the first
+rule that matches, and the answer is the earliest of those.
+*/
+
+#define MSGRULE_TYPE 1
+#define MSGRULE_SOURCE 2
+#define MSGRULE_MESSAGE 3
+#define MSGRULE_ID 4
+#define MSGRULE_LOG 5
+
+struct msgrules;
+
+extern struct msgrules *msgrules_new(void);
+extern int msgrules_add(struct msgrules *mr, char *action, char *test, char *value);
+extern void msgrules_compile(struct msgrules *mr);
+extern char *msgrules_match(struct msgrules *mr, struct event *e, char *log);
+extern int msgrules_count(struct msgrules *mr);
+extern void msgrules_free(struct msgrules *mr);
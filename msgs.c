@@ -1,20 +1,6 @@
 #include "mrbig.h"
 
-#define TEST_TYPE 1
-#define TEST_SOURCE 2
-#define TEST_MESSAGE 3
-#define TEST_ID 4
-#define TEST_LOG 5
-
-#define RULES_MAX 1000
-
-static struct rules {
-	char *action;
-	int test;
-	char *value;
-} rules[RULES_MAX];
-
-static int nrules;
+static struct msgrules *rules;
 
 static void sanitize_message(char *p)
 {
@@ -26,74 +12,7 @@ static void sanitize_message(char *p)
 
 static char *match_rules(struct event *e, char *log)
 {
-	int i;
-	char id[100];
-
-	for (i = 0; i < nrules; i++) {
-		switch (rules[i].test) {
-		case TEST_TYPE:
-			if ((e->type == EVENTLOG_ERROR_TYPE &&
-				!strcmp(rules[i].value, "error")) ||
-			    (e->type == EVENTLOG_WARNING_TYPE &&
-				!strcmp(rules[i].value, "warning")) ||
-			    (e->type == EVENTLOG_INFORMATION_TYPE &&
-				!strcmp(rules[i].value, "information")) ||
-			    (e->type == EVENTLOG_AUDIT_FAILURE &&
-				!strcmp(rules[i].value, "audit_failure")) ||
-			    (e->type == EVENTLOG_AUDIT_SUCCESS &&
-				!strcmp(rules[i].value, "audit_success"))) {
-				if (debug > 1) {
-					mrlog("returning %s because type is %s",
-						rules[i].action,
-						rules[i].value);
-				}
-				return rules[i].action;
-			}
-			break;
-		case TEST_SOURCE:
-			if (!strcmp(e->source, rules[i].value)) {
-				if (debug > 1) {
-					mrlog("returning %s because source is %s",
-						rules[i].action,
-						rules[i].value);
-				}
-				return rules[i].action;
-			}
-			break;
-		case TEST_MESSAGE:
-			if (strstr(e->message, rules[i].value)) {
-				if (debug > 1) {
-					mrlog("returning %s because message matches %s",
-						rules[i].action,
-						rules[i].value);
-				}
-				return rules[i].action;
-			}
-			break;
-		case TEST_ID:
-			sprintf(id, "%ld", (long)e->id);
-			if (!strcmp(id, rules[i].value)) {
-				if (debug > 1) {
-					mrlog("returning %s because id is %s",
-						rules[i].action,
-						rules[i].value);
-				}
-				return rules[i].action;
-			}
-			break;
-		case TEST_LOG:
-			if (!strcmp(log, rules[i].value)) {
-				if (debug > 1) {
-					mrlog("returning %s because log is %s",
-						rules[i].action,
-						rules[i].value);
-				}
-				return rules[i].action;
-			}
-			break;
-		}
-	}
-	return NULL;
+	return msgrules_match(rules, e, log);
 }
 
 static void read_msgcfg(void)
@@ -101,64 +20,82 @@ static void read_msgcfg(void)
 	char b[1000], action[100], test[100], value[1000];
 	int i, n;
 
-	nrules = 0;
-
-
-	for (i = 0; get_cfg("msgs", b, sizeof b, i) && nrules < RULES_MAX; i++) {
+	rules = msgrules_new();
+	for (i = 0; get_cfg("msgs", b, sizeof b, i); i++) {
 		if (b[0] == '#') continue;
 		n = sscanf(b, "%s %s %[^\r\n]", action, test, value);
 		if (n < 3) continue;
-		if (!strcmp(action, "green")) {
-			rules[nrules].action = "green";
-		} else if (!strcmp(action, "yellow")) {
-			rules[nrules].action = "yellow";
-		} else if (!strcmp(action, "red")) {
-			rules[nrules].action = "red";
-		} else if (!strcmp(action, "ignore")) {
-			rules[nrules].action = NULL;
-		} else {
-			continue;
-		}
-		if (!strcmp(test, "type")) {
-			rules[nrules].test = TEST_TYPE;
-		} else if (!strcmp(test, "source")) {
-			rules[nrules].test = TEST_SOURCE;
-		} else if (!strcmp(test, "message")) {
-			rules[nrules].test = TEST_MESSAGE;
-		} else if (!strcmp(test, "id")) {
-			rules[nrules].test = TEST_ID;
-		} else if (!strcmp(test, "log")) {
-			rules[nrules].test = TEST_LOG;
-		} else {
+		if (msgrules_add(rules, action, test, value) == 2) {
 			mrlog("In read_msgcfg: bogus test '%s'", test);
-			continue;
 		}
-		rules[nrules++].value = big_strdup("msgs.c/read_msgcfg", value);
 	}
+	msgrules_compile(rules);
 }
 
 static void free_cfg(void)
 {
+	msgrules_free(rules);
+	rules = NULL;
+}
+
+/* The retained events were matched against the old rules and window,
+   so any change to them means reading the logs from scratch */
+static void check_msgcfg(void)
+{
+	static unsigned long last;
+	unsigned long h;
+	char b[1000], age[20];
 	int i;
 
-	for (i = 0; i < nrules; i++) big_free("msgs.c/free_cfg", rules[i].value);
+	snprintf(age, sizeof age, "%d", msgage);
+	h = strhash(age);
+	for (i = 0; get_cfg("msgs", b, sizeof b, i); i++) {
+		h = h*31 + strhash(b);
+	}
+	if (h != last) {
+		if (debug) mrlog("msgs configuration changed, rereading logs");
+		evlog_reset_all();
+		last = h;
+	}
 }
 
 #define MAX_KEY_LENGTH 255
 #define MAX_VALUE_NAME 16383
 
-void msgs(void)
+struct channel {
+	struct logstate *ls;
+	int fast;
+	time_t cutoff;
+};
+
+/* Runs on the pool; touches nothing but its own channel */
+static void read_channel(void *arg)
+{
+	struct channel *c = arg;
+	struct evlog_provider pv;
+
+	if (debug) mrlog("Reading log %s", c->ls->name);
+	if (read_log(c->ls, msgage, c->fast, &pv)) {
+		evlog_read(c->ls, &pv, match_rules, c->cutoff);
+		pv.close(pv.ctx);
+	}
+	evlog_expire(c->ls, c->cutoff);
+}
+
+void msgs(struct mrcfg *mc)
 {
-	char b[5000];
-	int n = sizeof b;
+	struct sbuf b;
 	char cfgfile[1024];
 	char fastmsgsfile[1024];
 	FILE *fastfp;
 	int fastfile = 0;
 	char *fastmsgs_mode;
-	char *mycolor, *color, p[5000];
-	struct event *e;
-	struct event *events;
+	char *color;
+	struct logstate *ls;
+	struct retained *r;
+	struct channel *channels;
+	struct pool_job *jobs;
+	int j, nchannels;
 
 	HKEY hTestKey;
     	TCHAR    achKey[MAX_KEY_LENGTH+1];   // buffer for subkey name
@@ -176,27 +113,29 @@ void msgs(void)
 
     	DWORD i, retCode;
 
-	if (debug > 1) mrlog("msgs(%p, %d)", b, n);
+	if (debug > 1) mrlog("msgs()");
 
-	if (get_option("no_msgs", 0)) {
-		mrsend(mrmachine, "msgs", "clear", "option no_msgs\n");
+	if (get_option(mc, "no_msgs", 0)) {
+		mrsend(mc->machine, "msgs", "clear", "option no_msgs\n");
 		return;
 	}
 
 	cfgfile[0] = '\0';
-	snprcat(cfgfile, sizeof cfgfile, "%s%c%s", cfgdir, dirsep, "msgs.cfg");
+	snprcat(cfgfile, sizeof cfgfile, "%s%c%s", mc->cfgdir, dirsep, "msgs.cfg");
 	read_cfg("msgs", cfgfile);
 	read_msgcfg(/*cfgfile*/);
+	check_msgcfg();
 	fastmsgsfile[0] = '\0';
-	snprcat(fastmsgsfile, sizeof fastmsgsfile, "%s%c%s", cfgdir, dirsep, "fastmsgs.cfg");
+	snprcat(fastmsgsfile, sizeof fastmsgsfile, "%s%c%s", mc->cfgdir, dirsep, "fastmsgs.cfg");
 
 	time_t t0 = time(NULL);
 
 
 	color = "green";
-	p[0] = '\0';
+	sb_init(&b, 0);
+	sb_printf(&b, "%s\n\n", mc->now);
 
-	fastmsgs_mode = get_option("fastmsgs=", 1);
+	fastmsgs_mode = get_option(mc, "fastmsgs=", 1);
 	if (fastmsgs_mode == NULL) fastmsgs_mode = "fastmsgs=auto";
 
 	if (!strcmp(fastmsgs_mode+9, "auto")) {
@@ -228,6 +167,10 @@ void msgs(void)
 		        &cbSecurityDescriptor,   // security descriptor
 		        &ftLastWriteTime);       // last write time
 
+		channels = big_malloc("msgs (channels)",
+			(cSubKeys+1)*sizeof *channels);
+		jobs = big_malloc("msgs (jobs)", (cSubKeys+1)*sizeof *jobs);
+		nchannels = 0;
 		for (i = 0; i < cSubKeys; i++) {
 
 			cbName = MAX_KEY_LENGTH;
@@ -238,24 +181,36 @@ void msgs(void)
                 continue;
             }
             if (retCode == ERROR_SUCCESS) {
-				if (debug) mrlog("Reading log %s", achKey);
-				events = read_log(achKey, t0-msgage,
-						!strcmp(fastmsgs_mode+9, "on") || fastfile);
-				for (e = events; e; e = e->next) {
-					mycolor = match_rules(e, achKey);
-					if (mycolor) {
-						sanitize_message(e->message);
-						snprcat(p, sizeof p, "&%s %s - %s - %s%s\n",
-							mycolor, achKey, e->source,
-							ctime(&e->gtime), e->message);
-						if (!strcmp(color, "green") || !strcmp(mycolor, "red"))
-							color = mycolor;
-					}
-				}
-				free_log(events);
+				channels[nchannels].ls = evlog_state(achKey);
+				channels[nchannels].fast =
+					!strcmp(fastmsgs_mode+9, "on") || fastfile;
+				channels[nchannels].cutoff = t0-msgage;
+				jobs[nchannels].name = channels[nchannels].ls->name;
+				jobs[nchannels].fn = read_channel;
+				jobs[nchannels].arg = &channels[nchannels];
+				jobs[nchannels].budget = 0;
+				jobs[nchannels].state = POOL_IDLE;
+				nchannels++;
 			}
 		}
 		RegCloseKey(hTestKey);
+
+		/* Read the channels side by side, then report them in order */
+		pool_run(jobs, nchannels, msgworkers);
+		for (i = 0; i < nchannels; i++) {
+			ls = channels[i].ls;
+			for (j = 0; j < ls->n; j++) {
+				r = &ls->retained[j];
+				sanitize_message(r->message);
+				sb_printf(&b, "&%s %s - %s - %s%s\n",
+					r->color, ls->name, r->source,
+					ctime(&r->gtime), r->message);
+				if (!strcmp(color, "green") || !strcmp(r->color, "red"))
+					color = r->color;
+			}
+		}
+		big_free("msgs (jobs)", jobs);
+		big_free("msgs (channels)", channels);
 	}
 
 	if (fastfile) {
@@ -265,10 +220,10 @@ void msgs(void)
 	} else if (!strcmp(fastmsgs_mode+9, "auto")) {
 		remove(fastmsgsfile);
 	}
-	b[0] = '\0';
-	snprcat(b, n-1, "%s\n\n%s\n", now, p);
+	sb_printf(&b, "\n");
 
 	free_cfg();
-	mrsend(mrmachine, "msgs", color, b);
+	mrsendn(mc->machine, "msgs", color, b.s, b.len);
+	sb_free(&b);
 }
 
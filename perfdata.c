@@ -0,0 +1,646 @@
+#ifdef STANDALONE
+#include <string.h>
+#include <time.h>
+#include "perfdata.h"
+#include "standalone.h"
+#else
+#include "mrbig.h"
+#endif
+
+static PERF_OBJECT_TYPE *first_object(PERF_DATA_BLOCK *data_block)
+{
+	return (PERF_OBJECT_TYPE *)((BYTE *)data_block+data_block->HeaderLength);
+}
+
+static PERF_OBJECT_TYPE *next_object(PERF_OBJECT_TYPE *act)
+{
+	return (PERF_OBJECT_TYPE *)((BYTE *)act+act->TotalByteLength);
+}
+
+static PERF_COUNTER_DEFINITION *first_counter(PERF_OBJECT_TYPE *perf_object)
+{
+	return (PERF_COUNTER_DEFINITION *)((BYTE *)perf_object+perf_object->HeaderLength);
+}
+
+static PERF_COUNTER_DEFINITION *next_counter(PERF_COUNTER_DEFINITION *perf_counter)
+{
+	return (PERF_COUNTER_DEFINITION *)((BYTE *)perf_counter+perf_counter->ByteLength);
+}
+
+static PERF_COUNTER_BLOCK *get_counter_block(PERF_INSTANCE_DEFINITION *p_instance)
+{
+	return (PERF_COUNTER_BLOCK *)((BYTE *)p_instance+p_instance->ByteLength);
+}
+
+static PERF_INSTANCE_DEFINITION *first_instance(PERF_OBJECT_TYPE *p_object)
+{
+	return (PERF_INSTANCE_DEFINITION *)((BYTE *)p_object+p_object->DefinitionLength);
+}
+
+static PERF_INSTANCE_DEFINITION *next_instance(PERF_INSTANCE_DEFINITION *p_instance)
+{
+	/* next instance is after this instance + counter data */
+	PERF_COUNTER_BLOCK *p_ctr_blk = get_counter_block(p_instance);
+	return (PERF_INSTANCE_DEFINITION *)((BYTE *)p_instance+p_instance->ByteLength+p_ctr_blk->ByteLength);
+}
+
+/* Get size and offset of a counter. Return 1 for success, 0 for failure */
+/* If counter is odd, use the next index. This is for the incredibly
+   boneheaded way fractions are handled by the performance counters. */
+static int get_counter_offset(PERF_OBJECT_TYPE *op, int counter,
+				struct counter_info *ci)
+{
+	int b;
+	PERF_COUNTER_DEFINITION *cd;
+	BYTE *end = (BYTE *)op+op->DefinitionLength;
+	int base = counter & 1;
+
+	counter &= ~1;
+
+	cd = first_counter(op);
+	for (b = 0; b < op->NumCounters; b++) {
+		/* perfdata_object has checked DefinitionLength */
+		if ((BYTE *)cd+sizeof *cd > end || cd->ByteLength < sizeof *cd ||
+		    (BYTE *)cd+cd->ByteLength > end) {
+			mrlog("get_counter_offset: counter %d is out of bounds", b);
+			break;
+		}
+		if (cd->CounterNameTitleIndex == counter) {
+			if (base) {
+				base = 0;	/* use the next if any */
+			} else {
+				ci->size = cd->CounterSize;
+				ci->offset = cd->CounterOffset;
+				return 1;
+			}
+		}
+		cd = next_counter(cd);
+	}
+	ci->size = ci->offset = 0;
+	return 0;
+}
+
+/* Find an object in a data block of len bytes. Return NULL if it
+   isn't there or the block doesn't hold together. */
+PERF_OBJECT_TYPE *perfdata_object(PERF_DATA_BLOCK *bp, DWORD len, DWORD object)
+{
+	int a;
+	PERF_OBJECT_TYPE *op;
+	BYTE *end = (BYTE *)bp+len;
+
+	if (debug > 1) mrlog("perfdata_object(%p, %lu, %lu)",
+				bp, (unsigned long)len, (unsigned long)object);
+
+	if (len < sizeof *bp || bp->HeaderLength > len) return NULL;
+	op = first_object(bp);
+	for (a = 0; a < bp->NumObjectTypes; a++) {
+		if ((BYTE *)op+sizeof *op > end ||
+		    op->TotalByteLength < sizeof *op ||
+		    (BYTE *)op+op->TotalByteLength > end ||
+		    op->HeaderLength > op->DefinitionLength ||
+		    op->DefinitionLength > op->TotalByteLength) {
+			mrlog("perfdata_object: object %d is out of bounds", a);
+			return NULL;
+		}
+		if (debug > 1) mrlog("object %d is %d", a,
+					op->ObjectNameTitleIndex);
+		if (op->ObjectNameTitleIndex == object) return op;
+		op = next_object(op);
+	}
+	return NULL;
+}
+
+/* Fill in ci for each counter (terminated by 0) without the cache
+   below, for callers on other threads. Returns the number found. */
+int perfdata_offsets(PERF_OBJECT_TYPE *op, DWORD *counters,
+			struct counter_info *ci)
+{
+	int i, found = 0;
+
+	for (i = 0; counters[i]; i++) {
+		found += get_counter_offset(op, counters[i], ci+i);
+	}
+	return found;
+}
+
+/*
+Counter offsets are looked up once per object and kept, as long as
+the counter definitions of the object stay the same. That is checked
+with a hash of the definitions, which is much cheaper than searching
+them for every counter. Like the buffers in readperf.c this is only
+used from cpu(), so it needs no locking. The load sampler in cpuload.c
+runs on its own thread and uses perfdata_offsets instead.
+*/
+
+#define LAYOUT_MAX 16	/* counters remembered per object */
+
+struct layout {
+	DWORD object;
+	DWORD sum;
+	int n;
+	DWORD counter[LAYOUT_MAX];
+	struct counter_info ci[LAYOUT_MAX];
+	struct layout *next;
+};
+
+static struct layout *layouts;
+
+static DWORD layout_sum(PERF_OBJECT_TYPE *op)
+{
+	DWORD *p = (DWORD *)first_counter(op);
+	DWORD *end = (DWORD *)((BYTE *)op+op->DefinitionLength);
+	DWORD h = 2166136261u ^ op->NumCounters;
+
+	while (p < end) {
+		h = (h ^ *p++) * 16777619u;
+	}
+	return h;
+}
+
+/* Fill in ci for each counter (terminated by 0). Counters that aren't
+   there get size 0. Returns the number of counters found. */
+int perfdata_layout(PERF_OBJECT_TYPE *op, DWORD *counters,
+			struct counter_info *ci)
+{
+	struct layout *l;
+	DWORD sum = layout_sum(op);
+	int i, j, found = 0;
+
+	for (l = layouts; l; l = l->next) {
+		if (l->object == op->ObjectNameTitleIndex) break;
+	}
+	if (l == NULL) {
+		l = big_malloc("perfdata_layout", sizeof *l);
+		l->object = op->ObjectNameTitleIndex;
+		l->n = 0;
+		l->sum = sum;
+		l->next = layouts;
+		layouts = l;
+	}
+	if (l->sum != sum) {
+		if (debug) mrlog("perfdata_layout: object %lu has changed",
+				(unsigned long)l->object);
+		l->n = 0;
+		l->sum = sum;
+	}
+
+	for (i = 0; counters[i]; i++) {
+		for (j = 0; j < l->n; j++) {
+			if (l->counter[j] == counters[i]) break;
+		}
+		if (j < l->n) {
+			ci[i] = l->ci[j];
+		} else {
+			get_counter_offset(op, counters[i], ci+i);
+			if (l->n < LAYOUT_MAX) {
+				l->counter[l->n] = counters[i];
+				l->ci[l->n++] = ci[i];
+			}
+		}
+		if (ci[i].size) found++;
+	}
+	return found;
+}
+
+/* Instances are visited in place, nothing is copied or allocated */
+static int perfinst_check(struct perfinst *it)
+{
+	BYTE *end = (BYTE *)it->op+it->op->TotalByteLength;
+
+	if (it->id) {
+		if ((BYTE *)it->id+sizeof *it->id > end ||
+		    (BYTE *)it->id+it->id->ByteLength+sizeof *it->cb > end) {
+			mrlog("perfinst: instance %ld is out of bounds", (long)it->i);
+			return 0;
+		}
+		it->cb = get_counter_block(it->id);
+	}
+	if ((BYTE *)it->cb+sizeof *it->cb > end ||
+	    (BYTE *)it->cb+it->cb->ByteLength > end) {
+		mrlog("perfinst: counters of %ld are out of bounds", (long)it->i);
+		return 0;
+	}
+	return 1;
+}
+
+/* Returns 0 if there are no instances at all */
+int perfinst_first(PERF_OBJECT_TYPE *op, struct perfinst *it)
+{
+	it->op = op;
+	it->i = 0;
+	if (op->NumInstances == PERF_NO_INSTANCES) {
+		it->id = NULL;
+		it->cb = (PERF_COUNTER_BLOCK *)((BYTE *)op+op->DefinitionLength);
+	} else {
+		if (op->NumInstances <= 0) return 0;
+		it->id = first_instance(op);
+	}
+	return perfinst_check(it);
+}
+
+int perfinst_next(struct perfinst *it)
+{
+	if (it->id == NULL || it->i+1 >= it->op->NumInstances) return 0;
+	it->id = next_instance(it->id);
+	it->i++;
+	return perfinst_check(it);
+}
+
+/* The instance name, which must lie within the instance definition
+   like the counters lie within their block. NULL if it does not. */
+static WCHAR *instance_name(struct perfinst *it, DWORD *n)
+{
+	PERF_INSTANCE_DEFINITION *id = it->id;
+
+	if (id == NULL) return NULL;
+	if (id->NameOffset > id->ByteLength ||
+	    id->NameLength > id->ByteLength-id->NameOffset) {
+		mrlog("perfinst: name of %ld is out of bounds", (long)it->i);
+		return NULL;
+	}
+	*n = id->NameLength/sizeof(WCHAR);
+	return (WCHAR *)((BYTE *)id+id->NameOffset);
+}
+
+/* Compare the instance name with an ASCII name */
+int perfinst_is(struct perfinst *it, char *name)
+{
+	WCHAR *w;
+	DWORD i, n;
+
+	w = instance_name(it, &n);
+	if (w == NULL) return 0;
+	for (i = 0; i < n && name[i]; i++) {
+		if (w[i] != (unsigned char)name[i]) return 0;
+	}
+	return name[i] == '\0' && (i == n || w[i] == 0);
+}
+
+/* Copy the instance name to b, or "" if there is none */
+char *perfinst_name(struct perfinst *it, char *b, size_t n)
+{
+	WCHAR *w;
+	DWORD dn;
+	int wn;
+
+	b[0] = '\0';
+	w = instance_name(it, &dn);
+	if (w == NULL) return b;
+	wn = dn;
+#ifdef STANDALONE
+	{
+		int i;
+
+		for (i = 0; i < n-1 && i < wn && w[i]; i++) {
+			b[i] = w[i] < 0x80 ? w[i] : '?';
+		}
+		b[i] = '\0';
+	}
+#else
+	wn = WideCharToMultiByte(CP_ACP, 0, w, wn, b, n-1, 0, 0);
+	b[wn > 0 ? wn : 0] = '\0';
+#endif
+	return b;
+}
+
+uint64_t perfinst_value(struct perfinst *it, struct counter_info *ci)
+{
+	uint64_t value = 0;
+
+	if (ci->size <= sizeof value &&
+	    ci->offset+ci->size <= it->cb->ByteLength) {
+		memcpy(&value, (BYTE *)it->cb+ci->offset, ci->size);
+	}
+	return value;
+}
+
+/* Copy the counters (terminated by 0) for every instance of op */
+struct perfcounter *perfdata_counters(PERF_OBJECT_TYPE *op, DWORD *counters,
+			long long *perf_time, long long *perf_freq)
+{
+	int i, ncounters, b, more;
+	struct counter_info *ci;
+	struct perfinst it;
+	struct perfcounter *results;
+	char name[1024];
+
+	/* check to see how many counters we are interested in */
+	for (ncounters = 0; counters[ncounters]; ncounters++) {
+		if (debug > 1) mrlog("counters[%d] = %ld",
+			ncounters, (long)counters[ncounters]);
+	}
+
+	if (debug > 1) mrlog("%d interesting counters", ncounters);
+
+	if (perf_time) *perf_time = op->PerfTime.QuadPart;
+	if (perf_freq) *perf_freq = op->PerfFreq.QuadPart;
+	ci = big_malloc("perfdata_counters (ci)", (ncounters+1) * sizeof *ci);
+	perfdata_layout(op, counters, ci);
+
+	results = big_malloc("perfdata_counters (results)",
+			(1+(op->NumInstances > 0 ? op->NumInstances : 0)) * sizeof *results);
+	b = 0;
+	for (more = perfinst_first(op, &it); more; more = perfinst_next(&it)) {
+		results[b].value = big_malloc("perfdata_counters (value)",
+				ncounters * sizeof *results[b].value);
+		for (i = 0; i < ncounters; i++) {
+			results[b].value[i] = perfinst_value(&it, ci+i);
+		}
+		if (it.id == NULL) {
+			if (debug > 1) mrlog("No instances");
+			results[b].instance = NULL;
+			goto Done;
+		}
+		results[b++].instance = big_strdup("perfdata_counters (instance)",
+				perfinst_name(&it, name, sizeof name));
+	}
+	results[b].instance = NULL;
+	results[b].value = NULL;
+	if (b == 0 && op->NumInstances == PERF_NO_INSTANCES) {
+		/* the counters were out of bounds */
+		big_free("perfdata_counters (results)", results);
+		results = NULL;
+	}
+
+Done:
+	if (debug > 1) mrlog("perfdata_counters returns %p", results);
+	big_free("perfdata_counters (ci)", ci);
+	return results;
+}
+
+void free_perfcounters(struct perfcounter *pc)
+{
+	int i;
+
+	if (debug > 1) mrlog("free_perfcounters(%p)", pc);
+
+	if (pc == NULL) return;
+
+	if (pc[0].instance == NULL) {
+		big_free("free_perfcounters (value)", pc[0].value);
+		big_free("free_perfcounters (table)", pc);
+		return;
+	}
+
+	for (i = 0; pc[i].instance; i++) {
+		big_free("free_perfcounters (instance)", pc[i].instance);
+		big_free("free_perfcounters (value)", pc[i].value);
+	}
+	big_free("free_perfcounters (table)", pc);
+	return;
+}
+
+void print_perfcounters(struct perfcounter *pc, int ncounters)
+{
+	int i, j;
+
+	if (debug > 1) mrlog("print_perfcounters(%p, %d)", pc, ncounters);
+
+	if (pc == NULL) {
+		printf("No counters\n");
+		return;
+	}
+
+	if (pc[0].instance == NULL) {
+		printf("No instances. Values:\n");
+		for (j = 0; j < ncounters; j++) {
+			printf("%d\t%ld\n", j, (long)pc[0].value[j]);
+		}
+		return;
+	}
+
+	for (i = 0; pc[i].instance; i++) {
+		printf("Instance '%s':\n", pc[i].instance);
+		for (j = 0; j < ncounters; j++) {
+			printf("%d\t%ld\n", j, (long)pc[i].value[j]);
+		}
+	}
+}
+
+#ifdef STANDALONE
+/*
+Benchmark the parser on a captured data block, or on a made up one
+shaped like the Process object (230) of a busy server.
+
+	gcc -O2 -DSTANDALONE -o perfdata perfdata.c
+	./perfdata [-w file] [file]
+
+A captured block is the raw value returned by RegQueryValueEx for
+HKEY_PERFORMANCE_DATA, written to a file as is. -w writes the made up
+block to a file instead.
+*/
+
+#define NITER 1000
+#define SYNTH_OBJECT 230
+#define SYNTH_COUNTERS 28
+#define SYNTH_INSTANCES 400
+
+static BYTE *synth_block(DWORD *len)
+{
+	static WCHAR sig[4] = {'P', 'E', 'R', 'F'};
+	DWORD cblen = 8+8*SYNTH_COUNTERS;
+	DWORD deflen = sizeof(PERF_OBJECT_TYPE)+
+			SYNTH_COUNTERS*sizeof(PERF_COUNTER_DEFINITION);
+	DWORD instlen = sizeof(PERF_INSTANCE_DEFINITION)+32+cblen;
+	DWORD size = sizeof(PERF_DATA_BLOCK)+deflen+SYNTH_INSTANCES*instlen;
+	BYTE *data = big_malloc("synth_block", size), *p;
+	PERF_DATA_BLOCK *bp = (PERF_DATA_BLOCK *)data;
+	PERF_OBJECT_TYPE *op;
+	PERF_COUNTER_DEFINITION *cd;
+	PERF_INSTANCE_DEFINITION *id;
+	PERF_COUNTER_BLOCK *cb;
+	WCHAR *name;
+	char b[32];
+	int i, j;
+
+	memset(data, 0, size);
+	memcpy(bp->Signature, sig, sizeof sig);
+	bp->LittleEndian = 1;
+	bp->Version = 1;
+	bp->TotalByteLength = size;
+	bp->HeaderLength = sizeof *bp;
+	bp->NumObjectTypes = 1;
+
+	op = (PERF_OBJECT_TYPE *)(data+bp->HeaderLength);
+	op->TotalByteLength = size-bp->HeaderLength;
+	op->DefinitionLength = deflen;
+	op->HeaderLength = sizeof *op;
+	op->ObjectNameTitleIndex = SYNTH_OBJECT;
+	op->NumCounters = SYNTH_COUNTERS;
+	op->NumInstances = SYNTH_INSTANCES;
+	op->PerfTime.QuadPart = 123456789;
+	op->PerfFreq.QuadPart = 10000000;
+
+	cd = (PERF_COUNTER_DEFINITION *)((BYTE *)op+op->HeaderLength);
+	for (j = 0; j < SYNTH_COUNTERS; j++) {
+		cd[j].ByteLength = sizeof *cd;
+		cd[j].CounterNameTitleIndex = 2+2*j;
+		cd[j].CounterSize = 8;
+		cd[j].CounterOffset = 8+8*j;
+	}
+
+	p = (BYTE *)op+deflen;
+	for (i = 0; i < SYNTH_INSTANCES; i++) {
+		id = (PERF_INSTANCE_DEFINITION *)p;
+		id->ByteLength = sizeof *id+32;
+		id->NameOffset = sizeof *id;
+		id->UniqueID = -1;
+		name = (WCHAR *)(p+id->NameOffset);
+		if (i == SYNTH_INSTANCES-1) snprintf(b, sizeof b, "_Total");
+		else snprintf(b, sizeof b, "process%d", i);
+		for (j = 0; b[j]; j++) name[j] = b[j];
+		id->NameLength = 2*(j+1);
+		cb = (PERF_COUNTER_BLOCK *)(p+id->ByteLength);
+		cb->ByteLength = cblen;
+		for (j = 0; j < SYNTH_COUNTERS; j++) {
+			uint64_t v = (uint64_t)i*1000+j;
+			memcpy((BYTE *)cb+8+8*j, &v, sizeof v);
+		}
+		p += instlen;
+	}
+	*len = size;
+	return data;
+}
+
+static BYTE *read_block(char *fn, DWORD *len)
+{
+	FILE *fp = fopen(fn, "rb");
+	BYTE *data;
+	long n;
+
+	if (fp == NULL) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+	fseek(fp, 0, SEEK_END);
+	n = ftell(fp);
+	rewind(fp);
+	data = big_malloc("read_block", n);
+	if (fread(data, 1, n, fp) != n) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+	fclose(fp);
+	*len = n;
+	return data;
+}
+
+int main(int argc, char **argv)
+{
+	PERF_DATA_BLOCK *bp;
+	PERF_OBJECT_TYPE *op, *o2;
+	PERF_COUNTER_DEFINITION *cd;
+	struct perfcounter *pc;
+	struct counter_info ci[65];
+	struct perfinst it;
+	DWORD counters[65], len;
+	BYTE *data;
+	FILE *fp;
+	char name[64];
+	int a, i, j, n, more, total;
+	uint64_t sum;
+	clock_t t0, t1;
+
+	if (argc > 2 && !strcmp(argv[1], "-w")) {
+		data = synth_block(&len);
+		fp = fopen(argv[2], "wb");
+		if (fp == NULL || fwrite(data, 1, len, fp) != len) {
+			perror(argv[2]);
+			return EXIT_FAILURE;
+		}
+		fclose(fp);
+		big_free("main", data);
+		return 0;
+	}
+	if (argc > 1) data = read_block(argv[1], &len);
+	else data = synth_block(&len);
+	bp = (PERF_DATA_BLOCK *)data;
+	if (len < sizeof *bp) {
+		fprintf(stderr, "short block\n");
+		return EXIT_FAILURE;
+	}
+	printf("%lu bytes, %lu objects\n",
+		(unsigned long)len, (unsigned long)bp->NumObjectTypes);
+
+	/* Every counter of every object */
+	op = first_object(bp);
+	for (a = 0; a < bp->NumObjectTypes; a++) {
+		if (perfdata_object(bp, len, op->ObjectNameTitleIndex) != op) {
+			fprintf(stderr, "object %d is broken\n", a);
+			return EXIT_FAILURE;
+		}
+		cd = first_counter(op);
+		for (j = n = 0; j < op->NumCounters && n < 64; j++) {
+			counters[n++] = cd->CounterNameTitleIndex & ~1;
+			cd = next_counter(cd);
+		}
+		counters[n] = 0;
+		t0 = clock();
+		for (i = 0; i < NITER; i++) {
+			o2 = perfdata_object(bp, len, op->ObjectNameTitleIndex);
+			pc = perfdata_counters(o2, counters, NULL, NULL);
+			free_perfcounters(pc);
+		}
+		t1 = clock();
+		printf("object %lu: %ld instances, %d counters, %.3f us/copy\n",
+			(unsigned long)op->ObjectNameTitleIndex,
+			(long)op->NumInstances, n,
+			1e6*(t1-t0)/CLOCKS_PER_SEC/NITER);
+
+		/* The same values in place, and a lookup of _Total */
+		sum = 0;
+		total = 0;
+		t0 = clock();
+		for (i = 0; i < NITER; i++) {
+			o2 = perfdata_object(bp, len, op->ObjectNameTitleIndex);
+			perfdata_layout(o2, counters, ci);
+			for (more = perfinst_first(o2, &it); more; more = perfinst_next(&it)) {
+				for (j = 0; j < n; j++) sum += perfinst_value(&it, ci+j);
+				if (perfinst_is(&it, "_Total")) total++;
+			}
+		}
+		t1 = clock();
+		printf("object %lu: %.3f us/iteration, _Total found %d times, sum %llu\n",
+			(unsigned long)op->ObjectNameTitleIndex,
+			1e6*(t1-t0)/CLOCKS_PER_SEC/NITER, total,
+			(unsigned long long)sum);
+		op = next_object(op);
+	}
+
+	/* A name reaching past its instance is not read */
+	if (argc == 1) {
+		op = perfdata_object(bp, len, SYNTH_OBJECT);
+		for (more = perfinst_first(op, &it); more; more = perfinst_next(&it)) {
+			if (perfinst_is(&it, "_Total")) break;
+		}
+		if (!more) return EXIT_FAILURE;
+		it.id->NameLength = it.id->ByteLength;
+		if (perfinst_is(&it, "_Total") ||
+		    strcmp(perfinst_name(&it, name, sizeof name), "")) {
+			printf("name out of bounds: FAILED\n");
+			return EXIT_FAILURE;
+		}
+		printf("name out of bounds: ok\n");
+
+		/* Counter definitions reaching past the object, or stuck */
+		op->DefinitionLength = op->TotalByteLength+64;
+		if (perfdata_object(bp, len, SYNTH_OBJECT) != NULL) {
+			printf("definitions out of bounds: FAILED\n");
+			return EXIT_FAILURE;
+		}
+		op->DefinitionLength = sizeof *op+
+			SYNTH_COUNTERS*sizeof(PERF_COUNTER_DEFINITION);
+		first_counter(op)[3].ByteLength = 0;
+		counters[0] = 2+2*1;
+		counters[1] = 2+2*5;
+		counters[2] = 0;
+		if (perfdata_offsets(op, counters, ci) != 1 || ci[1].size) {
+			printf("definitions out of bounds: FAILED\n");
+			return EXIT_FAILURE;
+		}
+		printf("definitions out of bounds: ok\n");
+	}
+	big_free("main", data);
+	return 0;
+}
+#endif
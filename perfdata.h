@@ -0,0 +1,130 @@
+/* Parsing the performance data block.
+
+RegQueryValueEx(HKEY_PERFORMANCE_DATA, ...) returns a PERF_DATA_BLOCK
+with the requested objects in it. readperf.c fetches the block, this
+part finds objects, counters and instances in it. It does not call
+Windows, so it can be run on captured blocks on any platform.
+*/
+
+#ifdef STANDALONE
+#include <stdint.h>
+
+/* The parts of winperf.h we use, laid out as on Win64 */
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint16_t WCHAR;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef union {
+	int64_t QuadPart;
+} LARGE_INTEGER;
+
+typedef struct {
+	WORD wYear, wMonth, wDayOfWeek, wDay;
+	WORD wHour, wMinute, wSecond, wMilliseconds;
+} SYSTEMTIME;
+
+typedef struct {
+	WCHAR Signature[4];
+	DWORD LittleEndian;
+	DWORD Version;
+	DWORD Revision;
+	DWORD TotalByteLength;
+	DWORD HeaderLength;
+	DWORD NumObjectTypes;
+	LONG DefaultObject;
+	SYSTEMTIME SystemTime;
+	LARGE_INTEGER PerfTime;
+	LARGE_INTEGER PerfFreq;
+	LARGE_INTEGER PerfTime100nSec;
+	DWORD SystemNameLength;
+	DWORD SystemNameOffset;
+} PERF_DATA_BLOCK;
+
+typedef struct {
+	DWORD TotalByteLength;
+	DWORD DefinitionLength;
+	DWORD HeaderLength;
+	DWORD ObjectNameTitleIndex;
+	DWORD ObjectNameTitle;
+	DWORD ObjectHelpTitleIndex;
+	DWORD ObjectHelpTitle;
+	DWORD DetailLevel;
+	DWORD NumCounters;
+	LONG DefaultCounter;
+	LONG NumInstances;
+	DWORD CodePage;
+	LARGE_INTEGER PerfTime;
+	LARGE_INTEGER PerfFreq;
+} PERF_OBJECT_TYPE;
+
+typedef struct {
+	DWORD ByteLength;
+	DWORD CounterNameTitleIndex;
+	DWORD CounterNameTitle;
+	DWORD CounterHelpTitleIndex;
+	DWORD CounterHelpTitle;
+	LONG DefaultScale;
+	DWORD DetailLevel;
+	DWORD CounterType;
+	DWORD CounterSize;
+	DWORD CounterOffset;
+} PERF_COUNTER_DEFINITION;
+
+typedef struct {
+	DWORD ByteLength;
+	DWORD ParentObjectTitleIndex;
+	DWORD ParentObjectInstance;
+	LONG UniqueID;
+	DWORD NameOffset;
+	DWORD NameLength;
+} PERF_INSTANCE_DEFINITION;
+
+typedef struct {
+	DWORD ByteLength;
+} PERF_COUNTER_BLOCK;
+
+#define PERF_NO_INSTANCES (-1)
+#endif
+
+/*
+If there are no instances, read_perfcounters returns a single struct
+perfcounter where the instance field is NULL.
+
+If there are instances, it returns an array of struct perfcounter
+where each element has the instance name in the instance field. The
+end of the array is marked by an element with a NULL instance field.
+*/
+struct perfcounter {
+	char *instance;
+	uint64_t *value;
+};
+
+struct counter_info {
+	DWORD size, offset;
+};
+
+/* One instance of an object, pointing into the data block. Objects
+   without instances have a single one with id == NULL. */
+struct perfinst {
+	PERF_OBJECT_TYPE *op;
+	PERF_INSTANCE_DEFINITION *id;
+	PERF_COUNTER_BLOCK *cb;
+	LONG i;
+};
+
+extern PERF_OBJECT_TYPE *perfdata_object(PERF_DATA_BLOCK *bp, DWORD len,
+			DWORD object);
+extern int perfdata_offsets(PERF_OBJECT_TYPE *op, DWORD *counters,
+			struct counter_info *ci);
+extern int perfdata_layout(PERF_OBJECT_TYPE *op, DWORD *counters,
+			struct counter_info *ci);
+extern int perfinst_first(PERF_OBJECT_TYPE *op, struct perfinst *it);
+extern int perfinst_next(struct perfinst *it);
+extern int perfinst_is(struct perfinst *it, char *name);
+extern char *perfinst_name(struct perfinst *it, char *b, size_t n);
+extern uint64_t perfinst_value(struct perfinst *it, struct counter_info *ci);
+extern struct perfcounter *perfdata_counters(PERF_OBJECT_TYPE *op,
+			DWORD *counters, long long *perf_time, long long *perf_freq);
+extern void free_perfcounters(struct perfcounter *pc);
+extern void print_perfcounters(struct perfcounter *pc, int ncounters);
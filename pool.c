@@ -0,0 +1,160 @@
+#include "mrbig.h"
+
+/*
+int pool_run(struct pool_job *jobs, int njobs, int nworkers)
+
+Run a table of jobs on at most nworkers threads and wait for them.
+
+Jobs that are still running from an earlier call are skipped.
+A job with a nonzero budget (in seconds) is abandoned when it has
+been running for longer than that: pool_run stops waiting for it
+and starts a replacement worker so the remaining jobs still get
+nworkers threads. The abandoned job keeps the POOL_RUNNING state
+until it eventually returns, which keeps later calls from starting
+a second copy of it. The jobs table must therefore outlive the call
+if any job has a budget.
+
+Returns the number of jobs that did not complete during the call.
+*/
+
+struct pool {
+	struct pool_job *jobs;
+	int njobs;
+	volatile LONG next;
+	volatile LONG refs;
+	HANDLE done;
+};
+
+static void pool_release(struct pool *p)
+{
+	if (InterlockedDecrement(&p->refs) == 0) {
+		CloseHandle(p->done);
+		big_free("pool_release", p);
+	}
+}
+
+static DWORD WINAPI pool_worker(LPVOID arg)
+{
+	struct pool *p = arg;
+	struct pool_job *j;
+	LONG i;
+
+	while ((i = InterlockedIncrement(&p->next)-1) < p->njobs) {
+		j = &p->jobs[i];
+		/* Nobody else takes job i off the queue, so started can be
+		   set first; pool_run must never see a running job with
+		   the start time of an earlier run */
+		if (j->state != POOL_QUEUED) continue;
+		j->started = GetTickCount();
+		if (InterlockedCompareExchange(&j->state,
+				POOL_RUNNING, POOL_QUEUED) != POOL_QUEUED) {
+			continue;
+		}
+		if (debug > 1) mrlog("pool_worker: starting %s", j->name);
+		j->fn(j->arg);
+		if (debug > 1) mrlog("pool_worker: %s done after %lu ms",
+			j->name, (unsigned long)(GetTickCount()-j->started));
+		InterlockedExchange(&j->state, POOL_IDLE);
+		SetEvent(p->done);
+	}
+	pool_release(p);
+	return 0;
+}
+
+static int pool_spawn(struct pool *p)
+{
+	HANDLE h;
+
+	InterlockedIncrement(&p->refs);
+	h = CreateThread(NULL, 0, pool_worker, p, 0, NULL);
+	if (h == NULL) {
+		mrlog("pool_spawn: CreateThread failed (%d)",
+			(int)GetLastError());
+		pool_release(p);
+		return 0;
+	}
+	CloseHandle(h);
+	return 1;
+}
+
+int pool_run(struct pool_job *jobs, int njobs, int nworkers)
+{
+	struct pool *p;
+	char *abandoned;
+	int i, n, pending, lost;
+	DWORD elapsed;
+
+	if (debug > 1) mrlog("pool_run(%p, %d, %d)", jobs, njobs, nworkers);
+
+	if (njobs <= 0) return 0;
+	if (nworkers < 1) nworkers = 1;
+
+	abandoned = big_malloc("pool_run (abandoned)", njobs);
+
+	lost = 0;
+	n = 0;
+	for (i = 0; i < njobs; i++) {
+		abandoned[i] = 0;
+		if (InterlockedCompareExchange(&jobs[i].state,
+				POOL_QUEUED, POOL_IDLE) != POOL_IDLE) {
+			mrlog("pool_run: %s is still running, skipping",
+				jobs[i].name);
+			abandoned[i] = 1;
+			lost++;
+			continue;
+		}
+		n++;
+	}
+
+	/* Everything is still running from last time */
+	if (n == 0) {
+		big_free("pool_run (abandoned)", abandoned);
+		if (debug > 1) mrlog("pool_run returns %d", lost);
+		return lost;
+	}
+	if (nworkers > n) nworkers = n;
+
+	p = big_malloc("pool_run (pool)", sizeof *p);
+	p->jobs = jobs;
+	p->njobs = njobs;
+	p->next = 0;
+	p->refs = 1;	/* our own reference */
+	p->done = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	/* Without threads we can still do the work ourselves */
+	if (p->done == NULL) nworkers = 0;
+	for (i = 0; i < nworkers; i++) {
+		if (!pool_spawn(p)) break;
+	}
+	if (i == 0) {
+		mrlog("pool_run: no workers, running jobs serially");
+		InterlockedIncrement(&p->refs);
+		pool_worker(p);
+	}
+
+	for (;;) {
+		pending = 0;
+		for (i = 0; i < njobs; i++) {
+			if (abandoned[i] || jobs[i].state == POOL_IDLE) continue;
+			if (jobs[i].state == POOL_RUNNING && jobs[i].budget > 0) {
+				elapsed = GetTickCount()-jobs[i].started;
+				if (elapsed > (DWORD)jobs[i].budget*1000) {
+					mrlog("pool_run: %s exceeded its budget of %d seconds, abandoning",
+						jobs[i].name, jobs[i].budget);
+					abandoned[i] = 1;
+					lost++;
+					pool_spawn(p);
+					continue;
+				}
+			}
+			pending++;
+		}
+		if (pending == 0) break;
+		WaitForSingleObject(p->done, 1000);
+	}
+
+	big_free("pool_run (abandoned)", abandoned);
+	pool_release(p);
+	if (debug > 1) mrlog("pool_run returns %d", lost);
+	return lost;
+}
@@ -10,14 +10,22 @@ green Tue Jul 06 02:43:47 VS 2004 [ntserver] All processes are OK
 
 
 //  Forward declarations:
-static BOOL GetProcessList(void);
 //static void printError(TCHAR * msg);
 
-struct proc {
-	char *name;
+/* Open addressing hash table keyed on a name, ignoring case. Used for
+   the process counts and for finding the report for a machine. */
+struct slot {
+	char *name;		/* NULL for an empty slot */
+	unsigned long hash;
 	int count;
-	struct proc *next;
-} *plist;
+	struct report *report;
+};
+
+struct table {
+	struct slot *slots;
+	unsigned long mask;
+	int n;
+};
 
 struct cfg {
 	char *name;
@@ -27,13 +35,13 @@ struct cfg {
 } *pcfg;
 
 struct report {
-	char str[5000];
+	struct sbuf str;
 	char *machine;
 	char *color;
 	struct report *next;
 } *preports_procs;
 
-static void read_proccfg(/*char *p*/)
+static void read_proccfg(struct mrcfg *mc)
 {
 	struct cfg *pc;
 	char b[100], name[100];
@@ -65,72 +73,121 @@ static void read_proccfg(/*char *p*/)
 			pc->machine = big_strdup("procs (machine)", machine);
 		}
 		else
-			pc->machine = big_strdup("procs (machine)", mrmachine);
+			pc->machine = big_strdup("procs (machine)", mc->machine);
 		pc->next = pcfg;
 		pcfg = pc;
 	}
 }
 
-static struct proc *lookup_procname(char *p)
+static unsigned long hash_name(const char *p)
 {
-	struct proc *pl;
+	unsigned long h = 2166136261UL;
 
-	for (pl = plist; pl; pl = pl->next) {
-		if (!strcasecmp(pl->name, p)) {
-			return pl;
-		}
+	while (*p) {
+		h ^= (unsigned char)tolower((unsigned char)*p++);
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static void table_init(struct table *t, int n)
+{
+	unsigned long size = 16;
+
+	while (size < 2*(unsigned long)n) size *= 2;
+	t->slots = big_malloc("table_init", size*sizeof *t->slots);
+	memset(t->slots, 0, size*sizeof *t->slots);
+	t->mask = size-1;
+	t->n = 0;
+}
+
+static void table_free(struct table *t)
+{
+	big_free("table_free", t->slots);
+}
+
+/* Returns the slot for name, which is empty if it isn't there */
+static struct slot *table_find(struct table *t, char *name)
+{
+	unsigned long h = hash_name(name);
+	unsigned long i = h & t->mask;
+	struct slot *s;
+
+	for (;; i = (i+1) & t->mask) {
+		s = &t->slots[i];
+		if (s->name == NULL) break;
+		if (s->hash == h && !strcasecmp(s->name, name)) break;
 	}
-	pl = big_malloc("lookup_procname (node)", sizeof *pl);
-	pl->name = big_strdup("lookup_procname (name)", p);
-	pl->next = plist;
-	pl->count = 0;
-	plist = pl;
-	return pl;
+	s->hash = h;
+	return s;
 }
 
-static void store_procname(char *p)
+/* Returns the slot for name, adding it if needed. The table never
+   gets more than half full, since it is sized for all names up front. */
+static struct slot *table_add(struct table *t, char *name)
 {
-	struct proc *pl = lookup_procname(p);
+	struct slot *s = table_find(t, name);
 
-	pl->count++;
+	if (s->name == NULL) {
+		s->name = name;
+		t->n++;
+	}
+	return s;
 }
 
-void procs(void)
+void procs(struct mrcfg *mc)
 {
-	char b[5000];
-	int n = sizeof b;
+	struct sbuf b;
 	char cfgfile[1024];
-	struct proc *pl;
 	struct cfg *pc;
-	int m, running, unique;
-	plist = NULL;
+	int m, ncfg, running, unique;
 	struct report *rep;
+	struct table procs, machines;
+	struct slot *s;
+	clog_ProcSnap *ps;
+	DWORD i;
 	char *mycolor;
 
+	if (debug > 1) mrlog("procs()");
+
+	if (get_option(mc, "no_procs", 0)) {
+		mrsend(mc->machine, "procs", "clear", "option no_procs\n");
+		return;
+	}
+
 	preports_procs = big_malloc("procs (report)", sizeof(struct report));
-	preports_procs->machine = big_strdup("procs (report->machine)", mrmachine);
+	preports_procs->machine = big_strdup("procs (report->machine)", mc->machine);
 	preports_procs->next = NULL;
-	preports_procs->str[0] = 0;
+	sb_init(&preports_procs->str, 0);
 	preports_procs->color = "green";
 
-	if (debug > 1) mrlog("procs(%p, %d)", b, n);
+	cfgfile[0] = '\0';
+	snprcat(cfgfile, sizeof cfgfile, "%s%c%s", mc->cfgdir, dirsep, "procs.cfg");
+	read_cfg("procs", cfgfile);
+	read_proccfg(mc);
 
-	if (get_option("no_procs", 0)) {
-		mrsend(mrmachine, "procs", "clear", "option no_procs\n");
-		return;
+	/* Count every name in one pass, then each rule is one lookup */
+	ps = clog_procsnap_Get();
+	if (ps && ps->ErrorCode) {
+		mrlog("procs: can't get process list (%lu)", (unsigned long)ps->ErrorCode);
+	}
+	table_init(&procs, ps ? ps->NumRows : 0);
+	running = 0;
+	for (i = 0; ps && i < ps->NumRows; i++) {
+		table_add(&procs, ps->Rows[i].Name)->count++;
+		running++;
 	}
+	unique = procs.n;
 
-	cfgfile[0] = '\0';
-	snprcat(cfgfile, sizeof cfgfile, "%s%c%s", cfgdir, dirsep, "procs.cfg");
-	read_cfg("procs", cfgfile);
-	read_proccfg(/*cfgfile*/);
-	GetProcessList();
+	ncfg = 1;
+	for (pc = pcfg; pc; pc = pc->next) ncfg++;
+	table_init(&machines, ncfg);
+	table_add(&machines, preports_procs->machine)->report = preports_procs;
 
 	while (pcfg) {
 		pc = pcfg;
 		pcfg = pc->next;
-		pl = lookup_procname(pc->name);
-		m = pl->count;
+		m = table_find(&procs, pc->name)->count;
 		if (m < pc->min || m > pc->max) {
 			mycolor = "red";
 		} else {
@@ -138,54 +195,51 @@ void procs(void)
 		}
 //		p[0] = '\0';
 
-		for(rep = preports_procs; rep; rep = rep->next) {
-			if (!strcmp(pc->machine, rep->machine)) {
-				break;
-			}
-		}
-
+		s = table_find(&machines, pc->machine);
+		rep = s->report;
 		if (rep == NULL) {
 			rep = big_malloc("procs (report)", sizeof(struct report));
 			rep->next = preports_procs;
 			rep->machine = big_strdup("procs (report->machine)", pc->machine);
-			rep->str[0] = 0;
+			sb_init(&rep->str, 0);
 			rep->color = "green";
 			preports_procs = rep;
+			s = table_add(&machines, rep->machine);
+			s->report = rep;
 		}
 		if (strcmp(mycolor, "green")) {
 			// if any process is non-green, report goes red
 			rep->color = "red";
 		}
-		snprcat(rep->str, sizeof rep->str, "&%s %s - %d running (min %d, max %d)\n",
+		sb_printf(&rep->str, "&%s %s - %d running (min %d, max %d)\n",
 			mycolor, pc->name, m, pc->min, pc->max);
 //		strlcat(q, p, sizeof q);
 		big_free("procs (pc->name)", pc->name);
 		big_free("procs (pc->machine)", pc->machine);
 		big_free("procs (pc)", pc);
 	}
-	running = 0;
-	unique = 0;
-	while (plist) {
-		pl = plist;
-		plist = pl->next;
-		if (debug > 1) {
-			mrlog("Found %d instances of process '%s'", pl->count, pl->name);
+	if (debug > 1) {
+		for (i = 0; i <= procs.mask; i++) {
+			s = &procs.slots[i];
+			if (s->name == NULL) continue;
+			mrlog("Found %d instances of process '%s'", s->count, s->name);
 		}
-		running += pl->count;
-		unique++;
-		big_free("procs (pl->name)", pl->name);
-		big_free("procs (pl)", pl);
 	}
+	table_free(&machines);
+	table_free(&procs);
+	clog_procsnap_Release(ps);
 
 	rep = preports_procs;
 	while (rep) {
 		struct report* prev;
-		b[0] = '\0';
-		snprcat(b, n, "%s\n\n%s\nTotal %d processes running (%d unique)\n",
-			now, rep->str, running, unique);
-		mrsend(rep->machine, "procs", rep->color, b);
+		sb_init(&b, 0);
+		sb_printf(&b, "%s\n\n%s\nTotal %d processes running (%d unique)\n",
+			mc->now, rep->str.s, running, unique);
+		mrsendn(rep->machine, "procs", rep->color, b.s, b.len);
+		sb_free(&b);
 		prev = rep;
 		rep = rep->next;
+		sb_free(&prev->str);
 		big_free("procs (report->machine)", prev->machine);
 		big_free("procs (report)", prev);
 	}
@@ -193,57 +247,6 @@ void procs(void)
 }
 
 
-/* Works for NT 4 and up; requires psapi.dll */
-void PrintProcessNameAndID( DWORD processID )
-{
-    TCHAR szProcessName[MAX_PATH] = TEXT("<unknown>");
-
-    // Get a handle to the process.
-
-    HANDLE hProcess = OpenProcess( PROCESS_QUERY_INFORMATION |
-                                   PROCESS_VM_READ,
-                                   FALSE, processID );
-
-    // Get the process name.
-
-    if (NULL != hProcess )
-    {
-        HMODULE hMod;
-        DWORD cbNeeded;
-
-        if ( EnumProcessModules( hProcess, &hMod, sizeof(hMod),
-             &cbNeeded) )
-        {
-            GetModuleBaseName( hProcess, hMod, szProcessName,
-                               sizeof(szProcessName)/sizeof(TCHAR) );
-        }
-    }
-
-    store_procname(szProcessName);
-    CloseHandle( hProcess );
-}
-
-static BOOL GetProcessList(void)
-{
-    // Get the list of process identifiers.
-
-    DWORD aProcesses[1024], cbNeeded, cProcesses;
-    unsigned int i;
-
-    if ( !EnumProcesses( aProcesses, sizeof(aProcesses), &cbNeeded ) )
-        return FALSE;
-
-    // Calculate how many process identifiers were returned.
-
-    cProcesses = cbNeeded / sizeof(DWORD);
-
-    // Print the name and process identifier for each process.
-
-    for ( i = 0; i < cProcesses; i++ )
-        PrintProcessNameAndID( aProcesses[i] );
-    return TRUE;
-}
-
 #if 0	/* unused */
 static void printError(TCHAR * msg)
 {
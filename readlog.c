@@ -1,40 +1,86 @@
 #include "mrbig.h"
+#include "clientlog/pubcache.h"
 #include <winevt.h>
 
 #define EVENT_READ_TIMEOUT (1000)
 #define MAX_PROVIDER_NAME_LENGTH (255)
 #define MAX_EVENT_MESSAGE_SIZE (0x2000) // 8 KB
 #define EVENT_BATCH_SIZE (255)          // Number of events to fetch for each iteration of each log. When "fast" is enabled, do not fetch more events for that log
+#define RENDER_BUFFER_SIZE (0x1000)     // Initial size in bytes for the system properties of one event
 
 typedef struct Channel {
     WCHAR Name[256];
 } Channel;
 
-struct event *get_event_data(EVT_HANDLE eventHandle) {
-
-    struct event *result = NULL;
+/* The event log side of evlog.c: an evlog_provider reading one channel */
+struct winlog {
+    char *log;
+    EVT_HANDLE query;
+    EVT_HANDLE events[EVENT_BATCH_SIZE];
+    DWORD n, i;
+    int fast, batches;
+    EVT_HANDLE context;     // system render context, shared by all events in the pass
+    EVT_VARIANT *props;
+    DWORD propsSize;        // bytes
+    WCHAR *message;
+    DWORD messageSize;      // characters
+    EVT_HANDLE current;     // the last event returned, kept open for winlog_format
+    LPCWSTR provider;       // points into props
+    clog_PubCache *publishers;
+};
+
+static void *open_publisher(const wchar_t *provider) {
+    return EvtOpenPublisherMetadata(NULL, provider, NULL, 0, 0);
+}
 
-    // Follows general steps of .Net (C#) class EventLogRecord.cs, from System.Diagnostics.Reader
-    EVT_HANDLE contextHandle = EvtCreateRenderContext(0, NULL, EvtRenderContextSystem);
+static void close_publisher(void *handle) {
+    EvtClose(handle);
+}
 
-    DWORD bufferNeeded, propCount;
-    BOOL status = EvtRender(contextHandle, eventHandle, EvtRenderEventValues, 0, NULL, &bufferNeeded, &propCount);
+static BOOL format_message(struct winlog *w, EVT_HANDLE pmHandle, EVT_HANDLE eventHandle) {
+    DWORD bufferNeeded;
+    BOOL status = EvtFormatMessage(pmHandle, eventHandle, 0, 0, NULL, EvtFormatMessageEvent, w->messageSize, w->message, &bufferNeeded);
     DWORD error = GetLastError();
-    if (error != ERROR_INSUFFICIENT_BUFFER) {
-
-        EvtClose(contextHandle);
-        return result;
+    if (!status && error == ERROR_INSUFFICIENT_BUFFER) {
+        w->message = big_realloc("format_message", w->message, bufferNeeded * sizeof(WCHAR));
+        w->messageSize = bufferNeeded;
+        status = EvtFormatMessage(pmHandle, eventHandle, 0, 0, NULL, EvtFormatMessageEvent, w->messageSize, w->message, &bufferNeeded);
+        error = GetLastError();
     }
+    // EventLogRecord says: Unresolved inserts are indications that strings COULD be missing, and are not real errors
+    return status ||
+           error == ERROR_EVT_UNRESOLVED_VALUE_INSERT ||
+           error == ERROR_EVT_UNRESOLVED_PARAMETER_INSERT;
+}
 
-    EVT_VARIANT eventSystemProperties[bufferNeeded / sizeof(EVT_VARIANT)];
-    status = EvtRender(contextHandle, eventHandle, EvtRenderEventValues, bufferNeeded, eventSystemProperties, &bufferNeeded, &propCount);
-    if (!status) {
+// Only called for events that a rule or the report needs the message for
+static void winlog_format(struct event *e) {
+    struct winlog *w = e->handle;
 
-        EvtClose(contextHandle);
-        return result;
+    if (w->current == NULL || w->provider == NULL) return;
+    EVT_HANDLE pmHandle = clog_pubcache_Get(w->publishers, w->provider); // We cannot use e->source, since we need wchar_t*
+    if (format_message(w, pmHandle, w->current)) {
+        char message_buf[MAX_EVENT_MESSAGE_SIZE];
+        size_t message_len = wcstombs(message_buf, w->message, MAX_EVENT_MESSAGE_SIZE);
+        if (message_len >= MAX_EVENT_MESSAGE_SIZE) message_buf[MAX_EVENT_MESSAGE_SIZE - 1] = '\0';
+        e->message = big_strdup("winlog_format", message_buf);
     }
+}
+
+static BOOL get_event_data(struct winlog *w, EVT_HANDLE eventHandle, struct event *result) {
 
-    result = big_malloc("get_event_data (result)", sizeof(struct event));
+    // Follows general steps of .Net (C#) class EventLogRecord.cs, from System.Diagnostics.Reader
+    DWORD bufferNeeded, propCount;
+    BOOL status = EvtRender(w->context, eventHandle, EvtRenderEventValues, w->propsSize, w->props, &bufferNeeded, &propCount);
+    if (!status && GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+        w->props = big_realloc("get_event_data (props)", w->props, bufferNeeded);
+        w->propsSize = bufferNeeded;
+        status = EvtRender(w->context, eventHandle, EvtRenderEventValues, w->propsSize, w->props, &bufferNeeded, &propCount);
+    }
+    if (!status) {
+        return FALSE;
+    }
+    EVT_VARIANT *eventSystemProperties = w->props;
 
     EVT_VARIANT timestampPending = eventSystemProperties[EvtSystemTimeCreated];
     if (timestampPending.Type != EvtVarTypeNull) {
@@ -68,96 +114,156 @@ struct event *get_event_data(EVT_HANDLE eventHandle) {
         result->type = levelPending.ByteVal; // TODO convert
     }
 
-    if (providerName != NULL) {
-        // TODO: cache publisher handles like in .NET EventLogRecord.
-        EVT_HANDLE pmHandle = EvtOpenPublisherMetadata(NULL, providerName, NULL, 0, 0); // RE providerName. We cannot use result.Provider, since we need wchar_t*
-
-        WCHAR emptyBuffer[1] = {L'\0'}; // Due to: https://github.com/dotnet/runtime/issues/100198"
-        status = EvtFormatMessage(pmHandle, eventHandle, 0, 0, NULL, EvtFormatMessageEvent, 0, emptyBuffer, &bufferNeeded);
-        error = GetLastError();
+    // The message is formatted later, and only if it is needed
+    w->provider = providerName;
+    result->handle = w;
+    result->format = winlog_format;
+    return TRUE;
+}
 
-        if (!status && // EventLogRecord says: Unresolved inserts are indications that strings COULD be missing, and are not real errors
-            error != ERROR_EVT_UNRESOLVED_VALUE_INSERT &&
-            error != ERROR_EVT_UNRESOLVED_PARAMETER_INSERT &&
-            error != ERROR_INSUFFICIENT_BUFFER) {
+static int winlog_next(void *ctx, struct event *e) {
+    struct winlog *w = ctx;
 
-            EvtClose(pmHandle);
-            goto CLEANUP;
+    if (w->current) {
+        EvtClose(w->current);
+        w->current = NULL;
+    }
+    for (;;) {
+        while (w->i < w->n) {
+            EVT_HANDLE h = w->events[w->i++];
+            if (get_event_data(w, h, e)) {
+                w->current = h;
+                return 1;
+            }
+            EvtClose(h);
+            evlog_free_event(e);
         }
-
-        WCHAR messageBuffer[bufferNeeded];
-        status = EvtFormatMessage(pmHandle, eventHandle, 0, 0, NULL, EvtFormatMessageEvent, bufferNeeded, messageBuffer, &bufferNeeded);
-        EvtClose(pmHandle);
-        error = GetLastError();
-        if (!status &&
-            error != ERROR_EVT_UNRESOLVED_VALUE_INSERT &&
-            error != ERROR_EVT_UNRESOLVED_PARAMETER_INSERT) {
-
-            goto CLEANUP;
+        if (w->fast && w->batches) return 0;
+        w->n = w->i = 0;
+        if (!EvtNext(w->query, EVENT_BATCH_SIZE, w->events, EVENT_READ_TIMEOUT, 0, &w->n)) {
+            if (GetLastError() != ERROR_NO_MORE_ITEMS)
+                mrlog("read_log: Unable to iterate events in log %s, error code %lu", w->log, GetLastError());
+            w->n = 0;
+            return 0;
         }
+        w->batches++;
+    }
+}
 
-        char message_buf[MAX_EVENT_MESSAGE_SIZE];
-        size_t message_len = wcstombs(message_buf, messageBuffer, MAX_EVENT_MESSAGE_SIZE);
-        if (message_len >= MAX_EVENT_MESSAGE_SIZE) message_buf[MAX_EVENT_MESSAGE_SIZE - 1] = '\0';
-        result->message = big_strdup("get_event_data (message)", message_buf);
+static void winlog_close(void *ctx) {
+    struct winlog *w = ctx;
+
+    if (w->current) EvtClose(w->current);
+    while (w->i < w->n) EvtClose(w->events[w->i++]);
+    EvtClose(w->query);
+    if (w->context) EvtClose(w->context);
+    if (debug > 1) mrlog("winlog_close: publisher cache %lu hits, %lu misses", w->publishers->Hits, w->publishers->Misses);
+    big_free("winlog_close (props)", w->props);
+    big_free("winlog_close (message)", w->message);
+    big_free("winlog_close (log)", w->log);
+    big_free("winlog_close (winlog)", w);
+}
+
+/* Highest record number in the log, or -1 if it cannot be determined */
+static long long newest_record(WCHAR *wlog) {
+    EVT_HANDLE h = EvtOpenLog(NULL, wlog, EvtOpenChannelPath);
+    EVT_VARIANT v;
+    DWORD used;
+    long long oldest, count;
+
+    if (h == NULL) return -1;
+    if (!EvtGetLogInfo(h, EvtLogOldestRecordNumber, sizeof v, &v, &used)) {
+        EvtClose(h);
+        return -1;
     }
+    oldest = v.UInt64Val;
+    if (!EvtGetLogInfo(h, EvtLogNumberOfLogRecords, sizeof v, &v, &used)) {
+        EvtClose(h);
+        return -1;
+    }
+    count = v.UInt64Val;
+    EvtClose(h);
+    return count ? oldest + count - 1 : 0;
+}
 
-CLEANUP:
-    EvtClose(contextHandle);
-    if (result->source != NULL && result->message == NULL) result->message = "(No message)";
-    return result;
+static void free_publishers(void *p) {
+    clog_pubcache_Clear(p);
+    big_free("free_publishers", p);
 }
 
-struct event *read_log(char *log, int maxage, int fast) {
+/*
+Open a provider for the events in ls->name newer than the bookmark.
+Without a bookmark, read the last maxage seconds newest first.
+If the log has been cleared since the bookmark was taken, start over.
+When fast is set, only the newest batch of events is read per call,
+newest first, so the bookmark moves to the newest record and anything
+older than that batch is skipped rather than read on a later call.
+*/
+int read_log(struct logstate *ls, int maxage, int fast, struct evlog_provider *pv) {
     WCHAR wlog[128];
-    mbstowcs(wlog, log, 254);
+    WCHAR query[128];
+    DWORD flags = EvtQueryChannelPath;
+    long long newest = -1;
+
+    mbstowcs(wlog, ls->name, 127);
     wlog[127] = L'\0';
 
-    WCHAR query[128];
-    snwprintf(query, 128, L"Event/System[TimeCreated[timediff(@SystemTime) <= %d]]", maxage);
-    EVT_HANDLE hLog = EvtQuery(NULL, wlog, query, EvtQueryChannelPath | EvtQueryReverseDirection);
-    if (hLog == NULL) {
-        if (GetLastError() == 5) {
-            mrlog("read_log: Unable to read %s, Access Denied", log);
+    if (ls->bookmark) {
+        newest = newest_record(wlog);
+        evlog_cleared(ls, newest);
+    }
+
+    if (ls->bookmark) {
+        snwprintf(query, 128, L"Event/System[EventRecordID > %I64u]", (unsigned long long)ls->bookmark);
+        if (fast) {
+            // A busy log would otherwise leave us further behind every pass
+            if (newest - ls->bookmark > EVENT_BATCH_SIZE)
+                mrlog("read_log: %s is %lld events behind, skipping to the newest %d",
+                      ls->name, newest - ls->bookmark, EVENT_BATCH_SIZE);
+            flags |= EvtQueryReverseDirection;
         } else {
-            mrlog("read_log: Unable to read %s, error code %lu", log, GetLastError());
+            flags |= EvtQueryForwardDirection;
         }
-        return NULL;
-    }
-
-    EVT_HANDLE hEvents[EVENT_BATCH_SIZE];
-    DWORD numHandles = 0;
-    BOOL moreEvents;
-    struct event *events = NULL;
-    do {
-        moreEvents = EvtNext(hLog, EVENT_BATCH_SIZE, hEvents, EVENT_READ_TIMEOUT, 0, &numHandles);
-        if (moreEvents) {
-            for (int i = 0; i < numHandles; i++) {
-                struct event *e = get_event_data(hEvents[i]);
-                EvtClose(hEvents[i]);
-                e->next = events;
-                events = e;
-            }
+    } else {
+        snwprintf(query, 128, L"Event/System[TimeCreated[timediff(@SystemTime) <= %I64u]]", (unsigned long long)maxage * 1000);
+        flags |= EvtQueryReverseDirection;
+    }
+    EVT_HANDLE hLog = EvtQuery(NULL, wlog, query, flags);
+    if (hLog == NULL) {
+        if (GetLastError() == 5) {
+            mrlog("read_log: Unable to read %s, Access Denied", ls->name);
         } else {
-            if (GetLastError() != ERROR_NO_MORE_ITEMS)
-                mrlog("read_log: Unable to iterate events in log %s, error code %lu\n", log, GetLastError());
+            mrlog("read_log: Unable to read %s, error code %lu", ls->name, GetLastError());
         }
-    } while (!fast && moreEvents);
-    EvtClose(hLog);
-
-    return events;
-}
-
-void free_log(struct event *e) {
-    struct event *p;
+        return 0;
+    }
 
-    while (e) {
-        p = e;
-        e = p->next;
-        big_free("free_log(source)", p->source);
-        big_free("free_log(message)", p->message);
-        big_free("free_log(node)", p);
+    struct winlog *w = big_malloc("read_log (winlog)", sizeof *w);
+    w->log = big_strdup("read_log (log)", ls->name);
+    w->query = hLog;
+    w->n = w->i = 0;
+    w->fast = fast;
+    w->batches = 0;
+    w->current = NULL;
+    w->provider = NULL;
+    w->context = EvtCreateRenderContext(0, NULL, EvtRenderContextSystem);
+    w->propsSize = RENDER_BUFFER_SIZE;
+    w->props = big_malloc("read_log (props)", w->propsSize);
+    w->messageSize = MAX_EVENT_MESSAGE_SIZE;
+    w->message = big_malloc("read_log (message)", w->messageSize * sizeof(WCHAR));
+    // Publisher metadata handles are kept between passes and closed when
+    // the channel is reset. Each channel has its own cache, so that
+    // channels can be read at the same time.
+    if (ls->priv == NULL) {
+        ls->priv = big_malloc("read_log (publishers)", sizeof(clog_PubCache));
+        clog_pubcache_Init(ls->priv, open_publisher, close_publisher);
+        ls->free_priv = free_publishers;
     }
+    w->publishers = ls->priv;
+    pv->ctx = w;
+    pv->next = winlog_next;
+    pv->close = winlog_close;
+    return 1;
 }
 
 #if defined(STANDALONE)
@@ -171,8 +277,7 @@ void prettyEvent(struct event e) {
 }
 
 int main(int argv, char **argc) {
-    time_t t0 = 1000 * 60 * 60 * 24 * 7;
-    time_t msgage = 0;
+    int msgage = 60 * 60 * 24 * 7;
     char *fastmsgs_mode = "123123123123123312312312";
     int fastfile = FALSE;
     HKEY hTestKey;
@@ -214,11 +319,18 @@ int main(int argv, char **argc) {
                                    NULL, NULL, &ftLastWriteTime);
             if (retCode == ERROR_SUCCESS) {
                 printf("%s\n", achKey);
-                struct event *e = read_log(achKey, t0 - msgage,
-                                           !strcmp(fastmsgs_mode + 9, "on") || fastfile);
-                while (e != NULL) {
-                    prettyEvent(*e);
-                    e = e->next;
+                struct logstate *ls = evlog_state(achKey);
+                struct evlog_provider pv;
+                struct event e;
+                if (read_log(ls, msgage, !strcmp(fastmsgs_mode + 9, "on") || fastfile, &pv)) {
+                    memset(&e, 0, sizeof e);
+                    while (pv.next(pv.ctx, &e)) {
+                        evlog_message(&e);
+                        prettyEvent(e);
+                        evlog_free_event(&e);
+                        memset(&e, 0, sizeof e);
+                    }
+                    pv.close(pv.ctx);
                 }
             }
         }
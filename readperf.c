@@ -1,274 +1,131 @@
 #include "mrbig.h"
 
-#define DEFAULT_BUFFER_SIZE 4096
-
-struct counter_info {
-	DWORD size, offset;
-};
-
 /*
-struct perfcounter *read_perfcounters(DWORD object, DWORD *counters)
-
-If no value can be read, the function returns NULL.
-
-If there are no instances, the function returns a single struct
-perfcounter where the instance field is NULL.
-
-If there are instances, the function returns an array of struct
-perfcounter where each element has the instance name in the
-instance field. The end of the struct is marked by an element
-with a NULL instance field.
-
-This seems to solve the general case completely. I can write
-special versions of the function if it seems worthwhile.
+Performance data is read into buffers that are kept between calls,
+one for each query. A buffer remembers how large the last answer was
+and grows by doubling, so a big object like Process (230) costs one
+RegQueryValueEx per call once the size has been learnt, rather than
+one for every 4 KB of data. perfdata.c takes the answer apart.
+
+Only cpu() reads performance data through read_perfdata, and the pool
+never runs two copies of a test at once, so the buffers need no
+locking. The load sampler (cpuload.c) keeps its own buffer and calls
+read_perfbuf directly.
 */
 
-static PERF_OBJECT_TYPE *first_object(PERF_DATA_BLOCK *data_block)
-{
-	return (PERF_OBJECT_TYPE *)((BYTE *)data_block+data_block->HeaderLength);
-}
-
-static PERF_OBJECT_TYPE *next_object(PERF_OBJECT_TYPE *act)
-{
-	return (PERF_OBJECT_TYPE *)((BYTE *)act+act->TotalByteLength);
-}
+#define PERFBUF_MIN 65536
+#define PERFBUF_MAX (64*1024*1024)
 
-static PERF_COUNTER_DEFINITION *first_counter(PERF_OBJECT_TYPE *perf_object)
-{
-	return (PERF_COUNTER_DEFINITION *)((BYTE *)perf_object+perf_object->HeaderLength);
-}
+static struct perfbuf *perfbufs;
 
-static PERF_COUNTER_DEFINITION *next_counter(PERF_COUNTER_DEFINITION *perf_counter)
+/* Fetch the objects in pb->query into pb, allocating the buffer on
+   first use. Returns NULL if nothing could be read, otherwise the
+   length goes in *len. */
+PERF_DATA_BLOCK *read_perfbuf(struct perfbuf *pb, DWORD *len)
 {
-	return (PERF_COUNTER_DEFINITION *)((BYTE *)perf_counter+perf_counter->ByteLength);
+	DWORD size, type;
+	LONG ret;
+
+	if (pb->data == NULL) {
+		pb->size = PERFBUF_MIN;
+		pb->data = big_malloc("read_perfbuf (data)", pb->size);
+	}
+
+	for (;;) {
+		size = pb->size;
+		if (debug > 2) mrlog("About to call RegQueryValueEx");
+		ret = RegQueryValueEx(HKEY_PERFORMANCE_DATA, pb->query, 0, &type,
+				pb->data, &size);
+		if (debug > 2) mrlog("RegQueryValueEx returned %ld", ret);
+		if (ret == ERROR_SUCCESS) break;
+		if (ret != ERROR_MORE_DATA || pb->size >= PERFBUF_MAX) {
+			mrlog("read_perfbuf: can't read %s (%ld)", pb->query, ret);
+			return NULL;
+		}
+		/* The old contents are of no use, so no need to realloc */
+		big_free("read_perfbuf (data)", pb->data);
+		pb->size *= 2;
+		pb->data = big_malloc("read_perfbuf (data)", pb->size);
+		if (debug > 1) mrlog("Increase buffer to %lu",
+					(unsigned long)pb->size);
+	}
+	*len = size;
+	return (PERF_DATA_BLOCK *)pb->data;
 }
 
-static PERF_COUNTER_BLOCK *get_counter_block(PERF_INSTANCE_DEFINITION *p_instance)
+/* Fetch the objects in query (numbers separated by spaces). The block
+   stays valid until the next call with the same query. */
+PERF_DATA_BLOCK *read_perfdata(char *query, DWORD *len)
 {
-	return (PERF_COUNTER_BLOCK *)((BYTE *)p_instance+p_instance->ByteLength);
-}
+	struct perfbuf *pb;
 
-static PERF_INSTANCE_DEFINITION *first_instance(PERF_OBJECT_TYPE *p_object)
-{
-	return (PERF_INSTANCE_DEFINITION *)((BYTE *)p_object+p_object->DefinitionLength);
-}
+	if (debug) mrlog("read_perfdata(%s)", query);
 
-static PERF_INSTANCE_DEFINITION *next_instance(PERF_INSTANCE_DEFINITION *p_instance)
-{
-	/* next instance is after this instance + counter data */
-	PERF_COUNTER_BLOCK *p_ctr_blk = get_counter_block(p_instance);
-	return (PERF_INSTANCE_DEFINITION *)((BYTE *)p_instance+p_instance->ByteLength+p_ctr_blk->ByteLength);
+	for (pb = perfbufs; pb; pb = pb->next) {
+		if (!strcmp(pb->query, query)) break;
+	}
+	if (pb == NULL) {
+		pb = big_malloc("read_perfdata (perfbuf)", sizeof *pb);
+		pb->query = big_strdup("read_perfdata (query)", query);
+		pb->data = NULL;
+		pb->next = perfbufs;
+		perfbufs = pb;
+	}
+	return read_perfbuf(pb, len);
 }
 
-/* Get size and offset of a counter. Return 1 for success, 0 for failure */
-/* If counter is odd, use the next index. This is for the incredibly
-   boneheaded way fractions are handled by the performance counters. */
-static int get_counter_offset(PERF_OBJECT_TYPE *op, int counter,
-				struct counter_info *ci)
+/*
+A snapshot holds all the objects (terminated by 0) a test needs,
+fetched with a single query. Each query makes Windows run the
+collectors again, so one snapshot with three objects is about a third
+of the cost of three separate reads. Returns 1 for success, 0 for
+failure.
+*/
+int perfsnap_take(struct perfsnap *ps, DWORD *objects)
 {
-	int b;
-	PERF_COUNTER_DEFINITION *cd;
-	int base = counter & 1;
-
-	counter &= ~1;
+	char query[100];
+	int i;
 
-	cd = first_counter(op);
-	for (b = 0; b < op->NumCounters; b++) {
-		if (cd->CounterNameTitleIndex == counter) {
-			if (base) {
-				base = 0;	/* use the next if any */
-			} else {
-				ci->size = cd->CounterSize;
-				ci->offset = cd->CounterOffset;
-				return 1;
-			}
-		}
-		cd = next_counter(cd);
+	query[0] = '\0';
+	for (i = 0; objects[i]; i++) {
+		snprcat(query, sizeof query, i ? " %ld" : "%ld", (long)objects[i]);
 	}
-	return 0;
+	ps->bp = read_perfdata(query, &ps->len);
+	return ps->bp != NULL;
 }
 
-static PERF_OBJECT_TYPE *get_object(PERF_DATA_BLOCK *bp, int object)
+PERF_OBJECT_TYPE *perfsnap_object(struct perfsnap *ps, DWORD object)
 {
-	int a;
 	PERF_OBJECT_TYPE *op;
 
-	if (debug > 1) mrlog("get_object(%p, %d)", bp, object);
-
-	op = first_object(bp);
-	for (a = 0; a < bp->NumObjectTypes; a++) {
-		if (debug > 1) mrlog("object %d is %d", a,
-					op->ObjectNameTitleIndex);
-		if (op->ObjectNameTitleIndex == object) return op;
-		op = next_object(op);
-	}
-	return NULL;
+	if (ps->bp == NULL) return NULL;
+	op = perfdata_object(ps->bp, ps->len, object);
+	if (op == NULL) mrlog("Can't get object %d, giving up", object);
+	return op;
 }
 
-static char *dup_wide_to_multi(wchar_t *source)
+/* Like read_perfcounters, for an object in the snapshot */
+struct perfcounter *perfsnap_counters(struct perfsnap *ps, DWORD object,
+			DWORD *counters, long long *perf_time, long long *perf_freq)
 {
-	char b[1024];
-	WideCharToMultiByte(CP_ACP, 0, source, -1, b, sizeof b, 0, 0);
-	b[(sizeof b)-1] = '\0';
-	return big_strdup("dup_wide_to_multi", b);
+	PERF_OBJECT_TYPE *op = perfsnap_object(ps, object);
+
+	if (op == NULL) return NULL;
+	return perfdata_counters(op, counters, perf_time, perf_freq);
 }
 
 struct perfcounter *read_perfcounters(DWORD object, DWORD *counters,
 			long long *perf_time, long long *perf_freq)
 {
-	int i, ncounters, b;
-	char obj[100];
-	void *data = big_malloc("read_perfcounters (data)", DEFAULT_BUFFER_SIZE);
-	DWORD size = DEFAULT_BUFFER_SIZE;
-	DWORD ret;
-	struct counter_info *ci;
-	PERF_OBJECT_TYPE *object_ptr;
-	PERF_COUNTER_BLOCK *counter_block_ptr;
-	PERF_INSTANCE_DEFINITION *instance_ptr;
-	DWORD type;
-	wchar_t *name_ptr;
-	struct perfcounter *results;
+	DWORD objects[2];
+	struct perfsnap ps;
 
 	if (debug) mrlog("read_perfcounters(object = %ld)", (long)object);
 
-	/* check to see how many counters we are interested in */
-	for (ncounters = 0; counters[ncounters]; ncounters++) {
-		if (debug > 1) mrlog("counters[%d] = %ld",
-			ncounters, (long)counters[ncounters]);
-	}
-
-	if (debug > 1) mrlog("%d interesting counters", ncounters);
-
-	obj[0] = '\0';
-	snprcat(obj, sizeof obj, "%ld", (long)object);
-	if (debug > 2) mrlog("About to call RegQueryValueEx");
-	ret = RegQueryValueEx(HKEY_PERFORMANCE_DATA, obj, 0, &type,
-			(BYTE *)data, &size);
-	if (debug > 2) mrlog("RegQueryValueEx returned %ld", ret);
-	while (ret != ERROR_SUCCESS) {
-		if (ret == ERROR_MORE_DATA) {
-			if (debug > 1) mrlog("Increase buffer");
-			size += DEFAULT_BUFFER_SIZE;
-			data = big_realloc("read_perfcounters (data)", data, size);
-		} else {
-			if (debug) mrlog("Giving up");
-			big_free("read_perfcounters (data)", data);
-			return NULL;
-		}
-		ret = RegQueryValueEx(HKEY_PERFORMANCE_DATA, obj, 0, &type,
-				(BYTE *)data, &size);
-	}
-	if (debug > 1) mrlog("RegQueryValueEx returned ERROR_SUCCESS");
-	object_ptr = get_object(data, object);
-	if (debug > 2) mrlog("get_object returned %p", object_ptr);
-	if (object_ptr == NULL) {
-		mrlog("Can't get object %d, giving up", object);
-		big_free("read_perfcounters (data)", data);
-		return NULL;
-	}
-	if (perf_time) *perf_time = object_ptr->PerfTime.QuadPart;
-	if (perf_freq) *perf_freq = object_ptr->PerfFreq.QuadPart;
-	ci = big_malloc("read_perfcounters (ci)", ncounters * sizeof *ci);
-	for (i = 0; i < ncounters; i++) {
-		get_counter_offset(object_ptr, counters[i], ci+i);
-	}
-
-	if (object_ptr->NumInstances == PERF_NO_INSTANCES) {
-		if (debug > 1) mrlog("No instances");
-		results = big_malloc("read_perfcounters (results)",
-				sizeof *results);
-		results[0].instance = NULL;
-		results[0].value = big_malloc("read_perfcounters (value)",
-				ncounters * sizeof *results[0].value);
-		counter_block_ptr = (PERF_COUNTER_BLOCK *)
-			((BYTE *)object_ptr+object_ptr->DefinitionLength);
-		for (i = 0; i < ncounters; i++) {
-			memset(&(results[0].value[i]),
-				0,
-				sizeof results[0].value[i]);
-			memcpy(&(results[0].value[i]),
-				(BYTE *)counter_block_ptr+ci[i].offset,
-				ci[i].size);
-		}
-		goto Done;
-	}
-
-	results = big_malloc("read_perfcounter (results)",
-			(1+object_ptr->NumInstances) * sizeof *results);
-	instance_ptr = first_instance(object_ptr);
-	for (b = 0; b < object_ptr->NumInstances; b++) {
-		results[b].value = big_malloc("read_perfcounter (value)",
-				ncounters * sizeof *results[b].value);
-		name_ptr = (wchar_t *)
-			((BYTE *)instance_ptr+instance_ptr->NameOffset);
-		counter_block_ptr = get_counter_block(instance_ptr);
-		results[b].instance = dup_wide_to_multi(name_ptr);
-		for (i = 0; i < ncounters; i++) {
-			memset(&(results[b].value[i]),
-				0,
-				sizeof results[b].value[i]);
-			memcpy(&(results[b].value[i]),
-				(BYTE *)counter_block_ptr+ci[i].offset,
-				ci[i].size);
-		}
-		instance_ptr = next_instance(instance_ptr);
-	}
-	results[b].instance = NULL;
-
-Done:
-	if (debug > 1) mrlog("read_perfcounters returns %p", results);
-	big_free("read_perfcounters (data)", data);
-	big_free("read_perfcounters (ci)", ci);
-	return results;
-}
-
-void free_perfcounters(struct perfcounter *pc)
-{
-	int i;
-
-	if (debug > 1) mrlog("free_perfcounters(%p)", pc);
-
-	if (pc == NULL) return;
-
-	if (pc[0].instance == NULL) {
-		big_free("free_perfcounters (value)", pc[0].value);
-		big_free("free_perfcounters (table)", pc);
-		return;
-	}
-
-	for (i = 0; pc[i].instance; i++) {
-		big_free("free_perfcounters (instance)", pc[i].instance);
-		big_free("free_perfcounters (value)", pc[i].value);
-	}
-	big_free("free_perfcounters (table)", pc);
-	return;
-}
-
-void print_perfcounters(struct perfcounter *pc, int ncounters)
-{
-	int i, j;
-
-	if (debug > 1) mrlog("print_perfcounters(%p, %d)", pc, ncounters);
-
-	if (pc == NULL) {
-		printf("No counters\n");
-		return;
-	}
-
-	if (pc[0].instance == NULL) {
-		printf("No instances. Values:\n");
-		for (j = 0; j < ncounters; j++) {
-			printf("%d\t%ld\n", j, (long)pc[0].value[j]);
-		}
-		return;
-	}
-
-	for (i = 0; pc[i].instance; i++) {
-		printf("Instance '%s':\n", pc[i].instance);
-		for (j = 0; j < ncounters; j++) {
-			printf("%d\t%ld\n", j, (long)pc[i].value[j]);
-		}
-	}
+	objects[0] = object;
+	objects[1] = 0;
+	perfsnap_take(&ps, objects);
+	return perfsnap_counters(&ps, object, counters, perf_time, perf_freq);
 }
 
 #if 0
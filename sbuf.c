@@ -0,0 +1,86 @@
+#include "mrbig.h"
+
+/*
+A string that keeps track of its own length, for building reports.
+
+Appending costs only the text appended, unlike snprcat which has to
+strlen the whole destination first. The buffer grows in chunks as
+needed, up to a maximum size (report_size unless another size is
+given). Text beyond that is dropped and the string ends with
+SBUF_MARKER, so that a cut-off report says so.
+*/
+
+static void sb_grow(struct sbuf *sb, size_t need)
+{
+	size_t size = sb->size;
+
+	if (need <= size) return;
+	while (size < need) size = size ? 2*size : SBUF_CHUNK;
+	size = (size+SBUF_CHUNK-1)/SBUF_CHUNK*SBUF_CHUNK;
+	if (size > sb->max) size = sb->max;
+	if (sb->s == NULL) sb->s = big_malloc("sb_grow", size);
+	else sb->s = big_realloc("sb_grow", sb->s, size);
+	sb->size = size;
+}
+
+void sb_init(struct sbuf *sb, size_t max)
+{
+	sb->s = NULL;
+	sb->len = sb->size = 0;
+	sb->max = max ? max : report_size;
+	if (sb->max < 2*sizeof SBUF_MARKER) sb->max = 2*sizeof SBUF_MARKER;
+	sb->truncated = 0;
+	sb_grow(sb, 1);
+	sb->s[0] = '\0';
+}
+
+static void sb_truncate(struct sbuf *sb)
+{
+	size_t keep = sb->max-sizeof SBUF_MARKER;
+
+	if (sb->len > keep) sb->len = keep;
+	if (debug) mrlog("sb_truncate: report cut off at %ld bytes", (long)sb->len);
+	strcpy(sb->s+keep, SBUF_MARKER);
+	sb->len = sb->max-1;
+	sb->truncated = 1;
+}
+
+/* Returns the number of characters appended */
+int sb_vprintf(struct sbuf *sb, const char *fmt, va_list ap)
+{
+	va_list aq;
+	int n;
+
+	if (sb->truncated) return 0;
+	for (;;) {
+		va_copy(aq, ap);
+		n = vsnprintf(sb->s+sb->len, sb->size-sb->len, fmt, aq);
+		va_end(aq);
+		if (n >= 0 && sb->len+n < sb->size) break;
+		if (sb->size == sb->max) {
+			sb_truncate(sb);
+			return 0;
+		}
+		sb_grow(sb, n >= 0 ? sb->len+n+1 : 2*sb->size);
+	}
+	sb->len += n;
+	return n;
+}
+
+int sb_printf(struct sbuf *sb, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = sb_vprintf(sb, fmt, ap);
+	va_end(ap);
+	return n;
+}
+
+void sb_free(struct sbuf *sb)
+{
+	big_free("sb_free", sb->s);
+	sb->s = NULL;
+	sb->len = sb->size = 0;
+}
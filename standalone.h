@@ -0,0 +1,53 @@
+/* Stand-ins for the helpers in mrbig.c, for building the portable
+   files (evlog.c, msgrules.c, perfdata.c, extrun.c, dirwatch.c) on
+   their own with -DSTANDALONE. extrun.c and dirwatch.c also need
+   strlcpy.c. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+int debug = 0;
+
+extern size_t strlcpy(char *, const char *, size_t);
+
+void *big_malloc(char *p, size_t n)
+{
+	void *q = malloc(n);
+	if (q == NULL) {
+		fprintf(stderr, "%s: out of memory\n", p);
+		exit(EXIT_FAILURE);
+	}
+	return q;
+}
+
+void *big_realloc(char *p, void *q, size_t n)
+{
+	q = realloc(q, n);
+	if (q == NULL) {
+		fprintf(stderr, "%s: out of memory\n", p);
+		exit(EXIT_FAILURE);
+	}
+	return q;
+}
+
+void big_free(char *p, void *q)
+{
+	free(q);
+}
+
+char *big_strdup(char *p, char *q)
+{
+	return strcpy(big_malloc(p, strlen(q)+1), q);
+}
+
+void mrlog(char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
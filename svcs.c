@@ -22,7 +22,7 @@ struct svc {
 } *slist, *scfg;
 
 struct report {
-	char str[5000];
+	struct sbuf str;
 	char *machine;
 	char *color;
 	struct report *next;
@@ -83,7 +83,7 @@ struct AllServices EnumerateAllServices(SC_HANDLE sc) {
 	}
 }
 
-static void read_svccfg(void)
+static void read_svccfg(struct mrcfg *mc)
 {
 	struct svc *pc;
 	char b[256], name[256];
@@ -123,7 +123,7 @@ static void read_svccfg(void)
 			pc->machine = big_strdup("svcs.c/read_svccfg (machine)", machine);
 		}
 		else
-			pc->machine = big_strdup("svcs.c/read_svccfg (machine)", mrmachine);
+			pc->machine = big_strdup("svcs.c/read_svccfg (machine)", mc->machine);
 		pc->next = scfg;
 		scfg = pc;
 	}
@@ -147,10 +147,9 @@ static struct svc *lookup_svcname(char *p)
 }
 
 
-void svcs(void)
+void svcs(struct mrcfg *mc)
 {
-	char b[5000];
-	int n = sizeof b;
+	struct sbuf b;
 	struct svc *pc, *pl;
 
 	char cfgfile[1024];
@@ -164,34 +163,34 @@ void svcs(void)
 	SC_HANDLE sc;
 	struct report *rep;
 
-	preports = big_malloc("svcs (report)", sizeof(struct report));
-	preports->machine = big_strdup("svcs (report->machine)", mrmachine);
-	preports->next = NULL;
-	preports->str[0] = 0;
-	preports->color = "green";
-
-	if (debug > 1) mrlog("svcs(%p, %d)", b, n);
+	if (debug > 1) mrlog("svcs()");
 
-	if (get_option("no_svcs", 0)) {
-		mrsend(mrmachine, "svcs", "clear", "option no_svcs\n");
+	if (get_option(mc, "no_svcs", 0)) {
+		mrsend(mc->machine, "svcs", "clear", "option no_svcs\n");
 		return;
 	}
 
+	preports = big_malloc("svcs (report)", sizeof(struct report));
+	preports->machine = big_strdup("svcs (report->machine)", mc->machine);
+	preports->next = NULL;
+	sb_init(&preports->str, 0);
+	preports->color = "green";
+
 	cfgfile[0] = '\0';
-	snprcat(cfgfile, sizeof cfgfile, "%s%c%s", cfgdir, dirsep, "services.cfg");
+	snprcat(cfgfile, sizeof cfgfile, "%s%c%s", mc->cfgdir, dirsep, "services.cfg");
 	read_cfg("svcs", cfgfile);
-	read_svccfg();
+	read_svccfg(mc);
 
 	if ((cfg_mode & CFG_DISPLAY_NAME) && (cfg_mode & CFG_SERVICE_NAME)) {
 		preports->color = "red";
-		snprcat(preports->str, sizeof(preports->str), "%s\n",
+		sb_printf(&preports->str, "%s\n",
 			"Config using mix of service and display names\n");
 	}
 
 	sc = OpenSCManager(NULL, NULL, SC_MANAGER_ENUMERATE_SERVICE);
 	if (sc == NULL) {
 		preports->color = "red";
-		snprcat(preports->str, sizeof preports->str, "%s\n",
+		sb_printf(&preports->str, "%s\n",
 			"null sc handle");
 	} 
 	else 
@@ -233,12 +232,12 @@ void svcs(void)
 					rep = big_malloc("svcs (report)", sizeof(struct report));
 					rep->next = preports;
 					rep->machine = big_strdup("svcs (pc->machine)", pc->machine);
-					rep->str[0] = 0;
+					sb_init(&rep->str, 0);
 					rep->color = "green";
 					preports = rep;
 				}
 
-				snprcat(rep->str, sizeof rep->str,
+				sb_printf(&rep->str,
 					"&%s %s - status %d (expected %d)\n",
 					mycolor, pl->name, pl->status, pc->status);
 				if (strcmp(mycolor, "green"))
@@ -257,7 +256,7 @@ void svcs(void)
 
 		} else {
 			preports->color = "red";
-			snprcat(preports->str, sizeof(preports->str),
+			sb_printf(&preports->str,
 			"Can't get service list");
 		}
 	}
@@ -266,8 +265,8 @@ void svcs(void)
 	rep = preports;
 	while (rep) {
 		struct report* prev;
-		b[0] = '\0';
-		snprcat(b, n, "%s\n\n%s\n"
+		sb_init(&b, 0);
+		sb_printf(&b, "%s\n\n%s\n"
 			"Total %d registered services, %d running\n\n"
 			"%d = Not installed\n"
 			"%d = Stopped\n"
@@ -278,14 +277,16 @@ void svcs(void)
 			"%d = Pause pending\n"
 			"%d = Paused\n\n"
 			"(%d bytes svcslist)\n",
-			now, rep->str, (int)nsvcs, running,
+			mc->now, rep->str.s, (int)nsvcs, running,
 			0, SERVICE_STOPPED, SERVICE_START_PENDING,
 			SERVICE_STOP_PENDING, SERVICE_RUNNING,
 			SERVICE_CONTINUE_PENDING, SERVICE_PAUSE_PENDING,
 			SERVICE_PAUSED, (int)bufSize);
-		mrsend(rep->machine, "svcs", rep->color, b);
+		mrsendn(rep->machine, "svcs", rep->color, b.s, b.len);
+		sb_free(&b);
 		prev = rep;
 		rep = rep->next;
+		sb_free(&prev->str);
 		big_free("svcs", prev->machine);
 		big_free("svcs", prev);
 	}
@@ -60,7 +60,7 @@ field asd = 0 -- status will be indicated by red or green bullet
 go
 end
 */
-void wmi(void)
+void wmi(struct mrcfg *mc)
 {
 	LPCWSTR szComputer = L".";	// local computer
 	DISPATCH_OBJ(wmiSvc);
@@ -72,23 +72,23 @@ void wmi(void)
 	char *green = "green", *red = "red", *blue = "blue", *clear = "clear";
 	char always[100], *color = green, *bullet;
 	char page[100];
-	char report[10000];
+	struct sbuf report;
 
 	query[0] = L'\0';
-	report[0] = '\0';
 	always[0] = '\0';
 	page[0] = '\0';
 	nfields = 0;
 
 	if (debug) mrlog("wmi()");
 
-	if (get_option("no_wmi", 0)) {
+	if (get_option(mc, "no_wmi", 0)) {
 		/* no mrsend with clear status because we don't know
 		   the names of the tests
 		*/
 		return;
 	}
 
+	sb_init(&report, 0);
 	dhInitialize(TRUE);
 	for (i = 0; get_cfg("wmi", b, sizeof b, i); i++) {
 		if (debug) mrlog("wmi: %s", b);
@@ -101,7 +101,8 @@ void wmi(void)
 		} else if (!strcmp(key, "begin")) {
 			strcpy(page, value);
 			always[0] = '\0';
-			report[0] = '\0';
+			sb_free(&report);
+			sb_init(&report, 0);
 			color = green;
 		} else if (!strcmp(key, "end")) {
 			if (!page[0]) {
@@ -109,7 +110,7 @@ void wmi(void)
 				continue;
 			}
 			if (always[0]) color = always;
-			mrsend(mrmachine, page, color, report);
+			mrsendn(mc->machine, page, color, report.s, report.len);
 		} else if (!strcmp(key, "field")) {
 			fields[nfields].field[0] = '\0';
 			fields[nfields].op1[0] = '\0';
@@ -173,16 +174,16 @@ void wmi(void)
 					if (bullet == red) color = bullet;
 
 #if 1	/* this messes up the ncv rrd stuff */
-					snprcat(report, sizeof report, "&%s %s: %ls\n",
+					sb_printf(&report, "&%s %s: %ls\n",
 						bullet, fields[f].field,
 						szWmiItem?szWmiItem:L"");
 #else
-					snprcat(report, sizeof report, "%s: %ls &%s\n",
+					sb_printf(&report, "%s: %ls &%s\n",
 						fields[f].field, szWmiItem?szWmiItem:L"", bullet);
 #endif
 					dhFreeString(szWmiItem);
 				}
-				snprcat(report, sizeof report, "\n");
+				sb_printf(&report, "\n");
 			} NEXT(objWmiTest);
 
 cleanup:
@@ -192,11 +193,12 @@ cleanup:
 			_snwprintf(query, sizeof query, L"%hs", value);
 			nfields = 0;
 		} else if (!strcmp(key, "text")) {
-			snprcat(report, sizeof report, "%s\n", value);
+			sb_printf(&report, "%s\n", value);
 		} else {
 			mrlog("Unknown key '%s'", key);
 		}
 	}
+	sb_free(&report);
 	if (debug) mrlog("wmi done");
 	dhUninitialize(TRUE);
 	return;